@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_BENCH_COMMON_H
+#define AIPSTACK_BENCH_COMMON_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/platform/HostedPlatformImpl.h>
+#include <aipstack/event_loop/EventLoop.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/sim/VirtualWire.h>
+
+namespace AIpStackBenchmarks {
+
+using PlatformImpl = AIpStack::HostedPlatformImpl;
+using PlatformRef = AIpStack::PlatformRef<PlatformImpl>;
+using Platform = AIpStack::PlatformFacade<PlatformImpl>;
+
+using IndexService = AIpStack::AvlTreeIndexService;
+
+using BenchIpStackService = AIpStack::IpStackService<
+    AIpStack::IpStackOptions::HeaderBeforeIp::Is<AIpStack::EthHeader::Size>,
+    AIpStack::IpStackOptions::PathMtuCacheService::Is<
+        AIpStack::IpPathMtuCacheService<
+            AIpStack::IpPathMtuCacheOptions::NumMtuEntries::Is<16>,
+            AIpStack::IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    AIpStack::IpStackOptions::ReassemblyService::Is<
+        AIpStack::IpReassemblyService<
+            AIpStack::IpReassemblyOptions::MaxReassEntrys::Is<4>,
+            AIpStack::IpReassemblyOptions::MaxReassSize::Is<16000>
+        >
+    >
+>;
+
+// Building with AIPSTACK_BENCH_ENABLE_BBR defined to 1 selects BBR congestion
+// control instead of NewReno with HyStart++.
+#ifndef AIPSTACK_BENCH_ENABLE_BBR
+#define AIPSTACK_BENCH_ENABLE_BBR 0
+#endif
+
+constexpr bool BenchEnableBbr = AIPSTACK_BENCH_ENABLE_BBR;
+
+using BenchProtocolServicesList = AIpStack::MakeTypeList<
+    AIpStack::IpTcpProtoService<
+        AIpStack::IpTcpProtoOptions::NumTcpPcbs::Is<64>,
+        AIpStack::IpTcpProtoOptions::PcbIndexService::Is<IndexService>,
+        AIpStack::IpTcpProtoOptions::EnableBbr::Is<BenchEnableBbr>
+    >
+>;
+
+using BenchEthIpIfaceService = AIpStack::EthIpIfaceService<
+    AIpStack::EthIpIfaceOptions::NumArpEntries::Is<4>,
+    AIpStack::EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    AIpStack::EthIpIfaceOptions::HeaderBeforeEth::Is<0>,
+    AIpStack::EthIpIfaceOptions::TimersStructureService::Is<AIpStack::LinkedHeapService>
+>;
+
+class BenchStackArg : public BenchIpStackService::template Compose<
+    PlatformImpl, BenchProtocolServicesList> {};
+using BenchIpStack = AIpStack::IpStack<BenchStackArg>;
+
+using BenchIface = AIpStack::VirtualWireEthIface<BenchStackArg, BenchEthIpIfaceService>;
+
+using TcpArg = BenchIpStack::GetProtoArg<AIpStack::TcpApi>;
+using TcpListener = AIpStack::TcpListener<TcpArg>;
+using TcpConnection = AIpStack::TcpConnection<TcpArg>;
+
+constexpr AIpStack::Ip4Addr ServerAddr = AIpStack::Ip4Addr(10, 0, 0, 1);
+constexpr AIpStack::Ip4Addr ClientAddr = AIpStack::Ip4Addr(10, 0, 0, 2);
+constexpr std::uint8_t PrefixLength = 24;
+constexpr std::uint16_t ServerPort = 5001;
+
+// Common benchmark settings, set from "key=value" command line arguments.
+struct BenchSettings {
+    double duration_sec = 5.0;
+    AIpStack::VirtualWireParams wire;
+};
+
+inline bool benchUsage (char const *prog)
+{
+    std::fprintf(stderr, "Usage: %s [duration=<sec>] [mtu=<bytes>] "
+        "[bandwidth_mbps=<n>] [latency_us=<n>] [queue_depth=<n>]\n", prog);
+    return false;
+}
+
+inline bool parseBenchArgs (int argc, char *argv[], BenchSettings &settings)
+{
+    for (int i = 1; i < argc; i++) {
+        char const *arg = argv[i];
+        char const *eq = std::strchr(arg, '=');
+        if (eq == nullptr) {
+            return benchUsage(argv[0]);
+        }
+
+        double value = std::atof(eq + 1);
+        std::size_t key_len = std::size_t(eq - arg);
+
+        auto key_is = [&](char const *key) {
+            return std::strlen(key) == key_len && std::memcmp(arg, key, key_len) == 0;
+        };
+
+        if (key_is("duration")) {
+            settings.duration_sec = value;
+        }
+        else if (key_is("mtu")) {
+            settings.wire.eth_mtu = std::size_t(value);
+        }
+        else if (key_is("bandwidth_mbps")) {
+            settings.wire.bandwidth_bps = value * 1e6;
+        }
+        else if (key_is("latency_us")) {
+            settings.wire.latency_sec = value * 1e-6;
+        }
+        else if (key_is("queue_depth")) {
+            settings.wire.queue_depth = std::size_t(value);
+        }
+        else {
+            return benchUsage(argv[0]);
+        }
+    }
+
+    if (!(settings.duration_sec > 0.0) || settings.wire.eth_mtu < 590 ||
+        settings.wire.queue_depth == 0)
+    {
+        return benchUsage(argv[0]);
+    }
+
+    return true;
+}
+
+// Two IP stacks connected by a VirtualWire, driven by one EventLoop.
+class BenchTopology :
+    private AIpStack::NonCopyable<BenchTopology>
+{
+public:
+    BenchTopology (AIpStack::VirtualWireParams const &wire_params) :
+        m_platform_impl(m_event_loop),
+        m_platform(PlatformRef{&m_platform_impl}),
+        m_wire(wire_params),
+        m_server_stack(m_platform),
+        m_client_stack(m_platform),
+        m_server_iface(m_platform, &m_server_stack, m_wire,
+                       AIpStack::MacAddr(0x02, 0, 0, 0, 0, 1)),
+        m_client_iface(m_platform, &m_client_stack, m_wire,
+                       AIpStack::MacAddr(0x02, 0, 0, 0, 0, 2))
+    {
+        m_server_iface.iface().setIp4Addr(
+            AIpStack::IpIfaceIp4AddrSetting(PrefixLength, ServerAddr));
+        m_client_iface.iface().setIp4Addr(
+            AIpStack::IpIfaceIp4AddrSetting(PrefixLength, ClientAddr));
+        m_client_stack.getProtoApi<AIpStack::TcpApi>().setEphemeralPortKey(
+            AIpStack::SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    }
+
+    inline AIpStack::EventLoop & eventLoop () { return m_event_loop; }
+
+    inline Platform platform () const { return m_platform; }
+
+    inline AIpStack::TcpApi<TcpArg> & serverTcp ()
+    {
+        return m_server_stack.getProtoApi<AIpStack::TcpApi>();
+    }
+
+    inline AIpStack::TcpApi<TcpArg> & clientTcp ()
+    {
+        return m_client_stack.getProtoApi<AIpStack::TcpApi>();
+    }
+
+    inline BenchIface & serverIface () { return m_server_iface; }
+
+    inline BenchIface & clientIface () { return m_client_iface; }
+
+    inline AIpStack::VirtualWire<PlatformImpl>::Port & serverPort ()
+    {
+        return m_server_iface.port();
+    }
+
+    inline AIpStack::VirtualWire<PlatformImpl>::Port & clientPort ()
+    {
+        return m_client_iface.port();
+    }
+
+private:
+    AIpStack::EventLoop m_event_loop;
+    PlatformImpl m_platform_impl;
+    Platform m_platform;
+    AIpStack::VirtualWire<PlatformImpl> m_wire;
+    BenchIpStack m_server_stack;
+    BenchIpStack m_client_stack;
+    BenchIface m_server_iface;
+    BenchIface m_client_iface;
+};
+
+constexpr std::size_t BulkBufferSize = 512 * 1024;
+constexpr int BulkWindowUpdateThresDiv = 8;
+
+// Receives data and immediately makes the buffer space available again. Records
+// the longest interval without received data (which reflects loss recovery).
+class BulkSinkConnection : public TcpConnection
+{
+public:
+    // Called after data has been received, with the total number of bytes.
+    using ProgressHandler = AIpStack::Function<void(std::uint64_t bytes)>;
+
+    BulkSinkConnection (TcpListener &listener, ProgressHandler progress_handler) :
+        m_progress_handler(progress_handler),
+        m_buf_node{m_buffer.get(), BulkBufferSize, &m_buf_node},
+        m_bytes(0),
+        m_last_rx_time(AIpStack::EventLoop::getTime()),
+        m_max_stall_sec(0.0)
+    {
+        if (acceptConnection(listener) != AIpStack::IpErr::Success) {
+            throw std::runtime_error("acceptConnection failed");
+        }
+        setProportionalWindowUpdateThreshold(BulkBufferSize, BulkWindowUpdateThresDiv);
+        setRecvBuf({&m_buf_node, 0, BulkBufferSize});
+    }
+
+    inline std::uint64_t bytes () const { return m_bytes; }
+
+    inline double maxStallSec () const { return m_max_stall_sec; }
+
+private:
+    void connectionAborted () override final
+    {
+        std::fprintf(stderr, "Server connection aborted.\n");
+    }
+
+    void dataReceived (std::size_t amount) override final
+    {
+        AIpStack::EventLoopTime now = AIpStack::EventLoop::getTime();
+        double stall = std::chrono::duration<double>(now - m_last_rx_time).count();
+        if (stall > m_max_stall_sec) {
+            m_max_stall_sec = stall;
+        }
+        m_last_rx_time = now;
+
+        m_bytes += amount;
+        extendRecvBuf(amount);
+
+        if (m_progress_handler) {
+            m_progress_handler(m_bytes);
+        }
+    }
+
+    void dataSent ([[maybe_unused]] std::size_t amount) override final {}
+
+private:
+    ProgressHandler m_progress_handler;
+    std::unique_ptr<char[]> m_buffer{new char[BulkBufferSize]};
+    AIpStack::IpBufNode m_buf_node;
+    std::uint64_t m_bytes;
+    AIpStack::EventLoopTime m_last_rx_time;
+    double m_max_stall_sec;
+};
+
+// Keeps the send buffer full of (arbitrary) data.
+class BulkSourceConnection : public TcpConnection
+{
+public:
+    BulkSourceConnection (AIpStack::TcpApi<TcpArg> &tcp) :
+        m_buf_node{m_buffer.get(), BulkBufferSize, &m_buf_node}
+    {
+        AIpStack::TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        args.rcv_wnd = BulkBufferSize;
+        if (startConnection(tcp, args) != AIpStack::IpErr::Success) {
+            throw std::runtime_error("startConnection failed");
+        }
+        setSendBuf({&m_buf_node, 0, BulkBufferSize});
+        sendPush();
+    }
+
+private:
+    void connectionAborted () override final
+    {
+        std::fprintf(stderr, "Client connection aborted.\n");
+    }
+
+    void dataReceived ([[maybe_unused]] std::size_t amount) override final {}
+
+    void dataSent (std::size_t amount) override final
+    {
+        extendSendBuf(amount);
+        sendPush();
+    }
+
+private:
+    std::unique_ptr<char[]> m_buffer{new char[BulkBufferSize]()};
+    AIpStack::IpBufNode m_buf_node;
+};
+
+// Accepts a single BulkSinkConnection.
+class BulkSinkServer
+{
+public:
+    BulkSinkServer (AIpStack::TcpApi<TcpArg> &tcp,
+        BulkSinkConnection::ProgressHandler progress_handler = nullptr)
+    :
+        m_progress_handler(progress_handler),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&BulkSinkServer::connectionEstablished, this))
+    {
+        if (!m_listener.startListening(tcp, {
+            /*addr=*/ AIpStack::Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        })) {
+            throw std::runtime_error("startListening failed");
+        }
+        m_listener.setInitialReceiveWindow(BulkBufferSize);
+    }
+
+    inline BulkSinkConnection * connection () const
+    {
+        return m_con.get();
+    }
+
+    inline std::uint64_t bytes () const
+    {
+        return (m_con != nullptr) ? m_con->bytes() : 0;
+    }
+
+private:
+    void connectionEstablished ()
+    {
+        m_con = std::make_unique<BulkSinkConnection>(m_listener, m_progress_handler);
+    }
+
+private:
+    BulkSinkConnection::ProgressHandler m_progress_handler;
+    TcpListener m_listener;
+    std::unique_ptr<BulkSinkConnection> m_con;
+};
+
+inline double secondsSince (AIpStack::EventLoopTime start)
+{
+    return std::chrono::duration<double>(AIpStack::EventLoop::getTime() - start).count();
+}
+
+}
+
+#endif
@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Microbenchmarks of hot primitives: checksums, buffer chain utilities, index
+// and timer data structures and Struct field access. Each measurement prints
+// one JSON object with the time per operation.
+//
+// Arguments: [min_time_ms=<n>] [filter=<substring of benchmark name>]
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <aipstack/misc/TypedFunction.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/infra/Instance.h>
+#include <aipstack/infra/Struct.h>
+#include <aipstack/structure/Accessor.h>
+#include <aipstack/structure/LinkModel.h>
+#include <aipstack/structure/OperatorKeyCompare.h>
+#include <aipstack/structure/StructureRaiiWrapper.h>
+#include <aipstack/structure/TimerQueue.h>
+#include <aipstack/structure/TreeCompare.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/index/MruListIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+
+namespace AIpStackBenchmarks {
+
+struct PrimitivesSettings {
+    double min_time_sec = 0.2;
+    char const *filter = "";
+};
+
+static PrimitivesSettings g_settings;
+
+// Results are accumulated here so that the compiler cannot remove the work.
+static volatile std::uint64_t g_sink;
+
+// Runs 'func' (which performs 'ops_per_call' operations per call) repeatedly
+// for at least the minimum time and prints the time per operation. The best
+// of three rounds is reported.
+template<typename Func>
+static void runBench (char const *name, char const *shape, std::size_t bytes_per_op,
+                      std::size_t ops_per_call, Func func)
+{
+    if (std::strstr(name, g_settings.filter) == nullptr) {
+        return;
+    }
+
+    using Clock = std::chrono::steady_clock;
+
+    // Calibrate the number of calls per round.
+    std::uint64_t calls = 1;
+    while (true) {
+        auto start = Clock::now();
+        for (std::uint64_t i = 0; i < calls; i++) {
+            func();
+        }
+        double sec = std::chrono::duration<double>(Clock::now() - start).count();
+        if (sec >= g_settings.min_time_sec / 4.0 || calls >= (UINT64_C(1) << 40)) {
+            double scale = (g_settings.min_time_sec / 3.0) / (sec > 0.0 ? sec : 1e-9);
+            if (scale > 1.0) {
+                calls = std::uint64_t(double(calls) * scale) + 1;
+            }
+            break;
+        }
+        calls *= 2;
+    }
+
+    double best_ns = 0.0;
+    for (int round = 0; round < 3; round++) {
+        auto start = Clock::now();
+        for (std::uint64_t i = 0; i < calls; i++) {
+            func();
+        }
+        double sec = std::chrono::duration<double>(Clock::now() - start).count();
+        double ns = sec * 1e9 / (double(calls) * double(ops_per_call));
+        if (round == 0 || ns < best_ns) {
+            best_ns = ns;
+        }
+    }
+
+    std::printf("{\"bench\":\"%s\",\"shape\":\"%s\",\"ns_per_op\":%.3f", name, shape,
+                best_ns);
+    if (bytes_per_op > 0) {
+        std::printf(",\"mb_per_sec\":%.1f", double(bytes_per_op) * 1e3 / best_ns);
+    }
+    std::printf("}\n");
+    std::fflush(stdout);
+}
+
+// A buffer chain over a contiguous data area, split into nodes of the given size
+// (the last one may be shorter).
+class BufChain
+{
+public:
+    BufChain (std::size_t total_len, std::size_t node_len) :
+        m_data(new char[total_len]),
+        m_total_len(total_len)
+    {
+        std::mt19937 rng{std::uint32_t(total_len + node_len)};
+        for (std::size_t i = 0; i < total_len; i++) {
+            m_data[i] = char(rng() & 0x7F);
+        }
+
+        for (std::size_t pos = 0; pos < total_len; pos += node_len) {
+            std::size_t len = (node_len < total_len - pos) ? node_len : total_len - pos;
+            m_nodes.push_back(AIpStack::IpBufNode{m_data.get() + pos, len, nullptr});
+        }
+        for (std::size_t i = 0; i + 1 < m_nodes.size(); i++) {
+            m_nodes[i].next = &m_nodes[i + 1];
+        }
+    }
+
+    inline AIpStack::IpBufRef ref ()
+    {
+        return AIpStack::IpBufRef{&m_nodes[0], 0, m_total_len};
+    }
+
+    inline char * data () { return m_data.get(); }
+
+private:
+    std::unique_ptr<char[]> m_data;
+    std::size_t m_total_len;
+    std::vector<AIpStack::IpBufNode> m_nodes;
+};
+
+struct ChainShape {
+    char const *name;
+    std::size_t node_len;
+};
+
+constexpr std::size_t ChainTotalLen = 1500;
+
+static ChainShape const chain_shapes[] = {
+    {"1x1500", 1500},
+    {"3x500", 500},
+    {"12x128", 128},
+    {"215x7", 7},
+};
+
+static void benchChksum ()
+{
+    for (std::size_t len : {20, 64, 576, 1500, 9000, 65535}) {
+        BufChain chain(len, len);
+        char shape[32];
+        std::snprintf(shape, sizeof(shape), "len=%zu", len);
+        runBench("ip_chksum_inverted", shape, len, 1, [&]() {
+            g_sink = g_sink + IpChksumInverted(chain.data(), len);
+        });
+    }
+
+    for (ChainShape const &cs : chain_shapes) {
+        BufChain chain(ChainTotalLen, cs.node_len);
+        runBench("ip_chksum_accumulator_buf", cs.name, ChainTotalLen, 1, [&]() {
+            AIpStack::IpChksumAccumulator accum;
+            g_sink = g_sink + accum.getChksum(chain.ref());
+        });
+    }
+}
+
+static void benchBufUtils ()
+{
+    std::unique_ptr<char[]> flat(new char[ChainTotalLen]);
+
+    for (ChainShape const &cs : chain_shapes) {
+        BufChain chain(ChainTotalLen, cs.node_len);
+        BufChain dst_chain(ChainTotalLen, cs.node_len);
+
+        runBench("ipbuf_take_bytes", cs.name, ChainTotalLen, 1, [&]() {
+            AIpStack::IpBufRef rem = ipBufTakeBytes(chain.ref(), ChainTotalLen, flat.get());
+            g_sink = g_sink + rem.tot_len + std::uint8_t(flat[ChainTotalLen - 1]);
+        });
+
+        runBench("ipbuf_give_buf", cs.name, ChainTotalLen, 1, [&]() {
+            AIpStack::IpBufRef rem = ipBufGiveBuf(dst_chain.ref(), chain.ref());
+            g_sink = g_sink + rem.tot_len;
+        });
+
+        // The callback sums the bytes so that the throughput covers reading the data.
+        runBench("ipbuf_process_bytes", cs.name, ChainTotalLen, 1, [&]() {
+            std::size_t sum = 0;
+            AIpStack::IpBufRef rem = ipBufProcessBytes(chain.ref(), ChainTotalLen,
+                AIpStack::makeTypedFunction([&](char *data, std::size_t chunk_len) {
+                    for (std::size_t i = 0; i < chunk_len; i++) {
+                        sum += std::uint8_t(data[i]);
+                    }
+                    return chunk_len;
+                }));
+            g_sink = g_sink + rem.tot_len + sum;
+        });
+
+        // The data bytes are all below 0x80 so the search covers the whole chain.
+        runBench("ipbuf_find_byte_mut", cs.name, ChainTotalLen, 1, [&]() {
+            AIpStack::IpBufRef buf = chain.ref();
+            bool found = ipBufFindByteMut(buf, char(0xFF));
+            g_sink = g_sink + found + buf.tot_len;
+        });
+    }
+}
+
+// Index benchmark over entries with random 32-bit keys.
+template<typename IndexService>
+class IndexBench
+{
+    struct Entry;
+    struct EntryAccessor;
+    struct KeyFuncs;
+    using LinkModel = AIpStack::PointerLinkModel<Entry>;
+
+    AIPSTACK_MAKE_INSTANCE(TheIndex, (IndexService::template Index<
+        EntryAccessor, std::uint32_t, KeyFuncs, LinkModel, /*Duplicates=*/false>))
+
+    struct Entry {
+        typename TheIndex::Node node;
+        std::uint32_t key;
+    };
+
+    struct EntryAccessor : public AIpStack::MemberAccessor<
+        Entry, typename TheIndex::Node, &Entry::node> {};
+
+    struct KeyFuncs : public AIpStack::OperatorKeyCompare {
+        inline static std::uint32_t GetKeyOfEntry (Entry const &e)
+        {
+            return e.key;
+        }
+    };
+
+public:
+    static void run (char const *find_name, char const *update_name)
+    {
+        for (std::size_t count : {16, 256, 4096}) {
+            std::vector<Entry> entries(count + 1);
+            std::mt19937 rng{std::uint32_t(count)};
+            for (Entry &e : entries) {
+                e.key = std::uint32_t(rng());
+            }
+
+            AIpStack::StructureRaiiWrapper<typename TheIndex::Index> index;
+            for (std::size_t i = 0; i < count; i++) {
+                index.addEntry(entries[i]);
+            }
+
+            char shape[32];
+            std::snprintf(shape, sizeof(shape), "entries=%zu", count);
+
+            std::size_t pos = 0;
+            runBench(find_name, shape, 0, 1, [&]() {
+                Entry *e = index.findEntry(entries[pos].key);
+                g_sink = g_sink + e->key;
+                pos = (pos + 1 == count) ? 0 : pos + 1;
+            });
+
+            // Remove an entry and add the spare one, rotating through all entries.
+            std::size_t spare = count;
+            pos = 0;
+            runBench(update_name, shape, 0, 1, [&]() {
+                index.removeEntry(entries[pos]);
+                index.addEntry(entries[spare]);
+                spare = pos;
+                pos = (pos + 1 == count + 1) ? 0 : pos + 1;
+                if (pos == spare) {
+                    pos = (pos + 1 == count + 1) ? 0 : pos + 1;
+                }
+            });
+        }
+    }
+};
+
+// Timer benchmarks: a "hold" model where the earliest timer is removed and
+// re-inserted at a random later time, with a fixed number of active timers.
+class TimerBench
+{
+    struct Entry;
+    using LinkModel = AIpStack::PointerLinkModel<Entry>;
+    using HeapNode = AIpStack::LinkedHeapNode<LinkModel>;
+
+    struct NoUserData {};
+    using TheTimerQueueService = AIpStack::TimerQueueService<AIpStack::LinkedHeapService>;
+    using QueueNode = typename TheTimerQueueService::template Node<
+        LinkModel, std::uint32_t, NoUserData>;
+
+    struct Entry {
+        HeapNode heap_node;
+        QueueNode queue_node;
+        std::uint32_t time;
+    };
+
+    struct HeapAccessor : public AIpStack::MemberAccessor<
+        Entry, HeapNode, &Entry::heap_node> {};
+    struct QueueAccessor : public AIpStack::MemberAccessor<
+        Entry, QueueNode, &Entry::queue_node> {};
+
+    struct HeapKeyFuncs : public AIpStack::OperatorKeyCompare {
+        inline static std::uint32_t GetKeyOfEntry (Entry const &e)
+        {
+            return e.time;
+        }
+    };
+
+    struct HeapCompare : public AIpStack::TreeCompare<LinkModel, HeapKeyFuncs> {};
+
+    using Heap = AIpStack::LinkedHeap<HeapAccessor, HeapCompare, LinkModel>;
+
+    using Queue = typename TheTimerQueueService::template Queue<
+        LinkModel, QueueAccessor, std::uint32_t, NoUserData>;
+
+public:
+    static void run ()
+    {
+        for (std::size_t count : {16, 256, 4096}) {
+            std::vector<Entry> entries(count);
+            std::mt19937 rng{std::uint32_t(count)};
+
+            char shape[32];
+            std::snprintf(shape, sizeof(shape), "timers=%zu", count);
+
+            {
+                AIpStack::StructureRaiiWrapper<Heap> heap;
+                for (Entry &e : entries) {
+                    e.time = rng() % 1000000;
+                    heap.insert(e);
+                }
+
+                runBench("linked_heap_hold", shape, 0, 1, [&]() {
+                    Entry *e = heap.first();
+                    heap.remove(*e);
+                    e->time += 1 + rng() % 1000000;
+                    heap.insert(*e);
+                });
+            }
+
+            {
+                AIpStack::StructureRaiiWrapper<Queue> queue;
+                std::uint32_t now = 0;
+                queue.updateReferenceTime(now);
+                for (Entry &e : entries) {
+                    queue.insert(e, now + rng() % 1000000);
+                }
+
+                runBench("timer_queue_hold", shape, 0, 1, [&]() {
+                    std::uint32_t first_time = 0;
+                    queue.getFirstTime(first_time);
+                    now = first_time;
+                    queue.prepareForRemovingExpired(now);
+                    Entry *e = queue.removeExpired();
+                    queue.insert(*e, now + 1 + rng() % 1000000);
+                });
+            }
+        }
+    }
+};
+
+AIPSTACK_DEFINE_STRUCT(BenchHeader,
+    (Port1,  std::uint16_t)
+    (Port2,  std::uint16_t)
+    (Seq,    std::uint32_t)
+    (Ack,    std::uint32_t)
+    (Flags,  std::uint8_t)
+    (Wide,   std::uint64_t)
+)
+
+static void benchStruct ()
+{
+    constexpr std::size_t NumHeaders = 64;
+    std::unique_ptr<char[]> mem(new char[NumHeaders * BenchHeader::Size + 1]);
+
+    // Use an odd offset so that fields are unaligned as in real packets.
+    char *base = mem.get() + 1;
+
+    runBench("struct_set", "6_fields", 0, NumHeaders, [&]() {
+        for (std::size_t i = 0; i < NumHeaders; i++) {
+            auto hdr = BenchHeader::MakeRef(base + i * BenchHeader::Size);
+            hdr.set(BenchHeader::Port1(), std::uint16_t(i));
+            hdr.set(BenchHeader::Port2(), std::uint16_t(i + 1));
+            hdr.set(BenchHeader::Seq(), std::uint32_t(i * 3));
+            hdr.set(BenchHeader::Ack(), std::uint32_t(i * 5));
+            hdr.set(BenchHeader::Flags(), std::uint8_t(i));
+            hdr.set(BenchHeader::Wide(), std::uint64_t(i) << 33);
+        }
+    });
+
+    runBench("struct_get", "6_fields", 0, NumHeaders, [&]() {
+        std::uint64_t sum = 0;
+        for (std::size_t i = 0; i < NumHeaders; i++) {
+            auto hdr = BenchHeader::MakeRef(base + i * BenchHeader::Size);
+            sum += hdr.get(BenchHeader::Port1()) + hdr.get(BenchHeader::Port2()) +
+                   hdr.get(BenchHeader::Seq()) + hdr.get(BenchHeader::Ack()) +
+                   hdr.get(BenchHeader::Flags()) + hdr.get(BenchHeader::Wide());
+        }
+        g_sink = g_sink + sum;
+    });
+}
+
+static bool parseArgs (int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        char const *arg = argv[i];
+        if (std::strncmp(arg, "min_time_ms=", 12) == 0) {
+            g_settings.min_time_sec = std::atof(arg + 12) * 1e-3;
+        }
+        else if (std::strncmp(arg, "filter=", 7) == 0) {
+            g_settings.filter = arg + 7;
+        }
+        else {
+            std::fprintf(stderr, "Usage: %s [min_time_ms=<n>] [filter=<substring>]\n",
+                         argv[0]);
+            return false;
+        }
+    }
+    return g_settings.min_time_sec > 0.0;
+}
+
+}
+
+int main (int argc, char *argv[])
+{
+    using namespace AIpStackBenchmarks;
+
+    if (!parseArgs(argc, argv)) {
+        return 2;
+    }
+
+    benchChksum();
+    benchBufUtils();
+    IndexBench<AIpStack::AvlTreeIndexService>::run("avl_tree_index_find",
+                                                   "avl_tree_index_remove_add");
+    IndexBench<AIpStack::MruListIndexService>::run("mru_list_index_find",
+                                                   "mru_list_index_remove_add");
+    TimerBench::run();
+    benchStruct();
+
+    return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// TCP loss recovery scenarios. For each scenario a fixed amount of data is sent
+// from the client to the server while the frames received by the server (the
+// data direction) pass through a seeded FrameImpairment stage. Prints one JSON
+// object per scenario with the goodput, the longest interval without progress
+// (the worst recovery time) and the impairment counters.
+//
+// The "duration" argument is the time limit for each scenario.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <aipstack/sim/FrameImpairment.h>
+
+#include "bench_common.h"
+
+namespace AIpStackBenchmarks {
+
+constexpr std::uint64_t TransferBytes = 16 * 1024 * 1024;
+
+struct RecoveryScenario {
+    char const *name;
+    AIpStack::FrameImpairmentParams params;
+};
+
+static std::vector<RecoveryScenario> makeScenarios (std::size_t eth_mtu)
+{
+    using Loss = AIpStack::FrameLossModel;
+
+    std::vector<RecoveryScenario> scenarios;
+
+    auto add = [&](char const *name) -> AIpStack::FrameImpairmentParams & {
+        AIpStack::FrameImpairmentParams params;
+        params.seed = 1 + scenarios.size();
+        params.delay_sec = 0.0005;
+        params.max_frame_size = eth_mtu;
+        params.queue_limit = 1024;
+        scenarios.push_back(RecoveryScenario{name, params});
+        return scenarios.back().params;
+    };
+
+    add("baseline");
+
+    auto add_bernoulli = [&](char const *name, double loss_prob) {
+        AIpStack::FrameImpairmentParams &params = add(name);
+        params.loss_model = Loss::Bernoulli;
+        params.loss_prob = loss_prob;
+    };
+
+    add_bernoulli("bernoulli_0.1pct", 0.001);
+    add_bernoulli("bernoulli_1pct", 0.01);
+    add_bernoulli("bernoulli_2pct", 0.02);
+
+    {
+        AIpStack::FrameImpairmentParams &params = add("gilbert_elliott");
+        params.loss_model = Loss::GilbertElliott;
+        params.ge_p_good_bad = 0.005;
+        params.ge_p_bad_good = 0.3;
+        params.ge_loss_good = 0.0;
+        params.ge_loss_bad = 0.5;
+    }
+
+    add("reorder_2pct").reorder_prob = 0.02;
+
+    add("duplicate_2pct").duplicate_prob = 0.02;
+
+    add("jitter_200us").jitter_sec = 0.0002;
+
+    {
+        AIpStack::FrameImpairmentParams &params = add("rate_200mbps_shallow_queue");
+        params.rate_bps = 200e6;
+        params.queue_limit = 64;
+    }
+
+    return scenarios;
+}
+
+static bool runScenario (BenchSettings const &settings, RecoveryScenario const &scenario)
+{
+    BenchTopology topo(settings.wire);
+
+    topo.serverIface().setRxImpairment(scenario.params);
+
+    AIpStack::EventLoop &loop = topo.eventLoop();
+
+    BulkSinkServer server(topo.serverTcp(), [&loop](std::uint64_t bytes) {
+        if (bytes >= TransferBytes) {
+            loop.stop();
+        }
+    });
+    BulkSourceConnection client_con(topo.clientTcp());
+
+    Platform::Timer stop_timer(topo.platform(), [&loop]() {
+        loop.stop();
+    });
+    stop_timer.setAfter(Platform::TimeType(settings.duration_sec * Platform::TimeFreq));
+
+    AIpStack::EventLoopTime start_time = AIpStack::EventLoop::getTime();
+    loop.run();
+    double elapsed = secondsSince(start_time);
+
+    std::uint64_t bytes = server.bytes();
+    bool completed = bytes >= TransferBytes;
+    double max_stall = (server.connection() != nullptr) ?
+        server.connection()->maxStallSec() : elapsed;
+    AIpStack::FrameImpairmentStats const &stats =
+        topo.serverIface().getRxImpairment()->getStats();
+
+    std::printf("{\"bench\":\"tcp_recovery\",\"scenario\":\"%s\",\"completed\":%s,"
+        "\"elapsed_sec\":%.3f,\"bytes\":%llu,\"goodput_mbit_per_sec\":%.2f,"
+        "\"max_stall_ms\":%.3f,\"frames_in\":%llu,\"frames_lost\":%llu,"
+        "\"frames_duplicated\":%llu,\"frames_reordered\":%llu,"
+        "\"frames_queue_dropped\":%llu}\n",
+        scenario.name, completed ? "true" : "false", elapsed,
+        static_cast<unsigned long long>(bytes), 8.0 * double(bytes) / elapsed / 1e6,
+        max_stall * 1e3,
+        static_cast<unsigned long long>(stats.frames_in),
+        static_cast<unsigned long long>(stats.frames_lost),
+        static_cast<unsigned long long>(stats.frames_duplicated),
+        static_cast<unsigned long long>(stats.frames_reordered),
+        static_cast<unsigned long long>(stats.frames_queue_dropped));
+
+    return completed;
+}
+
+}
+
+int main (int argc, char *argv[])
+{
+    using namespace AIpStackBenchmarks;
+
+    BenchSettings settings;
+    settings.duration_sec = 60.0;
+    if (!parseBenchArgs(argc, argv, settings)) {
+        return 2;
+    }
+
+    int result = 0;
+    for (RecoveryScenario const &scenario : makeScenarios(settings.wire.eth_mtu)) {
+        if (!runScenario(settings, scenario)) {
+            result = 1;
+        }
+    }
+
+    return result;
+}
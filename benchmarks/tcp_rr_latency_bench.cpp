@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// TCP request/response round trips between two IpStacks connected by a
+// VirtualWire. The client sends a request, the server echoes it and the client
+// sends the next request once the whole response has arrived. Prints one JSON
+// object with round-trip time percentiles.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/event_loop/EventLoop.h>
+
+#include "bench_common.h"
+
+namespace AIpStackBenchmarks {
+
+constexpr std::size_t BufferSize = 64 * 1024;
+constexpr int WindowUpdateThresDiv = 8;
+constexpr std::size_t DefaultMsgSize = 1;
+
+// Echoes received data using the same circular buffer for receiving and sending.
+class EchoConnection : public TcpConnection
+{
+public:
+    EchoConnection (TcpListener &listener) :
+        m_buf_node{m_buffer.get(), BufferSize, &m_buf_node}
+    {
+        if (acceptConnection(listener) != AIpStack::IpErr::Success) {
+            throw std::runtime_error("acceptConnection failed");
+        }
+        setProportionalWindowUpdateThreshold(BufferSize, WindowUpdateThresDiv);
+        setRecvBuf({&m_buf_node, 0, BufferSize});
+        setSendBuf({&m_buf_node, 0, 0});
+    }
+
+private:
+    void connectionAborted () override final
+    {
+        std::fprintf(stderr, "Server connection aborted.\n");
+    }
+
+    void dataReceived (std::size_t amount) override final
+    {
+        if (amount > 0) {
+            extendSendBuf(amount);
+            sendPush();
+        }
+    }
+
+    void dataSent (std::size_t amount) override final
+    {
+        extendRecvBuf(amount);
+    }
+
+private:
+    std::unique_ptr<char[]> m_buffer{new char[BufferSize]};
+    AIpStack::IpBufNode m_buf_node;
+};
+
+class EchoServer
+{
+public:
+    EchoServer (AIpStack::TcpApi<TcpArg> &tcp) :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&EchoServer::connectionEstablished, this))
+    {
+        if (!m_listener.startListening(tcp, {
+            /*addr=*/ AIpStack::Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        })) {
+            throw std::runtime_error("startListening failed");
+        }
+        m_listener.setInitialReceiveWindow(BufferSize);
+    }
+
+private:
+    void connectionEstablished ()
+    {
+        m_con = std::make_unique<EchoConnection>(m_listener);
+    }
+
+private:
+    TcpListener m_listener;
+    std::unique_ptr<EchoConnection> m_con;
+};
+
+// Sends requests one at a time and records the round-trip time of each.
+class RequestConnection : public TcpConnection
+{
+public:
+    RequestConnection (AIpStack::TcpApi<TcpArg> &tcp, std::size_t msg_size) :
+        m_msg_size(msg_size),
+        m_tx_node{m_tx_buffer.get(), BufferSize, &m_tx_node},
+        m_rx_node{m_rx_buffer.get(), BufferSize, &m_rx_node},
+        m_rx_pending(0)
+    {
+        AIpStack::TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        args.rcv_wnd = BufferSize;
+        if (startConnection(tcp, args) != AIpStack::IpErr::Success) {
+            throw std::runtime_error("startConnection failed");
+        }
+        setProportionalWindowUpdateThreshold(BufferSize, WindowUpdateThresDiv);
+        setRecvBuf({&m_rx_node, 0, BufferSize});
+        setSendBuf({&m_tx_node, 0, 0});
+    }
+
+    inline std::vector<double> & samples () { return m_samples; }
+
+private:
+    void sendRequest ()
+    {
+        m_rx_pending = m_msg_size;
+        m_send_time = AIpStack::EventLoop::getTime();
+        extendSendBuf(m_msg_size);
+        sendPush();
+    }
+
+    void connectionAborted () override final
+    {
+        std::fprintf(stderr, "Client connection aborted.\n");
+    }
+
+    void connectionEstablished () override final
+    {
+        sendRequest();
+    }
+
+    void dataReceived (std::size_t amount) override final
+    {
+        extendRecvBuf(amount);
+
+        if (amount == 0 || amount > m_rx_pending) {
+            std::fprintf(stderr, "Unexpected data from server.\n");
+            return;
+        }
+
+        m_rx_pending -= amount;
+        if (m_rx_pending == 0) {
+            m_samples.push_back(secondsSince(m_send_time));
+            sendRequest();
+        }
+    }
+
+    void dataSent ([[maybe_unused]] std::size_t amount) override final {}
+
+private:
+    std::size_t m_msg_size;
+    std::unique_ptr<char[]> m_tx_buffer{new char[BufferSize]()};
+    std::unique_ptr<char[]> m_rx_buffer{new char[BufferSize]};
+    AIpStack::IpBufNode m_tx_node;
+    AIpStack::IpBufNode m_rx_node;
+    std::size_t m_rx_pending;
+    AIpStack::EventLoopTime m_send_time;
+    std::vector<double> m_samples;
+};
+
+static double percentileUs (std::vector<double> const &sorted, double p)
+{
+    std::size_t index = std::size_t(p * double(sorted.size() - 1) + 0.5);
+    return sorted[index] * 1e6;
+}
+
+static int runBenchmark (BenchSettings const &settings, std::size_t msg_size)
+{
+    BenchTopology topo(settings.wire);
+
+    EchoServer server(topo.serverTcp());
+    RequestConnection client_con(topo.clientTcp(), msg_size);
+
+    AIpStack::EventLoop &loop = topo.eventLoop();
+    Platform::Timer stop_timer(topo.platform(), [&loop]() {
+        loop.stop();
+    });
+    stop_timer.setAfter(Platform::TimeType(settings.duration_sec * Platform::TimeFreq));
+
+    AIpStack::EventLoopTime start_time = AIpStack::EventLoop::getTime();
+    loop.run();
+    double elapsed = secondsSince(start_time);
+
+    std::vector<double> &samples = client_con.samples();
+    if (samples.empty()) {
+        std::fprintf(stderr, "No round trips completed.\n");
+        return 1;
+    }
+
+    std::sort(samples.begin(), samples.end());
+
+    double sum = 0.0;
+    for (double sample : samples) {
+        sum += sample;
+    }
+
+    std::printf("{\"bench\":\"tcp_rr_latency\",\"elapsed_sec\":%.3f,"
+        "\"msg_size\":%zu,\"transactions\":%zu,\"transactions_per_sec\":%.0f,"
+        "\"rtt_mean_us\":%.2f,\"rtt_p50_us\":%.2f,\"rtt_p99_us\":%.2f,"
+        "\"rtt_max_us\":%.2f}\n",
+        elapsed, msg_size, samples.size(), double(samples.size()) / elapsed,
+        sum / double(samples.size()) * 1e6, percentileUs(samples, 0.5),
+        percentileUs(samples, 0.99), samples.back() * 1e6);
+
+    return 0;
+}
+
+}
+
+int main (int argc, char *argv[])
+{
+    using namespace AIpStackBenchmarks;
+
+    BenchSettings settings;
+    if (!parseBenchArgs(argc, argv, settings)) {
+        return 2;
+    }
+
+    return runBenchmark(settings, DefaultMsgSize);
+}
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Connection churn simulated in virtual time. A number of client slots each
+// repeatedly open a connection, exchange one request/response and close the
+// connection, waiting a think time between connections. Both stacks and the
+// VirtualWire run on SimulatedPlatformImpl, so TIME_WAIT and other long timers
+// cost no wall-clock time. Prints one JSON object with the simulated and
+// wall-clock durations and connection counts.
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/platform_specific/ReservedArray.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+namespace AIpStackBenchmarks {
+
+using PlatformImpl = AIpStack::SimulatedPlatformImpl;
+using PlatformRef = AIpStack::PlatformRef<PlatformImpl>;
+using Platform = AIpStack::PlatformFacade<PlatformImpl>;
+
+using IndexService = AIpStack::AvlTreeIndexService;
+
+using SimIpStackService = AIpStack::IpStackService<
+    AIpStack::IpStackOptions::HeaderBeforeIp::Is<AIpStack::EthHeader::Size>,
+    AIpStack::IpStackOptions::PathMtuCacheService::Is<
+        AIpStack::IpPathMtuCacheService<
+            AIpStack::IpPathMtuCacheOptions::NumMtuEntries::Is<16>,
+            AIpStack::IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    AIpStack::IpStackOptions::ReassemblyService::Is<
+        AIpStack::IpReassemblyService<
+            AIpStack::IpReassemblyOptions::MaxReassEntrys::Is<4>,
+            AIpStack::IpReassemblyOptions::MaxReassSize::Is<16000>
+        >
+    >
+>;
+
+using SimProtocolServicesList = AIpStack::MakeTypeList<
+    AIpStack::IpTcpProtoService<
+        AIpStack::IpTcpProtoOptions::NumTcpPcbs::Is<65536>,
+        AIpStack::IpTcpProtoOptions::PcbArrayService::Is<AIpStack::ReservedArrayService<32>>,
+        AIpStack::IpTcpProtoOptions::NumTimeWaitEntries::Is<8192>,
+        AIpStack::IpTcpProtoOptions::PcbIndexService::Is<IndexService>
+    >
+>;
+
+using SimEthIpIfaceService = AIpStack::EthIpIfaceService<
+    AIpStack::EthIpIfaceOptions::NumArpEntries::Is<4>,
+    AIpStack::EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    AIpStack::EthIpIfaceOptions::HeaderBeforeEth::Is<0>,
+    AIpStack::EthIpIfaceOptions::TimersStructureService::Is<AIpStack::LinkedHeapService>
+>;
+
+class SimStackArg : public SimIpStackService::template Compose<
+    PlatformImpl, SimProtocolServicesList> {};
+using SimIpStack = AIpStack::IpStack<SimStackArg>;
+
+using SimIface = AIpStack::VirtualWireEthIface<SimStackArg, SimEthIpIfaceService>;
+
+using TcpArg = SimIpStack::GetProtoArg<AIpStack::TcpApi>;
+using TcpListener = AIpStack::TcpListener<TcpArg>;
+using TcpConnection = AIpStack::TcpConnection<TcpArg>;
+
+constexpr AIpStack::Ip4Addr ServerAddr = AIpStack::Ip4Addr(10, 0, 0, 1);
+constexpr AIpStack::Ip4Addr ClientAddr = AIpStack::Ip4Addr(10, 0, 0, 2);
+constexpr std::uint8_t PrefixLength = 24;
+constexpr std::uint16_t ServerPort = 7;
+constexpr std::size_t BufferSize = 16 * 1024;
+
+struct ChurnSettings {
+    double sim_seconds = 3600.0;
+    std::size_t clients = 64;
+    double think_sec = 2.0;
+    std::size_t request_bytes = 1000;
+    double latency_sec = 0.0001;
+    double bandwidth_bps = 1e9;
+};
+
+static bool parseChurnArgs (int argc, char *argv[], ChurnSettings &settings)
+{
+    for (int i = 1; i < argc; i++) {
+        char const *arg = argv[i];
+        char const *eq = std::strchr(arg, '=');
+        double value = (eq != nullptr) ? std::atof(eq + 1) : 0.0;
+        std::size_t key_len = (eq != nullptr) ? std::size_t(eq - arg) : 0;
+
+        auto key_is = [&](char const *key) {
+            return std::strlen(key) == key_len && std::memcmp(arg, key, key_len) == 0;
+        };
+
+        if (key_is("sim_seconds")) {
+            settings.sim_seconds = value;
+        }
+        else if (key_is("clients")) {
+            settings.clients = std::size_t(value);
+        }
+        else if (key_is("think_ms")) {
+            settings.think_sec = value * 1e-3;
+        }
+        else if (key_is("request_bytes")) {
+            settings.request_bytes = std::size_t(value);
+        }
+        else if (key_is("latency_us")) {
+            settings.latency_sec = value * 1e-6;
+        }
+        else if (key_is("bandwidth_mbps")) {
+            settings.bandwidth_bps = value * 1e6;
+        }
+        else {
+            std::fprintf(stderr, "Usage: %s [sim_seconds=<n>] [clients=<n>] "
+                "[think_ms=<n>] [request_bytes=<n>] [latency_us=<n>] "
+                "[bandwidth_mbps=<n>]\n", argv[0]);
+            return false;
+        }
+    }
+
+    return settings.sim_seconds > 0.0 && settings.clients > 0 &&
+           settings.request_bytes > 0 && settings.request_bytes <= BufferSize;
+}
+
+// Server side: echoes data and closes after the client closes.
+class EchoServer :
+    private AIpStack::NonCopyable<EchoServer>
+{
+    class Session : public TcpConnection
+    {
+    public:
+        Session (EchoServer *server) :
+            m_server(server),
+            m_buf_node{m_buffer, BufferSize, &m_buf_node}
+        {
+            if (acceptConnection(server->m_listener) != AIpStack::IpErr::Success) {
+                throw std::runtime_error("acceptConnection failed");
+            }
+            setRecvBuf({&m_buf_node, 0, BufferSize});
+            setSendBuf({&m_buf_node, 0, 0});
+        }
+
+    private:
+        void connectionAborted () override final
+        {
+            // This destructs this object.
+            m_server->m_sessions.erase(this);
+        }
+
+        void dataReceived (std::size_t amount) override final
+        {
+            if (amount > 0) {
+                extendSendBuf(amount);
+                sendPush();
+            } else {
+                closeSending();
+            }
+        }
+
+        void dataSent (std::size_t amount) override final
+        {
+            extendRecvBuf(amount);
+        }
+
+    private:
+        EchoServer *m_server;
+        AIpStack::IpBufNode m_buf_node;
+        char m_buffer[BufferSize];
+    };
+
+public:
+    EchoServer (AIpStack::TcpApi<TcpArg> &tcp) :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&EchoServer::connectionEstablished, this))
+    {
+        if (!m_listener.startListening(tcp, {
+            /*addr=*/ AIpStack::Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1 << 20
+        })) {
+            throw std::runtime_error("startListening failed");
+        }
+        m_listener.setInitialReceiveWindow(BufferSize);
+    }
+
+private:
+    void connectionEstablished ()
+    {
+        auto session = std::make_unique<Session>(this);
+        Session *ptr = session.get();
+        m_sessions.emplace(ptr, std::move(session));
+    }
+
+private:
+    TcpListener m_listener;
+    std::unordered_map<Session *, std::unique_ptr<Session>> m_sessions;
+};
+
+struct ChurnCounters {
+    std::uint64_t started = 0;
+    std::uint64_t start_failed = 0;
+    std::uint64_t completed = 0;
+    std::uint64_t aborted = 0;
+};
+
+// Client side: one slot repeatedly runs a connection after a think time.
+class ClientSlot :
+    private AIpStack::NonCopyable<ClientSlot>
+{
+    class Session : public TcpConnection
+    {
+    public:
+        Session (ClientSlot *slot) :
+            m_slot(slot),
+            m_tx_node{m_tx_buffer, BufferSize, &m_tx_node},
+            m_rx_node{m_rx_buffer, BufferSize, &m_rx_node},
+            m_rx_pending(slot->m_settings.request_bytes)
+        {
+            std::memset(m_tx_buffer, 'r', sizeof(m_tx_buffer));
+        }
+
+        AIpStack::IpErr start (AIpStack::TcpApi<TcpArg> &tcp)
+        {
+            AIpStack::TcpStartConnectionArgs<TcpArg> args;
+            args.addr = ServerAddr;
+            args.port = ServerPort;
+            args.rcv_wnd = BufferSize;
+            AIpStack::IpErr err = startConnection(tcp, args);
+            if (err == AIpStack::IpErr::Success) {
+                setRecvBuf({&m_rx_node, 0, BufferSize});
+                setSendBuf({&m_tx_node, 0, 0});
+            }
+            return err;
+        }
+
+    private:
+        void connectionAborted () override final
+        {
+            // This destructs this object.
+            m_slot->sessionFinished(m_rx_pending == 0 && wasEndReceived());
+        }
+
+        void connectionEstablished () override final
+        {
+            extendSendBuf(m_slot->m_settings.request_bytes);
+            sendPush();
+        }
+
+        void dataReceived (std::size_t amount) override final
+        {
+            extendRecvBuf(amount);
+
+            if (amount > m_rx_pending) {
+                return;
+            }
+            m_rx_pending -= amount;
+
+            if (m_rx_pending == 0 && !wasEndSent()) {
+                closeSending();
+            }
+        }
+
+        void dataSent ([[maybe_unused]] std::size_t amount) override final {}
+
+    private:
+        ClientSlot *m_slot;
+        AIpStack::IpBufNode m_tx_node;
+        AIpStack::IpBufNode m_rx_node;
+        std::size_t m_rx_pending;
+        char m_tx_buffer[BufferSize];
+        char m_rx_buffer[BufferSize];
+    };
+
+public:
+    ClientSlot (Platform platform, AIpStack::TcpApi<TcpArg> &tcp,
+                ChurnSettings const &settings, ChurnCounters &counters,
+                Platform::TimeType first_start)
+    :
+        m_tcp(tcp),
+        m_settings(settings),
+        m_counters(counters),
+        m_timer(platform, AIPSTACK_BIND_MEMBER_TN(&ClientSlot::timerHandler, this))
+    {
+        m_timer.setAfter(first_start);
+    }
+
+private:
+    void timerHandler ()
+    {
+        m_session = std::make_unique<Session>(this);
+        if (m_session->start(m_tcp) != AIpStack::IpErr::Success) {
+            m_counters.start_failed++;
+            m_session.reset();
+            scheduleNext();
+            return;
+        }
+        m_counters.started++;
+    }
+
+    void sessionFinished (bool completed)
+    {
+        if (completed) {
+            m_counters.completed++;
+        } else {
+            m_counters.aborted++;
+        }
+        scheduleNext();
+        m_session.reset();
+    }
+
+    void scheduleNext ()
+    {
+        m_timer.setAfter(Platform::TimeType(m_settings.think_sec * Platform::TimeFreq));
+    }
+
+private:
+    AIpStack::TcpApi<TcpArg> &m_tcp;
+    ChurnSettings const &m_settings;
+    ChurnCounters &m_counters;
+    Platform::Timer m_timer;
+    std::unique_ptr<Session> m_session;
+};
+
+static int runBenchmark (ChurnSettings const &settings)
+{
+    PlatformImpl sim;
+    Platform platform{PlatformRef{&sim}};
+
+    AIpStack::VirtualWireParams wire_params;
+    wire_params.bandwidth_bps = settings.bandwidth_bps;
+    wire_params.latency_sec = settings.latency_sec;
+    AIpStack::VirtualWire<PlatformImpl> wire(wire_params);
+
+    ChurnCounters counters;
+
+    {
+        SimIpStack server_stack(platform);
+        SimIpStack client_stack(platform);
+        client_stack.getProtoApi<AIpStack::TcpApi>().setEphemeralPortKey(
+            AIpStack::SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+        SimIface server_iface(platform, &server_stack, wire,
+                              AIpStack::MacAddr(0x02, 0, 0, 0, 0, 1));
+        SimIface client_iface(platform, &client_stack, wire,
+                              AIpStack::MacAddr(0x02, 0, 0, 0, 0, 2));
+        server_iface.iface().setIp4Addr(
+            AIpStack::IpIfaceIp4AddrSetting(PrefixLength, ServerAddr));
+        client_iface.iface().setIp4Addr(
+            AIpStack::IpIfaceIp4AddrSetting(PrefixLength, ClientAddr));
+
+        EchoServer server(server_stack.getProtoApi<AIpStack::TcpApi>());
+
+        // Spread the first connections of the slots over one think time.
+        std::unique_ptr<std::unique_ptr<ClientSlot>[]> slots(
+            new std::unique_ptr<ClientSlot>[settings.clients]);
+        for (std::size_t i = 0; i < settings.clients; i++) {
+            double offset = settings.think_sec * double(i) / double(settings.clients);
+            slots[i] = std::make_unique<ClientSlot>(platform,
+                client_stack.getProtoApi<AIpStack::TcpApi>(), settings, counters,
+                Platform::TimeType(offset * Platform::TimeFreq));
+        }
+
+        auto wall_start = std::chrono::steady_clock::now();
+        sim.runUntil(Platform::TimeType(settings.sim_seconds * Platform::TimeFreq));
+        double wall_sec = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - wall_start).count();
+
+        std::printf("{\"bench\":\"tcp_sim_churn\",\"sim_sec\":%.1f,\"wall_sec\":%.3f,"
+            "\"speedup\":%.1f,\"clients\":%zu,\"connections_started\":%llu,"
+            "\"connections_completed\":%llu,\"connections_aborted\":%llu,"
+            "\"start_failures\":%llu,\"timers_dispatched\":%llu,\"frames\":%llu,"
+            "\"client_pcbs\":%d,\"server_pcbs\":%d}\n",
+            settings.sim_seconds, wall_sec, settings.sim_seconds / wall_sec,
+            settings.clients,
+            static_cast<unsigned long long>(counters.started),
+            static_cast<unsigned long long>(counters.completed),
+            static_cast<unsigned long long>(counters.aborted),
+            static_cast<unsigned long long>(counters.start_failed),
+            static_cast<unsigned long long>(sim.getNumDispatched()),
+            static_cast<unsigned long long>(server_iface.port().getStats().frames_sent +
+                                            client_iface.port().getStats().frames_sent),
+            client_stack.getProtoApi<AIpStack::TcpApi>().getNumPcbs(),
+            server_stack.getProtoApi<AIpStack::TcpApi>().getNumPcbs());
+
+        // Destruct the client slots while the stacks still exist.
+        slots.reset();
+    }
+
+    return (counters.completed > 0) ? 0 : 1;
+}
+
+}
+
+int main (int argc, char *argv[])
+{
+    using namespace AIpStackBenchmarks;
+
+    ChurnSettings settings;
+    if (!parseChurnArgs(argc, argv, settings)) {
+        return 2;
+    }
+
+    return runBenchmark(settings);
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Bulk TCP transfer between two IpStacks connected by a VirtualWire.
+// Prints one JSON object with the achieved goodput and segment rate.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+#include "bench_common.h"
+
+namespace AIpStackBenchmarks {
+
+static int runBenchmark (BenchSettings const &settings)
+{
+    BenchTopology topo(settings.wire);
+
+    BulkSinkServer server(topo.serverTcp());
+    BulkSourceConnection client_con(topo.clientTcp());
+
+    AIpStack::EventLoop &loop = topo.eventLoop();
+    Platform::Timer stop_timer(topo.platform(), [&loop]() {
+        loop.stop();
+    });
+    stop_timer.setAfter(Platform::TimeType(settings.duration_sec * Platform::TimeFreq));
+
+    AIpStack::EventLoopTime start_time = AIpStack::EventLoop::getTime();
+    topo.eventLoop().run();
+    double elapsed = secondsSince(start_time);
+
+    std::uint64_t bytes = server.bytes();
+    AIpStack::VirtualWireStats const &stats = topo.clientPort().getStats();
+
+    std::printf("{\"bench\":\"tcp_throughput\",\"elapsed_sec\":%.3f,"
+        "\"bytes\":%llu,\"gbit_per_sec\":%.4f,\"segments\":%llu,"
+        "\"segments_per_sec\":%.0f,\"frames_dropped\":%llu}\n",
+        elapsed, static_cast<unsigned long long>(bytes),
+        8.0 * double(bytes) / elapsed / 1e9,
+        static_cast<unsigned long long>(stats.frames_sent),
+        double(stats.frames_sent) / elapsed,
+        static_cast<unsigned long long>(stats.frames_dropped));
+
+    return (bytes > 0) ? 0 : 1;
+}
+
+}
+
+int main (int argc, char *argv[])
+{
+    using namespace AIpStackBenchmarks;
+
+    BenchSettings settings;
+    if (!parseBenchArgs(argc, argv, settings)) {
+        return 2;
+    }
+
+    return runBenchmark(settings);
+}
@@ -6,4 +6,10 @@ rec {
         enableSanitizers = true;
         customFlags = [ "-O2" ];
     };
+
+    aipstackBenchmarks = pkgs.callPackage benchmarks/benchmarks.nix {
+        enableAssertions = false;
+        enableSanitizers = false;
+        customFlags = [ "-O2" ];
+    };
 }
@@ -26,10 +26,12 @@
 #include <cstdio>
 #include <cstring>
 #include <memory>
+#include <random>
 #include <string>
 #include <stdexcept>
 
 #include <aipstack/misc/Function.h>
+#include <aipstack/misc/SipHash.h>
 #include <aipstack/structure/index/AvlTreeIndex.h>
 #include <aipstack/structure/index/MruListIndex.h>
 #include <aipstack/structure/minimum/LinkedHeap.h>
@@ -83,7 +85,8 @@ using MyIpStackService = AIpStack::IpStackService<
     AIpStack::IpStackOptions::ReassemblyService::Is<
         AIpStack::IpReassemblyService<
             AIpStack::IpReassemblyOptions::MaxReassEntrys::Is<16>,
-            AIpStack::IpReassemblyOptions::MaxReassSize::Is<60000>
+            AIpStack::IpReassemblyOptions::MaxReassSize::Is<60000>,
+            AIpStack::IpReassemblyOptions::ReassPoolSize::Is<128 * 1024>
         >
     >
 >;
@@ -150,6 +153,18 @@ using MyDhcpClient = AIpStack::IpDhcpClient<DhcpClientArg>;
 class MyExampleAppArg : public MyExampleAppService::template Compose<IpStackArg> {};
 using MyExampleApp = AIpStackExamples::ExampleApp<MyExampleAppArg>;
 
+// Generate a random key for the keyed hashes used by the stack
+static AIpStack::SipHashKey randomSipHashKey (std::random_device &rd)
+{
+    auto rand64 = [&rd]() {
+        return (std::uint64_t(rd()) << 32) | std::uint32_t(rd());
+    };
+    AIpStack::SipHashKey key;
+    key.k0 = rand64();
+    key.k1 = rand64();
+    return key;
+}
+
 // Callback function for printing DHCP client events
 static void dhcpClientCallback (
     std::unique_ptr<MyDhcpClient> const &dhcp, AIpStack::IpDhcpClientEvent event_type)
@@ -217,6 +232,13 @@ int main (int argc, char *argv[])
     // Construct the IP stack.
     auto stack = std::make_unique<MyIpStack>(platform);
     
+    // Set random keys for ephemeral port selection.
+    std::random_device random_dev;
+    stack->getProtoApi<AIpStack::TcpApi>().setEphemeralPortKey(
+        randomSipHashKey(random_dev));
+    stack->getProtoApi<AIpStack::UdpApi>().setEphemeralPortKey(
+        randomSipHashKey(random_dev));
+    
     // Construct the TAP interface.
     std::unique_ptr<MyTapIface> iface;
     try {
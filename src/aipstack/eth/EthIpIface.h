@@ -310,7 +310,8 @@ public:
             /*hw_type=*/ IpHwType::Ethernet,
             /*hw_iface=*/ static_cast<EthHwIface *>(this),
             AIPSTACK_BIND_MEMBER_TN(&EthIpIface::driverSendIp4Packet, this),
-            AIPSTACK_BIND_MEMBER_TN(&EthIpIface::driverGetState, this)
+            AIPSTACK_BIND_MEMBER_TN(&EthIpIface::driverGetState, this),
+            AIPSTACK_BIND_MEMBER_TN(&EthIpIface::driverSendIp4Packets, this)
         }),
         m_timer(platform_, AIPSTACK_BIND_MEMBER_TN(&EthIpIface::timerHandler, this))
     {
@@ -433,6 +434,43 @@ private:
         return m_params.send_frame(frame);
     }
     
+    IpErr driverSendIp4Packets (IpBufRef const *pkts, std::size_t num_pkts,
+        Ip4Addr ip_addr, IpSendRetryRequest *retryReq, std::size_t &num_sent)
+    {
+        num_sent = 0;
+
+        // Resolve the MAC address once for all packets.
+        MacAddr dst_mac;
+        IpErr resolve_err = resolve_hw_addr(ip_addr, &dst_mac, retryReq);
+        if (AIPSTACK_UNLIKELY(resolve_err != IpErr::Success)) {
+            return resolve_err;
+        }
+        
+        for (; num_sent < num_pkts; num_sent++) {
+            IpBufRef pkt = pkts[num_sent];
+
+            // Reveal the Ethernet header.
+            if (AIPSTACK_UNLIKELY(pkt.offset < EthHeader::Size)) {
+                return IpErr::NoHeaderSpace;
+            }
+            IpBufRef frame = pkt.revealHeader(EthHeader::Size);
+            
+            // Write the Ethernet header.
+            auto eth_header = EthHeader::MakeRef(frame.getChunkPtr());
+            eth_header.set(EthHeader::DstMac(),  dst_mac);
+            eth_header.set(EthHeader::SrcMac(),  *m_params.mac_addr);
+            eth_header.set(EthHeader::EthType(), EthType::Ipv4);
+            
+            // Send the frame via the lower-layer driver.
+            IpErr err = m_params.send_frame(frame);
+            if (AIPSTACK_UNLIKELY(err != IpErr::Success)) {
+                return err;
+            }
+        }
+
+        return IpErr::Success;
+    }
+    
     IpIfaceDriverState driverGetState ()
     {
         // Get the state from the lower-layer driver.
@@ -116,10 +116,11 @@ public:
      * no longer ready to handle these calls.
      * 
      * When this is called, there must be no remaining @ref IpIfaceListener
-     * objects listening on this interface or @ref IpIfaceStateObserver objects
-     * observing this interface. Additionally, this must not be called in
-     * potentially hazardous context with respect to IP processing, such as
-     * from withing receive processing of this interface (@ref recvIp4Packet).
+     * objects listening on this interface, @ref IpIfaceStateObserver objects
+     * observing this interface or @ref IpStaticRoute objects using this
+     * interface. Additionally, this must not be called in potentially hazardous
+     * context with respect to IP processing, such as from withing receive
+     * processing of this interface (@ref recvIp4Packet).
      * Safety can be ensured by performing the destruction from a top-level event
      * handler such as a timer.
      */
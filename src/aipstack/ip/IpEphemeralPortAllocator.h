@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_IP_EPHEMERAL_PORT_ALLOCATOR_H
+#define AIPSTACK_IP_EPHEMERAL_PORT_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/BinaryTools.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/ip/IpAddr.h>
+
+namespace AIpStack {
+
+/**
+ * Selects ephemeral ports using the double-hash algorithm from RFC 6056
+ * (Algorithm 4).
+ * 
+ * The starting point of the search depends on a keyed hash of the local address
+ * and the remote address and port, so different destinations use independent
+ * port sequences. A small table of counters, indexed by a second hash of the same
+ * tuple, is advanced by every candidate that is tried. Consequently consecutive
+ * connections to the same destination get consecutive fresh ports, and ports
+ * which were just given out (and may now be in TIME_WAIT) are only revisited
+ * after the whole range has been used. In the common case the first candidate
+ * is free.
+ * 
+ * Both the offset and the table index are taken from a SipHash of the tuple. The
+ * key must be secret and random for the ports to be unpredictable to an off-path
+ * attacker; it is set using @ref setKey, normally from the application through
+ * the protocol API.
+ * 
+ * @tparam PortFirst First port in the ephemeral range.
+ * @tparam PortLast Last port in the ephemeral range (inclusive).
+ * @tparam TableSize Number of counters in the table (power of two).
+ */
+template<PortNum PortFirst, PortNum PortLast, std::size_t TableSize = 16>
+class IpEphemeralPortAllocator
+{
+    static_assert(PortFirst > 0);
+    static_assert(PortFirst <= PortLast);
+    static_assert(TableSize > 0 && (TableSize & (TableSize - 1)) == 0);
+    
+    static constexpr std::uint32_t NumPorts = std::uint32_t(PortLast - PortFirst) + 1;
+    
+public:
+    /**
+     * Initialize the allocator.
+     * 
+     * The counters are reset and the key is set to all zeros. Until a random key
+     * is set using @ref setKey, the port sequences are predictable (but still
+     * differ between destinations), and @ref allocate asserts that a key has
+     * been set.
+     */
+    void init ()
+    {
+        m_key = SipHashKey();
+        m_key_set = false;
+        for (std::uint16_t &cnt : m_table) {
+            cnt = 0;
+        }
+    }
+    
+    /**
+     * Set the secret key used to hash address tuples.
+     * 
+     * This may be called at any time; it only changes the ports selected
+     * afterwards.
+     * 
+     * @param key New key, which should be random.
+     */
+    void setKey (SipHashKey const &key)
+    {
+        m_key = key;
+        m_key_set = true;
+    }
+    
+    /**
+     * Return whether a key has been set using @ref setKey.
+     * 
+     * @return True if a key has been set.
+     */
+    bool isKeySet () const
+    {
+        return m_key_set;
+    }
+    
+    /**
+     * Find a free ephemeral port for the given address tuple.
+     * 
+     * @param port_is_free Callable as `bool(PortNum)`, returns whether the local
+     *        port may be used with the given tuple.
+     * @return The selected port, or 0 if all ports in the range are in use.
+     */
+    template<typename PortIsFree>
+    PortNum allocate (Ip4Addr local_addr, Ip4Addr remote_addr, PortNum remote_port,
+                      PortIsFree port_is_free)
+    {
+        // Without a secret key the ports are predictable.
+        AIPSTACK_ASSERT(m_key_set);
+        
+        char msg[10];
+        WriteBinaryInt<std::uint32_t, BinaryBigEndian>(local_addr.value(), msg + 0);
+        WriteBinaryInt<std::uint32_t, BinaryBigEndian>(remote_addr.value(), msg + 4);
+        WriteBinaryInt<std::uint16_t, BinaryBigEndian>(remote_port, msg + 8);
+        std::uint64_t h = SipHash24(m_key, msg, sizeof(msg));
+        
+        // The two halves of the hash are independent. The offset and counter are
+        // reduced separately since their sum could overflow.
+        std::uint32_t offset = std::uint32_t(h) % NumPorts;
+        std::uint32_t index = std::uint32_t(h >> 32) & (TableSize - 1);
+        std::uint16_t &counter = m_table[index];
+        
+        for (std::uint32_t i = 0; i < NumPorts; i++) {
+            PortNum port = PortNum(PortFirst + (offset + counter % NumPorts) % NumPorts);
+            counter++;
+            
+            if (port_is_free(port)) {
+                return port;
+            }
+        }
+        
+        return 0;
+    }
+    
+private:
+    SipHashKey m_key;
+    bool m_key_set;
+    std::uint16_t m_table[TableSize];
+};
+
+}
+
+#endif
@@ -25,6 +25,7 @@
 #ifndef AIPSTACK_IP_IFACE_H
 #define AIPSTACK_IP_IFACE_H
 
+#include <cstddef>
 #include <cstdint>
 
 #include <aipstack/misc/MinMax.h>
@@ -77,6 +78,7 @@ class IpIface :
 {
     template<typename> friend class IpStack;
     template<typename> friend class IpIfaceListener;
+    template<typename> friend class IpStaticRoute;
     template<typename> friend class IpIfaceStateObserver;
     template<typename> friend class IpDriverIface;
 
@@ -85,6 +87,7 @@ private:
         m_stack(stack),
         m_params(params),
         m_ip_mtu(MinValueU(TypeMax<std::uint16_t>, params.ip_mtu)),
+        m_num_static_routes(0),
         m_have_addr(false),
         m_have_gateway(false)
     {
@@ -95,14 +98,17 @@ private:
         
         // Add the interface to the list of interfaces.
         m_stack->m_iface_list.prepend(*this);
+        m_stack->routeConfigChanged();
     }
 
     ~IpIface ()
     {
         AIPSTACK_ASSERT(m_listeners_list.isEmpty());
+        AIPSTACK_ASSERT(m_num_static_routes == 0);
         
         // Remove the interface from the list of interfaces.
         m_stack->m_iface_list.remove(*this);
+        m_stack->routeConfigChanged();
     }
 
     inline IpDriverIface<Arg> & driver () {
@@ -133,6 +139,8 @@ public:
                 (Ip4Addr::AllOnesAddr() & ~m_addr.netmask);
             m_addr.prefix = value.prefix;
         }
+
+        m_stack->routeConfigChanged();
     }
     
     /**
@@ -166,6 +174,8 @@ public:
         if (value.present) {
             m_gateway = value.addr;
         }
+
+        m_stack->routeConfigChanged();
     }
     
     /**
@@ -299,6 +309,7 @@ private:
     std::uint16_t m_ip_mtu;
     IpIfaceIp4Addrs m_addr;
     Ip4Addr m_gateway;
+    std::size_t m_num_static_routes;
     bool m_have_addr;
     bool m_have_gateway;
 };
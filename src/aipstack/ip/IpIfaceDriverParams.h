@@ -108,6 +108,34 @@ struct IpIfaceDriverParams {
      * @return Driver-provided-state (currently just the link-up flag).
      */
     Function<IpIfaceDriverState()> get_state = nullptr;
+
+    /**
+     * Driver function used to send multiple IPv4 packets to the same next hop.
+     *
+     * @note This function is optional. If it is not provided, the stack will call
+     * @ref send_ip4_packet for each packet instead.
+     *
+     * This is called by @ref IpStack::sendIp4DgramsFast to pass a batch of packets
+     * to the driver in one call. The same considerations as for @ref send_ip4_packet
+     * apply to each packet. The driver should send the packets in order and stop at
+     * the first packet which could not be sent; the stack does not attempt the
+     * remaining packets. Per-batch work such as next hop address resolution should
+     * be done once. If it fails, nothing is sent and sendRetryReq is used as for
+     * @ref send_ip4_packet.
+     *
+     * @param pkts Pointer to the first element of an array of packets to send (each
+     *        including the IP header).
+     * @param num_pkts Number of packets in the array (at least one).
+     * @param ip_addr Next hop address (the same for all packets).
+     * @param sendRetryReq See @ref send_ip4_packet.
+     * @param num_sent Must be set to the number of packets which were sent
+     *        successfully (a prefix of the array).
+     * @return Success if all packets were sent, otherwise the error code for the
+     *         first packet which could not be sent.
+     */
+    Function<IpErr(IpBufRef const *pkts, std::size_t num_pkts, Ip4Addr ip_addr,
+                   IpSendRetryRequest *sendRetryReq, std::size_t &num_sent)>
+        send_ip4_packets = nullptr;
 };
 
 /** @} */
@@ -249,6 +249,41 @@ public:
         return true;
     }
     
+    bool handlePathMtuProbed (Ip4Addr remote_addr, std::uint16_t mtu)
+    {
+        // Find the entry of this address. If it there is none, do nothing.
+        MtuLinkModelRef mtu_ref = m_mtu_index.findEntry(remote_addr, *this);
+        if (mtu_ref.isNull()) {
+            return false;
+        }
+        
+        MtuEntry &mtu_entry = *mtu_ref;
+        AIPSTACK_ASSERT(mtu_entry.state == OneOf(EntryState::Referenced, EntryState::Unused));
+        AIPSTACK_ASSERT(mtu_entry.remote_addr == remote_addr);
+        
+        // Make sure the PMTU will not exceed the interface MTU.
+        IpRouteInfoIp4<StackArg> route_info;
+        if (m_ip_stack->routeIp4(remote_addr, route_info)) {
+            mtu = MinValue(mtu, route_info.iface->getMtu());
+        }
+        
+        // Only ever raise the PMTU here.
+        if (mtu <= mtu_entry.mtu) {
+            return false;
+        }
+        
+        // Update PMTU, reset timeout.
+        mtu_entry.mtu = mtu;
+        mtu_entry.minutes_old = 0;
+        
+        // Notify all MtuRef referencing this entry.
+        if (mtu_entry.state == EntryState::Referenced) {
+            notify_pmtu_changed(mtu_entry);
+        }
+        
+        return true;
+    }
+    
     class MtuRef :
         private NonCopyable<MtuRef>
     #ifndef IN_DOXYGEN
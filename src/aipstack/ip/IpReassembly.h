@@ -25,16 +25,15 @@
 #ifndef AIPSTACK_IPREASSEMBLY_H
 #define AIPSTACK_IPREASSEMBLY_H
 
+#include <cstddef>
 #include <cstdint>
-#include <cstring>
 
 #include <aipstack/misc/Use.h>
 #include <aipstack/misc/Assert.h>
 #include <aipstack/misc/MinMax.h>
 #include <aipstack/misc/NonCopyable.h>
-#include <aipstack/misc/MinMax.h>
 #include <aipstack/misc/Function.h>
-#include <aipstack/infra/Struct.h>
+#include <aipstack/misc/EnumUtils.h>
 #include <aipstack/infra/Buf.h>
 #include <aipstack/infra/BufUtils.h>
 #include <aipstack/infra/Options.h>
@@ -58,8 +57,12 @@ class IpReassembly;
 /**
  * Implements IPv4 datagram reassembly.
  * 
- * The implementation uses the strategy suggested in RFC 815, whereby hole
- * descriptors are placed at the beginnings of holes.
+ * Datagrams being reassembled are indexed by a hash of (ident, src, dst, proto).
+ * Fragment data is stored in fixed-size chunks taken from a pool shared by all
+ * datagrams, where each chunk holds a fixed, aligned range of the datagram
+ * payload. The received ranges are tracked as a sorted list of intervals. A
+ * completed datagram is returned as a chain of buffer nodes over its chunks,
+ * without further copying.
  * 
  * @tparam Arg An instantiated @ref IpReassemblyService::Compose template
  *         or a type derived from such. Note that the @ref IpStack actually
@@ -71,34 +74,46 @@ class IpReassembly :
     private NonCopyable<IpReassembly<Arg>>
 {
     AIPSTACK_USE_VALS(Arg::Params, (MaxReassEntrys, MaxReassSize, MaxReassHoles,
-                                    MaxReassTimeSeconds))
+                                    MaxReassTimeSeconds, ReassChunkSize, ReassPoolSize))
     AIPSTACK_USE_TYPES(Arg, (PlatformImpl))
     
     using Platform = PlatformFacade<PlatformImpl>;
     AIPSTACK_USE_TYPES(Platform, (TimeType))
     
     static_assert(MaxReassEntrys > 0);
+    static_assert(MaxReassEntrys < TypeMax<std::uint16_t>);
     static_assert(MaxReassSize >= Ip4RequiredRecvSize);
     static_assert(MaxReassHoles >= 1);
-    static_assert(MaxReassHoles <= 250); // important to prevent num_holes overflow
     static_assert(MaxReassTimeSeconds >= 5);
     
-    // Null link value in HoleDescriptor lists.
-    inline static constexpr std::uint16_t ReassNullLink = TypeMax<std::uint16_t>;
+    // The first chunk must hold any transport-layer header in one piece.
+    static_assert(ReassChunkSize >= 64);
+    
+    // Null value for entry and chunk indices.
+    inline static constexpr std::uint16_t ReassNullIndex = TypeMax<std::uint16_t>;
     
-    // Hole descriptor structure, placed at the beginning of a hole.
-    AIPSTACK_DEFINE_STRUCT(HoleDescriptor,
-        (HoleSize,       StructRawField<std::uint16_t>)
-        (NextHoleOffset, StructRawField<std::uint16_t>)
-    )
+    // Number of chunks needed for a datagram of the maximum size.
+    inline static constexpr std::size_t ChunksPerDgram =
+        (MaxReassSize + std::size_t(ReassChunkSize - 1)) / ReassChunkSize;
     
-    // We need to be able to put a hole descriptor after the reassembled data.
-    static_assert(MaxReassSize <= TypeMax<std::uint16_t> - HoleDescriptor::Size);
+    // Number of chunks in the pool, by default enough for MaxReassEntrys datagrams
+    // of the maximum size.
+    inline static constexpr std::size_t NumChunks = (ReassPoolSize == 0) ?
+        MaxReassEntrys * ChunksPerDgram : ReassPoolSize / ReassChunkSize;
     
-    // The size of the reassembly buffers, with additional space for a hole descriptor
-    // at the end.
-    inline static constexpr std::uint16_t ReassBufferSize =
-        MaxReassSize + HoleDescriptor::Size;
+    static_assert(NumChunks * ReassChunkSize >= Ip4RequiredRecvSize);
+    static_assert(NumChunks < TypeMax<std::uint16_t>);
+    
+    // Number of hash buckets, the smallest power of two not less than MaxReassEntrys.
+    static constexpr std::size_t calc_num_buckets ()
+    {
+        std::size_t num = 1;
+        while (num < std::size_t(MaxReassEntrys)) {
+            num *= 2;
+        }
+        return num;
+    }
+    inline static constexpr std::size_t NumBuckets = calc_num_buckets();
     
     // Maximum time that a reassembly entry can be valid.
     inline static constexpr TimeType ReassMaxExpirationTicks =
@@ -111,24 +126,46 @@ class IpReassembly :
     inline static constexpr TimeType PurgeTimerInterval = Platform::WorkingTimeSpanTicks;
     
     struct ReassEntry {
-        // Offset in data to the first hole, or ReassNullLink for free entry.
-        std::uint16_t first_hole_offset;
+        // Next entry in the hash bucket or in the free list.
+        std::uint16_t next;
+        // Whether the entry is in a hash bucket.
+        bool active;
+        // Number of received data ranges.
+        std::uint8_t num_ranges;
         // The total data length, or 0 if last fragment not yet received.
         std::uint16_t data_length;
+        // Datagram identification.
+        std::uint16_t ident;
+        Ip4Addr src_addr;
+        Ip4Addr dst_addr;
+        Ip4Protocol proto;
+        // Set of ECN codepoints of received fragments (bit 1 << codepoint).
+        std::uint8_t ecn_seen;
         // Time after which the entry is considered invalid.
         TimeType expiration_time;
-        // IPv4 header (options not stored).
-        char header[Ip4Header::Size];
-        // Data and holes, each hole starts with a HoleDescriptor.
-        // The last HoleDescriptor::Size bytes are to ensure these is space
-        // for the last hole descriptor, they cannot contain data.
-        char data[ReassBufferSize];
+        // Sorted, non-adjacent ranges of received data.
+        std::uint16_t range_start[MaxReassHoles];
+        std::uint16_t range_end[MaxReassHoles];
+        // Chunk indices for each ReassChunkSize-sized part of the data.
+        std::uint16_t chunks[ChunksPerDgram];
+    };
+    
+    struct ReassChunk {
+        // Buffer node used when returning a reassembled datagram.
+        IpBufNode node;
+        // Next chunk in the free list.
+        std::uint16_t next_free;
+        char data[ReassChunkSize];
     };
     
 private:
     typename Platform::Timer m_timer;
-    IpBufNode m_reass_node;
-    ReassEntry m_reass_packets[MaxReassEntrys];
+    std::uint16_t m_free_entries;
+    std::uint16_t m_free_chunks;
+    std::uint16_t m_delivered_entry;
+    std::uint16_t m_buckets[NumBuckets];
+    ReassEntry m_entries[MaxReassEntrys];
+    ReassChunk m_chunks[NumChunks];
     
 public:
     /**
@@ -137,14 +174,32 @@ public:
      * @param platform_ The platform facade.
      */
     IpReassembly (Platform platform_) :
-        m_timer(platform_, AIPSTACK_BIND_MEMBER_TN(&IpReassembly::timerHandler, this))
+        m_timer(platform_, AIPSTACK_BIND_MEMBER_TN(&IpReassembly::timerHandler, this)),
+        m_free_entries(ReassNullIndex),
+        m_free_chunks(ReassNullIndex),
+        m_delivered_entry(ReassNullIndex)
     {
         // Start the timer for the first interval.
         m_timer.setAfter(PurgeTimerInterval);
         
-        // Mark all reassembly entries as unused.
-        for (auto &reass : m_reass_packets) {
-            reass.first_hole_offset = ReassNullLink;
+        for (auto &bucket : m_buckets) {
+            bucket = ReassNullIndex;
+        }
+        
+        // Put all entries and chunks on the free lists.
+        for (std::size_t i = MaxReassEntrys; i > 0; i--) {
+            ReassEntry &reass = m_entries[i - 1];
+            reass.active = false;
+            for (auto &chunk_index : reass.chunks) {
+                chunk_index = ReassNullIndex;
+            }
+            reass.next = m_free_entries;
+            m_free_entries = std::uint16_t(i - 1);
+        }
+        
+        for (std::size_t i = NumChunks; i > 0; i--) {
+            m_chunks[i - 1].next_free = m_free_chunks;
+            m_free_chunks = std::uint16_t(i - 1);
         }
     }
 
@@ -167,24 +222,35 @@ public:
      * @param proto IP protocol number.
      * @param more_fragments More-fragments flag.
      * @param fragment_offset Fragment offset in bytes.
-     * @param header Pointer to the IPv4 header (only the base header is used).
-     *        The data in the header must match the various arguments of this
-     *        function (ident...fragment_offset).
+     * @param ecn The ECN codepoint of the incoming packet must be passed, and if
+     *        a datagram is reassembled this will be changed to the codepoint of
+     *        the reassembled datagram according to RFC 3168 section 5.3: CE if
+     *        any fragment was CE, otherwise ECT or not-ECT as the fragments.
+     *        Fragments which mix not-ECT with ECT or CE cause the datagram to
+     *        be dropped.
      * @param dgram The IP payload of the incoming datagram must be passed,
      *        and if a datagram is reassembled (return value is true) then this
      *        will be changed to reference the reassembled payload, otherwise it
      *        will not be changed. If a reassembled datagram is returned, then the
-     *        referenced memory region may be used until the next call of this
-     *        function.
+     *        referenced memory regions may be used until the next call of this
+     *        function. The reassembled payload generally consists of multiple
+     *        buffer nodes but the first node contains at least the first
+     *        ReassChunkSize bytes.
      * @return True if a datagram was reassembled, false if not.
      */
     bool reassembleIp4 (std::uint16_t ident, Ip4Addr src_addr, Ip4Addr dst_addr,
         std::uint8_t ttl, Ip4Protocol proto, bool more_fragments,
-        std::uint16_t fragment_offset, char const *header, IpBufRef &dgram)
+        std::uint16_t fragment_offset, Ip4Ecn &ecn, IpBufRef &dgram)
     {
         AIPSTACK_ASSERT(dgram.tot_len <= TypeMax<std::uint16_t>);
         AIPSTACK_ASSERT(more_fragments || fragment_offset > 0);
         
+        // Release the chunks of any previously returned datagram.
+        if (m_delivered_entry != ReassNullIndex) {
+            free_entry(m_delivered_entry);
+            m_delivered_entry = ReassNullIndex;
+        }
+        
         // Sanity check data length.
         if (dgram.tot_len == 0) {
             return false;
@@ -192,34 +258,38 @@ public:
         
         // Check if we have a reassembly entry for this datagram.
         TimeType now = platform().getTime();
-        ReassEntry *reass = find_reass_entry(now, ident, src_addr, dst_addr, proto);
+        std::size_t bucket = bucket_for(ident, src_addr, dst_addr, proto);
+        std::uint16_t reass_index =
+            find_reass_entry(now, bucket, ident, src_addr, dst_addr, proto);
         
-        if (reass == nullptr) {
+        if (reass_index == ReassNullIndex) {
             // Allocate an entry.
-            reass = alloc_reass_entry(now, ttl);
-            
-            // Copy the IP header.
-            std::memcpy(reass->header, header, Ip4Header::Size);
+            reass_index = alloc_reass_entry(now, ttl);
+            ReassEntry &reass = m_entries[reass_index];
             
-            // Set first hole and unknown data length.
-            reass->first_hole_offset = 0;
-            reass->data_length = 0;
+            // Set the identification, no data and unknown data length.
+            reass.ident = ident;
+            reass.src_addr = src_addr;
+            reass.dst_addr = dst_addr;
+            reass.proto = proto;
+            reass.num_ranges = 0;
+            reass.data_length = 0;
+            reass.ecn_seen = 0;
             
-            // Write a hole from start of data to infinity (ReassBufferSize).
-            // The final HoleDescriptor::Size bytes of the hole serve as
-            // infinity because they cannot be filled by a fragment. This also
-            // means that we will always have at least one hole in the list.
-            auto hole = HoleDescriptor::MakeRef(reass->data);
-            hole.set(typename HoleDescriptor::HoleSize(),       ReassBufferSize);
-            hole.set(typename HoleDescriptor::NextHoleOffset(), ReassNullLink);
+            // Insert into the hash bucket.
+            reass.active = true;
+            reass.next = m_buckets[bucket];
+            m_buckets[bucket] = reass_index;
         }
         
+        ReassEntry &reass = m_entries[reass_index];
+        
         do {
-            // Verify that the fragment fits into the buffer.
+            // Verify that the fragment fits into the maximum size.
             if (fragment_offset > MaxReassSize ||
                 dgram.tot_len > std::uint16_t(MaxReassSize - fragment_offset))
             {
-                goto invalidate_reass;
+                break;
             }
             std::uint16_t fragment_end = std::uint16_t(fragment_offset + dgram.tot_len);
             
@@ -236,232 +306,297 @@ public:
             // Is this the last fragment?
             if (!more_fragments) {
                 // Check for inconsistent data_length.
-                if (reass->data_length != 0 && fragment_end != reass->data_length) {
-                    goto invalidate_reass;
+                if (reass.data_length != 0 && fragment_end != reass.data_length) {
+                    break;
+                }
+                
+                // Check for data beyond the end.
+                if (reass.num_ranges > 0 &&
+                    reass.range_end[reass.num_ranges - 1] > fragment_end)
+                {
+                    break;
                 }
                 
                 // Remember the data_length.
-                reass->data_length = fragment_end;
+                reass.data_length = fragment_end;
             } else {
                 // Check for data beyond the end.
-                if (reass->data_length != 0 && fragment_end > reass->data_length) {
-                    goto invalidate_reass;
+                if (reass.data_length != 0 && fragment_end > reass.data_length) {
+                    break;
                 }
             }
             
-            // Update the holes based on this fragment.
-            std::uint16_t prev_hole_offset = ReassNullLink;
-            std::uint16_t hole_offset = reass->first_hole_offset;
-            std::uint8_t num_holes = 0;
-            do {
-                AIPSTACK_ASSERT(prev_hole_offset == ReassNullLink ||
-                    hole_offset_valid(prev_hole_offset));
-                AIPSTACK_ASSERT(hole_offset_valid(hole_offset));
-                
-                // Get the hole info.
-                auto hole = HoleDescriptor::MakeRef(reass->data + hole_offset);
-                std::uint16_t hole_size = hole.get(typename HoleDescriptor::HoleSize());
-                std::uint16_t next_hole_offset =
-                    hole.get(typename HoleDescriptor::NextHoleOffset());
-                
-                // Calculate the hole end.
-                AIPSTACK_ASSERT(hole_size <= ReassBufferSize - hole_offset);
-                std::uint16_t hole_end = hole_offset + hole_size;
-                
-                // If this is the last fragment, sanity check that the hole offset
-                // is not greater than the end of this fragment; this would mean
-                // that some data was received beyond the end.
-                if (!more_fragments && hole_offset > fragment_end) {
-                    goto invalidate_reass;
-                }
-                
-                // If the fragment does not overlap with the hole, skip the hole.
-                if (fragment_offset >= hole_end || fragment_end <= hole_offset) {
-                    prev_hole_offset = hole_offset;
-                    hole_offset = next_hole_offset;
-                    num_holes++;
-                    continue;
-                }
-                
-                // The fragment overlaps with the hole. We will be dismantling
-                // this hole and creating between zero and two new holes.
-                
-                // Create a new hole on the left if needed.
-                if (fragment_offset > hole_offset) {
-                    // Sanity check hole size.
-                    std::uint16_t new_hole_size = fragment_offset - hole_offset;
-                    if (new_hole_size < HoleDescriptor::Size) {
-                        goto invalidate_reass;
-                    }
-                    
-                    // Write the hole size.
-                    // Note that the hole is in the same place as the old hole.
-                    auto new_hole = HoleDescriptor::MakeRef(reass->data + hole_offset);
-                    new_hole.set(typename HoleDescriptor::HoleSize(), new_hole_size);
-                    
-                    // The link to this hole is already set up.
-                    //reass_link_prev(reass, prev_hole_offset, hole_offset);
-                    
-                    // Advance prev_hole_offset to this hole.
-                    prev_hole_offset = hole_offset;
-                    
-                    num_holes++;
-                }
-                
-                // Create a new hole on the right if needed.
-                if (fragment_end < hole_end) {
-                    // Sanity check hole size.
-                    std::uint16_t new_hole_size = hole_end - fragment_end;
-                    if (new_hole_size < HoleDescriptor::Size) {
-                        goto invalidate_reass;
-                    }
-                    
-                    // Write the hole size.
-                    auto new_hole = HoleDescriptor::MakeRef(reass->data + fragment_end);
-                    new_hole.set(typename HoleDescriptor::HoleSize(), new_hole_size);
-                    
-                    // Setup the link to this hole.
-                    reass_link_prev(reass, prev_hole_offset, fragment_end);
-                    
-                    // Advance prev_hole_offset to this hole.
-                    prev_hole_offset = fragment_end;
-                    
-                    num_holes++;
-                }
-                
-                // Setup the link to the next hole.
-                reass_link_prev(reass, prev_hole_offset, next_hole_offset);
-                
-                // Advance to the next hole (if any).
-                hole_offset = next_hole_offset;
-            } while (hole_offset != ReassNullLink);
+            // Remember the ECN codepoint. Not-ECT must not be mixed with
+            // ECT or CE.
+            reass.ecn_seen |= std::uint8_t(1 << AsUnderlying(ecn));
+            constexpr std::uint8_t NotEctBit = 1 << AsUnderlying(Ip4Ecn::NotEct);
+            if ((reass.ecn_seen & NotEctBit) != 0 && reass.ecn_seen != NotEctBit) {
+                break;
+            }
             
-            // It is not possible that there are no more holes due to
-            // the final HoleDescriptor::Size bytes that cannot be filled.
-            AIPSTACK_ASSERT(reass->first_hole_offset != ReassNullLink);
+            // Add the fragment to the received ranges. This fails if there
+            // would be too many ranges (i.e. too many holes).
+            if (!add_range(reass, fragment_offset, fragment_end)) {
+                break;
+            }
             
-            // Copy the fragment data into the reassembly buffer.
-            IpBufRef dgram_tmp = dgram;
-            dgram_tmp = ipBufTakeBytes(dgram_tmp,
-                dgram.tot_len, reass->data + fragment_offset);
+            // Copy the fragment data into the chunks, allocating them as needed.
+            if (!store_data(reass_index, fragment_offset, dgram)) {
+                break;
+            }
             
-            // If we have not yet received the final fragment or there
-            // are still holes after the end, the reassembly is not complete.
-            if (reass->data_length == 0 || reass->first_hole_offset < reass->data_length) {
-                // If there are too many holes, invalidate.
-                if (num_holes > MaxReassHoles) {
-                    goto invalidate_reass;
-                }
+            // If we have not yet received the final fragment or there are still
+            // holes, the reassembly is not complete.
+            if (reass.data_length == 0 || reass.num_ranges != 1 ||
+                reass.range_start[0] != 0 || reass.range_end[0] != reass.data_length)
+            {
                 return false;
             }
             
-            // If the above check passed, this must be the last hole starting at exactly
-            // data_length and spanning to the end of the buffer (ReassBufferSize).
-            // Consider that when we first got a !more_fragments fragment, we would have
-            // aborted if there was any existing data buffered beyond data_length or if
-            // we later received a fragment with data beyond that.
-            AIPSTACK_ASSERT(reass->first_hole_offset == reass->data_length);
-#if AIPSTACK_ASSERTIONS
-            auto hole = HoleDescriptor::MakeRef(reass->data + reass->first_hole_offset);
-            std::uint16_t hole_size        = hole.get(typename HoleDescriptor::HoleSize());
-            std::uint16_t next_hole_offset = hole.get(typename HoleDescriptor::NextHoleOffset());
-            AIPSTACK_ASSERT(hole_size == ReassBufferSize - reass->first_hole_offset);
-            AIPSTACK_ASSERT(next_hole_offset == ReassNullLink);
-#endif
-            
-            // Invalidate the reassembly entry.
-            reass->first_hole_offset = ReassNullLink;
+            // Remove the entry from the index. It will be freed on the next call.
+            unlink_entry(reass_index);
+            m_delivered_entry = reass_index;
             
-            // Setup dgram to point to the reassembled data.
-            m_reass_node = IpBufNode{reass->data, MaxReassSize, nullptr};
-            dgram = IpBufRef{&m_reass_node, 0, reass->data_length};
+            // Setup dgram to point to the reassembled data, chaining the chunks.
+            std::size_t num_chunks = chunk_for_offset(reass.data_length - 1) + 1;
+            IpBufNode const *next_node = nullptr;
+            for (std::size_t i = num_chunks; i > 0; i--) {
+                AIPSTACK_ASSERT(reass.chunks[i - 1] != ReassNullIndex);
+                ReassChunk &chunk = m_chunks[reass.chunks[i - 1]];
+                chunk.node = IpBufNode{chunk.data, ReassChunkSize, next_node};
+                next_node = &chunk.node;
+            }
+            dgram = IpBufRef{next_node, 0, reass.data_length};
+            ecn = reassembled_ecn(reass.ecn_seen);
             
             // Continue to process the reassembled datagram.
             return true;
         } while (false);
         
-    invalidate_reass:
-        reass->first_hole_offset = ReassNullLink;
+        // Invalidate the reassembly entry.
+        unlink_entry(reass_index);
+        free_entry(reass_index);
         return false;
     }
     
 private:
-    ReassEntry * find_reass_entry (TimeType now, std::uint16_t ident, Ip4Addr src_addr,
+    inline static std::size_t chunk_for_offset (std::size_t offset)
+    {
+        return offset / ReassChunkSize;
+    }
+    
+    static std::size_t bucket_for (std::uint16_t ident, Ip4Addr src_addr,
                                    Ip4Addr dst_addr, Ip4Protocol proto)
     {
-        ReassEntry *found_entry = nullptr;
-        
-        for (auto &reass : m_reass_packets) {
-            // Ignore free entries.
-            if (reass.first_hole_offset == ReassNullLink) {
-                continue;
-            }
-            
-            // If the entry has expired, mark is as free and ignore.
-            if (TimeType(reass.expiration_time - now) > ReassMaxExpirationTicks) {
-                reass.first_hole_offset = ReassNullLink;
-                continue;
+        std::uint32_t hash = src_addr.value() * std::uint32_t(0x9E3779B1);
+        hash ^= dst_addr.value() + std::uint32_t(0x7F4A7C15) + (hash << 6) + (hash >> 2);
+        hash ^= (std::uint32_t(ident) << 8) | std::uint8_t(proto);
+        hash *= std::uint32_t(0x85EBCA6B);
+        hash ^= hash >> 16;
+        return hash & (NumBuckets - 1);
+    }
+    
+    // Get the ECN codepoint of a reassembled datagram from the set of those of
+    // the fragments, which does not mix not-ECT with others.
+    static Ip4Ecn reassembled_ecn (std::uint8_t ecn_seen)
+    {
+        for (Ip4Ecn ecn : {Ip4Ecn::Ce, Ip4Ecn::Ect0, Ip4Ecn::Ect1}) {
+            if ((ecn_seen & (1 << AsUnderlying(ecn))) != 0) {
+                return ecn;
             }
+        }
+        return Ip4Ecn::NotEct;
+    }
+    
+    inline static bool is_expired (ReassEntry const &reass, TimeType now)
+    {
+        return TimeType(reass.expiration_time - now) > ReassMaxExpirationTicks;
+    }
+    
+    std::uint16_t find_reass_entry (TimeType now, std::size_t bucket,
+        std::uint16_t ident, Ip4Addr src_addr, Ip4Addr dst_addr, Ip4Protocol proto)
+    {
+        for (std::uint16_t index = m_buckets[bucket]; index != ReassNullIndex;
+             index = m_entries[index].next)
+        {
+            ReassEntry &reass = m_entries[index];
             
-            // If the entry matches, return it after going through all
-            // so that we purge all expired entries.
-            auto reass_hdr = Ip4Header::MakeRef(reass.header);
-            if (reass_hdr.get(Ip4Header::Ident())   == ident &&
-                reass_hdr.get(Ip4Header::SrcAddr()) == src_addr &&
-                reass_hdr.get(Ip4Header::DstAddr()) == dst_addr &&
-                reass_hdr.get(Ip4Header::Proto())   == proto)
+            if (reass.ident == ident && reass.src_addr == src_addr &&
+                reass.dst_addr == dst_addr && reass.proto == proto)
             {
-                found_entry = &reass;
+                // If the entry has expired, free it and act as if it was not found.
+                if (is_expired(reass, now)) {
+                    unlink_entry(index);
+                    free_entry(index);
+                    return ReassNullIndex;
+                }
+                
+                return index;
             }
         }
         
-        return found_entry;
+        return ReassNullIndex;
     }
     
-    ReassEntry * alloc_reass_entry (TimeType now, std::uint8_t ttl)
+    std::uint16_t alloc_reass_entry (TimeType now, std::uint8_t ttl)
     {
-        TimeType future = now + ReassMaxExpirationTicks;
+        // If there is no free entry, evict the one which would expire first.
+        if (m_free_entries == ReassNullIndex) {
+            [[maybe_unused]] bool evicted = evict_entry(ReassNullIndex);
+            AIPSTACK_ASSERT(evicted);
+        }
         
-        ReassEntry *result_reass = nullptr;
+        std::uint16_t index = m_free_entries;
+        AIPSTACK_ASSERT(index != ReassNullIndex);
+        ReassEntry &reass = m_entries[index];
+        m_free_entries = reass.next;
         
-        for (auto &reass : m_reass_packets) {
-            // If the entry is unused, use it.
-            if (reass.first_hole_offset == ReassNullLink) {
-                result_reass = &reass;
-                break;
+        // Set the expiration time.
+        std::uint8_t seconds = MinValue(ttl, MaxReassTimeSeconds);
+        reass.expiration_time = now + seconds * TimeType(Platform::TimeFreq);
+        
+        return index;
+    }
+    
+    // Evict the active entry with the least expiration time, except for the
+    // given entry. Returns false if there was no entry to evict.
+    bool evict_entry (std::uint16_t except_index)
+    {
+        TimeType future = platform().getTime() + ReassMaxExpirationTicks;
+        
+        std::uint16_t evict_index = ReassNullIndex;
+        
+        for (std::size_t i = 0; i < std::size_t(MaxReassEntrys); i++) {
+            ReassEntry &reass = m_entries[i];
+            
+            if (!reass.active || i == except_index) {
+                continue;
             }
             
-            // Look for the entry with the least expiration time.
-            if (result_reass == nullptr ||
+            if (evict_index == ReassNullIndex ||
                 TimeType(future - reass.expiration_time) >
-                    TimeType(future - result_reass->expiration_time))
+                    TimeType(future - m_entries[evict_index].expiration_time))
             {
-                result_reass = &reass;
+                evict_index = std::uint16_t(i);
             }
         }
         
-        // Set the expiration time.
-        std::uint8_t seconds = MinValue(ttl, MaxReassTimeSeconds);
-        result_reass->expiration_time = now + seconds * TimeType(Platform::TimeFreq);
+        if (evict_index == ReassNullIndex) {
+            return false;
+        }
         
-        return result_reass;
+        unlink_entry(evict_index);
+        free_entry(evict_index);
+        return true;
     }
     
-    static void reass_link_prev (ReassEntry *reass, std::uint16_t prev_hole_offset, std::uint16_t hole_offset)
+    void unlink_entry (std::uint16_t index)
     {
-        AIPSTACK_ASSERT(prev_hole_offset == ReassNullLink || hole_offset_valid(prev_hole_offset));
+        ReassEntry &reass = m_entries[index];
+        AIPSTACK_ASSERT(reass.active);
+        
+        std::uint16_t *link = &m_buckets[bucket_for(
+            reass.ident, reass.src_addr, reass.dst_addr, reass.proto)];
+        while (*link != index) {
+            AIPSTACK_ASSERT(*link != ReassNullIndex);
+            link = &m_entries[*link].next;
+        }
+        *link = reass.next;
         
-        if (prev_hole_offset == ReassNullLink) {
-            reass->first_hole_offset = hole_offset;
+        reass.active = false;
+    }
+    
+    void free_entry (std::uint16_t index)
+    {
+        ReassEntry &reass = m_entries[index];
+        AIPSTACK_ASSERT(!reass.active);
+        
+        // Return the chunks to the pool.
+        for (auto &chunk_index : reass.chunks) {
+            if (chunk_index != ReassNullIndex) {
+                m_chunks[chunk_index].next_free = m_free_chunks;
+                m_free_chunks = chunk_index;
+                chunk_index = ReassNullIndex;
+            }
+        }
+        
+        reass.next = m_free_entries;
+        m_free_entries = index;
+    }
+    
+    // Merge the range [start, end) into the sorted list of received ranges,
+    // joining any overlapping or adjacent ranges.
+    static bool add_range (ReassEntry &reass, std::uint16_t start, std::uint16_t end)
+    {
+        std::size_t num = reass.num_ranges;
+        
+        // Find the first range which does not end before start (first_idx) and
+        // the first range which starts after end (end_idx). Ranges in between
+        // are to be merged with the new range.
+        std::size_t first_idx = 0;
+        while (first_idx < num && reass.range_end[first_idx] < start) {
+            first_idx++;
+        }
+        std::size_t end_idx = first_idx;
+        while (end_idx < num && reass.range_start[end_idx] <= end) {
+            end_idx++;
+        }
+        
+        if (first_idx == end_idx) {
+            // Insert a new range.
+            if (num >= std::size_t(MaxReassHoles)) {
+                return false;
+            }
+            for (std::size_t i = num; i > first_idx; i--) {
+                reass.range_start[i] = reass.range_start[i - 1];
+                reass.range_end[i] = reass.range_end[i - 1];
+            }
+            reass.range_start[first_idx] = start;
+            reass.range_end[first_idx] = end;
+            reass.num_ranges = std::uint8_t(num + 1);
         } else {
-            auto prev_hole = HoleDescriptor::MakeRef(reass->data + prev_hole_offset);
-            prev_hole.set(typename HoleDescriptor::NextHoleOffset(), hole_offset);
+            // Merge into the range at first_idx and remove the others.
+            reass.range_start[first_idx] = MinValue(start, reass.range_start[first_idx]);
+            reass.range_end[first_idx] = MaxValue(end, reass.range_end[end_idx - 1]);
+            std::size_t num_removed = end_idx - first_idx - 1;
+            for (std::size_t i = end_idx; i < num; i++) {
+                reass.range_start[i - num_removed] = reass.range_start[i];
+                reass.range_end[i - num_removed] = reass.range_end[i];
+            }
+            reass.num_ranges = std::uint8_t(num - num_removed);
         }
+        
+        return true;
     }
     
-    inline static bool hole_offset_valid (std::uint16_t hole_offset)
+    bool store_data (std::uint16_t reass_index, std::uint16_t offset, IpBufRef data)
     {
-        return hole_offset <= MaxReassSize;
+        ReassEntry &reass = m_entries[reass_index];
+        
+        while (data.tot_len > 0) {
+            std::size_t chunk_pos = chunk_for_offset(offset);
+            std::size_t chunk_offset = offset % ReassChunkSize;
+            std::uint16_t amount =
+                std::uint16_t(MinValueU(data.tot_len, ReassChunkSize - chunk_offset));
+            
+            std::uint16_t &chunk_index = reass.chunks[chunk_pos];
+            
+            if (chunk_index == ReassNullIndex) {
+                // Allocate a chunk, evicting other entries if the pool is exhausted.
+                while (m_free_chunks == ReassNullIndex) {
+                    if (!evict_entry(reass_index)) {
+                        return false;
+                    }
+                }
+                chunk_index = m_free_chunks;
+                m_free_chunks = m_chunks[chunk_index].next_free;
+            }
+            
+            data = ipBufTakeBytes(data, amount, m_chunks[chunk_index].data + chunk_offset);
+            offset += amount;
+        }
+        
+        return true;
     }
     
     void timerHandler ()
@@ -469,10 +604,14 @@ private:
         // Restart the timer.
         m_timer.setAfter(PurgeTimerInterval);
         
-        // Purge any expired reassembly entries by calling find_reass_entry with
-        // dummy IP information.
+        // Purge any expired reassembly entries.
         TimeType now = platform().getTime();
-        find_reass_entry(now, 0, Ip4Addr::ZeroAddr(), Ip4Addr::ZeroAddr(), Ip4Protocol(0));
+        for (std::size_t i = 0; i < std::size_t(MaxReassEntrys); i++) {
+            if (m_entries[i].active && is_expired(m_entries[i], now)) {
+                unlink_entry(std::uint16_t(i));
+                free_entry(std::uint16_t(i));
+            }
+        }
     }
 };
 
@@ -483,17 +622,18 @@ private:
  */
 struct IpReassemblyOptions {
     /**
-     * Maximum number of datagrams being reassembled. This affects memory use.
+     * Maximum number of datagrams being reassembled.
      */
     AIPSTACK_OPTION_DECL_VALUE(MaxReassEntrys, int, 1)
     
     /**
-     * Maximum size of reassembled datagrams. This affects memory use.
+     * Maximum size of reassembled datagrams.
      */
     AIPSTACK_OPTION_DECL_VALUE(MaxReassSize, std::uint16_t, 1480)
     
     /**
-     * Maximum number of holes in an incompletely reassembled datagram.
+     * Maximum number of separate received data ranges (that is, roughly the
+     * number of holes) in an incompletely reassembled datagram.
      */
     AIPSTACK_OPTION_DECL_VALUE(MaxReassHoles, std::uint8_t, 10)
     
@@ -502,6 +642,23 @@ struct IpReassemblyOptions {
      * as an additional restriction to the TTL seconds limit.
      */
     AIPSTACK_OPTION_DECL_VALUE(MaxReassTimeSeconds, std::uint8_t, 60)
+    
+    /**
+     * Size of the chunks in which fragment data is stored.
+     * 
+     * Each chunk stores a fixed part of a datagram, so this is the granularity
+     * of memory use. It must be at least 64.
+     */
+    AIPSTACK_OPTION_DECL_VALUE(ReassChunkSize, std::uint16_t, 512)
+    
+    /**
+     * Total memory for fragment data in bytes, shared by all datagrams being
+     * reassembled. This determines memory use.
+     * 
+     * If zero, enough memory is reserved for @ref MaxReassEntrys datagrams of
+     * size @ref MaxReassSize.
+     */
+    AIPSTACK_OPTION_DECL_VALUE(ReassPoolSize, std::size_t, 0)
 };
 
 /**
@@ -524,6 +681,8 @@ class IpReassemblyService {
     AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, MaxReassSize)
     AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, MaxReassHoles)
     AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, MaxReassTimeSeconds)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, ReassChunkSize)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpReassemblyOptions, ReassPoolSize)
     
 public:
 #ifndef IN_DOXYGEN
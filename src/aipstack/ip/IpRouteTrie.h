@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_IP_ROUTE_TRIE_H
+#define AIPSTACK_IP_ROUTE_TRIE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <aipstack/meta/ChooseInt.h>
+#include <aipstack/misc/Assert.h>
+#include <aipstack/ip/IpAddr.h>
+
+namespace AIpStack {
+
+/**
+ * Longest-prefix-match table of IPv4 routes in a statically sized binary trie.
+ * 
+ * Each node corresponds to a prefix and has a child for each value of the next
+ * address bit. A route is stored at the node for its prefix, so a lookup follows
+ * the address bits from the root and returns the route seen last, visiting at most
+ * 33 nodes regardless of the number of routes. Each route adds at most one node
+ * per prefix bit, so the node array for MaxRoutes routes is allocated statically.
+ * 
+ * Routes can only be added; the table is rebuilt from scratch (@ref reset) when the
+ * set of routes changes.
+ * 
+ * @tparam Value Type of values associated with routes.
+ * @tparam MaxRoutes Maximum number of routes (at least one).
+ */
+template<typename Value, std::size_t MaxRoutes>
+class IpRouteTrie
+{
+    static_assert(MaxRoutes > 0);
+
+    static constexpr std::size_t MaxNodes = 1 + MaxRoutes * Ip4Addr::Bits;
+
+    // Node indices, where zero (the root) means no child.
+    using NodeIndex = ChooseIntForMax<MaxNodes - 1>;
+
+    // Route indices, where MaxRoutes means no route.
+    using RouteIndex = ChooseIntForMax<MaxRoutes>;
+
+    struct Node {
+        NodeIndex child[2];
+        RouteIndex route;
+    };
+
+public:
+    /**
+     * Remove all routes.
+     */
+    void reset ()
+    {
+        m_num_nodes = 1;
+        m_num_routes = 0;
+        init_node(m_nodes[0]);
+    }
+
+    /**
+     * Add a route unless there already is one with the same prefix.
+     * 
+     * If a route with the same network address and prefix length was added before,
+     * the table is not changed. Hence when multiple routes are equivalent, they
+     * should be added in order of preference.
+     * 
+     * @param netaddr Network address; bits outside of the prefix must be zero.
+     * @param prefix Prefix length, not greater than @ref Ip4Addr::Bits.
+     * @param value Value associated with the route.
+     * @return True if the route was added or an equivalent route exists, false if
+     *         the table is full.
+     */
+    bool add (Ip4Addr netaddr, std::uint8_t prefix, Value const &value)
+    {
+        AIPSTACK_ASSERT(prefix <= Ip4Addr::Bits);
+        AIPSTACK_ASSERT((netaddr & Ip4Addr::PrefixMask(prefix)) == netaddr);
+
+        // Follow the existing nodes along the prefix.
+        std::size_t node_idx = 0;
+        std::uint8_t depth = 0;
+        while (depth < prefix) {
+            NodeIndex child = m_nodes[node_idx].child[addr_bit(netaddr, depth)];
+            if (child == 0) {
+                break;
+            }
+            node_idx = child;
+            depth++;
+        }
+
+        if (depth == prefix && m_nodes[node_idx].route != MaxRoutes) {
+            return true;
+        }
+
+        if (m_num_routes == MaxRoutes) {
+            return false;
+        }
+
+        // Create the remaining nodes, which is bounded by the node array size
+        // since every route adds at most Ip4Addr::Bits nodes.
+        for (; depth < prefix; depth++) {
+            AIPSTACK_ASSERT(m_num_nodes < MaxNodes);
+            std::size_t new_idx = m_num_nodes++;
+            init_node(m_nodes[new_idx]);
+            m_nodes[node_idx].child[addr_bit(netaddr, depth)] = NodeIndex(new_idx);
+            node_idx = new_idx;
+        }
+
+        std::size_t route_idx = m_num_routes++;
+        m_values[route_idx] = value;
+        m_nodes[node_idx].route = RouteIndex(route_idx);
+
+        return true;
+    }
+
+    /**
+     * Find the route with the longest prefix matching an address.
+     * 
+     * @param addr Address to look up.
+     * @return Pointer to the value of the matching route, or null if no route
+     *         matches. It is valid until the table is changed.
+     */
+    Value const * lookup (Ip4Addr addr) const
+    {
+        std::size_t node_idx = 0;
+        std::size_t route_idx = m_nodes[0].route;
+        
+        for (std::uint8_t depth = 0; depth < Ip4Addr::Bits; depth++) {
+            NodeIndex child = m_nodes[node_idx].child[addr_bit(addr, depth)];
+            if (child == 0) {
+                break;
+            }
+            node_idx = child;
+            if (m_nodes[node_idx].route != MaxRoutes) {
+                route_idx = m_nodes[node_idx].route;
+            }
+        }
+
+        return (route_idx != MaxRoutes) ? &m_values[route_idx] : nullptr;
+    }
+
+private:
+    inline static void init_node (Node &node)
+    {
+        node.child[0] = 0;
+        node.child[1] = 0;
+        node.route = MaxRoutes;
+    }
+
+    inline static int addr_bit (Ip4Addr addr, std::uint8_t depth)
+    {
+        return (addr.value() >> (Ip4Addr::Bits - 1 - depth)) & 1;
+    }
+
+private:
+    std::size_t m_num_nodes;
+    std::size_t m_num_routes;
+    Node m_nodes[MaxNodes];
+    Value m_values[MaxRoutes];
+};
+
+}
+
+#endif
@@ -27,6 +27,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 #include <aipstack/meta/ListForEach.h>
 #include <aipstack/meta/TypeListUtils.h>
@@ -61,6 +62,8 @@
 #include <aipstack/ip/IpIfaceStateObserver.h>
 #include <aipstack/ip/IpDriverIface.h>
 #include <aipstack/ip/IpMtuRef.h>
+#include <aipstack/ip/IpStaticRoute.h>
+#include <aipstack/ip/IpRouteTrie.h>
 #include <aipstack/ip/IpStackInternalDefs.h>
 #include <aipstack/platform/PlatformFacade.h>
 
@@ -100,6 +103,9 @@ namespace AIpStack {
  * facility for the stack to notify the application of interface addition, removal
  * or configuration changes, but it may be added in the future.
  * 
+ * In addition to the routes implied by interface configuration, static routes can be
+ * added to the routing table by constructing @ref IpStaticRoute instances.
+ * 
  * Application code which uses different transport-layer protocols (such as TCP) is
  * expected to go through @ref IpStack to gain access to the appropriate protocol
  * handlers, using @ref IpStack::GetProtoArg and @ref IpStack::getProtoApi.
@@ -132,9 +138,11 @@ class IpStack :
     template<typename> friend class IpIfaceListener;
     template<typename> friend class IpDriverIface;
     template<typename> friend class IpMtuRef;
+    template<typename> friend class IpStaticRoute;
     
     AIPSTACK_USE_TYPES(Arg, (Params, ProtocolServicesList))
-    AIPSTACK_USE_VALS(Params, (HeaderBeforeIp, IcmpTTL, AllowBroadcastPing))
+    AIPSTACK_USE_VALS(Params, (HeaderBeforeIp, IcmpTTL, AllowBroadcastPing,
+                               RouteCacheSize, RouteTableSize))
     AIPSTACK_USE_TYPES(Params, (PathMtuCacheService, ReassemblyService))
 
 public:
@@ -229,6 +237,11 @@ private:
     using Iface = IpIface<Arg>;
     using IfaceListener = IpIfaceListener<Arg>;
     using IfaceLinkModel = typename InternalDefs::IfaceLinkModel;
+    using StaticRoute = IpStaticRoute<Arg>;
+    using StaticRouteLinkModel = typename InternalDefs::StaticRouteLinkModel;
+
+    static_assert(RouteCacheSize == 0 || (RouteCacheSize & (RouteCacheSize - 1)) == 0,
+                  "RouteCacheSize must be zero or a power of two");
     
 public:
     /**
@@ -268,8 +281,12 @@ public:
         m_reassembly(platform),
         m_path_mtu_cache(platform, this),
         m_next_id(0),
+        m_route_config_gen(0),
+        m_route_table_valid(false),
         m_protocols(ResourceTupleInitSame(), IpProtocolHandlerArgs<Arg>{platform, this})
-    {}
+    {
+        invalidate_route_cache();
+    }
     
     /**
      * Destruct the IP stack.
@@ -281,6 +298,7 @@ public:
     ~IpStack ()
     {
         AIPSTACK_ASSERT(m_iface_list.isEmpty());
+        AIPSTACK_ASSERT(m_static_routes.isEmpty());
     }
     
     /**
@@ -424,7 +442,8 @@ public:
         auto ip4_header = Ip4Header::MakeRef(pkt.getChunkPtr());
         IpChksumAccumulator chksum;
         
-        std::uint16_t version_ihl_dscp_ecn = std::uint16_t((4 << Ip4VersionShift) | 5) << 8;
+        std::uint16_t version_ihl_dscp_ecn = std::uint16_t(
+            (((4 << Ip4VersionShift) | 5) << 8) | IpDscpEcnForSendFlags(send_flags));
         chksum.addWord(WrapType<std::uint16_t>(), version_ihl_dscp_ecn);
         ip4_header.set(Ip4Header::VersionIhlDscpEcn(), version_ihl_dscp_ecn);
         
@@ -582,7 +601,8 @@ public:
         auto ip4_header = Ip4Header::MakeRef(header_end_ptr - Ip4Header::Size);
         IpChksumAccumulator chksum;
         
-        std::uint16_t version_ihl_dscp_ecn = std::uint16_t((4 << Ip4VersionShift) | 5) << 8;
+        std::uint16_t version_ihl_dscp_ecn = std::uint16_t(
+            (((4 << Ip4VersionShift) | 5) << 8) | IpDscpEcnForSendFlags(common.send_flags));
         chksum.addWord(WrapType<std::uint16_t>(), version_ihl_dscp_ecn);
         ip4_header.set(Ip4Header::VersionIhlDscpEcn(), version_ihl_dscp_ecn);
         
@@ -662,6 +682,129 @@ public:
             pkt, prep.route_info.addr, retryReq);
     }
 
+    /**
+     * Send multiple datagrams after preparation with @ref prepareSendIp4Dgram.
+     *
+     * This is like calling @ref sendIp4DgramFast for each datagram, except that the
+     * header fields written by @ref prepareSendIp4Dgram are only written into the buffer
+     * of the first datagram and are copied from there into the others, and that the
+     * packets are passed to the driver in a single call (if the driver provides @ref
+     * IpIfaceDriverParams::send_ip4_packets).
+     *
+     * This function does not support fragmentation. If a datagram would be too large,
+     * preceding datagrams are still sent and the error @ref IpErr::FragmentationNeeded
+     * is returned (unless sending a preceding datagram failed).
+     *
+     * @param prep Structure with internal information that was filled in
+     *             using @ref prepareSendIp4Dgram (see @ref sendIp4DgramFast).
+     * @param dgrams Pointer to the first element of an array of datagrams to be sent.
+     *               The first datagram must be in the buffer that was used in @ref
+     *               prepareSendIp4Dgram via the header_end_ptr argument. The same
+     *               requirements as for the `dgram` argument of @ref sendIp4DgramFast
+     *               apply to all datagrams. The elements of the array are used as
+     *               temporary storage and their values are unspecified on return.
+     * @param num_dgrams Number of datagrams in the array (may be zero).
+     * @param retryReq If not null, this may provide notification when to retry sending
+     *                 after an unsuccessful attempt (notification is not guaranteed).
+     * @param num_sent Set to the number of datagrams which were sent successfully. These
+     *                 are always the first datagrams in the array.
+     * @return Success if all datagrams were sent, otherwise the error code for the first
+     *         datagram which was not sent.
+     */
+    IpErr sendIp4DgramsFast (IpSendPreparedIp4<Arg> const &prep, IpBufRef *dgrams,
+                             std::size_t num_dgrams, IpSendRetryRequest *retryReq,
+                             std::size_t &num_sent)
+    {
+        num_sent = 0;
+
+        if (AIPSTACK_UNLIKELY(num_dgrams == 0)) {
+            return IpErr::Success;
+        }
+
+        // Common header fields are copied from the header of the first datagram.
+        char const *prep_header = dgrams[0].getChunkPtr() - Ip4Header::Size;
+        std::uint16_t mtu = prep.route_info.iface->getMtu();
+
+        // Complete the IP header of each datagram, replacing the datagram references
+        // with packet references in the array.
+        std::size_t num_ready = 0;
+        for (; num_ready < num_dgrams; num_ready++) {
+            IpBufRef dgram = dgrams[num_ready];
+            AIPSTACK_ASSERT(dgram.tot_len <= TypeMax<std::uint16_t>);
+            AIPSTACK_ASSERT(dgram.offset >= Ip4Header::Size);
+
+            // Reveal IP header.
+            IpBufRef pkt = dgram.revealHeader(Ip4Header::Size);
+
+            // This function does not support fragmentation.
+            if (AIPSTACK_UNLIKELY(pkt.tot_len > mtu)) {
+                break;
+            }
+
+            // Copy the prepared header fields (except for the first datagram).
+            char *header_ptr = pkt.getChunkPtr();
+            if (num_ready > 0) {
+                std::memcpy(header_ptr, prep_header, Ip4Header::Size);
+            }
+
+            // Write remaining IP header fields and complete the header checksum.
+            auto ip4_header = Ip4Header::MakeRef(header_ptr);
+            IpChksumAccumulator chksum(prep.partial_chksum_state);
+
+            chksum.addWord(WrapType<std::uint16_t>(), std::uint16_t(pkt.tot_len));
+            ip4_header.set(Ip4Header::TotalLen(), std::uint16_t(pkt.tot_len));
+
+            std::uint16_t ident = m_next_id++; // generate identification number
+            chksum.addWord(WrapType<std::uint16_t>(), ident);
+            ip4_header.set(Ip4Header::Ident(), ident);
+
+            ip4_header.set(Ip4Header::HeaderChksum(), chksum.getChksum());
+
+            dgrams[num_ready] = pkt;
+        }
+
+        // Pass the packets to the driver.
+        IpErr err = IpErr::Success;
+        if (AIPSTACK_LIKELY(num_ready > 0)) {
+            err = send_ip4_packets_to_driver(prep.route_info, dgrams, num_ready,
+                                             retryReq, num_sent);
+        }
+
+        if (AIPSTACK_UNLIKELY(err == IpErr::Success && num_ready < num_dgrams)) {
+            err = IpErr::FragmentationNeeded;
+        }
+
+        return err;
+    }
+
+private:
+    static IpErr send_ip4_packets_to_driver (
+        IpRouteInfoIp4<Arg> const &route_info, IpBufRef const *pkts, std::size_t num_pkts,
+        IpSendRetryRequest *retryReq, std::size_t &num_sent)
+    {
+        IpIfaceDriverParams const &params = route_info.iface->m_params;
+
+        // Use the batch driver function if the driver provides it.
+        if (params.send_ip4_packets) {
+            num_sent = 0;
+            IpErr err = params.send_ip4_packets(
+                pkts, num_pkts, route_info.addr, retryReq, num_sent);
+            AIPSTACK_ASSERT(num_sent <= num_pkts);
+            AIPSTACK_ASSERT((err == IpErr::Success) == (num_sent == num_pkts));
+            return err;
+        }
+
+        // Otherwise send the packets one by one, stopping at the first error.
+        for (num_sent = 0; num_sent < num_pkts; num_sent++) {
+            IpErr err = params.send_ip4_packet(pkts[num_sent], route_info.addr, retryReq);
+            if (AIPSTACK_UNLIKELY(err != IpErr::Success)) {
+                return err;
+            }
+        }
+
+        return IpErr::Success;
+    }
+
 private:
     inline static IpErr checkSendIp4Allowed (
         Ip4AddrPair const &addrs, IpSendFlags send_flags, Iface *iface)
@@ -695,16 +838,28 @@ public:
      * 
      * Determines the interface and next hop address for sending a packet to
      * the given address. The logic is:
-     * - If there is any interface with an address configured for which the
-     *   destination address belongs to the subnet of the interface, the
-     *   resulting interface is the most recently added interface out of
-     *   such interfaces with the longest prefix length, and the resulting
-     *   hop address is the destination address.
+     * - The candidate routes are the subnets of interfaces which have an
+     *   address configured (the hop address being the destination address)
+     *   and the static routes (see @ref IpStaticRoute; the hop address being
+     *   the gateway of the route or the destination address if the route has
+     *   no gateway). If any candidate route matches the destination address,
+     *   the result is the matching route with the longest prefix length. Among
+     *   these, an interface subnet is preferred, then the static route with the
+     *   lowest metric, then the most recently added interface or static route.
      * - Otherwise, if any interface has a gateway configured, the resulting
      *   interface is the most recently added such interface, and the
      *   resulting hop address is the gateway address of that interface.
      * - Otherwise, the function fails (returns false).
      * 
+     * Routes are looked up in a trie built from the interface subnets and static
+     * routes (see @ref IpStackOptions::RouteTableSize), which takes bounded time
+     * regardless of the number of interfaces and routes. If there are more routes
+     * than fit into the trie, all interfaces and routes are searched instead.
+     * Results are also remembered in a small cache indexed by the destination
+     * address (see @ref IpStackOptions::RouteCacheSize). The trie is rebuilt and the
+     * cache is invalidated when the routing configuration changes (see @ref
+     * getRouteConfigGeneration).
+     * 
      * @param dst_addr Destination address to determine routing for.
      * @param route_info Routing information will be written here.
      * @return True on success (route_info was filled in),
@@ -712,32 +867,30 @@ public:
      */
     bool routeIp4 (Ip4Addr dst_addr, IpRouteInfoIp4<Arg> &route_info) const
     {
-        int best_prefix = -1;
-        Iface *best_iface = nullptr;
-        
-        for (Iface *iface = m_iface_list.first(); iface != nullptr;
-             iface = m_iface_list.next(*iface))
-        {
-            if (iface->ip4AddrIsLocal(dst_addr)) {
-                int iface_prefix = iface->m_addr.prefix;
-                if (iface_prefix > best_prefix) {
-                    best_prefix = iface_prefix;
-                    best_iface = iface;
-                }
+        if constexpr (RouteCacheSize > 0) {
+            RouteCacheEntry &entry = m_route_cache[route_cache_index(dst_addr)];
+            
+            if (AIPSTACK_LIKELY(entry.iface != nullptr && entry.dst_addr == dst_addr &&
+                                entry.gen == m_route_config_gen))
+            {
+                route_info.iface = entry.iface;
+                route_info.addr = entry.hop_addr;
+                return true;
             }
-            else if (iface->m_have_gateway && best_iface == nullptr) {
-                best_iface = iface;
+            
+            if (!lookup_route(dst_addr, route_info)) {
+                return false;
             }
+            
+            entry.dst_addr = dst_addr;
+            entry.hop_addr = route_info.addr;
+            entry.iface = route_info.iface;
+            entry.gen = m_route_config_gen;
+            
+            return true;
+        } else {
+            return lookup_route(dst_addr, route_info);
         }
-        
-        if (AIPSTACK_UNLIKELY(best_iface == nullptr)) {
-            return false;
-        }
-        
-        route_info.iface = best_iface;
-        route_info.addr = (best_prefix >= 0) ? dst_addr : best_iface->m_gateway;
-        
-        return true;
     }
     
     /**
@@ -823,6 +976,32 @@ public:
         return m_path_mtu_cache.handlePacketTooBig(remote_addr, TypeMax<std::uint16_t>);
     }
     
+    /**
+     * Raise a Path MTU estimate after a protocol handler has confirmed a larger
+     * Path MTU (Packetization Layer Path MTU Discovery, RFC 8899).
+     * 
+     * This should be called by a protocol handler when a probe packet of size
+     * `mtu` (including the IP header) that was sent with fragmentation disabled
+     * has been acknowledged by the remote host. The Path MTU estimate is raised
+     * to min(interface_mtu, mtu) if it is less than that. Nothing is done if there
+     * is no existing Path MTU estimate for the address.
+     * 
+     * A protocol handler can lower the estimate using @ref handleIcmpPacketTooBig
+     * when it determines that packets of a certain size are black-holed.
+     * 
+     * If the Path MTU estimate was raised, then all existing @ref IpMtuRef setup
+     * for this address are notified (@ref IpMtuRef::pmtuChanged are called),
+     * directly from this function.
+     * 
+     * @param remote_addr Address for which the Path MTU was probed.
+     * @param mtu Size of the acknowledged probe packet including the IP header.
+     * @return True if the Path MTU estimate was raised, false if not.
+     */
+    inline bool handlePathMtuProbed (Ip4Addr remote_addr, std::uint16_t mtu)
+    {
+        return m_path_mtu_cache.handlePathMtuProbed(remote_addr, mtu);
+    }
+    
     /**
      * Check if the source address of a received datagram appears to be
      * a unicast address.
@@ -920,12 +1099,230 @@ public:
         out_local_addr = addr_setting.addr;
         return IpErr::Success;
     }
+
+    /**
+     * Return the current generation number of the routing configuration.
+     * 
+     * The generation number changes whenever anything changes which may affect
+     * the results of @ref routeIp4 or @ref prepareSendIp4Dgram, or invalidate
+     * previously returned @ref IpRouteInfoIp4 structures. That is when a network
+     * interface is added or removed, the address or gateway of an interface is
+     * changed, or a static route (@ref IpStaticRoute) is added or removed.
+     * 
+     * This allows caching the results of these functions beyond the scope where they
+     * would normally be valid. A cached @ref IpSendPreparedIp4 can be used with @ref
+     * sendIp4DgramFast as long as the generation number is the same as when it was
+     * prepared.
+     * 
+     * @return Routing configuration generation number.
+     */
+    inline std::uint32_t getRouteConfigGeneration () const
+    {
+        return m_route_config_gen;
+    }
     
+private:
+    inline void routeConfigChanged ()
+    {
+        m_route_config_gen++;
+        m_route_table_valid = false;
+        
+        // Cache entries are tagged with the generation, so they only need to be
+        // cleared when the generation wraps around.
+        if (AIPSTACK_UNLIKELY(m_route_config_gen == 0)) {
+            invalidate_route_cache();
+        }
+    }
+    
+    void invalidate_route_cache ()
+    {
+        for (RouteCacheEntry &entry : m_route_cache) {
+            entry.iface = nullptr;
+        }
+    }
+    
+    inline static std::size_t route_cache_index (Ip4Addr dst_addr)
+    {
+        std::uint32_t hash = dst_addr.value() * std::uint32_t(0x9E3779B1);
+        return (hash >> 16) & (RouteCacheSize - 1);
+    }
+    
+    bool lookup_route (Ip4Addr dst_addr, IpRouteInfoIp4<Arg> &route_info) const
+    {
+        if constexpr (RouteTableSize > 0) {
+            if (AIPSTACK_UNLIKELY(!m_route_table_valid)) {
+                build_route_table();
+            }
+            
+            if (AIPSTACK_LIKELY(!m_route_table_overflow)) {
+                RouteTableEntry const *entry = m_route_table.lookup(dst_addr);
+                
+                if (entry != nullptr) {
+                    route_info.iface = entry->iface;
+                    route_info.addr = entry->gateway.isZero() ? dst_addr : entry->gateway;
+                }
+                else if (m_route_table_gateway_iface != nullptr) {
+                    route_info.iface = m_route_table_gateway_iface;
+                    route_info.addr = m_route_table_gateway_iface->m_gateway;
+                }
+                else {
+                    return false;
+                }
+                
+                return true;
+            }
+        }
+        
+        return search_route(dst_addr, route_info);
+    }
+    
+    // Build the route trie used by lookup_route. This gives the same results as
+    // search_route since routes with the same prefix are added in order of
+    // preference (the first one added is kept): interface subnets in the order of
+    // the interface list, then static routes in the order of their list.
+    void build_route_table () const
+    {
+        m_route_table.reset();
+        m_route_table_overflow = false;
+        m_route_table_gateway_iface = nullptr;
+        
+        for (Iface *iface = m_iface_list.first(); iface != nullptr;
+             iface = m_iface_list.next(*iface))
+        {
+            if (iface->m_have_addr) {
+                if (!m_route_table.add(iface->m_addr.netaddr, iface->m_addr.prefix,
+                                       RouteTableEntry{iface, Ip4Addr::ZeroAddr()}))
+                {
+                    m_route_table_overflow = true;
+                }
+            }
+            if (iface->m_have_gateway && m_route_table_gateway_iface == nullptr) {
+                m_route_table_gateway_iface = iface;
+            }
+        }
+        
+        for (StaticRoute *route = m_static_routes.first(); route != nullptr;
+             route = m_static_routes.next(*route))
+        {
+            if (!m_route_table.add(route->m_params.dst_addr, route->m_params.prefix,
+                    RouteTableEntry{route->m_iface, route->m_params.gateway}))
+            {
+                m_route_table_overflow = true;
+            }
+        }
+        
+        m_route_table_valid = true;
+    }
+    
+    bool search_route (Ip4Addr dst_addr, IpRouteInfoIp4<Arg> &route_info) const
+    {
+        int best_prefix = -1;
+        Iface *best_iface = nullptr;
+        Ip4Addr best_hop_addr;
+        Iface *gateway_iface = nullptr;
+        
+        for (Iface *iface = m_iface_list.first(); iface != nullptr;
+             iface = m_iface_list.next(*iface))
+        {
+            if (iface->ip4AddrIsLocal(dst_addr)) {
+                int iface_prefix = iface->m_addr.prefix;
+                if (iface_prefix > best_prefix) {
+                    best_prefix = iface_prefix;
+                    best_iface = iface;
+                    best_hop_addr = dst_addr;
+                }
+            }
+            else if (iface->m_have_gateway && gateway_iface == nullptr) {
+                gateway_iface = iface;
+            }
+        }
+        
+        // Static routes are sorted by decreasing prefix length, so the first
+        // matching one is the best. It is only used if its prefix is longer than
+        // that of any matching interface subnet.
+        for (StaticRoute *route = m_static_routes.first();
+             route != nullptr && int(route->m_params.prefix) > best_prefix;
+             route = m_static_routes.next(*route))
+        {
+            if (route->matches(dst_addr)) {
+                best_prefix = route->m_params.prefix;
+                best_iface = route->m_iface;
+                best_hop_addr = route->m_params.gateway.isZero() ?
+                    dst_addr : route->m_params.gateway;
+                break;
+            }
+        }
+        
+        if (best_iface == nullptr && gateway_iface != nullptr) {
+            best_iface = gateway_iface;
+            best_hop_addr = gateway_iface->m_gateway;
+        }
+        
+        if (AIPSTACK_UNLIKELY(best_iface == nullptr)) {
+            return false;
+        }
+        
+        route_info.iface = best_iface;
+        route_info.addr = best_hop_addr;
+        
+        return true;
+    }
+    
+    void addStaticRoute (StaticRoute &route)
+    {
+        // Keep the list sorted by decreasing prefix length then increasing metric,
+        // inserting the new route before existing routes with the same ones.
+        StaticRoute *after = nullptr;
+        for (StaticRoute *r = m_static_routes.first(); r != nullptr;
+             r = m_static_routes.next(*r))
+        {
+            if (r->m_params.prefix < route.m_params.prefix ||
+                (r->m_params.prefix == route.m_params.prefix &&
+                 r->m_params.metric >= route.m_params.metric))
+            {
+                break;
+            }
+            after = r;
+        }
+        
+        if (after == nullptr) {
+            m_static_routes.prepend(route);
+        } else {
+            m_static_routes.insertAfter(route, *after);
+        }
+        
+        routeConfigChanged();
+    }
+    
+    void removeStaticRoute (StaticRoute &route)
+    {
+        m_static_routes.remove(route);
+        routeConfigChanged();
+    }
+
 private:    
     using IfaceList = LinkedList<
         MemberAccessor<Iface, LinkedListNode<IfaceLinkModel>, &Iface::m_iface_list_node>,
         IfaceLinkModel, false>;
     
+    using StaticRouteList = LinkedList<
+        MemberAccessor<StaticRoute, LinkedListNode<StaticRouteLinkModel>,
+                       &StaticRoute::m_list_node>,
+        StaticRouteLinkModel, false>;
+    
+    struct RouteCacheEntry {
+        Ip4Addr dst_addr;
+        Ip4Addr hop_addr;
+        Iface *iface;
+        std::uint32_t gen;
+    };
+    
+    // Route in the route trie; a zero gateway means the destination is the hop.
+    struct RouteTableEntry {
+        Iface *iface;
+        Ip4Addr gateway;
+    };
+    
     // Public works around access control issue from IpMtuRef with some compilers.
 public:
 #ifndef IN_DOXYGEN
@@ -1017,6 +1414,9 @@ private:
             return;
         }
         
+        // Get the ECN codepoint, reassembly may change it.
+        Ip4Ecn ecn = Ip4Ecn(version_ihl_dscp_ecn & Ip4EcnMask);
+        
         // Check if the more-fragments flag is set or the fragment offset is nonzero.
         if (AIPSTACK_UNLIKELY((flags_offset & (Ip4Flags::MF|Ip4Flags::OffsetMask)) != Enum0)) {
             // Only accept fragmented packets which are unicasts to the
@@ -1036,16 +1436,17 @@ private:
             // Perform reassembly.
             if (!iface->m_stack->m_reassembly.reassembleIp4(
                 ip4_header.get(Ip4Header::Ident()), src_addr, dst_addr, ttl, proto,
-                more_fragments, fragment_offset, ip4_header.data, dgram))
+                more_fragments, fragment_offset, ecn, dgram))
             {
                 return;
             }
             // Continue processing the reassembled datagram.
-            // Note, dgram was modified pointing to the reassembled data.
+            // Note, dgram was modified pointing to the reassembled data,
+            // and ecn to the codepoint of the reassembled datagram.
         }
         
         // Create the IpRxInfoIp4 struct.
-        IpRxInfoIp4<Arg> ip_info{src_addr, dst_addr, ttl, proto, iface, header_len};
+        IpRxInfoIp4<Arg> ip_info{src_addr, dst_addr, ttl, proto, iface, header_len, ecn};
 
         // Do the real processing now that the datagram is complete and
         // sanity checked.
@@ -1199,7 +1600,7 @@ private:
         
         // Read IP header fields.
         auto ip4_header = Ip4Header::MakeRef(icmp_data.getChunkPtr());
-        std::uint8_t version_ihl = ip4_header.get(Ip4Header::VersionIhlDscpEcn()) >> 8;
+        std::uint16_t version_ihl_dscp_ecn = ip4_header.get(Ip4Header::VersionIhlDscpEcn());
         std::uint16_t total_len  = ip4_header.get(Ip4Header::TotalLen());
         std::uint8_t ttl         = ip4_header.get(Ip4Header::Ttl());
         Ip4Protocol proto        = ip4_header.get(Ip4Header::Proto());
@@ -1207,6 +1608,7 @@ private:
         Ip4Addr dst_addr         = ip4_header.get(Ip4Header::DstAddr());
         
         // Check IP version.
+        std::uint8_t version_ihl = version_ihl_dscp_ecn >> 8;
         if (AIPSTACK_UNLIKELY((version_ihl >> Ip4VersionShift) != 4)) {
             return;
         }
@@ -1229,7 +1631,8 @@ private:
         Ip4DestUnreachMeta du_meta = {code, rest};
         
         // Create the IpRxInfoIp4 struct.
-        IpRxInfoIp4<Arg> ip_info{src_addr, dst_addr, ttl, proto, iface, header_len};
+        Ip4Ecn ecn = Ip4Ecn(version_ihl_dscp_ecn & Ip4EcnMask);
+        IpRxInfoIp4<Arg> ip_info{src_addr, dst_addr, ttl, proto, iface, header_len, ecn};
         
         // Get the included IP data.
         std::size_t data_len = MinValueU(icmp_data.tot_len, total_len) - header_len;
@@ -1252,7 +1655,15 @@ private:
     Reassembly m_reassembly;
     PathMtuCache m_path_mtu_cache;
     StructureRaiiWrapper<IfaceList> m_iface_list;
+    StructureRaiiWrapper<StaticRouteList> m_static_routes;
     std::uint16_t m_next_id;
+    std::uint32_t m_route_config_gen;
+    mutable RouteCacheEntry m_route_cache[MaxValue(std::size_t(1), RouteCacheSize)];
+    mutable bool m_route_table_valid;
+    mutable bool m_route_table_overflow;
+    mutable Iface *m_route_table_gateway_iface;
+    mutable IpRouteTrie<RouteTableEntry, MaxValue(std::size_t(1), RouteTableSize)>
+        m_route_table;
     InstantiateVariadic<ResourceTuple, ProtocolsList> m_protocols;
 };
 
@@ -1281,6 +1692,23 @@ struct IpStackOptions {
      */
     AIPSTACK_OPTION_DECL_VALUE(AllowBroadcastPing, bool, false)
     
+    /**
+     * Number of entries in the route cache used by @ref IpStack::routeIp4.
+     * 
+     * This must be zero (to disable the cache) or a power of two.
+     */
+    AIPSTACK_OPTION_DECL_VALUE(RouteCacheSize, std::size_t, 8)
+    
+    /**
+     * Maximum number of routes in the route trie used by @ref IpStack::routeIp4.
+     * 
+     * Routes are the subnets of interfaces with an address and static routes
+     * (@ref IpStaticRoute). If there are more, routing falls back to searching
+     * all interfaces and routes. The trie takes about (1 + 32 * RouteTableSize)
+     * nodes of a few bytes each. Zero disables the trie.
+     */
+    AIPSTACK_OPTION_DECL_VALUE(RouteTableSize, std::size_t, 8)
+    
     /**
      * Path MTU Discovery parameters/implementation.
      * 
@@ -1321,6 +1749,8 @@ class IpStackService {
     AIPSTACK_OPTION_CONFIG_VALUE(IpStackOptions, HeaderBeforeIp)
     AIPSTACK_OPTION_CONFIG_VALUE(IpStackOptions, IcmpTTL)
     AIPSTACK_OPTION_CONFIG_VALUE(IpStackOptions, AllowBroadcastPing)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpStackOptions, RouteCacheSize)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpStackOptions, RouteTableSize)
     AIPSTACK_OPTION_CONFIG_TYPE(IpStackOptions, PathMtuCacheService)
     AIPSTACK_OPTION_CONFIG_TYPE(IpStackOptions, ReassemblyService)
     
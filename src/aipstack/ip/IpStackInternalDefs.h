@@ -34,6 +34,7 @@ namespace AIpStack {
 template<typename> class IpStack;
 template<typename> class IpIface;
 template<typename> class IpIfaceListener;
+template<typename> class IpStaticRoute;
 
 // This class provides some types that cannot be defined in IpStack because that
 // would cause circular dependency problems, e.g. from IpIface.
@@ -43,10 +44,12 @@ class IpStackInternalDefs
     template<typename> friend class IpStack;
     template<typename> friend class IpIface;
     template<typename> friend class IpIfaceListener;
+    template<typename> friend class IpStaticRoute;
 
 private:
     using IfaceLinkModel = PointerLinkModel<IpIface<Arg>>;
     using IfaceListenerLinkModel = PointerLinkModel<IpIfaceListener<Arg>>;
+    using StaticRouteLinkModel = PointerLinkModel<IpStaticRoute<Arg>>;
 };
 
 #endif
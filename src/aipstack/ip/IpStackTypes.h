@@ -220,10 +220,20 @@ enum class IpSendFlags : std::uint16_t {
      */
     DontFragmentFlag = AsUnderlying(Ip4Flags::DF),
 
+    /**
+     * ECN-capable transport.
+     * 
+     * Using this flag will set the ECT(0) codepoint in the IP header, telling
+     * routers that they may mark the datagram with CE (Congestion Experienced)
+     * instead of dropping it (RFC 3168). It must only be used by protocols which
+     * respond to CE marks, such as TCP after ECN has been negotiated.
+     */
+    EcnCapableFlag = std::uint16_t(1) << 2,
+
     /**
      * Mask of all flags which may be passed to send functions.
      */
-    AllFlags = AllowBroadcastFlag|AllowNonLocalSrc|DontFragmentFlag,
+    AllFlags = AllowBroadcastFlag|AllowNonLocalSrc|DontFragmentFlag|EcnCapableFlag,
 };
 #ifndef IN_DOXYGEN
 AIPSTACK_ENUM_BITFIELD(IpSendFlags)
@@ -244,6 +254,12 @@ inline constexpr Ip4Flags IpFlagsInSendFlags(IpSendFlags send_flags) {
     return Ip4Flags(AsUnderlying(send_flags) & 0xFF00);
 }
 
+// Get the DSCP+ECN byte for the IP header based on IpSendFlags (for internal use).
+inline constexpr std::uint8_t IpDscpEcnForSendFlags(IpSendFlags send_flags) {
+    return ((send_flags & IpSendFlags::EcnCapableFlag) != Enum0) ?
+        AsUnderlying(Ip4Ecn::Ect0) : 0;
+}
+
 #endif
 
 /**
@@ -386,6 +402,15 @@ struct IpRxInfoIp4 {
      * The length of the IPv4 header in bytes.
      */
     std::uint8_t header_len;
+
+    /**
+     * The ECN codepoint.
+     * 
+     * For a reassembled datagram this is CE if any fragment was CE, otherwise
+     * the codepoint of the fragments (datagrams with fragments mixing not-ECT
+     * and ECT or CE are dropped, see RFC 3168 section 5.3).
+     */
+    Ip4Ecn ecn;
 };
 
 /**
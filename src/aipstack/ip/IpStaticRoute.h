@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_IP_STATIC_ROUTE_H
+#define AIPSTACK_IP_STATIC_ROUTE_H
+
+#include <cstdint>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/structure/LinkedList.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStackInternalDefs.h>
+
+namespace AIpStack {
+
+#ifndef IN_DOXYGEN
+template<typename> class IpStack;
+template<typename> class IpIface;
+#endif
+
+/**
+ * @addtogroup ip-stack
+ * @{
+ */
+
+/**
+ * Parameters of a static IPv4 route, passed to the @ref IpStaticRoute constructor.
+ */
+struct IpStaticRouteParams {
+    /**
+     * The destination network address. Bits outside of the prefix are ignored.
+     */
+    Ip4Addr dst_addr = Ip4Addr::ZeroAddr();
+
+    /**
+     * The destination prefix length (0 for a default route).
+     * 
+     * It must not exceed @ref Ip4Addr::Bits (this is an assert).
+     */
+    std::uint8_t prefix = 0;
+
+    /**
+     * The gateway address, or zero if the destination network is directly
+     * reachable through the interface.
+     */
+    Ip4Addr gateway = Ip4Addr::ZeroAddr();
+
+    /**
+     * Route metric used to choose between routes with the same prefix length;
+     * a lower metric is preferred.
+     */
+    std::uint8_t metric = 0;
+};
+
+/**
+ * Static IPv4 route which is part of the routing table of @ref IpStack.
+ * 
+ * The route is in effect while this object exists. See @ref IpStack::routeIp4
+ * for how static routes are considered along with routes implied by interface
+ * configuration.
+ * 
+ * @tparam Arg Template parameter of @ref IpStack.
+ */
+template<typename Arg>
+class IpStaticRoute :
+    private NonCopyable<IpStaticRoute<Arg>>
+{
+    template<typename> friend class IpStack;
+    template<typename> friend class IpIface;
+
+public:
+    /**
+     * Construct the route object, adding the route to the routing table.
+     * 
+     * @param iface The interface through which packets matching the route are
+     *        sent. It is the responsibility of the user to ensure that the
+     *        interface is not removed while this object still exists.
+     * @param params Route parameters.
+     */
+    IpStaticRoute (IpIface<Arg> *iface, IpStaticRouteParams const &params) :
+        m_iface(iface),
+        m_params(params)
+    {
+        AIPSTACK_ASSERT(iface != nullptr);
+        AIPSTACK_ASSERT(params.prefix <= Ip4Addr::Bits);
+
+        m_netmask = Ip4Addr::PrefixMask(m_params.prefix);
+        m_params.dst_addr = m_params.dst_addr & m_netmask;
+
+        m_iface->m_num_static_routes++;
+        m_iface->m_stack->addStaticRoute(*this);
+    }
+
+    /**
+     * Destruct the route object, removing the route from the routing table.
+     */
+    ~IpStaticRoute ()
+    {
+        m_iface->m_stack->removeStaticRoute(*this);
+        m_iface->m_num_static_routes--;
+    }
+
+    /**
+     * Return the interface of the route.
+     * 
+     * @return Interface of the route.
+     */
+    inline IpIface<Arg> * getIface () const
+    {
+        return m_iface;
+    }
+
+    /**
+     * Return the route parameters.
+     * 
+     * The destination address has bits outside of the prefix cleared.
+     * 
+     * @return Route parameters.
+     */
+    inline IpStaticRouteParams const & getParams () const
+    {
+        return m_params;
+    }
+
+private:
+    inline bool matches (Ip4Addr addr) const
+    {
+        return (addr & m_netmask) == m_params.dst_addr;
+    }
+
+private:
+    using InternalDefs = IpStackInternalDefs<Arg>;
+    using StaticRouteLinkModel = typename InternalDefs::StaticRouteLinkModel;
+
+private:
+    LinkedListNode<StaticRouteLinkModel> m_list_node;
+    IpIface<Arg> *m_iface;
+    IpStaticRouteParams m_params;
+    Ip4Addr m_netmask;
+};
+
+/** @} */
+
+}
+
+#endif
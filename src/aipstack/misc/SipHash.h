@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_SIP_HASH_H
+#define AIPSTACK_SIP_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <aipstack/misc/BinaryTools.h>
+
+namespace AIpStack {
+
+/**
+ * @ingroup misc
+ * @defgroup sip-hash SipHash
+ * @brief Keyed hash function for short inputs
+ * 
+ * The @ref SipHash24 function implements SipHash-2-4 as described in "SipHash: a fast
+ * short-input PRF" by Jean-Philippe Aumasson and Daniel J. Bernstein. It is suitable as a
+ * message authentication code for short messages such as addresses.
+ * 
+ * @{
+ */
+
+/**
+ * Key for @ref SipHash24.
+ */
+struct SipHashKey {
+    std::uint64_t k0 = 0;
+    std::uint64_t k1 = 0;
+};
+
+#ifndef IN_DOXYGEN
+namespace SipHashPrivate {
+    inline std::uint64_t Rotl (std::uint64_t x, int b)
+    {
+        return (x << b) | (x >> (64 - b));
+    }
+    
+    inline void Round (std::uint64_t (&v)[4])
+    {
+        v[0] += v[1]; v[1] = Rotl(v[1], 13); v[1] ^= v[0]; v[0] = Rotl(v[0], 32);
+        v[2] += v[3]; v[3] = Rotl(v[3], 16); v[3] ^= v[2];
+        v[0] += v[3]; v[3] = Rotl(v[3], 21); v[3] ^= v[0];
+        v[2] += v[1]; v[1] = Rotl(v[1], 17); v[1] ^= v[2]; v[2] = Rotl(v[2], 32);
+    }
+    
+    inline void Compress (std::uint64_t (&v)[4], std::uint64_t m)
+    {
+        v[3] ^= m;
+        Round(v);
+        Round(v);
+        v[0] ^= m;
+    }
+}
+#endif
+
+/**
+ * Calculate the SipHash-2-4 of a message.
+ * 
+ * @param key The secret key.
+ * @param data Pointer to the message.
+ * @param len Length of the message in bytes.
+ * @return The 64-bit hash value.
+ */
+inline std::uint64_t SipHash24 (SipHashKey const &key, char const *data, std::size_t len)
+{
+    using namespace SipHashPrivate;
+    
+    std::uint64_t v[4] = {
+        key.k0 ^ 0x736f6d6570736575u,
+        key.k1 ^ 0x646f72616e646f6du,
+        key.k0 ^ 0x6c7967656e657261u,
+        key.k1 ^ 0x7465646279746573u,
+    };
+    
+    // Process whole 8-byte words.
+    std::size_t rem_len = len;
+    for (; rem_len >= 8; rem_len -= 8, data += 8) {
+        Compress(v, ReadBinaryInt<std::uint64_t, BinaryLittleEndian>(data));
+    }
+    
+    // The last word contains the remaining bytes and the message length.
+    std::uint64_t last = std::uint64_t(len) << 56;
+    for (std::size_t i = 0; i < rem_len; i++) {
+        last |= std::uint64_t(std::uint8_t(data[i])) << (8 * i);
+    }
+    Compress(v, last);
+    
+    // Finalization.
+    v[2] ^= 0xff;
+    for (int i = 0; i < 4; i++) {
+        Round(v);
+    }
+    
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+/** @} */
+
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_MIRRORED_BUFFER_H
+#define AIPSTACK_MIRRORED_BUFFER_H
+
+#include <cstddef>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/platform_specific/FileDescriptorWrapper.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup misc-platform_specific
+ * @{
+ */
+
+/**
+ * Memory buffer which is mapped twice at consecutive addresses.
+ * 
+ * This class is only available on Linux.
+ * 
+ * The memory is a `memfd` mapped two times back-to-back, so that for any
+ * `i < size()`, `data()[size() + i]` refers to the same byte as `data()[i]`.
+ * Consequently any range of at most `size()` bytes starting within the buffer
+ * is contiguous in memory, even if it logically wraps around. This is intended
+ * for use with @ref SendRingBuffer and @ref RecvRingBuffer (see their `mirrored`
+ * setup parameter), so that read and write ranges never need to be split or
+ * copied into a separate mirror region.
+ * 
+ * The size is rounded up to a multiple of the page size.
+ */
+class MirroredBuffer :
+    private NonCopyable<MirroredBuffer>
+{
+public:
+    /**
+     * Allocate and map the buffer.
+     * 
+     * @param min_size Minimum size of the buffer. Must be positive.
+     * @throw std::runtime_error If creating or mapping the memory fails.
+     */
+    explicit MirroredBuffer (std::size_t min_size)
+    {
+        std::size_t page_size = std::size_t(::sysconf(_SC_PAGESIZE));
+        m_size = (min_size + (page_size - 1)) / page_size * page_size;
+        
+        FileDescriptorWrapper fd(::memfd_create("aipstack_mirrored_buffer", MFD_CLOEXEC));
+        if (!fd) {
+            throw std::runtime_error("memfd_create failed.");
+        }
+        
+        if (::ftruncate(*fd, off_t(m_size)) != 0) {
+            throw std::runtime_error("ftruncate failed.");
+        }
+        
+        // Reserve address space for both mappings, then map the memfd over
+        // each half. The memfd can be closed after mapping.
+        void *mem = ::mmap(nullptr, 2 * m_size, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) {
+            throw std::runtime_error("mmap (reserve) failed.");
+        }
+        m_data = static_cast<char *>(mem);
+        
+        for (int i = 0; i < 2; i++) {
+            void *res = ::mmap(m_data + i * m_size, m_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_FIXED, *fd, 0);
+            if (res == MAP_FAILED) {
+                ::munmap(m_data, 2 * m_size);
+                throw std::runtime_error("mmap (mirror) failed.");
+            }
+        }
+    }
+    
+    /**
+     * Unmap the buffer.
+     */
+    ~MirroredBuffer ()
+    {
+        ::munmap(m_data, 2 * m_size);
+    }
+    
+    /**
+     * Return a pointer to the start of the buffer.
+     * 
+     * The memory range of `2 * size()` bytes starting here is accessible, with
+     * the second half being a mirror of the first.
+     */
+    inline char * data () const
+    {
+        return m_data;
+    }
+    
+    /**
+     * Return the size of the buffer (not counting the mirror).
+     */
+    inline std::size_t size () const
+    {
+        return m_size;
+    }
+    
+private:
+    char *m_data;
+    std::size_t m_size;
+};
+
+/** @} */
+
+}
+
+#endif
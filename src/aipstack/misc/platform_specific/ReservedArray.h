@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_RESERVED_ARRAY_H
+#define AIPSTACK_RESERVED_ARRAY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/ResourceArray.h>
+#include <aipstack/misc/ExceptionUtils.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup misc-platform_specific
+ * @{
+ */
+
+/**
+ * Array with a fixed maximum size whose elements are constructed on demand
+ * in address space reserved up front.
+ * 
+ * The constructor reserves (but does not commit) address space for `MaxSize`
+ * elements and constructs the first `SlabSize` elements (or `MaxSize` if
+ * that is less). The array is later grown using @ref grow, which commits memory
+ * and constructs elements at the end. Since the reserved address range never
+ * moves, references to elements and their array indices remain valid as the
+ * array grows. Memory is only committed for constructed elements (rounded up
+ * to the page size).
+ * 
+ * On Linux, if `HugePages` is true, transparent huge pages are requested for
+ * the reserved range, which reduces TLB misses for large arrays. On Windows
+ * `HugePages` has no effect.
+ * 
+ * The constructor throws `std::bad_alloc` if the address space cannot be
+ * reserved.
+ * 
+ * @tparam Elem Type of array elements.
+ * @tparam MaxSize Maximum number of elements. Must be positive.
+ * @tparam SlabSize Number of elements constructed initially and the default
+ *         growth increment. Must be positive.
+ * @tparam HugePages Whether to request huge pages.
+ */
+template<typename Elem, std::size_t MaxSize, std::size_t SlabSize, bool HugePages>
+class ReservedArray :
+    private NonCopyable<ReservedArray<Elem, MaxSize, SlabSize, HugePages>>
+{
+    static_assert(MaxSize > 0);
+    static_assert(SlabSize > 0);
+    
+    // Alignment used for the reservation when huge pages are requested,
+    // so that committed ranges can be backed by huge pages.
+    inline static constexpr std::size_t HugePageSize = std::size_t(2) << 20;
+    
+public:
+    /**
+     * Reserve address space and construct the initial elements.
+     * 
+     * @tparam Args Types of arguments used for constructing elements.
+     * @param args Arguments used for constructing each element.
+     */
+    template<typename ...Args>
+    ReservedArray (ResourceArrayInitSame, Args const & ... args) :
+        m_reserved(nullptr),
+        m_reserved_size(0),
+        m_committed_size(0),
+        m_array(nullptr),
+        m_size(0)
+    {
+        reserve();
+        
+        bool grown;
+        AIPSTACK_TRY {
+            grown = grow(SlabSize < MaxSize ? SlabSize : MaxSize, args...);
+        }
+        AIPSTACK_CATCH(..., {
+            destruct_and_release();
+            throw;
+        })
+        
+        if (!grown) {
+            destruct_and_release();
+            throw std::bad_alloc();
+        }
+    }
+    
+    /**
+     * Destruct the elements in reverse order and release the memory.
+     */
+    ~ReservedArray ()
+    {
+        destruct_and_release();
+    }
+    
+    /**
+     * Return the number of constructed elements.
+     */
+    inline std::size_t size () const
+    {
+        return m_size;
+    }
+    
+    /**
+     * Construct elements at the end until the array has the given size.
+     * 
+     * If `new_size` is not greater than the current size, nothing is done. If it
+     * is greater than `MaxSize`, the array is grown to `MaxSize` only.
+     * 
+     * @param new_size Requested number of elements.
+     * @param args Arguments used for constructing each new element.
+     * @return True on success, false if memory could not be committed (in which
+     *         case no elements have been constructed).
+     */
+    template<typename ...Args>
+    bool grow (std::size_t new_size, Args const & ... args)
+    {
+        if (new_size > MaxSize) {
+            new_size = MaxSize;
+        }
+        
+        if (new_size <= m_size) {
+            return true;
+        }
+        
+        if (!commit(new_size * sizeof(Elem))) {
+            return false;
+        }
+        
+        while (m_size < new_size) {
+            new(&m_array[m_size]) Elem(args...);
+            m_size++;
+        }
+        
+        return true;
+    }
+    
+    /**
+     * Return a reference to the element at the given index.
+     * 
+     * The index may refer to an element which is being constructed (this allows
+     * elements to compute their own index during construction).
+     * 
+     * @param index Index of element. Must be less than `MaxSize`.
+     */
+    inline Elem & operator[] (std::size_t index)
+    {
+        AIPSTACK_ASSERT(index < MaxSize);
+        return m_array[index];
+    }
+    
+    /**
+     * Return a reference to the element at the given index (const).
+     */
+    inline Elem const & operator[] (std::size_t index) const
+    {
+        AIPSTACK_ASSERT(index < MaxSize);
+        return m_array[index];
+    }
+    
+    /**
+     * Return a pointer to the first element for range-based for loops.
+     */
+    inline Elem * begin ()
+    {
+        return m_array;
+    }
+    
+    /**
+     * Return a pointer past the last constructed element for range-based for loops.
+     */
+    inline Elem * end ()
+    {
+        return m_array + m_size;
+    }
+    
+private:
+    static std::size_t page_size ()
+    {
+    #ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return info.dwPageSize;
+    #else
+        return std::size_t(sysconf(_SC_PAGESIZE));
+    #endif
+    }
+    
+    inline static std::size_t round_up (std::size_t value, std::size_t unit)
+    {
+        return (value + (unit - 1)) / unit * unit;
+    }
+    
+    inline std::size_t commit_unit () const
+    {
+        return HugePages ? HugePageSize : page_size();
+    }
+    
+    void reserve ()
+    {
+        std::size_t unit = commit_unit();
+        std::size_t array_size = round_up(MaxSize * sizeof(Elem), unit);
+        
+        // Reserve one extra unit so that the array can be aligned to it.
+        std::size_t reserve_size = array_size + (HugePages ? unit : 0);
+        
+    #ifdef _WIN32
+        void *mem = VirtualAlloc(nullptr, reserve_size, MEM_RESERVE, PAGE_NOACCESS);
+        if (mem == nullptr) {
+            throw std::bad_alloc();
+        }
+    #else
+        void *mem = mmap(nullptr, reserve_size, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+    #endif
+        
+        m_reserved = static_cast<char *>(mem);
+        m_reserved_size = reserve_size;
+        
+        std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(mem);
+        std::uintptr_t aligned = (addr + (unit - 1)) / unit * unit;
+        m_array = reinterpret_cast<Elem *>(aligned);
+        
+    #if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+        if (HugePages) {
+            // This is only advice, failure is not an error.
+            madvise(m_array, array_size, MADV_HUGEPAGE);
+        }
+    #endif
+    }
+    
+    bool commit (std::size_t bytes)
+    {
+        std::size_t new_committed = round_up(bytes, commit_unit());
+        if (new_committed <= m_committed_size) {
+            return true;
+        }
+        
+        char *start = reinterpret_cast<char *>(m_array) + m_committed_size;
+        std::size_t len = new_committed - m_committed_size;
+        
+    #ifdef _WIN32
+        if (VirtualAlloc(start, len, MEM_COMMIT, PAGE_READWRITE) == nullptr) {
+            return false;
+        }
+    #else
+        if (mprotect(start, len, PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+    #endif
+        
+        m_committed_size = new_committed;
+        return true;
+    }
+    
+    void destruct_and_release ()
+    {
+        while (m_size > 0) {
+            m_size--;
+            m_array[m_size].Elem::~Elem();
+        }
+        
+        release();
+    }
+    
+    void release ()
+    {
+        if (m_reserved != nullptr) {
+        #ifdef _WIN32
+            VirtualFree(m_reserved, 0, MEM_RELEASE);
+        #else
+            munmap(m_reserved, m_reserved_size);
+        #endif
+            m_reserved = nullptr;
+        }
+    }
+    
+private:
+    char *m_reserved;
+    std::size_t m_reserved_size;
+    std::size_t m_committed_size;
+    Elem *m_array;
+    std::size_t m_size;
+};
+
+/**
+ * Array service selecting @ref ReservedArray, for use with the PcbArrayService
+ * option of @ref IpTcpProtoService.
+ * 
+ * @tparam SlabSize Initial number of elements and the growth increment.
+ * @tparam HugePages Whether to request huge pages for the reserved memory.
+ */
+template<std::size_t SlabSize, bool HugePages = false>
+class ReservedArrayService {
+public:
+    #ifndef IN_DOXYGEN
+    inline static constexpr std::size_t GrowSize = SlabSize;
+    
+    template<typename Elem, std::size_t MaxSize>
+    using Array = ReservedArray<Elem, MaxSize, SlabSize, HugePages>;
+    #endif
+};
+
+/** @} */
+
+}
+
+#endif
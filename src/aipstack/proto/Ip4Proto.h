@@ -47,6 +47,14 @@ enum class Ip4Flags : std::uint16_t {
 };
 AIPSTACK_ENUM_BITFIELD(Ip4Flags)
 
+// ECN codepoints in the low two bits of the DSCP+ECN byte (RFC 3168).
+enum class Ip4Ecn : std::uint8_t {
+    NotEct = 0,
+    Ect1   = 1,
+    Ect0   = 2,
+    Ce     = 3,
+};
+
 AIPSTACK_DEFINE_STRUCT(Ip4Header,
     (VersionIhlDscpEcn, std::uint16_t)
     (TotalLen,          std::uint16_t)
@@ -61,6 +69,7 @@ AIPSTACK_DEFINE_STRUCT(Ip4Header,
 
 inline constexpr int Ip4VersionShift = 4;
 inline constexpr std::uint8_t Ip4IhlMask = 0xF;
+inline constexpr std::uint8_t Ip4EcnMask = 0x3;
 
 inline constexpr std::size_t Ip4MaxHeaderSize = 60;
 
@@ -72,6 +72,7 @@ enum class TcpOption : std::uint8_t {
     Nop = 1,
     MSS = 2,
     WndScale = 3,
+    FastOpen = 34,
 };
 
 inline constexpr std::size_t Ip4TcpHeaderSize = Ip4Header::Size + Tcp4Header::Size;
@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_FRAME_IMPAIRMENT_H
+#define AIPSTACK_FRAME_IMPAIRMENT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <aipstack/misc/Use.h>
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/platform/PlatformFacade.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup sim
+ * @{
+ */
+
+/**
+ * Packet loss model used by @ref FrameImpairment.
+ */
+enum class FrameLossModel {
+    /**
+     * No random loss.
+     */
+    None,
+
+    /**
+     * Each frame is lost independently with probability
+     * @ref FrameImpairmentParams::loss_prob.
+     */
+    Bernoulli,
+
+    /**
+     * Two-state Gilbert-Elliott model.
+     * 
+     * The model is in the Good or Bad state, each with its own loss probability
+     * (@ref FrameImpairmentParams::ge_loss_good, @ref FrameImpairmentParams::ge_loss_bad).
+     * Before each frame it moves from Good to Bad with probability
+     * @ref FrameImpairmentParams::ge_p_good_bad and from Bad to Good with
+     * probability @ref FrameImpairmentParams::ge_p_bad_good. This produces bursts
+     * of losses.
+     */
+    GilbertElliott,
+};
+
+/**
+ * Parameters of a @ref FrameImpairment stage.
+ * 
+ * The default values describe a transparent stage (no loss, delay or rate limit).
+ */
+struct FrameImpairmentParams {
+    /**
+     * Seed of the random number generator.
+     * 
+     * The same seed and the same sequence of input frames and times give the same
+     * sequence of impairments.
+     */
+    std::uint64_t seed = 1;
+
+    /**
+     * Loss model.
+     */
+    FrameLossModel loss_model = FrameLossModel::None;
+
+    /**
+     * Loss probability for @ref FrameLossModel::Bernoulli.
+     */
+    double loss_prob = 0.0;
+
+    /**
+     * Good to Bad transition probability for @ref FrameLossModel::GilbertElliott.
+     */
+    double ge_p_good_bad = 0.0;
+
+    /**
+     * Bad to Good transition probability for @ref FrameLossModel::GilbertElliott.
+     */
+    double ge_p_bad_good = 1.0;
+
+    /**
+     * Loss probability in the Good state for @ref FrameLossModel::GilbertElliott.
+     */
+    double ge_loss_good = 0.0;
+
+    /**
+     * Loss probability in the Bad state for @ref FrameLossModel::GilbertElliott.
+     */
+    double ge_loss_bad = 1.0;
+
+    /**
+     * Probability that a frame which was not lost is passed on twice.
+     */
+    double duplicate_prob = 0.0;
+
+    /**
+     * Probability that a frame is passed on without the configured delay, so that
+     * it overtakes frames which are still being delayed.
+     */
+    double reorder_prob = 0.0;
+
+    /**
+     * Fixed delay in seconds.
+     */
+    double delay_sec = 0.0;
+
+    /**
+     * Maximum random deviation from @ref delay_sec in seconds (uniform
+     * distribution). Frames are passed on in order of their resulting times, so
+     * jitter larger than the frame spacing also reorders frames.
+     */
+    double jitter_sec = 0.0;
+
+    /**
+     * Rate limit in bits per second, or zero for no limit.
+     */
+    double rate_bps = 0.0;
+
+    /**
+     * Maximum frame size accepted.
+     */
+    std::size_t max_frame_size = 1514;
+
+    /**
+     * Maximum number of frames being held; further frames are dropped.
+     */
+    std::size_t queue_limit = 256;
+};
+
+/**
+ * Counters maintained by a @ref FrameImpairment stage.
+ */
+struct FrameImpairmentStats {
+    std::uint64_t frames_in = 0;
+    std::uint64_t frames_out = 0;
+    std::uint64_t frames_lost = 0;
+    std::uint64_t frames_duplicated = 0;
+    std::uint64_t frames_reordered = 0;
+    std::uint64_t frames_queue_dropped = 0;
+};
+
+/**
+ * Deterministic packet impairment stage, similar to Linux netem.
+ * 
+ * Frames passed to @ref inputFrame are copied and later passed to the output
+ * handler, after applying random loss, duplication, reordering, delay with jitter
+ * and a rate limit according to @ref FrameImpairmentParams. Frames are always
+ * output from a timer handler, never from within @ref inputFrame.
+ * 
+ * The stage can be placed anywhere frames are passed around, for example between a
+ * driver and @ref EthIpIface::recvFrame (see @ref VirtualWireEthIface::setRxImpairment).
+ * 
+ * @tparam PlatformImpl The platform implementation class.
+ */
+template<typename PlatformImpl>
+class FrameImpairment :
+    private NonCopyable<FrameImpairment<PlatformImpl>>
+{
+    using Platform = PlatformFacade<PlatformImpl>;
+    AIPSTACK_USE_TYPES(Platform, (TimeType))
+
+    using Index = std::size_t;
+    inline static constexpr Index NullIndex = Index(-1);
+
+    struct Entry {
+        TimeType out_time;
+        std::size_t len;
+        Index next;
+    };
+
+public:
+    /**
+     * Type of callback called to pass on a frame.
+     * 
+     * The frame data is only valid during the call. The handler may call
+     * @ref inputFrame but must not destruct this object.
+     */
+    using FrameOutputHandler = Function<void(IpBufRef frame)>;
+
+    /**
+     * Construct the stage.
+     * 
+     * @param platform The platform facade.
+     * @param params Impairment parameters.
+     * @param handler Callback for output frames (must not be null).
+     */
+    FrameImpairment (Platform platform, FrameImpairmentParams const &params,
+                     FrameOutputHandler handler)
+    :
+        m_params(params),
+        m_handler(handler),
+        m_timer(platform, AIPSTACK_BIND_MEMBER_TN(&FrameImpairment::timerHandler, this)),
+        m_entries(new Entry[params.queue_limit]),
+        m_buffer(new char[params.queue_limit * params.max_frame_size]),
+        m_rng_state(params.seed),
+        m_ge_bad(false),
+        m_rate_free_time(platform.getTime()),
+        m_rate_frac_ticks(0.0)
+    {
+        AIPSTACK_ASSERT(params.max_frame_size > 0);
+        AIPSTACK_ASSERT(params.queue_limit > 0);
+        AIPSTACK_ASSERT(params.delay_sec >= 0.0);
+        AIPSTACK_ASSERT(params.jitter_sec >= 0.0);
+        AIPSTACK_ASSERT(params.rate_bps >= 0.0);
+
+        m_pending_first = NullIndex;
+        m_free_first = NullIndex;
+        for (Index i = params.queue_limit; i > 0; i--) {
+            m_entries[i - 1].next = m_free_first;
+            m_free_first = i - 1;
+        }
+    }
+
+    /**
+     * Return the impairment parameters.
+     * 
+     * @return Parameters as passed to the constructor.
+     */
+    inline FrameImpairmentParams const & getParams () const
+    {
+        return m_params;
+    }
+
+    /**
+     * Return the counters.
+     * 
+     * @return Counters of frames processed by this stage.
+     */
+    inline FrameImpairmentStats const & getStats () const
+    {
+        return m_stats;
+    }
+
+    /**
+     * Pass a frame into the stage.
+     * 
+     * @param frame Frame data; it is copied as needed.
+     * @return Success if the frame was accepted (including when it is lost
+     *         deliberately), @ref IpErr::PacketTooLarge if it exceeds
+     *         @ref FrameImpairmentParams::max_frame_size or
+     *         @ref IpErr::OutputBufferFull if the queue limit was reached.
+     */
+    IpErr inputFrame (IpBufRef frame)
+    {
+        m_stats.frames_in++;
+
+        if (frame.tot_len > m_params.max_frame_size) {
+            return IpErr::PacketTooLarge;
+        }
+
+        if (decideLoss()) {
+            m_stats.frames_lost++;
+            return IpErr::Success;
+        }
+
+        int copies = 1;
+        if (m_params.duplicate_prob > 0.0 && randomDouble() < m_params.duplicate_prob) {
+            m_stats.frames_duplicated++;
+            copies = 2;
+        }
+
+        IpErr err = IpErr::Success;
+        for (int copy = 0; copy < copies; copy++) {
+            err = enqueueFrame(frame);
+            if (err != IpErr::Success) {
+                break;
+            }
+        }
+
+        return err;
+    }
+
+private:
+    // xorshift64* generator, enough for simulation purposes and fully reproducible.
+    std::uint64_t randomNext ()
+    {
+        if (m_rng_state == 0) {
+            m_rng_state = UINT64_C(0x9E3779B97F4A7C15);
+        }
+        m_rng_state ^= m_rng_state >> 12;
+        m_rng_state ^= m_rng_state << 25;
+        m_rng_state ^= m_rng_state >> 27;
+        return m_rng_state * UINT64_C(0x2545F4914F6CDD1D);
+    }
+
+    // Uniform random number in [0, 1).
+    double randomDouble ()
+    {
+        return double(randomNext() >> 11) * (1.0 / double(UINT64_C(1) << 53));
+    }
+
+    bool decideLoss ()
+    {
+        switch (m_params.loss_model) {
+            case FrameLossModel::Bernoulli:
+                return randomDouble() < m_params.loss_prob;
+
+            case FrameLossModel::GilbertElliott: {
+                double p_change = m_ge_bad ? m_params.ge_p_bad_good : m_params.ge_p_good_bad;
+                if (randomDouble() < p_change) {
+                    m_ge_bad = !m_ge_bad;
+                }
+                double p_loss = m_ge_bad ? m_params.ge_loss_bad : m_params.ge_loss_good;
+                return randomDouble() < p_loss;
+            }
+
+            default:
+                return false;
+        }
+    }
+
+    IpErr enqueueFrame (IpBufRef frame)
+    {
+        if (m_free_first == NullIndex) {
+            m_stats.frames_queue_dropped++;
+            return IpErr::OutputBufferFull;
+        }
+
+        TimeType now = m_timer.platform().getTime();
+
+        // Rate limiting: the frame leaves after the previous one has been
+        // transmitted.
+        TimeType out_time = now;
+        if (m_params.rate_bps > 0.0) {
+            if (!Platform::timeGreaterOrEqual(m_rate_free_time, now)) {
+                m_rate_free_time = now;
+                m_rate_frac_ticks = 0.0;
+            }
+            m_rate_frac_ticks +=
+                (8.0 * double(frame.tot_len) / m_params.rate_bps) * Platform::TimeFreq;
+            TimeType whole_ticks = TimeType(m_rate_frac_ticks);
+            m_rate_free_time += whole_ticks;
+            m_rate_frac_ticks -= double(whole_ticks);
+            out_time = m_rate_free_time;
+        }
+
+        // Delay with jitter, unless this frame is chosen to be reordered.
+        if (m_params.reorder_prob > 0.0 && randomDouble() < m_params.reorder_prob) {
+            m_stats.frames_reordered++;
+        } else {
+            double delay = m_params.delay_sec;
+            if (m_params.jitter_sec > 0.0) {
+                delay += (2.0 * randomDouble() - 1.0) * m_params.jitter_sec;
+            }
+            if (delay > 0.0) {
+                out_time += TimeType(delay * Platform::TimeFreq);
+            }
+        }
+
+        Index index = m_free_first;
+        m_free_first = m_entries[index].next;
+
+        Entry &entry = m_entries[index];
+        ipBufTakeBytes(frame, frame.tot_len, m_buffer.get() + index * m_params.max_frame_size);
+        entry.out_time = out_time;
+        entry.len = frame.tot_len;
+
+        // Insert into the pending list sorted by output time, after any entries
+        // with the same time so that such frames keep their order.
+        Index *link = &m_pending_first;
+        while (*link != NullIndex &&
+               Platform::timeGreaterOrEqual(out_time, m_entries[*link].out_time))
+        {
+            link = &m_entries[*link].next;
+        }
+        entry.next = *link;
+        *link = index;
+
+        if (m_pending_first == index) {
+            m_timer.setAt(out_time);
+        }
+
+        return IpErr::Success;
+    }
+
+    void timerHandler ()
+    {
+        TimeType now = m_timer.platform().getTime();
+
+        while (m_pending_first != NullIndex) {
+            Index index = m_pending_first;
+            Entry &entry = m_entries[index];
+
+            if (!Platform::timeGreaterOrEqual(now, entry.out_time)) {
+                m_timer.setAt(entry.out_time);
+                break;
+            }
+
+            // Unlink before calling the handler but keep the slot allocated until
+            // it returns, so that reentrant inputFrame calls cannot overwrite it.
+            m_pending_first = entry.next;
+
+            IpBufNode node{m_buffer.get() + index * m_params.max_frame_size,
+                           entry.len, nullptr};
+            m_stats.frames_out++;
+            m_handler(IpBufRef{&node, 0, entry.len});
+
+            m_entries[index].next = m_free_first;
+            m_free_first = index;
+
+            // The handler may have inserted a new first entry; the loop simply
+            // continues with the current first entry.
+        }
+    }
+
+private:
+    FrameImpairmentParams m_params;
+    FrameOutputHandler m_handler;
+    typename Platform::Timer m_timer;
+    std::unique_ptr<Entry[]> m_entries;
+    std::unique_ptr<char[]> m_buffer;
+    Index m_pending_first;
+    Index m_free_first;
+    std::uint64_t m_rng_state;
+    bool m_ge_bad;
+    TimeType m_rate_free_time;
+    double m_rate_frac_ticks;
+    FrameImpairmentStats m_stats;
+};
+
+/** @} */
+
+}
+
+#endif
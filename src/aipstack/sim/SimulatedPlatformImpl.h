@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_SIMULATED_PLATFORM_IMPL_H
+#define AIPSTACK_SIMULATED_PLATFORM_IMPL_H
+
+#include <cstdint>
+
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/Use.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/structure/LinkModel.h>
+#include <aipstack/structure/Accessor.h>
+#include <aipstack/structure/StructureRaiiWrapper.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup sim
+ * @{
+ */
+
+/**
+ * Platform implementation with a virtual clock, for discrete-event simulation.
+ * 
+ * Time does not advance on its own. The run functions (@ref run, @ref runUntil,
+ * @ref runOne) repeatedly take the earliest set timer, advance the clock directly
+ * to its expiration time and call its handler. Since all activity of the stack
+ * and of in-process drivers such as @ref VirtualWire is driven by timers, long
+ * scenarios (for example TCP TIME_WAIT periods) are simulated as fast as the
+ * handlers can execute.
+ * 
+ * Timers expiring at the same time are dispatched in the order in which they were
+ * set, so a simulation is fully deterministic.
+ * 
+ * It implements all the functionality described in the @ref PlatformImplStub
+ * documentation. Note that the documentation of this class does not include
+ * definitions matching those in @ref PlatformImplStub. The clock has nanosecond
+ * resolution like that of @ref HostedPlatformImpl.
+ */
+class SimulatedPlatformImpl :
+    public NonCopyable<SimulatedPlatformImpl>
+{
+    struct TimerHeapNodeAccessor;
+    struct TimerCompare;
+
+public:
+    #ifndef IN_DOXYGEN
+
+    using ThePlatformRef = PlatformRef<SimulatedPlatformImpl>;
+
+    inline static constexpr bool ImplIsStatic = false;
+
+    using TimeType = std::uint64_t;
+
+    inline static constexpr double TimeFreq = 1e9;
+
+    inline static constexpr TimeType RelativeTimeLimit = TypeMax<TimeType> / 64;
+
+    class Timer;
+
+    #endif
+
+private:
+    using TimerLinkModel = PointerLinkModel<Timer>;
+    using TimerHeap = LinkedHeap<TimerHeapNodeAccessor, TimerCompare, TimerLinkModel>;
+    using TimerHeapNode = LinkedHeapNode<TimerLinkModel>;
+
+public:
+    /**
+     * Construct the platform implementation.
+     * 
+     * @param start_time Initial value of the virtual clock.
+     */
+    inline SimulatedPlatformImpl (TimeType start_time = 0);
+
+    /**
+     * Destruct the platform implementation. All timers must have been destructed.
+     */
+    inline ~SimulatedPlatformImpl ();
+
+    /**
+     * Dispatch the earliest timer, if any.
+     * 
+     * The clock is advanced to the expiration time of the timer if that is in the
+     * future.
+     * 
+     * @return True if a timer was dispatched, false if no timer was set.
+     */
+    inline bool runOne ();
+
+    /**
+     * Dispatch timers until no timer is set or @ref stop is called.
+     */
+    inline void run ();
+
+    /**
+     * Dispatch all timers expiring at or before a specific time and then advance
+     * the clock to that time.
+     * 
+     * If @ref stop is called from a handler, this returns immediately without
+     * advancing the clock any further.
+     * 
+     * @param end_time Time until which to run; it must not be in the past.
+     */
+    inline void runUntil (TimeType end_time);
+
+    /**
+     * Make the current @ref run or @ref runUntil call return after the current
+     * handler returns.
+     */
+    inline void stop ();
+
+    /**
+     * Return the number of timer handlers called so far.
+     * 
+     * @return Number of dispatched timers.
+     */
+    inline std::uint64_t getNumDispatched () const { return m_num_dispatched; }
+
+    #ifndef IN_DOXYGEN
+
+    inline TimeType getTime () { return m_now; }
+
+    inline TimeType getEventTime () { return m_now; }
+
+    class Timer :
+        private NonCopyable<Timer>,
+        private ThePlatformRef
+    {
+        friend class SimulatedPlatformImpl;
+
+    public:
+        inline Timer (ThePlatformRef ref, Function<void()> handler);
+
+        inline ~Timer ();
+
+        using ThePlatformRef::ref;
+
+        inline bool isSet () const { return m_is_set; }
+
+        inline TimeType getSetTime () const { return m_set_time; }
+
+        inline void unset ();
+
+        inline void setAt (TimeType abs_time);
+
+    private:
+        inline SimulatedPlatformImpl & impl () const { return *ref().platformImpl(); }
+
+    private:
+        TimerHeapNode m_heap_node;
+        Function<void()> m_handler;
+        TimeType m_set_time;
+        TimeType m_dispatch_time;
+        std::uint64_t m_seq;
+        bool m_is_set;
+    };
+
+    #endif
+
+private:
+    // Interpret a time relative to the current time as described for TimeType in
+    // PlatformImplStub: times up to half of the clock period behind are in the past.
+    inline bool timeIsPast (TimeType time) const
+    {
+        return TimeType(time - m_now) > TypeMax<TimeType> / 2;
+    }
+
+private:
+    StructureRaiiWrapper<TimerHeap> m_timer_heap;
+    TimeType m_now;
+    std::uint64_t m_next_seq;
+    std::uint64_t m_num_dispatched;
+    std::uint64_t m_num_timers;
+    bool m_stop;
+};
+
+#ifndef IN_DOXYGEN
+
+struct SimulatedPlatformImpl::TimerHeapNodeAccessor : public MemberAccessor<
+    Timer, TimerHeapNode, &Timer::m_heap_node> {};
+
+// Timers are ordered by dispatch time (the set time clamped to be no earlier than
+// the time at which it was set) and then by the order of setting.
+struct SimulatedPlatformImpl::TimerCompare {
+    AIPSTACK_USE_TYPES(TimerLinkModel, (State, Ref))
+
+    inline static int compareEntries (State, Ref ref1, Ref ref2)
+    {
+        Timer &tim1 = *ref1;
+        Timer &tim2 = *ref2;
+
+        if (tim1.m_dispatch_time != tim2.m_dispatch_time) {
+            return (tim1.m_dispatch_time < tim2.m_dispatch_time) ? -1 : 1;
+        }
+
+        if (tim1.m_seq != tim2.m_seq) {
+            return (tim1.m_seq < tim2.m_seq) ? -1 : 1;
+        }
+
+        return 0;
+    }
+
+    inline static int compareKeyEntry (State, TimeType time1, Ref ref2)
+    {
+        Timer &tim2 = *ref2;
+
+        if (time1 != tim2.m_dispatch_time) {
+            return (time1 < tim2.m_dispatch_time) ? -1 : 1;
+        }
+
+        return 0;
+    }
+};
+
+SimulatedPlatformImpl::SimulatedPlatformImpl (TimeType start_time) :
+    m_now(start_time),
+    m_next_seq(0),
+    m_num_dispatched(0),
+    m_num_timers(0),
+    m_stop(false)
+{}
+
+SimulatedPlatformImpl::~SimulatedPlatformImpl ()
+{
+    AIPSTACK_ASSERT(m_num_timers == 0);
+}
+
+bool SimulatedPlatformImpl::runOne ()
+{
+    Timer *tim = m_timer_heap.first();
+    if (tim == nullptr) {
+        return false;
+    }
+
+    m_timer_heap.remove(*tim);
+    tim->m_is_set = false;
+
+    if (tim->m_dispatch_time > m_now) {
+        m_now = tim->m_dispatch_time;
+    }
+
+    m_num_dispatched++;
+    tim->m_handler();
+
+    return true;
+}
+
+void SimulatedPlatformImpl::run ()
+{
+    m_stop = false;
+
+    while (!m_stop && runOne());
+}
+
+void SimulatedPlatformImpl::runUntil (TimeType end_time)
+{
+    AIPSTACK_ASSERT(end_time >= m_now);
+
+    m_stop = false;
+
+    while (!m_stop) {
+        Timer *tim = m_timer_heap.first();
+        if (tim == nullptr || tim->m_dispatch_time > end_time) {
+            m_now = end_time;
+            break;
+        }
+        runOne();
+    }
+}
+
+void SimulatedPlatformImpl::stop ()
+{
+    m_stop = true;
+}
+
+SimulatedPlatformImpl::Timer::Timer (ThePlatformRef ref, Function<void()> handler) :
+    ThePlatformRef(ref),
+    m_handler(handler),
+    m_is_set(false)
+{
+    impl().m_num_timers++;
+}
+
+SimulatedPlatformImpl::Timer::~Timer ()
+{
+    unset();
+    impl().m_num_timers--;
+}
+
+void SimulatedPlatformImpl::Timer::unset ()
+{
+    if (m_is_set) {
+        impl().m_timer_heap.remove(*this);
+        m_is_set = false;
+    }
+}
+
+void SimulatedPlatformImpl::Timer::setAt (TimeType abs_time)
+{
+    SimulatedPlatformImpl &pimpl = impl();
+
+    unset();
+
+    // Since the virtual clock starts at the given time and does not wrap in
+    // practice, dispatch times are compared as plain integers. Times in the past
+    // are dispatched at the current time.
+    m_set_time = abs_time;
+    m_dispatch_time = pimpl.timeIsPast(abs_time) ? pimpl.m_now : abs_time;
+    m_seq = pimpl.m_next_seq++;
+    m_is_set = true;
+
+    pimpl.m_timer_heap.insert(*this);
+}
+
+#endif
+
+/** @} */
+
+}
+
+#endif
@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_VIRTUAL_WIRE_H
+#define AIPSTACK_VIRTUAL_WIRE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <aipstack/misc/Use.h>
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/structure/LinkedList.h>
+#include <aipstack/structure/LinkModel.h>
+#include <aipstack/structure/Accessor.h>
+#include <aipstack/structure/StructureRaiiWrapper.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/Instance.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/sim/FrameImpairment.h>
+
+namespace AIpStack {
+
+/**
+ * @addtogroup sim
+ * @{
+ */
+
+/**
+ * Link parameters of a @ref VirtualWire.
+ */
+struct VirtualWireParams {
+    /**
+     * Maximum frame size including the 14-byte Ethernet header.
+     */
+    std::size_t eth_mtu = 1514;
+
+    /**
+     * Bandwidth of each port in bits per second, or zero for unlimited.
+     */
+    double bandwidth_bps = 0.0;
+
+    /**
+     * One-way propagation delay in seconds.
+     */
+    double latency_sec = 0.0;
+
+    /**
+     * Maximum number of frames waiting for transmission by each port.
+     * 
+     * A frame stops counting against this limit once it has been transmitted,
+     * frames propagating over the wire are held separately.
+     */
+    std::size_t queue_depth = 128;
+};
+
+/**
+ * Counters maintained by each @ref VirtualWire::Port.
+ */
+struct VirtualWireStats {
+    std::uint64_t frames_sent = 0;
+    std::uint64_t bytes_sent = 0;
+    std::uint64_t frames_dropped = 0;
+};
+
+/**
+ * In-process shared-medium link connecting any number of ports.
+ * 
+ * A frame sent through a port is queued in the transmit queue of that port. It
+ * is transmitted at the configured bandwidth after any frames queued before it,
+ * and delivered to all other ports after the configured latency. Frames are
+ * always delivered from a timer handler, never from within @ref Port::sendFrame.
+ * If the transmit queue is full, @ref Port::sendFrame fails with
+ * @ref IpErr::OutputBufferFull. Frames which have been transmitted and are only
+ * waiting for the latency to pass do not occupy the transmit queue.
+ * 
+ * All ports must be used from the same event loop (the platform implementation
+ * is not required to be thread-safe).
+ * 
+ * @tparam PlatformImpl The platform implementation class.
+ */
+template<typename PlatformImpl>
+class VirtualWire :
+    private NonCopyable<VirtualWire<PlatformImpl>>
+{
+    using Platform = PlatformFacade<PlatformImpl>;
+    AIPSTACK_USE_TYPES(Platform, (TimeType))
+
+public:
+    class Port;
+
+private:
+    using PortLinkModel = PointerLinkModel<Port>;
+
+public:
+    /**
+     * Construct the wire.
+     * 
+     * @param params Link parameters.
+     */
+    VirtualWire (VirtualWireParams const &params) :
+        m_params(params)
+    {
+        AIPSTACK_ASSERT(params.eth_mtu > 0);
+        AIPSTACK_ASSERT(params.bandwidth_bps >= 0.0);
+        AIPSTACK_ASSERT(params.latency_sec >= 0.0);
+        AIPSTACK_ASSERT(params.queue_depth > 0);
+    }
+
+    /**
+     * Destruct the wire. All ports must have been destructed.
+     */
+    ~VirtualWire ()
+    {
+        AIPSTACK_ASSERT(m_ports.isEmpty());
+    }
+
+    /**
+     * Return the link parameters.
+     * 
+     * @return Link parameters as passed to the constructor.
+     */
+    inline VirtualWireParams const & getParams () const
+    {
+        return m_params;
+    }
+
+    /**
+     * A port (network adapter) attached to a @ref VirtualWire.
+     */
+    class Port :
+        private NonCopyable<Port>
+    {
+        friend class VirtualWire;
+
+        struct QueueEntry {
+            TimeType tx_end_time;
+            TimeType deliver_time;
+            std::size_t len;
+        };
+
+    public:
+        /**
+         * Type of callback called when a frame is received.
+         * 
+         * The frame data is only valid during the call. The handler may send frames
+         * but must not destruct any port of the wire.
+         */
+        using FrameReceivedHandler = Function<void(IpBufRef frame)>;
+
+        /**
+         * Construct the port and attach it to the wire.
+         * 
+         * @param platform The platform facade.
+         * @param wire The wire, which must outlive this port.
+         * @param handler Callback for received frames (must not be null).
+         */
+        Port (Platform platform, VirtualWire &wire, FrameReceivedHandler handler) :
+            m_wire(wire),
+            m_handler(handler),
+            m_timer(platform, AIPSTACK_BIND_MEMBER_TN(&Port::timerHandler, this)),
+            m_queue(new QueueEntry[wire.m_params.queue_depth]),
+            m_buffer(new char[wire.m_params.queue_depth * wire.m_params.eth_mtu]),
+            m_capacity(wire.m_params.queue_depth),
+            m_queue_start(0),
+            m_queue_count(0),
+            m_num_waiting(0),
+            m_delivering(false),
+            m_tx_free_time(platform.getTime()),
+            m_tx_frac_ticks(0.0)
+        {
+            m_wire.m_ports.append(*this);
+        }
+
+        /**
+         * Detach the port from the wire, discarding any queued frames.
+         */
+        ~Port ()
+        {
+            m_wire.m_ports.remove(*this);
+        }
+
+        /**
+         * Return the platform facade.
+         * 
+         * @return The platform facade passed to the constructor.
+         */
+        inline Platform platform () const
+        {
+            return m_timer.platform();
+        }
+
+        /**
+         * Return the maximum frame size.
+         * 
+         * @return @ref VirtualWireParams::eth_mtu.
+         */
+        inline std::size_t getMtu () const
+        {
+            return m_wire.m_params.eth_mtu;
+        }
+
+        /**
+         * Return the port counters.
+         * 
+         * @return Counters for frames sent through this port.
+         */
+        inline VirtualWireStats const & getStats () const
+        {
+            return m_stats;
+        }
+
+        /**
+         * Queue a frame for transmission to the other ports.
+         * 
+         * @param frame Frame to send; it is copied. Its size must not exceed
+         *        @ref getMtu (this is an assert).
+         * @return Success or @ref IpErr::OutputBufferFull.
+         */
+        IpErr sendFrame (IpBufRef frame)
+        {
+            VirtualWireParams const &params = m_wire.m_params;
+            AIPSTACK_ASSERT(frame.tot_len <= params.eth_mtu);
+
+            TimeType now = m_timer.platform().getTime();
+
+            // Only frames which have not been fully transmitted count against
+            // the queue depth.
+            updateWaiting(now);
+
+            if (m_num_waiting == params.queue_depth) {
+                m_stats.frames_dropped++;
+                return IpErr::OutputBufferFull;
+            }
+
+            // Make space for the frame, the storage also holds frames which
+            // are propagating.
+            if (m_queue_count == m_capacity) {
+                grow();
+            }
+
+            std::size_t index = (m_queue_start + m_queue_count) % m_capacity;
+            ipBufTakeBytes(frame, frame.tot_len, m_buffer.get() + index * params.eth_mtu);
+
+            // Transmission starts when the previous frame has been transmitted
+            // or now, whichever is later.
+            if (!Platform::timeGreaterOrEqual(m_tx_free_time, now)) {
+                m_tx_free_time = now;
+                m_tx_frac_ticks = 0.0;
+            }
+
+            if (params.bandwidth_bps > 0.0) {
+                m_tx_frac_ticks +=
+                    (8.0 * double(frame.tot_len) / params.bandwidth_bps) * Platform::TimeFreq;
+                TimeType whole_ticks = TimeType(m_tx_frac_ticks);
+                m_tx_free_time += whole_ticks;
+                m_tx_frac_ticks -= double(whole_ticks);
+            }
+
+            TimeType latency_ticks = TimeType(params.latency_sec * Platform::TimeFreq);
+
+            m_queue[index] = QueueEntry{
+                m_tx_free_time, m_tx_free_time + latency_ticks, frame.tot_len};
+            m_queue_count++;
+            m_num_waiting++;
+
+            m_stats.frames_sent++;
+            m_stats.bytes_sent += frame.tot_len;
+
+            if (m_queue_count == 1) {
+                m_timer.setAt(m_queue[index].deliver_time);
+            }
+
+            return IpErr::Success;
+        }
+
+    private:
+        // Stop counting frames whose transmission has completed as waiting.
+        // These are the oldest of the waiting frames, which are at the end.
+        void updateWaiting (TimeType now)
+        {
+            while (m_num_waiting > 0) {
+                std::size_t index =
+                    (m_queue_start + m_queue_count - m_num_waiting) % m_capacity;
+                if (!Platform::timeGreaterOrEqual(now, m_queue[index].tx_end_time)) {
+                    break;
+                }
+                m_num_waiting--;
+            }
+        }
+
+        // Double the capacity of the frame storage.
+        void grow ()
+        {
+            std::size_t eth_mtu = m_wire.m_params.eth_mtu;
+            std::size_t new_capacity = 2 * m_capacity;
+
+            std::unique_ptr<QueueEntry[]> new_queue(new QueueEntry[new_capacity]);
+            std::unique_ptr<char[]> new_buffer(new char[new_capacity * eth_mtu]);
+
+            for (std::size_t i = 0; i < m_queue_count; i++) {
+                std::size_t index = (m_queue_start + i) % m_capacity;
+                new_queue[i] = m_queue[index];
+                std::memcpy(new_buffer.get() + i * eth_mtu,
+                            m_buffer.get() + index * eth_mtu, m_queue[index].len);
+            }
+
+            // While delivering, the frame being delivered is in the buffer which
+            // was current when delivery started, keep that until it is done.
+            if (m_delivering && m_retired_buffer == nullptr) {
+                m_retired_buffer = std::move(m_buffer);
+            }
+
+            m_queue = std::move(new_queue);
+            m_buffer = std::move(new_buffer);
+            m_capacity = new_capacity;
+            m_queue_start = 0;
+        }
+
+        void timerHandler ()
+        {
+            VirtualWireParams const &params = m_wire.m_params;
+            TimeType now = m_timer.platform().getTime();
+
+            while (m_queue_count > 0) {
+                QueueEntry const &entry = m_queue[m_queue_start];
+
+                if (!Platform::timeGreaterOrEqual(now, entry.deliver_time)) {
+                    m_timer.setAt(entry.deliver_time);
+                    break;
+                }
+
+                // Deliver to the other ports. The entry stays queued meanwhile so
+                // that frames sent from the handlers cannot overwrite it.
+                std::size_t len = entry.len;
+                IpBufNode node{m_buffer.get() + m_queue_start * params.eth_mtu,
+                               len, nullptr};
+                m_delivering = true;
+                for (Port *port = m_wire.m_ports.first(); port != nullptr;
+                     port = m_wire.m_ports.next(*port))
+                {
+                    if (port != this) {
+                        port->m_handler(IpBufRef{&node, 0, len});
+                    }
+                }
+                m_delivering = false;
+                m_retired_buffer.reset();
+
+                m_queue_start = (m_queue_start + 1) % m_capacity;
+                m_queue_count--;
+                if (m_num_waiting > m_queue_count) {
+                    m_num_waiting = m_queue_count;
+                }
+            }
+        }
+
+    private:
+        LinkedListNode<PortLinkModel> m_list_node;
+        VirtualWire &m_wire;
+        FrameReceivedHandler m_handler;
+        typename Platform::Timer m_timer;
+        std::unique_ptr<QueueEntry[]> m_queue;
+        std::unique_ptr<char[]> m_buffer;
+        std::unique_ptr<char[]> m_retired_buffer;
+        std::size_t m_capacity;
+        std::size_t m_queue_start;
+        std::size_t m_queue_count;
+        std::size_t m_num_waiting;
+        bool m_delivering;
+        TimeType m_tx_free_time;
+        double m_tx_frac_ticks;
+        VirtualWireStats m_stats;
+    };
+
+private:
+    using PortList = LinkedList<
+        MemberAccessor<Port, LinkedListNode<PortLinkModel>, &Port::m_list_node>,
+        PortLinkModel, true>;
+
+private:
+    VirtualWireParams m_params;
+    StructureRaiiWrapper<PortList> m_ports;
+};
+
+/**
+ * Ethernet network interface attached to a @ref VirtualWire.
+ * 
+ * This combines a @ref VirtualWire::Port with an @ref EthIpIface, similar to how
+ * a hardware driver would. The link is always reported as up. Optionally, received
+ * frames can be passed through a @ref FrameImpairment stage before reaching the
+ * @ref EthIpIface (see @ref setRxImpairment).
+ * 
+ * @tparam StackArg Template parameter of @ref IpStack.
+ * @tparam TheEthIpIfaceService An instantiated @ref EthIpIfaceService.
+ */
+template<typename StackArg, typename TheEthIpIfaceService>
+class VirtualWireEthIface :
+    private NonCopyable<VirtualWireEthIface<StackArg, TheEthIpIfaceService>>
+{
+    using PlatformImpl = typename StackArg::PlatformImpl;
+    using Platform = PlatformFacade<PlatformImpl>;
+
+    AIPSTACK_MAKE_INSTANCE(TheEthIpIface, (TheEthIpIfaceService::template Compose<
+        PlatformImpl, StackArg>))
+
+public:
+    /**
+     * Construct the interface.
+     * 
+     * @param platform The platform facade.
+     * @param stack The IP stack.
+     * @param wire The wire to attach to.
+     * @param mac_addr MAC address of the interface.
+     */
+    VirtualWireEthIface (Platform platform, IpStack<StackArg> *stack,
+                         VirtualWire<PlatformImpl> &wire, MacAddr const &mac_addr)
+    :
+        m_port(platform, wire,
+            AIPSTACK_BIND_MEMBER_TN(&VirtualWireEthIface::frameReceived, this)),
+        m_mac_addr(mac_addr),
+        m_eth_iface(platform, stack, EthIfaceDriverParams{
+            /*eth_mtu=*/ m_port.getMtu(),
+            /*mac_addr=*/ &m_mac_addr,
+            AIPSTACK_BIND_MEMBER_TN(&VirtualWireEthIface::driverSendFrame, this),
+            AIPSTACK_BIND_MEMBER_TN(&VirtualWireEthIface::driverGetEthState, this)
+        })
+    {}
+
+    /**
+     * Return the IP interface.
+     * 
+     * @return The @ref IpIface of the @ref EthIpIface.
+     */
+    inline IpIface<StackArg> & iface ()
+    {
+        return m_eth_iface.iface();
+    }
+
+    /**
+     * Return the wire port.
+     * 
+     * @return The @ref VirtualWire::Port used by this interface.
+     */
+    inline typename VirtualWire<PlatformImpl>::Port & port ()
+    {
+        return m_port;
+    }
+
+    /**
+     * Start passing received frames through a new @ref FrameImpairment stage.
+     * 
+     * Any previous impairment stage is destructed, discarding frames held by it.
+     * 
+     * @param params Impairment parameters.
+     */
+    void setRxImpairment (FrameImpairmentParams const &params)
+    {
+        m_rx_impairment.reset();
+        m_rx_impairment.reset(new FrameImpairment<PlatformImpl>(
+            m_port.platform(), params,
+            AIPSTACK_BIND_MEMBER_TN(&VirtualWireEthIface::impairedFrameReceived, this)));
+    }
+
+    /**
+     * Stop using an impairment stage for received frames.
+     * 
+     * Frames held by the stage are discarded.
+     */
+    void clearRxImpairment ()
+    {
+        m_rx_impairment.reset();
+    }
+
+    /**
+     * Return the receive impairment stage.
+     * 
+     * @return The stage created by @ref setRxImpairment, or null if none.
+     */
+    inline FrameImpairment<PlatformImpl> * getRxImpairment ()
+    {
+        return m_rx_impairment.get();
+    }
+
+private:
+    void frameReceived (IpBufRef frame)
+    {
+        if (m_rx_impairment != nullptr) {
+            m_rx_impairment->inputFrame(frame);
+        } else {
+            m_eth_iface.recvFrame(frame);
+        }
+    }
+
+    void impairedFrameReceived (IpBufRef frame)
+    {
+        m_eth_iface.recvFrame(frame);
+    }
+
+    IpErr driverSendFrame (IpBufRef frame)
+    {
+        return m_port.sendFrame(frame);
+    }
+
+    EthIfaceState driverGetEthState ()
+    {
+        EthIfaceState state = {};
+        state.link_up = true;
+        return state;
+    }
+
+private:
+    typename VirtualWire<PlatformImpl>::Port m_port;
+    MacAddr m_mac_addr;
+    TheEthIpIface m_eth_iface;
+    std::unique_ptr<FrameImpairment<PlatformImpl>> m_rx_impairment;
+};
+
+/** @} */
+
+}
+
+#endif
@@ -34,12 +34,13 @@
 #include <aipstack/misc/Hints.h>
 #include <aipstack/misc/Assert.h>
 #include <aipstack/misc/Use.h>
-#include <aipstack/misc/IntRange.h>
 #include <aipstack/misc/MinMax.h>
 #include <aipstack/misc/ResourceArray.h>
 #include <aipstack/misc/NonCopyable.h>
 #include <aipstack/misc/OneOf.h>
+#include <aipstack/misc/Pragma.h>
 #include <aipstack/misc/EnumUtils.h>
+#include <aipstack/misc/SipHash.h>
 #include <aipstack/structure/LinkedList.h>
 #include <aipstack/structure/LinkModel.h>
 #include <aipstack/structure/StructureRaiiWrapper.h>
@@ -51,17 +52,23 @@
 #include <aipstack/proto/Tcp4Proto.h>
 #include <aipstack/ip/IpAddr.h>
 #include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpEphemeralPortAllocator.h>
 #include <aipstack/platform/PlatformFacade.h>
 #include <aipstack/tcp/TcpState.h>
 #include <aipstack/tcp/TcpSeqNum.h>
 #include <aipstack/tcp/TcpPcbFlags.h>
 #include <aipstack/tcp/TcpOosBuffer.h>
+#include <aipstack/tcp/TcpSegTimes.h>
+#include <aipstack/tcp/TcpSegSamples.h>
+#include <aipstack/tcp/TcpWindowedMax.h>
 #include <aipstack/tcp/TcpApi.h>
 #include <aipstack/tcp/TcpListener.h>
 #include <aipstack/tcp/TcpConnection.h>
 #include <aipstack/tcp/TcpMultiTimer.h>
 #include <aipstack/tcp/TcpPcbKey.h>
+#include <aipstack/tcp/TcpTimeWaitTable.h>
 #include <aipstack/tcp/TcpOptions.h>
+#include <aipstack/tcp/TcpFastOpen.h>
 #include <aipstack/tcp/IpTcpProto_constants.h>
 #include <aipstack/tcp/IpTcpProto_input.h>
 #include <aipstack/tcp/IpTcpProto_output.h>
@@ -77,15 +84,22 @@ class IpTcpProto :
     private TcpApi<Arg>
 {
     AIPSTACK_USE_VALS(Arg::Params, (TcpTTL, NumTcpPcbs, NumOosSegs,
-        EphemeralPortFirst, EphemeralPortLast, LinkWithArrayIndices))
-    AIPSTACK_USE_TYPES(Arg::Params, (PcbIndexService))
+        EphemeralPortFirst, EphemeralPortLast, LinkWithArrayIndices, NumTimeWaitEntries,
+        NumFastOpenCookies, NumRackSegTimes, EnableEcn, EcnDctcp,
+        EnablePlpmtud, InitialCwndSegments, EnableHyStart, EnableBbr))
+    AIPSTACK_USE_TYPES(Arg::Params, (PcbIndexService, PcbArrayService))
     AIPSTACK_USE_TYPES(Arg, (PlatformImpl, StackArg))
     
     using Platform = PlatformFacade<PlatformImpl>;
     AIPSTACK_USE_TYPE(Platform, TimeType)
     
     static_assert(NumTcpPcbs > 0);
-    static_assert(NumOosSegs > 0 && NumOosSegs < 16);
+    static_assert(NumTimeWaitEntries > 0);
+    static_assert(NumFastOpenCookies >= 0);
+    static_assert(NumRackSegTimes > 0);
+    static_assert(EnableEcn || !EcnDctcp);
+    static_assert(InitialCwndSegments >= 1 && InitialCwndSegments <= 255);
+    static_assert(NumOosSegs > 0);
     static_assert(EphemeralPortFirst > 0);
     static_assert(EphemeralPortFirst <= EphemeralPortLast);
     
@@ -100,26 +114,60 @@ class IpTcpProto :
     using Input = IpTcpProto_input<Arg>;
     using Output = IpTcpProto_output<Arg>;
     
-    AIPSTACK_USE_TYPES(Constants, (RttType))
+    AIPSTACK_USE_TYPES(Constants, (RttType, DrTimeType))
     
     struct TcpPcb;
     
-    // Number of ephemeral ports.
-    inline static constexpr PortNum NumEphemeralPorts =
-        EphemeralPortLast - EphemeralPortFirst + 1;
-    
     // Unsigned integer type usable as an index for the PCBs array.
     // We use the largest value of that type as null (which cannot
     // be a valid PCB index).
     using PcbIndexType = ChooseIntForMax<NumTcpPcbs, false>;
     inline static constexpr PcbIndexType PcbIndexNull = PcbIndexType(-1);
     
+    // Whether the PCB array is created with fewer than NumTcpPcbs PCBs and
+    // grown as needed (PcbArrayService given), or is a static array.
+    inline static constexpr bool GrowablePcbs = !std::is_void_v<PcbArrayService>;
+    
+    struct StaticPcbArrayService {
+        template<typename Elem, std::size_t MaxSize>
+        using Array = ResourceArray<Elem, MaxSize>;
+    };
+    
+    using PcbArray = typename std::conditional_t<GrowablePcbs,
+        PcbArrayService, StaticPcbArrayService>::template Array<TcpPcb, NumTcpPcbs>;
+    
     // Instantiate the out-of-sequence buffering.
     using OosBufferService = TcpOosBufferService<
         TcpOosBufferServiceOptions::NumOosSegs::Is<NumOosSegs>
     >;
     AIPSTACK_MAKE_INSTANCE(OosBuffer, (OosBufferService))
     
+    // Delivery rate snapshot recorded with each sampled transmission for BBR
+    // (see IpTcpProto_output::pcb_bbr_rate_sample), with the transmit time in
+    // delivery rate time units.
+    struct RateSegInfo {
+        TcpSeqInt delivered;
+        DrTimeType sent_time;
+        DrTimeType delivered_time;
+        DrTimeType first_sent_time;
+        bool app_limited;
+        bool retransmitted;
+    };
+    
+    using SegInfo = std::conditional_t<EnableBbr, RateSegInfo, TcpSegSamplesNoInfo>;
+    
+    // Transmit times of outstanding data for RACK loss detection.
+    using SegTimes = TcpSegTimes<RttType, NumRackSegTimes>;
+    
+    // Exact transmit times of sampled segments for the RTT samples of
+    // HyStart++, along with the delivery rate snapshots for BBR. These are
+    // not needed without either.
+    using SegSamples = TcpSegSamples<RttType,
+        (EnableHyStart || EnableBbr) ? Constants::NumSegSamples : 1, SegInfo>;
+    
+    // Windowed maximum of BBR bandwidth samples over rounds.
+    using BwFilter = TcpWindowedMax<std::uint32_t, std::uint16_t>;
+    
     struct PcbLinkModel;
     
     // Instantiate the PCB index.
@@ -135,6 +183,10 @@ class IpTcpProto :
     using Listener = TcpListener<Arg>;
     using Connection = TcpConnection<Arg>;
     
+    // Table of connections in TIME_WAIT, which do not occupy a PCB.
+    using TimeWaitTable = TcpTimeWaitTable<PlatformImpl, PcbIndexService, NumTimeWaitEntries>;
+    using TimeWaitEntry = typename TimeWaitTable::Entry;
+    
     // These TcpPcb fields are injected into TcpMultiTimer to fill up what
     // would otherwise be holes in the layout, for better memory use.
     struct MultiTimerUserData {
@@ -143,24 +195,37 @@ class IpTcpProto :
         // In the SYN_SENT state this is set based on the interface MTU and
         // the calculation is completed at the transition to ESTABLISHED.
         std::uint16_t base_snd_mss;
+        
+        // Additional flags (see comments in TcpPcbExtFlags).
+        std::uint8_t ext_flags;
     };
     
     /**
      * Timers:
-     * AbrtTimer: for aborting PCB (TIME_WAIT, abandonment)
+     * AbrtTimer: for aborting PCB (SYN timeouts, abandonment)
      * OutputTimer: for pcb_output after send buffer extension
      * RtxTimer: for retransmission, window probe and cwnd idle reset
+     * TlpTimer: for tail loss probe and RACK reordering timeout
+     * SentTimer: for deferred reporting of sent data (send low watermark)
      */
     struct AbrtTimer {};
     struct OutputTimer {};
     struct RtxTimer {};
-    using PcbMultiTimer = TcpMultiTimer<
-        PlatformImpl, TcpPcb, MultiTimerUserData, AbrtTimer, OutputTimer, RtxTimer>;
+    struct TlpTimer {};
+    struct SentTimer {};
+    using PcbMultiTimer = TcpMultiTimer<PlatformImpl, TcpPcb, MultiTimerUserData,
+        AbrtTimer, OutputTimer, RtxTimer, TlpTimer, SentTimer>;
     
     /**
      * A TCP Protocol Control Block.
      * These are maintained internally within the stack and may
      * survive deinit/reset of an associated Connection object.
+     * 
+     * The layout is arranged so that the fields used when processing
+     * each segment are contiguous: the state and times at the end of
+     * PcbMultiTimer, the key, and the members up to (excluding)
+     * unrefed_list_node. Members used only at setup/teardown go after
+     * that. This is checked by static asserts following the definition.
      */
     struct TcpPcb final :
         // Send retry request (inherited for efficiency).
@@ -189,16 +254,9 @@ class IpTcpProto :
             AIPSTACK_ASSERT(con == nullptr);
         }
         
-        // Node for the PCB index.
+        // Node for the PCB index (follows the key since lookups use both).
         typename PcbIndex::Node index_hook;
         
-        // Node for the unreferenced PCBs list.
-        // The function pcb_is_in_unreferenced_list specifies exactly when
-        // a PCB is suposed to be in the unreferenced list. The only
-        // exception to this is while pcb_unlink_con is during the callback
-        // pcb_unlink_con-->pcb_aborted-->connectionAborted.
-        LinkedListNode<PcbLinkModel> unrefed_list_node;
-        
         // Pointer back to IpTcpProto.
         IpTcpProto *tcp;    
         
@@ -250,6 +308,15 @@ class IpTcpProto :
         std::uint32_t snd_wnd_shift : 4;
         std::uint32_t rcv_wnd_shift : 4;
         
+        // Cold fields follow, these are not used for each segment.
+        
+        // Node for the unreferenced PCBs list.
+        // The function pcb_is_in_unreferenced_list specifies exactly when
+        // a PCB is suposed to be in the unreferenced list. The only
+        // exception to this is while pcb_unlink_con is during the callback
+        // pcb_unlink_con-->pcb_aborted-->connectionAborted.
+        LinkedListNode<PcbLinkModel> unrefed_list_node;
+        
         // Convenience functions for flags.
         inline bool hasFlag (TcpPcbFlags flag) const {
             return (TcpPcbFlags(flags) & flag) != Enum0;
@@ -261,6 +328,16 @@ class IpTcpProto :
             flags = AsUnderlying(TcpPcbFlags(flags) & ~flag);
         }
         
+        inline bool hasFlag (TcpPcbExtFlags flag) const {
+            return (TcpPcbExtFlags(this->ext_flags) & flag) != Enum0;
+        }
+        inline void setFlag (TcpPcbExtFlags flag) {
+            this->ext_flags = AsUnderlying(TcpPcbExtFlags(this->ext_flags) | flag);
+        }
+        inline void clearFlag (TcpPcbExtFlags flag) {
+            this->ext_flags = AsUnderlying(TcpPcbExtFlags(this->ext_flags) & ~flag);
+        }
+        
         // Check if a flag is set and clear it.
         inline bool hasAndClearFlag (TcpPcbFlags flag)
         {
@@ -320,12 +397,35 @@ class IpTcpProto :
             Output::pcb_rtx_timer_handler(this);
         }
         
+        inline void timerExpired (TlpTimer)
+        {
+            Output::pcb_tlp_timer_handler(this);
+        }
+        
+        inline void timerExpired (SentTimer)
+        {
+            Input::pcb_sent_timer_handler(this);
+        }
+        
         // Send retry callback.
         void retrySending () override final {
             Output::pcb_send_retry(this);
         }
     };
     
+    // Layout checks for TcpPcb (see its description). The bases precede the
+    // members, and the fields used for each segment, from MultiTimerUserData at
+    // the end of PcbMultiTimer up to the first cold member, fit within two cache
+    // lines. TcpPcb is not standard-layout so offsetof is only conditionally
+    // supported; GCC and Clang support it here but warn.
+    AIPSTACK_GCC_DIAGNOSTIC_START("GCC diagnostic ignored \"-Winvalid-offsetof\"")
+    static_assert(offsetof(TcpPcb, index_hook) >= sizeof(IpSendRetryRequest) +
+                  sizeof(PcbMultiTimer) + sizeof(TcpPcbKey));
+    static_assert(offsetof(TcpPcb, unrefed_list_node) - offsetof(TcpPcb, index_hook) +
+                  sizeof(TcpPcbKey) + sizeof(MultiTimerUserData)
+                  <= 2 * Constants::CacheLineSize);
+    AIPSTACK_GCC_DIAGNOSTIC_END
+    
     // Define the hook accessor for the PCB index.
     struct PcbIndexAccessor : public MemberAccessor<
         TcpPcb, typename PcbIndex::Node, &TcpPcb::index_hook> {};
@@ -339,10 +439,16 @@ public:
     IpTcpProto (IpProtocolHandlerArgs<StackArg> args) :
         m_stack(args.stack),
         m_current_pcb(nullptr),
-        m_next_ephemeral_port(EphemeralPortFirst),
+        m_timewait_table(args.platform, Constants::TimeWaitTimeTicks),
         m_pcbs(ResourceArrayInitSame(), args.platform, this)
     {
         AIPSTACK_ASSERT(args.stack != nullptr);
+        
+        m_ephemeral_ports.init();
+        
+        // There is no usable default Fast Open key, listeners cannot enable Fast
+        // Open until the application sets one using TcpApi::setFastOpenKey.
+        m_fast_open_key_set = false;
     }
     
     /**
@@ -381,6 +487,16 @@ private:
     
     TcpPcb * allocate_pcb ()
     {
+        // If the PCB array can grow, do that before resorting to reusing
+        // an unreferenced PCB which is not closed.
+        if constexpr (GrowablePcbs) {
+            if (m_unrefed_pcbs_list.isEmpty() ||
+                (*m_unrefed_pcbs_list.lastNotEmpty(*this)).state() != TcpStates::CLOSED)
+            {
+                grow_pcbs(m_pcbs.size() + PcbArrayService::GrowSize);
+            }
+        }
+        
         // No PCB available?
         if (m_unrefed_pcbs_list.isEmpty()) {
             return nullptr;
@@ -400,11 +516,44 @@ private:
         return pcb;
     }
     
+    // Construct more PCBs (if the PCB array can grow). The new PCBs are moved to
+    // the end of the unreferenced list so that they are used first.
+    bool grow_pcbs (std::size_t num_pcbs)
+    {
+        if constexpr (GrowablePcbs) {
+            std::size_t old_size = m_pcbs.size();
+            if (!m_pcbs.grow(num_pcbs, platform(), this)) {
+                return false;
+            }
+            
+            for (std::size_t i = old_size; i < m_pcbs.size(); i++) {
+                TcpPcb &pcb = m_pcbs[i];
+                m_unrefed_pcbs_list.remove({pcb, *this}, *this);
+                m_unrefed_pcbs_list.append({pcb, *this}, *this);
+            }
+            
+            return m_pcbs.size() >= num_pcbs;
+        } else {
+            return num_pcbs <= NumTcpPcbs;
+        }
+    }
+    
+    inline int get_num_pcbs () const
+    {
+        if constexpr (GrowablePcbs) {
+            return int(m_pcbs.size());
+        } else {
+            return NumTcpPcbs;
+        }
+    }
+    
     void pcb_assert_closed (TcpPcb *pcb)
     {
         AIPSTACK_ASSERT(!pcb->tim(AbrtTimer()).isSet());
         AIPSTACK_ASSERT(!pcb->tim(OutputTimer()).isSet());
         AIPSTACK_ASSERT(!pcb->tim(RtxTimer()).isSet());
+        AIPSTACK_ASSERT(!pcb->tim(TlpTimer()).isSet());
+        AIPSTACK_ASSERT(!pcb->tim(SentTimer()).isSet());
         AIPSTACK_ASSERT(!pcb->IpSendRetryRequest::isActive());
         AIPSTACK_ASSERT(pcb->tcp == this);
         AIPSTACK_ASSERT(pcb->state() == TcpStates::CLOSED);
@@ -447,12 +596,8 @@ private:
             tcp->m_current_pcb = nullptr;
         }
         
-        // Remove the PCB from the index in which it is.
-        if (pcb->state() == TcpStates::TIME_WAIT) {
-            tcp->m_pcb_index_timewait.removeEntry({*pcb, *tcp}, *tcp);
-        } else {
-            tcp->m_pcb_index_active.removeEntry({*pcb, *tcp}, *tcp);
-        }
+        // Remove the PCB from the index.
+        tcp->m_pcb_index_active.removeEntry({*pcb, *tcp}, *tcp);
         
         // Make sure the PCB is at the end of the unreferenced list.
         if (pcb != tcp->m_unrefed_pcbs_list.lastNotEmpty(*tcp)) {
@@ -468,40 +613,36 @@ private:
         tcp->pcb_assert_closed(pcb);
     }
     
-    // NOTE: doDelayedTimerUpdate must be called after return.
-    // We are okay because this is only called from pcb_input.
+    // Move the connection to the TIME_WAIT table and close the PCB. The PCB
+    // is aborted, so the caller must stop input processing after return.
     static void pcb_go_to_time_wait (TcpPcb *pcb)
     {
         AIPSTACK_ASSERT(pcb->state() !=
             OneOf(TcpStates::CLOSED, TcpStates::SYN_RCVD, TcpStates::TIME_WAIT));
+        AIPSTACK_ASSERT(pcb->tcp->m_current_pcb == pcb);
         
-        // Disassociate any Connection. This will call the
-        // connectionAborted callback if we do have a Connection.
-        pcb_unlink_con(pcb, false);
-        
-        // Set snd_nxt to snd_una in order to not accept any more acknowledgements.
-        // This is currently not necessary since we only enter TIME_WAIT after
-        // having received a FIN, but in the future we might do some non-standard
-        // transitions where this is not the case.
-        pcb->snd_nxt = pcb->snd_una;
-        
-        // Change state.
-        pcb->setState(TcpStates::TIME_WAIT);
-        
-        // Move the PCB from the active index to the time-wait index.
         IpTcpProto *tcp = pcb->tcp;
-        tcp->m_pcb_index_active.removeEntry({*pcb, *tcp}, *tcp);
-        tcp->m_pcb_index_timewait.addEntry({*pcb, *tcp}, *tcp);
-        
-        // Stop timers due to asserts in their handlers.
-        pcb->tim(OutputTimer()).unset();
-        pcb->tim(RtxTimer()).unset();
         
-        // Clear the OutPending flag due to its preconditions.
-        pcb->clearFlag(TcpPcbFlags::OutPending);
-        
-        // Start the TIME_WAIT timeout.
-        pcb->tim(AbrtTimer()).setAfter(Constants::TimeWaitTimeTicks);
+        // Save what is needed to respond to segments of this connection.
+        // Using snd_una instead of snd_nxt means that no more acknowledgements
+        // are accepted. This is currently not different since we only enter
+        // TIME_WAIT after everything has been acknowledged.
+        TcpPcbKey key = *pcb;
+        TcpSeqNum rcv_nxt = pcb->rcv_nxt;
+        TcpSeqNum snd_nxt = pcb->snd_una;
+        std::uint16_t hdr_wnd = Input::pcb_ann_wnd(pcb);
+        bool ack_pending = pcb->hasFlag(TcpPcbFlags::AckPending);
+        
+        tcp->m_timewait_table.add(key, rcv_nxt, snd_nxt, hdr_wnd);
+        
+        // Close the PCB, so that it is available for reuse immediately. This
+        // will call the connectionAborted callback if we do have a Connection.
+        pcb_abort(pcb, false);
+        
+        // Send any ACK that was pending (normally the ACK for the FIN).
+        if (ack_pending) {
+            Output::send_ack(tcp, key, snd_nxt, rcv_nxt, hdr_wnd);
+        }
     }
     
     // NOTE: doDelayedTimerUpdate must be called after return.
@@ -516,6 +657,7 @@ private:
         // Stop these timers due to asserts in their handlers.
         pcb->tim(OutputTimer()).unset();
         pcb->tim(RtxTimer()).unset();
+        pcb->tim(TlpTimer()).unset();
         
         // Clear the OutPending flag due to its preconditions.
         pcb->clearFlag(TcpPcbFlags::OutPending);
@@ -598,6 +740,9 @@ private:
         // Clear RcvWndUpd flag since this flag must imply con != nullptr.
         pcb->clearFlag(TcpPcbFlags::RcvWndUpd);
         
+        // Stop the SentTimer since there is no longer anyone to report to.
+        pcb->tim(SentTimer()).unset();
+        
         // Abort if in SYN_SENT state or some data is queued or some data was received but
         // not processed by the application. The pcb_abort() will decide whether to send an
         // RST (no RST in SYN_SENT, RST otherwise).
@@ -735,6 +880,7 @@ private:
         pcb->setState(TcpStates::SYN_SENT);
         // WndScale to send the window scale option
         pcb->flags = AsUnderlying(TcpPcbFlags::WndScale);
+        pcb->ext_flags = 0;
         pcb->con = con;
         pcb->local_addr = local_addr;
         pcb->remote_addr = remote_addr;
@@ -751,6 +897,20 @@ private:
         pcb->snd_wnd_shift = 0;
         pcb->rcv_wnd_shift = Constants::RcvWndShift;
         
+        // With Fast Open, if we have a cookie for the server, the SYN is deferred
+        // so that it can carry the initial data. It is sent when the application
+        // pushes data (pcb_fast_open_push) or else by the RtxTimer shortly.
+        bool defer_syn = false;
+        if (args.fast_open) {
+            pcb->setFlag(TcpPcbExtFlags::FastOpen);
+            defer_syn = m_fast_open_cache.find(remote_addr) != nullptr;
+        }
+        
+        // Request ECN in the SYN if enabled.
+        if (EnableEcn) {
+            pcb->setFlag(TcpPcbExtFlags::EcnOk);
+        }
+        
         // Add the PCB to the active index.
         m_pcb_index_active.addEntry({*pcb, *this}, *this);
         
@@ -758,12 +918,15 @@ private:
         pcb->tim(AbrtTimer()).setAfter(Constants::SynSentTimeoutTicks);
         
         // Start the retransmission timer.
-        pcb->tim(RtxTimer()).setAfter(Output::pcb_rto_time(pcb));
+        pcb->tim(RtxTimer()).setAfter(
+            defer_syn ? Constants::OutputTimerTicks : Output::pcb_rto_time(pcb));
         
         pcb->doDelayedTimerUpdate();
         
         // Send the SYN.
-        Output::pcb_send_syn(pcb);
+        if (!defer_syn) {
+            Output::pcb_send_syn(pcb);
+        }
         
         // Return the PCB.
         *out_pcb = pcb;
@@ -773,17 +936,14 @@ private:
     PortNum get_ephemeral_port (
         Ip4Addr local_addr, Ip4Addr remote_addr, PortNum remote_port)
     {
-        for ([[maybe_unused]] PortNum i : IntRange(NumEphemeralPorts)) {
-            PortNum port = m_next_ephemeral_port;
-            m_next_ephemeral_port = (port < EphemeralPortLast) ?
-                (port + 1) : EphemeralPortFirst;
-            
-            if (find_pcb({local_addr, remote_addr, port, remote_port}) == nullptr) {
-                return port;
-            }
-        }
-        
-        return 0;
+        // The allocator gives consecutive connections to the same destination
+        // fresh ports, so normally the first candidate is not in use by an active
+        // PCB or a TIME_WAIT entry, but both are checked.
+        return m_ephemeral_ports.allocate(local_addr, remote_addr, remote_port,
+            [&](PortNum port) {
+                TcpPcbKey key{local_addr, remote_addr, port, remote_port};
+                return find_pcb(key) == nullptr && m_timewait_table.find(key) == nullptr;
+            });
     }
     
     inline static bool pcb_is_in_unreferenced_list (TcpPcb *pcb)
@@ -802,20 +962,14 @@ private:
         }
     }
     
-    // Find a PCB by address tuple.
+    // Find a PCB by address tuple. Connections in TIME_WAIT are
+    // not found here since they are kept in m_timewait_table.
     TcpPcb * find_pcb (TcpPcbKey const &key)
     {
-        // Look in the active index first.
         TcpPcb *pcb = m_pcb_index_active.findEntry(key, *this);
         AIPSTACK_ASSERT(pcb == nullptr ||
             pcb->state() != OneOf(TcpStates::CLOSED, TcpStates::TIME_WAIT));
         
-        // If not found, look in the time-wait index.
-        if (AIPSTACK_UNLIKELY(pcb == nullptr)) {
-            pcb = m_pcb_index_timewait.findEntry(key, *this);
-            AIPSTACK_ASSERT(pcb == nullptr || pcb->state() == TcpStates::TIME_WAIT);
-        }
-        
         return pcb;
     }
     
@@ -871,24 +1025,37 @@ private:
     TcpPcb *m_current_pcb;
     IpBufRef m_received_opts_buf;
     TcpOptions m_received_opts;
-    PortNum m_next_ephemeral_port;
+    IpEphemeralPortAllocator<EphemeralPortFirst, EphemeralPortLast> m_ephemeral_ports;
     StructureRaiiWrapper<UnrefedPcbsList> m_unrefed_pcbs_list;
     StructureRaiiWrapper<typename PcbIndex::Index> m_pcb_index_active;
-    StructureRaiiWrapper<typename PcbIndex::Index> m_pcb_index_timewait;
-    ResourceArray<TcpPcb, NumTcpPcbs> m_pcbs;
+    TimeWaitTable m_timewait_table;
+    TcpFastOpenCookieGen m_fast_open_gen;
+    bool m_fast_open_key_set;
+    TcpFastOpenCookieCache<NumFastOpenCookies> m_fast_open_cache;
+    PcbArray m_pcbs;
     
     struct PcbArrayAccessor : public MemberAccessor<
-        IpTcpProto, ResourceArray<TcpPcb, NumTcpPcbs>, &IpTcpProto::m_pcbs> {};
+        IpTcpProto, PcbArray, &IpTcpProto::m_pcbs> {};
 };
 
 struct IpTcpProtoOptions {
     AIPSTACK_OPTION_DECL_VALUE(TcpTTL, std::uint8_t, 64)
     AIPSTACK_OPTION_DECL_VALUE(NumTcpPcbs, int, 32)
-    AIPSTACK_OPTION_DECL_VALUE(NumOosSegs, std::uint8_t, 4)
+    AIPSTACK_OPTION_DECL_VALUE(NumOosSegs, std::uint16_t, 4)
     AIPSTACK_OPTION_DECL_VALUE(EphemeralPortFirst, std::uint16_t, 49152)
     AIPSTACK_OPTION_DECL_VALUE(EphemeralPortLast, std::uint16_t, 65535)
     AIPSTACK_OPTION_DECL_TYPE(PcbIndexService, void)
     AIPSTACK_OPTION_DECL_VALUE(LinkWithArrayIndices, bool, true)
+    AIPSTACK_OPTION_DECL_VALUE(NumTimeWaitEntries, int, 128)
+    AIPSTACK_OPTION_DECL_TYPE(PcbArrayService, void)
+    AIPSTACK_OPTION_DECL_VALUE(NumFastOpenCookies, int, 8)
+    AIPSTACK_OPTION_DECL_VALUE(NumRackSegTimes, int, 4)
+    AIPSTACK_OPTION_DECL_VALUE(EnableEcn, bool, false)
+    AIPSTACK_OPTION_DECL_VALUE(EcnDctcp, bool, false)
+    AIPSTACK_OPTION_DECL_VALUE(EnablePlpmtud, bool, false)
+    AIPSTACK_OPTION_DECL_VALUE(InitialCwndSegments, int, 10)
+    AIPSTACK_OPTION_DECL_VALUE(EnableHyStart, bool, true)
+    AIPSTACK_OPTION_DECL_VALUE(EnableBbr, bool, false)
 };
 
 template<typename ...Options>
@@ -903,6 +1070,16 @@ class IpTcpProtoService {
     AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, EphemeralPortLast)
     AIPSTACK_OPTION_CONFIG_TYPE(IpTcpProtoOptions, PcbIndexService)
     AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, LinkWithArrayIndices)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, NumTimeWaitEntries)
+    AIPSTACK_OPTION_CONFIG_TYPE(IpTcpProtoOptions, PcbArrayService)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, NumFastOpenCookies)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, NumRackSegTimes)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, EnableEcn)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, EcnDctcp)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, EnablePlpmtud)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, InitialCwndSegments)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, EnableHyStart)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpTcpProtoOptions, EnableBbr)
     
 public:
     // This tells IpStack which IP protocol we receive packets for.
@@ -25,6 +25,7 @@
 #ifndef AIPSTACK_IP_TCP_PROTO_CONSTANTS_H
 #define AIPSTACK_IP_TCP_PROTO_CONSTANTS_H
 
+#include <cstddef>
 #include <cstdint>
 
 #include <aipstack/meta/BitsInInt.h>
@@ -67,6 +68,13 @@ public:
     // For intermediate RTT results we need a larger type.
     using RttNextType = std::uint32_t;
 
+    // Delivery rate samples for BBR use a finer granularity between 1us and 2us,
+    // since intervals shorter than the RTT time unit are common on fast paths.
+    // These times are stored in 32-bit variables, giving a range of over an hour.
+    inline static constexpr int DrTimeShift = BitsInFloat(1e-6 * Platform::TimeFreq);
+    static_assert(DrTimeShift <= RttShift);
+    using DrTimeType = std::uint32_t;
+
     // Don't allow the remote host to lower the MSS beyond this.
     // NOTE: pcb_calc_snd_mss_from_pmtu relies on this definition.
     inline static constexpr std::uint16_t MinAllowedMss =
@@ -76,12 +84,89 @@ public:
     // We disable fragmentation of TCP segments sent by us, due to PMTUD.
     inline static constexpr IpSendFlags TcpIpSendFlags = IpSendFlags::DontFragmentFlag;
     
+    // Path MTU to fall back to when PLPMTUD (RFC 8899) suspects a black hole,
+    // BASE_PLPMTU of RFC 8899 (the fallback after that is MinMTU).
+    inline static constexpr std::uint16_t PlpmtudBaseMtu = 1200;
+    
+    // Number of consecutive retransmission timeouts with full-sized segments
+    // after which PLPMTUD assumes that the path MTU has been black-holed.
+    inline static constexpr std::uint8_t PlpmtudBlackHoleRtos = 2;
+    
+    // PLPMTUD stops searching when the range of unprobed path MTUs is smaller.
+    inline static constexpr std::uint16_t PlpmtudMinProbeStep = 32;
+    
+    // HyStart++ (RFC 9406) parameters: the minimum number of RTT samples in a
+    // round, the bounds and divisor of the RTT increase threshold, the cwnd
+    // growth divisor in Conservative Slow Start and its number of rounds.
+    inline static constexpr std::uint8_t HyStartRttSamples = 8;
+    inline static constexpr RttType HyStartMinRttThresh = 0.004 * RttTimeFreq;
+    inline static constexpr RttType HyStartMaxRttThresh = 0.016 * RttTimeFreq;
+    inline static constexpr int HyStartMinRttDivisor = 8;
+    inline static constexpr int HyStartCssGrowthDivisor = 4;
+    inline static constexpr std::uint8_t HyStartCssRounds = 5;
+    
+    // Number of outstanding segments whose exact transmit times are kept for
+    // RTT and delivery rate samples (see TcpSegSamples). With a larger window,
+    // HyStart++ and BBR still get about this many samples per round.
+    inline static constexpr int NumSegSamples = HyStartRttSamples;
+    
+    // BBR gains are fixed-point with BbrGainBits fractional bits. Startup uses
+    // the high gain 2/ln(2) for pacing and cwnd, Drain paces with its inverse,
+    // ProbeBW cycles the pacing gain through BbrPacingGainCycle with a cwnd
+    // gain of 2.
+    inline static constexpr int BbrGainBits = 8;
+    inline static constexpr std::uint16_t BbrUnitGain = 1 << BbrGainBits;
+    inline static constexpr std::uint16_t BbrHighGain = BbrUnitGain * 2885 / 1000 + 1;
+    inline static constexpr std::uint16_t BbrDrainGain = BbrUnitGain * 1000 / 2885;
+    inline static constexpr std::uint16_t BbrCwndGain = 2 * BbrUnitGain;
+    inline static constexpr std::uint8_t BbrGainCycleLen = 8;
+    inline static constexpr std::uint16_t BbrPacingGainCycle[BbrGainCycleLen] = {
+        BbrUnitGain * 5 / 4, BbrUnitGain * 3 / 4, BbrUnitGain, BbrUnitGain,
+        BbrUnitGain, BbrUnitGain, BbrUnitGain, BbrUnitGain};
+    
+    // BBR bandwidth values are in bytes per RTT time unit (see RttTimeFreq),
+    // fixed-point with BbrBwBits fractional bits, though the samples are taken
+    // in delivery rate time units (see DrTimeShift). The maximum bandwidth is
+    // taken over BbrBwFilterRounds rounds.
+    inline static constexpr int BbrBwBits = 8;
+    inline static constexpr std::uint16_t BbrBwFilterRounds = 10;
+    
+    // Startup ends when the bandwidth has not grown by BbrFullBwGain in
+    // BbrFullBwRounds rounds.
+    inline static constexpr std::uint16_t BbrFullBwGain = BbrUnitGain * 5 / 4;
+    inline static constexpr std::uint8_t BbrFullBwRounds = 3;
+    
+    // BBR enters ProbeRTT when the minimum RTT has not been seen for
+    // BbrMinRttWindow, and stays there for at least BbrProbeRttTime.
+    inline static constexpr RttType BbrMinRttWindow = 10.0 * RttTimeFreq;
+    inline static constexpr RttType BbrProbeRttTime = 0.2 * RttTimeFreq;
+    
+    // Minimum BBR cwnd in segments (also the cwnd in ProbeRTT), and segments
+    // added to the cwnd target to allow for delayed and stretched ACKs.
+    inline static constexpr int BbrMinCwndSegs = 4;
+    inline static constexpr int BbrCwndQuantumSegs = 3;
+    
+    // How far sending may get ahead of the BBR pacing rate. Up to this much
+    // data is sent at once, which limits the number of OutputTimer events.
+    inline static constexpr TimeType BbrPacingBurstTicks = 0.001 * Platform::TimeFreq;
+    
+    // Fixed-point precision of the DCTCP congestion estimate alpha (RFC 8257),
+    // and the shift which gives the estimation gain g=1/16.
+    inline static constexpr int DctcpAlphaBits = 10;
+    inline static constexpr int DctcpGainShift = 4;
+    
     // Maximum theoreticaly possible send and receive window.
     inline static constexpr TcpSeqInt MaxWindow = 0x3fffffff;
     
     // Default window update threshold (overridable by setWindowUpdateThreshold).
     inline static constexpr TcpSeqInt DefaultWndAnnThreshold = 2700;
     
+    // Receive buffer auto-tuning: minimum measurement interval (used when the
+    // RTT estimate is smaller), and headroom in segments added to twice the
+    // amount of data received in one measurement interval.
+    inline static constexpr RttType RcvAutoTuneMinInterval = 0.002 * RttTimeFreq;
+    inline static constexpr TcpSeqInt RcvAutoTuneSlackSegs = 4;
+    
     // How old at most an ACK may be to be considered acceptable (MAX.SND.WND in RFC 5961).
     inline static constexpr TcpSeqInt MaxAckBefore = 0xFFFF;
     
@@ -116,6 +201,17 @@ public:
     inline static constexpr RttType MaxRtxTime =
         MinValue(double(TypeMax<RttType>), 60. * RttTimeFreq);
     
+    // Minimum tail loss probe timeout (RFC 8985 section 7.2).
+    inline static constexpr RttType MinTlpTime               = 0.01 * RttTimeFreq;
+    
+    // Worst case delayed ACK time added to the probe timeout when only one
+    // segment is outstanding (WCDelAckT in RFC 8985).
+    inline static constexpr RttType TlpDelAckTime            = 0.2 * RttTimeFreq;
+    
+    // Minimum time after which RACK considers a segment lost if a later one was
+    // delivered, to avoid reacting to any reordering when the RTT is very low.
+    inline static constexpr RttType MinRackLossTime          = 0.002 * RttTimeFreq;
+    
     // Number of duplicate ACKs to trigger fast retransmit/recovery.
     inline static constexpr std::uint8_t FastRtxDupAcks = 3;
     
@@ -133,6 +229,10 @@ public:
     // Minimum amount to extend the receive window when a PCB is
     // abandoned before the FIN has been received.
     inline static constexpr TcpSeqInt MinAbandonRcvWndIncr = TypeMax<std::uint16_t>;
+    
+    // Cache line size assumed when checking that the fields of TcpPcb and
+    // TcpConnection used for each segment are packed together.
+    inline static constexpr std::size_t CacheLineSize = 64;
 };
 
 }
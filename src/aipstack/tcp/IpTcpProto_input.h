@@ -46,6 +46,7 @@
 #include <aipstack/tcp/TcpMiscUtils.h>
 #include <aipstack/tcp/TcpState.h>
 #include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/tcp/TcpPcbKey.h>
 #include <aipstack/tcp/TcpPcbFlags.h>
 #include <aipstack/tcp/TcpOptions.h>
 
@@ -61,7 +62,8 @@ class IpTcpProto_input
     using TcpProto = IpTcpProto<Arg>;
     
     AIPSTACK_USE_TYPES(TcpProto, (Listener, Connection, TcpPcb, Output, Constants,
-                                  AbrtTimer, RtxTimer, OutputTimer, StackArg))
+                                  AbrtTimer, RtxTimer, OutputTimer, SentTimer,
+                                  StackArg, TimeWaitEntry))
     AIPSTACK_USE_VALS(TcpProto, (pcb_aborted_in_callback))
     
 public:
@@ -88,6 +90,7 @@ public:
         tcp_meta.ack_num     = tcp_header.get(Tcp4Header::AckNum());
         tcp_meta.flags       = tcp_header.get(Tcp4Header::OffsetFlags());
         tcp_meta.window_size = tcp_header.get(Tcp4Header::WindowSize());
+        tcp_meta.ecn_ce      = ip_info.ecn == Ip4Ecn::Ce;
         
         // Check TCP checksum.
         IpChksumAccumulator chksum_accum;
@@ -122,13 +125,24 @@ public:
         tcp_data = ipBufSkipBytes(tcp_data, opts_len);
         
         // Try to handle using a PCB.
-        TcpPcb *pcb = tcp->find_pcb({ip_info.dst_addr, ip_info.src_addr,
-                                     tcp_meta.local_port, tcp_meta.remote_port});
+        TcpPcbKey key{ip_info.dst_addr, ip_info.src_addr,
+                      tcp_meta.local_port, tcp_meta.remote_port};
+        TcpPcb *pcb = tcp->find_pcb(key);
         if (AIPSTACK_LIKELY(pcb != nullptr)) {
             pcb_input(tcp, pcb, tcp_meta, tcp_data);
             return;
         }
         
+        // Try to handle using a TIME_WAIT entry. If this is a SYN which
+        // may start a new connection, the entry is removed and we continue
+        // to look for a listener.
+        TimeWaitEntry *tw_entry = tcp->m_timewait_table.find(key);
+        if (AIPSTACK_UNLIKELY(tw_entry != nullptr)) {
+            if (!timewait_input(tcp, *tw_entry, tcp_meta, tcp_data.tot_len)) {
+                return;
+            }
+        }
+        
         // Sanity check source address - reject broadcast addresses.
         // We do this after looking up the PCB for performance, since
         // the PCBs already have sanity checked addresses. There is a
@@ -142,7 +156,7 @@ public:
         // Try to handle using a listener.
         Listener *lis = tcp->find_listener_for_rx(ip_info.dst_addr, tcp_meta.local_port);
         if (lis != nullptr) {
-            return listen_input(lis, ip_info, tcp_meta, tcp_data.tot_len);
+            return listen_input(lis, ip_info, tcp_meta, tcp_data);
         }
         
         // Reply with RST, unless this is an RST.
@@ -296,6 +310,31 @@ public:
         }
     }
     
+    // Arrange for the Connection to report acknowledged data from the SentTimer,
+    // which happens after the current input processing is complete.
+    static void pcb_sent_report_needed (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        if (!pcb->tim(SentTimer()).isSet()) {
+            pcb->tim(SentTimer()).setAfter(0);
+            pcb->doDelayedTimerUpdateIfNeeded();
+        }
+    }
+    
+    // SentTimer handler. Reports acknowledged data to the Connection.
+    static void pcb_sent_timer_handler (TcpPcb *pcb)
+    {
+        // The SentTimer is stopped when the Connection abandons the PCB.
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        // Delayed timer update is needed by timer expiration. It is done first
+        // since the application callback may do anything with the PCB.
+        pcb->doDelayedTimerUpdate();
+        
+        pcb->con->report_sent();
+    }
+    
     static void pcb_update_rcv_wnd_after_abandoned (TcpPcb *pcb, TcpSeqInt rcv_ann_thres)
     {
         AIPSTACK_ASSERT(pcb->state().isAcceptingData());
@@ -357,15 +396,38 @@ public:
         // Initialize some variables.
         Connection *con = pcb->con;
         con->m_v.snd_wnd = snd_wnd;
-        con->m_v.cwnd = CalcInitialTcpCwnd(pcb->snd_mss);
+        con->m_v.cwnd = Output::pcb_initial_cwnd(pcb);
         pcb->setFlag(TcpPcbFlags::CwndInit);
         con->m_v.ssthresh = Constants::MaxWindow;
         con->m_v.cwnd_acked = 0;
+        
+        // Initialize the DCTCP estimate, starting with the most conservative alpha.
+        con->m_v.dctcp_wnd_end = pcb->snd_nxt;
+        con->m_v.dctcp_acked = 0;
+        con->m_v.dctcp_marked = 0;
+        con->m_v.dctcp_alpha = std::uint16_t(1) << Constants::DctcpAlphaBits;
+        
+        // Start the first HyStart++ round.
+        con->m_v.hs_round_end = pcb->snd_nxt;
+        con->m_v.hs_last_min_rtt = TypeMax<typename Constants::RttType>;
+        con->m_v.hs_cur_min_rtt = TypeMax<typename Constants::RttType>;
+        con->m_v.hs_rtt_samples = 0;
+        con->m_v.hs_css_rounds = 0;
+        
+        // Initialize the PLPMTUD search.
+        if (TcpProto::EnablePlpmtud) {
+            Output::pcb_plpmtud_init(pcb);
+        }
+        
+        // Initialize BBR.
+        if (TcpProto::EnableBbr) {
+            Output::pcb_bbr_init(pcb);
+        }
     }
     
 private:
     static void listen_input (Listener *lis, IpRxInfoIp4<StackArg> const &ip_info,
-                              TcpSegMeta const &tcp_meta, std::size_t tcp_data_len)
+                              TcpSegMeta const &tcp_meta, IpBufRef tcp_data)
     {
         do {
             // For a new connection we expect SYN flag and no FIN, RST, ACK.
@@ -419,6 +481,7 @@ private:
             // Initialize most of the PCB.
             pcb->setState(TcpStates::SYN_RCVD);
             pcb->flags = 0;
+            pcb->ext_flags = 0;
             pcb->lis = lis;
             pcb->local_addr = ip_info.dst_addr;
             pcb->remote_addr = ip_info.src_addr;
@@ -447,6 +510,28 @@ private:
                 pcb->rcv_wnd_shift = Constants::RcvWndShift;
             }
             
+            // Agree to use ECN if enabled and requested by the SYN (RFC 3168 6.1.1).
+            if (TcpProto::EnableEcn &&
+                (tcp_meta.flags & (Tcp4Flags::Ece|Tcp4Flags::Cwr)) ==
+                    (Tcp4Flags::Ece|Tcp4Flags::Cwr))
+            {
+                pcb->setFlag(TcpPcbExtFlags::EcnOk);
+            }
+            
+            // Handle the Fast Open option if the listener has Fast Open enabled.
+            // A SYN with data and a valid cookie is accepted right away, otherwise
+            // the SYN-ACK will carry a cookie for future connections.
+            bool fast_open_accept = false;
+            if (lis->m_fast_open &&
+                (tcp->m_received_opts.options & TcpOptionFlags::FastOpen) != Enum0)
+            {
+                pcb->setFlag(TcpPcbExtFlags::FastOpen);
+                fast_open_accept = tcp_data.tot_len > 0 &&
+                    tcp->m_fast_open_gen.checkCookie(pcb->remote_addr,
+                        tcp->m_received_opts.fast_open_cookie,
+                        tcp->m_received_opts.fast_open_cookie_len);
+            }
+            
             // Increment the listener's PCB count.
             AIPSTACK_ASSERT(lis->m_num_pcbs < TypeMax<int>);
             lis->m_num_pcbs++;
@@ -465,14 +550,151 @@ private:
             
             pcb->doDelayedTimerUpdate();
             
-            // Reply with a SYN-ACK.
-            Output::pcb_send_syn(pcb);
+            if (fast_open_accept) {
+                // Accept the connection with the data (this sends the SYN-ACK).
+                listen_fast_open_input(pcb, tcp_meta, tcp_data);
+            } else {
+                // Reply with a SYN-ACK.
+                Output::pcb_send_syn(pcb);
+            }
             return;
         } while (false);
         
     refuse:
         // Refuse connection by RST.
-        Output::send_rst_reply(lis->m_tcp, ip_info, tcp_meta, tcp_data_len);
+        Output::send_rst_reply(lis->m_tcp, ip_info, tcp_meta, tcp_data.tot_len);
+    }
+    
+    // Accept a connection from a SYN with a valid Fast Open cookie (RFC 7413). The
+    // listener's EstablishedHandler is called right away and if the connection is
+    // accepted, the data is delivered and acknowledged by the SYN-ACK. Like pcb_input,
+    // this sets m_current_pcb so that aborts from callbacks are detected.
+    static void listen_fast_open_input (TcpPcb *pcb, TcpSegMeta const &tcp_meta,
+                                        IpBufRef tcp_data)
+    {
+        TcpProto *tcp = pcb->tcp;
+        AIPSTACK_ASSERT(tcp->m_current_pcb == nullptr);
+        
+        tcp->m_current_pcb = pcb;
+        
+        listen_fast_open_input_core(pcb, tcp_meta, tcp_data);
+        
+        if (AIPSTACK_LIKELY(tcp->m_current_pcb != nullptr)) {
+            tcp->m_current_pcb->doDelayedTimerUpdate();
+            tcp->m_current_pcb = nullptr;
+        }
+    }
+    
+    static void listen_fast_open_input_core (TcpPcb *pcb, TcpSegMeta const &tcp_meta,
+                                             IpBufRef tcp_data)
+    {
+        AIPSTACK_ASSERT(pcb->state() == TcpStates::SYN_RCVD);
+        AIPSTACK_ASSERT(pcb->hasFlag(TcpPcbExtFlags::FastOpen));
+        
+        TcpProto *tcp = pcb->tcp;
+        Listener *lis = pcb->lis;
+        
+        // Account for the SYN-ACK which is sent below. Stuff the send window into
+        // snd_una for pcb_complete_established_transition as
+        // pcb_input_syn_sent_rcvd_processing does, the window in a SYN is unscaled.
+        pcb->snd_nxt = pcb->snd_una + 1u;
+        pcb->snd_una = TcpSeqNum(TcpSeqInt(tcp_meta.window_size));
+        
+        // The SYN_RCVD timeouts are not needed. If the SYN-ACK is lost, the
+        // client will retransmit the SYN (see pcb_uncommon_flags_processing).
+        pcb->tim(AbrtTimer()).unset();
+        pcb->tim(RtxTimer()).unset();
+        
+        // Let the application accept the connection as for a SYN_RCVD PCB
+        // in pcb_input_syn_sent_rcvd_processing.
+        lis->m_accept_pcb = pcb;
+        tcp->m_unrefed_pcbs_list.remove({*pcb, *tcp}, *tcp);
+        
+        lis->m_established_handler();
+        
+        if (AIPSTACK_UNLIKELY(tcp->m_current_pcb == nullptr)) {
+            return;
+        }
+        
+        if (AIPSTACK_UNLIKELY(
+            pcb->state() == TcpStates::SYN_RCVD || pcb->con == nullptr))
+        {
+            TcpProto::pcb_abort(pcb, true);
+            return;
+        }
+        
+        // Deliver the data which fits into the receive buffer. The client
+        // will send the rest again since the SYN-ACK does not acknowledge it.
+        if (pcb->state().isAcceptingData()) {
+            tcp_data.tot_len = MinValueU(tcp_data.tot_len, pcb->con->m_v.rcv_buf.tot_len);
+            if (!pcb_input_rcv_processing(pcb, 0, false, tcp_data)) {
+                return;
+            }
+        }
+        
+        // Send the SYN-ACK, this also serves as the ACK for the data.
+        Output::pcb_send_fast_open_syn_ack(pcb);
+        pcb->clearFlag(TcpPcbFlags::AckPending);
+        
+        // Output any data queued by the application, like pcb_input_core.
+        if (pcb->hasAndClearFlag(TcpPcbFlags::OutPending)) {
+            AIPSTACK_ASSERT(pcb->state().canOutput());
+            AIPSTACK_ASSERT(Output::pcb_has_snd_outstanding(pcb));
+            
+            Output::pcb_output(pcb, false);
+        }
+    }
+    
+    // Handle a segment for a connection in TIME_WAIT. Returns true if the
+    // segment is a SYN which may start a new connection, in which case the
+    // entry has been removed.
+    static bool timewait_input (TcpProto *tcp, TimeWaitEntry &tw_entry,
+                                TcpSegMeta const &tcp_meta, std::size_t tcp_data_len)
+    {
+        Tcp4Flags rst_syn_ack =
+            tcp_meta.flags & (Tcp4Flags::Rst|Tcp4Flags::Syn|Tcp4Flags::Ack);
+        
+        if ((rst_syn_ack & Tcp4Flags::Rst) != Enum0) {
+            // RST with the exact expected sequence number ends TIME_WAIT,
+            // other RSTs are ignored.
+            if (tcp_meta.seq_num == tw_entry.rcv_nxt) {
+                tcp->m_timewait_table.remove(tw_entry);
+            }
+            return false;
+        }
+        
+        if (rst_syn_ack == Tcp4Flags::Syn) {
+            // A SYN with a sequence number beyond the end of the old connection
+            // cannot be confused with its segments, accept it for a new
+            // connection (RFC 1122 4.2.2.13, RFC 6191 without timestamps).
+            if (tw_entry.rcv_nxt.mod_lt(tcp_meta.seq_num)) {
+                tcp->m_timewait_table.remove(tw_entry);
+                return true;
+            }
+        }
+        else if (rst_syn_ack == Tcp4Flags::Ack) {
+            std::size_t seqlen = CalcTcpSeqLen(tcp_meta.flags, tcp_data_len);
+            
+            // An empty ACK for the expected sequence number needs no response.
+            // This avoids exchanging ACKs with a peer which is also in TIME_WAIT.
+            if (seqlen == 0 && tcp_meta.seq_num == tw_entry.rcv_nxt) {
+                return false;
+            }
+            
+            // A retransmitted FIN restarts the timeout.
+            if ((tcp_meta.flags & Tcp4Flags::Fin) != Enum0) {
+                tcp->m_timewait_table.restartTimeout(tw_entry);
+            }
+        }
+        else if ((rst_syn_ack & Tcp4Flags::Ack) == Enum0) {
+            // Segments without ACK are dropped.
+            return false;
+        }
+        
+        // Reply with an ACK.
+        Output::send_ack(tcp, tw_entry, tw_entry.snd_nxt, tw_entry.rcv_nxt,
+                         tw_entry.hdr_wnd);
+        return false;
     }
     
     static void pcb_input (TcpProto *tcp, TcpPcb *pcb, TcpSegMeta const &tcp_meta,
@@ -538,16 +760,16 @@ private:
         }
         
         if (AIPSTACK_LIKELY(pcb->state().isAcceptingData())) {
+            // Track CE marks to be echoed.
+            if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbExtFlags::EcnOk))) {
+                pcb_input_ecn(pcb, tcp_meta);
+            }
+            
             // Process received data or FIN.
             if (!pcb_input_rcv_processing(pcb, eff_rel_seq, seg_fin, tcp_data)) {
                 return;
             }
         }
-        else if (pcb->state() == TcpStates::TIME_WAIT) {
-            // Reply with an ACK and restart the timeout.
-            pcb->setFlag(TcpPcbFlags::AckPending);
-            pcb->tim(AbrtTimer()).setAfter(Constants::TimeWaitTimeTicks);
-        }
         
         // Output if needed.
         if (pcb->hasAndClearFlag(TcpPcbFlags::OutPending)) {
@@ -589,16 +811,19 @@ private:
             seg_fin = false;
             
             // Check ACK validity for SYN_SENT state (RFC 793 p66).
-            // We require that the ACK acknowledges the SYN. We must also
-            // check that we have event sent the SYN (snd_nxt).
-            if (pcb->snd_nxt == pcb->snd_una || tcp_meta.ack_num != pcb->snd_nxt) {
+            // We require that the ACK acknowledges the SYN and no more than any
+            // data sent with the SYN (Fast Open). We must also check that we have
+            // event sent the SYN (snd_nxt).
+            if (pcb->snd_nxt == pcb->snd_una || tcp_meta.ack_num == pcb->snd_una ||
+                !pcb->snd_una.ref_lte(tcp_meta.ack_num, pcb->snd_nxt))
+            {
                 Output::send_rst(pcb->tcp, /*key=*/*pcb,
                     /*seq_num=*/tcp_meta.ack_num, /*ack=*/false, /*ack_num=*/TcpSeqNum(0));
                 return false;
             }
             
-            // The SYN is being acknowledged.
-            acked = 1;
+            // The SYN and possibly some data sent with it is being acknowledged.
+            acked = tcp_meta.ack_num - pcb->snd_una;
         } else {
             // Calculate the right edge of the receive window.
             TcpSeqInt rcv_wnd = pcb->rcv_ann_wnd;
@@ -753,6 +978,15 @@ private:
                     Output::pcb_send_syn(pcb);
                     pcb->tim(AbrtTimer()).setAfter(Constants::SynRcvdTimeoutTicks);
                 }
+                else if (pcb->state() != TcpStates::SYN_RCVD &&
+                    pcb->hasFlag(TcpPcbExtFlags::FastOpen) &&
+                    tcp_meta.seq_num.mod_lt(pcb->rcv_nxt))
+                {
+                    // The connection was accepted from a Fast Open SYN and this
+                    // seems to be a retransmission of the SYN since the client did
+                    // not receive our SYN-ACK, retransmit it.
+                    Output::pcb_send_fast_open_syn_ack(pcb);
+                }
                 else {
                     Output::pcb_send_empty_ack(pcb);
                 }
@@ -792,7 +1026,7 @@ private:
         }
         // If our SYN is not acknowledged, send RST and drop. In SYN_RCVD,
         // RFC 793 seems to allow ack_num==snd_una which doesn't make sense.
-        // Note that in SYN_SENT, acked is always one here.
+        // Note that in SYN_SENT, acked is always at least one here.
         else if (acked == 0) {
             Output::send_rst(pcb->tcp, *pcb,
                 /*seq_num=*/tcp_meta.ack_num, /*ack=*/false, /*ack_num=*/TcpSeqNum(0));
@@ -813,10 +1047,22 @@ private:
             return false;
         }
         
-        // In SYN_SENT and SYN_RCVD the remote acks only our SYN no more.
-        // Otherwise we would have bailed out already.
-        AIPSTACK_ASSERT(pcb->snd_nxt == pcb->snd_una + 1u);
-        AIPSTACK_ASSERT(tcp_meta.ack_num == pcb->snd_nxt);
+        // In SYN_RCVD the remote acks only our SYN no more, in SYN_SENT it
+        // may also ack data sent with the SYN. Otherwise we would have bailed
+        // out already. Any data sent with the SYN but not acked will be sent
+        // again from the send buffer, so reset snd_nxt to the ack.
+        AIPSTACK_ASSERT(syn_sent || acked == 1);
+        pcb->snd_nxt = tcp_meta.ack_num;
+        std::size_t syn_data_acked = acked - 1u;
+        
+        // Fast Open is no longer relevant (see TcpPcbExtFlags::FastOpen).
+        bool fast_open = pcb->hasFlag(TcpPcbExtFlags::FastOpen);
+        pcb->clearFlag(TcpPcbExtFlags::FastOpen);
+        
+        // In SYN_SENT, ECN is used only if the SYN-ACK has ECE without CWR.
+        if (syn_sent && (tcp_meta.flags & (Tcp4Flags::Ece|Tcp4Flags::Cwr)) != Tcp4Flags::Ece) {
+            pcb->clearFlag(TcpPcbExtFlags::EcnOk);
+        }
         
         // Stop the SYN_RCVD abort timer.
         pcb->tim(AbrtTimer()).unset();
@@ -859,6 +1105,17 @@ private:
                 return false;
             }
             
+            // Remember any Fast Open cookie from the server for future connections,
+            // along with the MSS which limits the data sent with the SYN.
+            if (AIPSTACK_UNLIKELY(fast_open) &&
+                (tcp->m_received_opts.options & TcpOptionFlags::FastOpen) != Enum0 &&
+                tcp->m_received_opts.fast_open_cookie_len > 0)
+            {
+                tcp->m_fast_open_cache.store(pcb->remote_addr, pcb->base_snd_mss,
+                    tcp->m_received_opts.fast_open_cookie,
+                    tcp->m_received_opts.fast_open_cookie_len);
+            }
+            
             // Handle the window scale option.
             AIPSTACK_ASSERT(pcb->snd_wnd_shift == 0);
             if ((tcp->m_received_opts.options & TcpOptionFlags::WndScale) != Enum0) {
@@ -887,6 +1144,18 @@ private:
             AIPSTACK_ASSERT(con != nullptr);
             AIPSTACK_ASSERT(con->m_v.pcb == pcb);
             
+            // Remove data acknowledged with the SYN from the send buffer. Nothing
+            // else has been sent, so snd_buf_cur is the same as snd_buf.
+            if (AIPSTACK_UNLIKELY(syn_data_acked > 0)) {
+                AIPSTACK_ASSERT(syn_data_acked <= con->m_v.snd_buf.tot_len);
+                AIPSTACK_ASSERT(con->m_v.snd_buf_cur.tot_len == con->m_v.snd_buf.tot_len);
+                
+                con->m_v.snd_buf = ipBufSkipBytes(con->m_v.snd_buf, syn_data_acked);
+                con->m_v.snd_buf_cur = con->m_v.snd_buf;
+                con->m_v.snd_psh_index -=
+                    MinValueU(con->m_v.snd_psh_index, syn_data_acked);
+            }
+            
             // Make sure sending of any queued data starts.
             if (con->m_v.snd_buf.tot_len > 0) {
                 pcb->setFlag(TcpPcbFlags::OutPending);
@@ -906,6 +1175,15 @@ private:
                 return false;
             }
             
+            // Report data acknowledged with the SYN as sent. The Connection
+            // may have been moved or abandoned in the callback.
+            if (AIPSTACK_UNLIKELY(syn_data_acked > 0) && pcb->con != nullptr) {
+                pcb->con->data_sent(syn_data_acked);
+                if (AIPSTACK_UNLIKELY(pcb_aborted_in_callback(pcb))) {
+                    return false;
+                }
+            }
+            
             // Possible transitions in callback (except to CLOSED):
             // - ESTABLISHED->FIN_WAIT_1
         } else {
@@ -970,7 +1248,13 @@ private:
         if (AIPSTACK_UNLIKELY(pcb->con == nullptr)) {
             pcb->tcp->move_unrefed_pcb_to_front(pcb);
         }
-        
+
+        // For a connection accepted from a Fast Open SYN, an acceptable segment
+        // without SYN means the client has received our SYN-ACK.
+        if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbExtFlags::FastOpen))) {
+            pcb->clearFlag(TcpPcbExtFlags::FastOpen);
+        }
+
         // Handle new acknowledgments.
         if (acked > 0) {
             // We can only get here if there was anything pending acknowledgement
@@ -987,6 +1271,12 @@ private:
             // measurement and congestion control related processing.
             Output::pcb_output_handle_acked(pcb, tcp_meta.ack_num, acked);
             
+            // Respond to congestion signaled by ECE.
+            if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbExtFlags::EcnOk))) {
+                Output::pcb_ecn_ack_received(pcb, tcp_meta.ack_num, acked,
+                    (tcp_meta.flags & Tcp4Flags::Ece) != Enum0);
+            }
+            
             // Update snd_una due to sequences having been ACKed.
             pcb->snd_una = tcp_meta.ack_num;
             
@@ -1054,6 +1344,17 @@ private:
                 AIPSTACK_ASSERT(pcb->state() ==
                     OneOf(TcpStates::FIN_WAIT_1, TcpStates::CLOSING, TcpStates::LAST_ACK));
                 
+                // Report any data whose report was deferred due to the send
+                // low watermark, before the end. The Connection may be reset or
+                // moved in the callback, so it is looked up again below.
+                if (pcb->con != nullptr && pcb->con->m_v.snd_unreported > 0) {
+                    pcb->con->report_sent();
+                    if (AIPSTACK_UNLIKELY(pcb_aborted_in_callback(pcb))) {
+                        return false;
+                    }
+                    // Possible transitions in callback (except to CLOSED): none.
+                }
+                
                 // Tell Connection and application (if any) about end sent.
                 Connection *con = pcb->con;
                 if (AIPSTACK_LIKELY(con != nullptr)) {
@@ -1118,6 +1419,10 @@ private:
                 pcb->con != nullptr &&
                 pcb_decode_wnd_size(pcb, tcp_meta.window_size) == pcb->con->m_v.snd_wnd
             ) {
+                if (TcpProto::EnableBbr) {
+                    Output::pcb_bbr_dup_ack_received(pcb);
+                }
+                
                 if (pcb->num_dupack <
                         Constants::FastRtxDupAcks + Constants::MaxAdditionaDupAcks)
                 {
@@ -1128,6 +1433,9 @@ private:
                     else if (pcb->num_dupack > Constants::FastRtxDupAcks) {
                         Output::pcb_extra_dup_ack_received(pcb);
                     }
+                    else {
+                        Output::pcb_rack_dup_ack_received(pcb);
+                    }
                 }
             }
         }
@@ -1152,6 +1460,23 @@ private:
         return true;
     }
     
+    // Update the EcnEcho flag based on a received segment. Normally ECE is
+    // sent from a CE mark until a segment with CWR is received (RFC 3168
+    // 6.1.3). With EcnDctcp, ECE reflects the latest segment exactly, which
+    // works because every segment with data is acknowledged (RFC 8257 3.2).
+    static void pcb_input_ecn (TcpPcb *pcb, TcpSegMeta const &tcp_meta)
+    {
+        AIPSTACK_ASSERT(pcb->hasFlag(TcpPcbExtFlags::EcnOk));
+        
+        if (TcpProto::EcnDctcp || (tcp_meta.flags & Tcp4Flags::Cwr) != Enum0) {
+            pcb->clearFlag(TcpPcbExtFlags::EcnEcho);
+        }
+        
+        if (AIPSTACK_UNLIKELY(tcp_meta.ecn_ce)) {
+            pcb->setFlag(TcpPcbExtFlags::EcnEcho);
+        }
+    }
+    
     static bool pcb_input_rcv_processing (TcpPcb *pcb,
         TcpSeqInt eff_rel_seq, bool seg_fin, IpBufRef const &tcp_data)
     {
@@ -1325,6 +1650,14 @@ private:
             // Possible transitions in callback (except to CLOSED):
             // - ESTABLISHED->FIN_WAIT_1
             // - CLOSE_WAIT->LAST_ACK
+            
+            // Update receive buffer auto-tuning if enabled. The connection may
+            // have been reset in the callback, hence pcb->con is checked.
+            if (AIPSTACK_UNLIKELY(pcb->con != nullptr && pcb->con->m_v.rcv_at_max != 0)) {
+                if (!pcb_rcv_auto_tune(pcb)) {
+                    return false;
+                }
+            }
         }
         
         // Processing a FIN?
@@ -1341,8 +1674,63 @@ private:
             }
             
             // Complete transition from FIN_WAIT_2 to TIME_WAIT.
+            // This closes the PCB and sends the pending ACK.
             if (pcb->state() == TcpStates::FIN_WAIT_2_TIME_WAIT) {
                 TcpProto::pcb_go_to_time_wait(pcb);
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    // Receive buffer auto-tuning (dynamic right-sizing). The amount of data
+    // received is measured over intervals of about one RTT. If the receive buffer
+    // is smaller than twice that amount (the sender may double its rate within
+    // the next RTT) the application is asked to grow the buffer. A receiver often
+    // has only the RTT measured in the handshake, which is good enough here.
+    static bool pcb_rcv_auto_tune (TcpPcb *pcb)
+    {
+        using RttType = typename Constants::RttType;
+        
+        Connection *con = pcb->con;
+        AIPSTACK_ASSERT(con != nullptr);
+        
+        RttType now = Output::pcb_rack_time(pcb);
+        
+        // Start the first measurement.
+        if (!con->m_v.rcv_at_measuring) {
+            con->m_v.rcv_at_measuring = true;
+            con->m_v.rcv_at_seq = pcb->rcv_nxt;
+            con->m_v.rcv_at_time = now;
+            return true;
+        }
+        
+        // Wait until the measurement interval has elapsed.
+        RttType interval = MaxValue(Constants::RcvAutoTuneMinInterval,
+            pcb->hasFlag(TcpPcbFlags::RttValid) ?
+            con->m_v.srtt : Constants::InitialRtxTime);
+        if (RttType(now - con->m_v.rcv_at_time) < interval) {
+            return true;
+        }
+        
+        // Get the amount received in this interval and start the next one.
+        TcpSeqInt rcvd = MinValue(TcpSeqInt(pcb->rcv_nxt - con->m_v.rcv_at_seq),
+                                  Constants::MaxWindow);
+        con->m_v.rcv_at_seq = pcb->rcv_nxt;
+        con->m_v.rcv_at_time = now;
+        
+        // Calculate the desired buffer size, bounded by the maximum.
+        TcpSeqInt slack = Constants::RcvAutoTuneSlackSegs * pcb->snd_mss;
+        std::size_t buf_size = MinValueU(2 * rcvd + slack, con->m_v.rcv_at_max);
+        
+        // Ask the application for a larger buffer if needed.
+        if (buf_size > con->m_v.rcv_at_size) {
+            con->m_v.rcv_at_size = buf_size;
+            
+            con->recv_buf_grow_requested(buf_size);
+            if (AIPSTACK_UNLIKELY(pcb_aborted_in_callback(pcb))) {
+                return false;
             }
         }
         
@@ -27,6 +27,7 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
 
 #include <aipstack/misc/Use.h>
 #include <aipstack/misc/Assert.h>
@@ -48,6 +49,7 @@
 #include <aipstack/tcp/TcpPcbFlags.h>
 #include <aipstack/tcp/TcpPcbKey.h>
 #include <aipstack/tcp/TcpOptions.h>
+#include <aipstack/tcp/TcpFastOpen.h>
 
 namespace AIpStack {
 
@@ -61,11 +63,14 @@ class IpTcpProto_output
     using TcpProto = IpTcpProto<Arg>;
     
     AIPSTACK_USE_TYPES(TcpProto, (TcpPcb, Input, TimeType, Constants, OutputTimer,
-                                  RtxTimer, StackArg, Connection))
-    AIPSTACK_USE_TYPES(Constants, (RttType, RttNextType))
+                                  RtxTimer, TlpTimer, StackArg, Connection, SegInfo,
+                                  SegSamples))
+    AIPSTACK_USE_TYPES(Constants, (RttType, RttNextType, DrTimeType))
     AIPSTACK_USE_VALS(IpStack<StackArg>, (HeaderBeforeIp4Dgram))
 
     inline static constexpr RttType RttTypeMax = TypeMax<RttType>;
+    inline static constexpr DrTimeType DrTimeTypeMax = TypeMax<DrTimeType>;
+    inline static constexpr int RttToDrShift = Constants::RttShift - Constants::DrTimeShift;
     
 public:
     // Check if our FIN has been ACKed.
@@ -93,6 +98,12 @@ public:
             tcp_opts.wnd_scale = pcb->rcv_wnd_shift;
         }
         
+        // Add the Fast Open option and any data to be sent with the SYN.
+        IpBufRef syn_data = IpBufRef{};
+        if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbExtFlags::FastOpen))) {
+            pcb_syn_fast_open(pcb, tcp_opts, syn_data);
+        }
+        
         // The SYN and SYN-ACK must always have non-scaled window size.
         // For justification of assert see see create_connection, listen_input.
         AIPSTACK_ASSERT(pcb->rcv_ann_wnd <= TypeMax<std::uint16_t>);
@@ -102,9 +113,15 @@ public:
         Tcp4Flags flags = Tcp4Flags::Syn |
             ((pcb->state() == TcpStates::SYN_RCVD) ? Tcp4Flags::Ack : Tcp4Flags(0));
         
+        // Request ECN with ECE+CWR in the SYN, agree with ECE in the SYN-ACK.
+        if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbExtFlags::EcnOk))) {
+            flags |= (pcb->state() == TcpStates::SYN_RCVD) ?
+                Tcp4Flags::Ece : (Tcp4Flags::Ece|Tcp4Flags::Cwr);
+        }
+        
         // Send the segment.
         IpErr err = send_tcp_nodata(pcb->tcp, *pcb, pcb->snd_una, pcb->rcv_nxt,
-                                    window_size, flags, &tcp_opts, pcb);
+                                    window_size, flags, &tcp_opts, pcb, syn_data);
         
         if (err == IpErr::Success) {
             // Have we sent the SYN for the first time?
@@ -112,8 +129,10 @@ public:
                 // Start a round-trip-time measurement.
                 pcb_start_rtt_measurement(pcb, true);
                 
-                // Bump snd_nxt.
-                pcb->snd_nxt += 1u;
+                // Bump snd_nxt. Any data sent with the SYN is included so that
+                // the SYN-ACK may acknowledge it (pcb_input_basic_processing),
+                // but the send buffer is only advanced when that happens.
+                pcb->snd_nxt += 1u + TcpSeqInt(syn_data.tot_len);
             } else {
                 // Retransmission, stop any round-trip-time measurement.
                 pcb->clearFlag(TcpPcbFlags::RttPending);
@@ -121,6 +140,58 @@ public:
         }
     }
     
+    // Send a SYN-ACK for a connection accepted from a Fast Open SYN. The PCB is
+    // already ESTABLISHED with snd_una just after our SYN, and the SYN-ACK also
+    // acknowledges data received with the SYN.
+    AIPSTACK_NO_INLINE
+    static void pcb_send_fast_open_syn_ack (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->state().isActive());
+        AIPSTACK_ASSERT(pcb->hasFlag(TcpPcbExtFlags::FastOpen));
+        
+        // The interface MSS is not remembered past SYN_RCVD, base_snd_mss is
+        // a conservative substitute.
+        TcpOptions tcp_opts;
+        tcp_opts.options = TcpOptionFlags::Mss;
+        tcp_opts.mss = pcb->base_snd_mss;
+        
+        if (pcb->hasFlag(TcpPcbFlags::WndScale)) {
+            tcp_opts.options |= TcpOptionFlags::WndScale;
+            tcp_opts.wnd_scale = pcb->rcv_wnd_shift;
+        }
+        
+        // The window in a SYN-ACK is not scaled. Let pcb_ann_wnd update rcv_ann_wnd
+        // then limit it to what can be announced, the next segment will announce
+        // any more window.
+        Input::pcb_ann_wnd(pcb);
+        if (pcb->rcv_ann_wnd > TypeMax<std::uint16_t>) {
+            pcb->rcv_ann_wnd = TypeMax<std::uint16_t>;
+            pcb->setFlag(TcpPcbFlags::RcvWndUpd);
+        }
+        std::uint16_t window_size = std::uint16_t(pcb->rcv_ann_wnd);
+        
+        Tcp4Flags flags = Tcp4Flags::Syn|Tcp4Flags::Ack;
+        if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbExtFlags::EcnOk))) {
+            flags |= Tcp4Flags::Ece;
+        }
+        
+        send_tcp_nodata(pcb->tcp, *pcb, pcb->snd_una - 1u, pcb->rcv_nxt, window_size,
+                        flags, &tcp_opts, pcb);
+    }
+    
+    // Send a SYN which was deferred for Fast Open (see create_connection) once
+    // the application has pushed data or closed sending.
+    static void pcb_fast_open_push (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->state() == TcpStates::SYN_SENT);
+        
+        if (pcb->hasFlag(TcpPcbExtFlags::FastOpen) && pcb->snd_nxt == pcb->snd_una) {
+            pcb->tim(RtxTimer()).setAfter(pcb_rto_time(pcb));
+            pcb_send_syn(pcb);
+            pcb->doDelayedTimerUpdateIfNeeded();
+        }
+    }
+    
     // Send an empty ACK (which may be a window update).
     AIPSTACK_NO_INLINE
     static void pcb_send_empty_ack (TcpPcb *pcb)
@@ -128,9 +199,15 @@ public:
         // Get the window size value.
         std::uint16_t window_size = Input::pcb_ann_wnd(pcb);
         
+        // Echo any CE mark.
+        Tcp4Flags flags = Tcp4Flags::Ack;
+        if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbExtFlags::EcnEcho))) {
+            flags |= Tcp4Flags::Ece;
+        }
+        
         // Send it.
         send_tcp_nodata(pcb->tcp, *pcb, pcb->snd_nxt, pcb->rcv_nxt, window_size,
-                        Tcp4Flags::Ack, nullptr, pcb);
+                        flags, nullptr, pcb);
     }
     
     // Send an RST for this PCB.
@@ -210,6 +287,32 @@ public:
         }
     }
     
+    // Like pcb_push_output, but outside of input processing output is done
+    // immediately instead of from the OutputTimer.
+    static void pcb_flush_output (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->state().canOutput());
+        AIPSTACK_ASSERT(pcb_has_snd_outstanding(pcb));
+        
+        if (pcb->inInputProcessing()) {
+            // Output will be done at the end of input processing.
+            pcb->setFlag(TcpPcbFlags::OutPending);
+        } else {
+            // Stop any OutputTimer armed for delayed output, since output is
+            // done now. Otherwise it would expire later and send full segments
+            // of data queued meanwhile, even if the connection has been corked.
+            // If pcb_output needs the timer for pacing or retrying, it sets it.
+            pcb->clearFlag(TcpPcbFlags::OutRetry);
+            pcb->tim(OutputTimer()).unset();
+            
+            // Output queued data now.
+            pcb_output(pcb, false);
+            
+            // Delayed timer update is needed by pcb_output.
+            pcb->doDelayedTimerUpdateIfNeeded();
+        }
+    }
+    
     // Check if there is any unacknowledged or unsent data or FIN.
     static bool pcb_has_snd_outstanding (TcpPcb *pcb)
     {
@@ -320,10 +423,19 @@ public:
         // Create the output helper (which optimizes sending multiple segments at a time).
         PcbOutputHelper output_helper;
         
+        // Whether anything was sent, for arming the tail loss probe.
+        bool sent_any = false;
+        
         // Send segments while we have some non-delayable data or FIN
         // queued, and there is some window availabe. But for the case
         // of rtx_or_window_probe, this condition is always true.
         while ((snd_buf_cur->tot_len > data_threshold || fin) && rem_wnd > 0) {
+            // With BBR, stop if sending now would get ahead of the pacing rate.
+            // The OutputTimer has then been set to continue.
+            if (TcpProto::EnableBbr && !rtx_or_window_probe && !pcb_bbr_pacing_allows(pcb)) {
+                break;
+            }
+            
             // Send a segment.
             TcpSeqInt seg_seqlen;
             IpErr err = pcb_output_segment(
@@ -384,6 +496,22 @@ public:
             
             // Clear AckPending flag to avoid sending an empty ACK needlessly.
             pcb->clearFlag(TcpPcbFlags::AckPending);
+            
+            // Advance the pacing schedule.
+            if (TcpProto::EnableBbr) {
+                pcb_bbr_paced_sent(pcb, seg_seqlen);
+            }
+            
+            sent_any = true;
+        }
+        
+        // With BBR, if everything queued was sent and the windows would allow
+        // more, the rate samples until this data is acked are app-limited.
+        if (TcpProto::EnableBbr && snd_buf_cur->tot_len <= data_threshold && !fin &&
+            rem_wnd > 0)
+        {
+            con->m_v.dr_app_limited = true;
+            con->m_v.dr_app_limited_end = pcb->snd_nxt;
         }
         
         // If the IdleTimer flag is set, clear it and ensure that the RtxTimer
@@ -403,8 +531,15 @@ public:
         if (!pcb->tim(RtxTimer()).isSet()) {
             if (AIPSTACK_LIKELY(pcb_has_snd_unacked(pcb)) || pcb->con->m_v.snd_wnd == 0) {
                 pcb->tim(RtxTimer()).setAfter(pcb_rto_time(pcb));
+                sent_any = true;
             }
         }
+        
+        // Restart the tail loss probe timeout after sending or (re)starting the
+        // RtxTimer (which happens after new data is acked).
+        if (sent_any) {
+            pcb_arm_tlp_timer(pcb);
+        }
     }
     
     /**
@@ -521,11 +656,12 @@ public:
             
             Connection *con = pcb->con;
             
-            // Reduce the CWND (RFC 5681 section 4.1).
+            // Reduce the CWND (RFC 5681 section 4.1). Not with BBR, where
+            // pacing prevents a burst when sending resumes.
             // Also reset cwnd_acked to avoid old accumulated value
             // from causing an undesired cwnd increase later.
-            TcpSeqInt initial_cwnd = CalcInitialTcpCwnd(pcb->snd_mss);
-            if (con->m_v.cwnd >= initial_cwnd) {
+            TcpSeqInt initial_cwnd = pcb_initial_cwnd(pcb);
+            if (!TcpProto::EnableBbr && con->m_v.cwnd >= initial_cwnd) {
                 con->m_v.cwnd = initial_cwnd;
                 pcb->setFlag(TcpPcbFlags::CwndInit);
             }
@@ -553,6 +689,16 @@ public:
             return;
         }
         
+        // A SYN deferred for Fast Open (see create_connection) which the application
+        // did not push is sent now, this is not a retransmission.
+        if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbExtFlags::FastOpen)) &&
+            pcb->state() == TcpStates::SYN_SENT && pcb->snd_nxt == pcb->snd_una)
+        {
+            pcb->tim(RtxTimer()).setAfter(pcb_rto_time(pcb));
+            pcb_send_syn(pcb);
+            return;
+        }
+        
         // Double the retransmission timeout and restart the timer.
         RttType doubled_rto = (pcb->rto > RttTypeMax / 2) ? RttTypeMax : (2 * pcb->rto);
         pcb->rto = MinValue(Constants::MaxRtxTime, doubled_rto);
@@ -575,6 +721,11 @@ public:
         } else {
             // This is for data or FIN retransmission while not abandoned.
             
+            // Check for a PMTU black hole, this may lower snd_mss.
+            if (TcpProto::EnablePlpmtud) {
+                pcb_plpmtud_rtx_timeout(pcb);
+            }
+            
             // Check for first retransmission.
             if (!pcb->hasFlag(TcpPcbFlags::RtxActive)) {
                 // Set flag to indicate there has been a retransmission.
@@ -583,6 +734,12 @@ public:
                 
                 // Update ssthresh (RFC 5681).
                 pcb_update_ssthresh_for_rtx(pcb);
+                
+                // BBR restores cwnd once the retransmitted data is acked.
+                if (TcpProto::EnableBbr) {
+                    pcb_bbr_save_cwnd(pcb);
+                    con->m_v.bbr_rto_restore = true;
+                }
             }
             
             // Set cwnd to one segment (RFC 5681).
@@ -599,6 +756,9 @@ public:
             // Exit any fast recovery.
             pcb->num_dupack = 0;
             
+            // No tail loss probe or RACK timeout until new data is acked.
+            pcb->tim(TlpTimer()).unset();
+            
             // Requeue all data and FIN.
             pcb_requeue_everything(pcb);
             
@@ -617,10 +777,12 @@ public:
     {
         AIPSTACK_ASSERT(pcb->state().canOutput());
         
-        // Requeue data.
+        // Requeue data. The transmit times will be recorded again.
         Connection *con = pcb->con;
         if (AIPSTACK_LIKELY(con != nullptr)) {
             con->m_v.snd_buf_cur = con->m_v.snd_buf;
+            con->m_v.seg_times.reset();
+            con->m_v.seg_samples.reset();
         }
         
         // Requeue any FIN.
@@ -640,8 +802,40 @@ public:
         // Clear the RtxActive flag since any retransmission has now been acked.
         pcb->clearFlag(TcpPcbFlags::RtxActive);
         
+        // Any tail loss probe has served its purpose. The TlpTimer is stopped
+        // and restarted by pcb_output_active along with the RtxTimer.
+        pcb->clearFlag(TcpPcbExtFlags::TlpSent);
+        pcb->tim(TlpTimer()).unset();
+        
         Connection *con = pcb->con;
         
+        // Forget the transmit times of acked data. Before that, get RTT
+        // samples for HyStart++ from the sampled segments being acked, the
+        // last of which gives the minimum. These samples are only used in the
+        // initial slow start, where nothing has been retransmitted yet.
+        RttType hs_rtt = RttTypeMax;
+        std::size_t hs_num_samples = 0;
+        BbrRateSample rate_sample;
+        if (AIPSTACK_LIKELY(con != nullptr)) {
+            if (pcb_hystart_sampling(pcb)) {
+                RttType sent_time;
+                typename SegSamples::Info info;
+                hs_num_samples = con->m_v.seg_samples.getLastAcked(
+                    pcb->snd_una, ack_num, sent_time, info);
+                if (hs_num_samples > 0) {
+                    hs_rtt = RttType(pcb_rack_time(pcb) - sent_time);
+                }
+            }
+            
+            // Take a delivery rate sample for BBR.
+            if constexpr (TcpProto::EnableBbr) {
+                pcb_bbr_rate_sample(pcb, ack_num, acked, rate_sample);
+            }
+            
+            con->m_v.seg_times.acked(pcb->snd_una, ack_num);
+            con->m_v.seg_samples.acked(pcb->snd_una, ack_num);
+        }
+        
         // Handle end of round-trip-time measurement.
         if (pcb->hasFlag(TcpPcbFlags::RttPending)) {
             // If we have RttPending outside of SYN_SENT/SYN_RCVD we must
@@ -662,6 +856,20 @@ public:
             // Reset the duplicate ACK counter.
             pcb->num_dupack = 0;
         }
+        // With BBR, cwnd comes from the model and duplicate ACKs only lead to
+        // retransmission. A partial ACK in fast recovery retransmits the first
+        // unacknowledged segment, otherwise fast recovery is ended if any.
+        else if (TcpProto::EnableBbr) {
+            pcb_bbr_ack_received(pcb, ack_num, acked, rate_sample);
+            
+            if (pcb->num_dupack >= Constants::FastRtxDupAcks &&
+                pcb->hasFlag(TcpPcbFlags::Recover) && ack_num.mod_lt(con->m_v.recover))
+            {
+                pcb_output_partial_ack_rtx(pcb, acked);
+            } else {
+                pcb->num_dupack = 0;
+            }
+        }
         // Not in fast recovery?
         else if (AIPSTACK_LIKELY(pcb->num_dupack < Constants::FastRtxDupAcks)) {
             // Reset the duplicate ACK counter.
@@ -669,8 +877,12 @@ public:
             
             // Perform congestion-control processing.
             if (con->m_v.cwnd <= con->m_v.ssthresh) {
-                // Slow start.
-                pcb_increase_cwnd_acked(pcb, acked);
+                // Slow start, with HyStart++ in the initial slow start.
+                if (TcpProto::EnableHyStart && con->m_v.ssthresh == Constants::MaxWindow) {
+                    pcb_hystart_ack(pcb, ack_num, acked, hs_rtt, hs_num_samples);
+                } else {
+                    pcb_increase_cwnd_acked(pcb, acked);
+                }
             } else {
                 // Congestion avoidance.
                 if (!pcb->hasFlag(TcpPcbFlags::CwndIncrd)) {
@@ -708,7 +920,7 @@ public:
                 pcb->num_dupack = 0;
             } else {
                 // Retransmit the first unacknowledged segment.
-                pcb_output_active(pcb, true);
+                pcb_output_partial_ack_rtx(pcb, acked);
                 
                 // Deflate CWND by the amount of data ACKed.
                 // Be careful to not bring CWND below snd_mss.
@@ -731,6 +943,61 @@ public:
         {
             pcb->clearFlag(TcpPcbFlags::Recover);
         }
+        
+        // Check whether a PLPMTUD probe has been acked.
+        if (TcpProto::EnablePlpmtud && AIPSTACK_LIKELY(con != nullptr)) {
+            pcb_plpmtud_ack_received(pcb, ack_num);
+        }
+    }
+    
+    // Retransmit the first unacknowledged segment after a partial ACK in fast
+    // recovery. This is called from pcb_output_handle_acked before snd_una and
+    // snd_buf are advanced, so the acked data is skipped here. The FIN cannot
+    // have been acked since an ACK below recover does not cover everything.
+    static void pcb_output_partial_ack_rtx (TcpPcb *pcb, TcpSeqInt acked)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        AIPSTACK_ASSERT(acked <= pcb->con->m_v.snd_buf.tot_len);
+        
+        Connection *con = pcb->con;
+        
+        IpBufRef data = ipBufSkipBytes(con->m_v.snd_buf, acked);
+        bool fin = !pcb->state().isSndOpen();
+        if (data.tot_len == 0 && !fin) {
+            return;
+        }
+        
+        // Like for retransmission in pcb_output_active, respect only snd_wnd
+        // (relative to the old snd_una) but send at least one count.
+        TcpSeqInt rem_wnd = (con->m_v.snd_wnd > acked) ?
+            TcpSeqInt(con->m_v.snd_wnd - acked) : 1;
+        
+        PcbOutputHelper output_helper;
+        TcpSeqInt seg_seqlen;
+        IpErr err = pcb_output_segment(pcb, output_helper, data, fin, rem_wnd, &seg_seqlen);
+        
+        // See pcb_output_active, the RTO will take care of retransmission.
+        if (AIPSTACK_UNLIKELY(err == IpErr::FragmentationNeeded)) {
+            pcb->tcp->m_stack->handleLocalPacketTooBig(pcb->remote_addr);
+        }
+        
+        if (TcpProto::EnableBbr) {
+            pcb_bbr_arm_rack_rtx_timer(pcb);
+        }
+    }
+    
+    // With BBR, a lost retransmission in fast recovery is detected by RACK
+    // (RFC 8985 section 6.2) using the TlpTimer, instead of waiting for the
+    // RTO. BBR keeps the window at the model's BDP during recovery, and
+    // without SACK each hole takes a round trip to repair, so that there are
+    // many retransmissions and the RTO would often stall the connection.
+    static void pcb_bbr_arm_rack_rtx_timer (TcpPcb *pcb)
+    {
+        RttType delay;
+        if (pcb_rack_loss_delay(pcb, delay)) {
+            pcb->tim(TlpTimer()).setAfter(
+                TimeType(MaxValue(delay, RttType(1))) << Constants::RttShift);
+        }
     }
     
     // Called from Input when the number of duplicate ACKs has
@@ -744,32 +1011,50 @@ public:
         // If we have recover (>=snd_nxt), we must not enter fast recovery.
         // In that case we must decrement num_dupack by one, to indicate that
         // we are not in fast recovery and the next duplicate ACK is still
-        // a candidate.
-        if (pcb->hasFlag(TcpPcbFlags::Recover)) {
+        // a candidate. BBR does not reduce cwnd due to loss and keeps sending
+        // new data during recovery, so it only waits until everything up to
+        // recover is acked; then the duplicate ACKs are for that new data.
+        Connection *con = pcb->con;
+        if (pcb->hasFlag(TcpPcbFlags::Recover) && !(TcpProto::EnableBbr &&
+            con != nullptr && pcb->snd_una == con->m_v.recover))
+        {
             pcb->num_dupack--;
             return;
         }
         
+        // If the lost segment is a PLPMTUD probe, the loss is not taken as a
+        // sign of congestion (RFC 8899 section 3). The retransmission below
+        // marks the probe as failed.
+        bool probe_lost = TcpProto::EnablePlpmtud && con != nullptr &&
+            pcb->hasFlag(TcpPcbExtFlags::MtuProbe) &&
+            con->m_v.mtu_probe_seq == pcb->snd_una;
+        
         // Do the retransmission.
         pcb_output(pcb, true);
         
-        Connection *con = pcb->con;
         if (AIPSTACK_LIKELY(con != nullptr)) {
             // Set recover.
             pcb->setFlag(TcpPcbFlags::Recover);
             con->m_v.recover = pcb->snd_nxt;
             
-            // Update ssthresh.
-            pcb_update_ssthresh_for_rtx(pcb);
-            
-            // Update cwnd.
-            TcpSeqInt cwnd = con->m_v.ssthresh;
-            AddToSat(cwnd, 3u * TcpSeqInt(pcb->snd_mss));
-            con->m_v.cwnd = cwnd;
-            pcb->clearFlag(TcpPcbFlags::CwndInit);
+            // BBR does not reduce cwnd due to loss.
+            if (!TcpProto::EnableBbr && AIPSTACK_LIKELY(!probe_lost)) {
+                // Update ssthresh.
+                pcb_update_ssthresh_for_rtx(pcb);
+                
+                // Update cwnd.
+                TcpSeqInt cwnd = con->m_v.ssthresh;
+                AddToSat(cwnd, 3u * TcpSeqInt(pcb->snd_mss));
+                con->m_v.cwnd = cwnd;
+                pcb->clearFlag(TcpPcbFlags::CwndInit);
+            }
             
             // Schedule output due to possible CWND increase.
             pcb->setFlag(TcpPcbFlags::OutPending);
+            
+            if (TcpProto::EnableBbr) {
+                pcb_bbr_arm_rack_rtx_timer(pcb);
+            }
         }
     }
     
@@ -781,7 +1066,7 @@ public:
         AIPSTACK_ASSERT(pcb_has_snd_unacked(pcb));
         AIPSTACK_ASSERT(pcb->num_dupack > Constants::FastRtxDupAcks);
         
-        if (AIPSTACK_LIKELY(pcb->con != nullptr)) {
+        if (!TcpProto::EnableBbr && AIPSTACK_LIKELY(pcb->con != nullptr)) {
             // Increment CWND by snd_mss.
             AddToSat(pcb->con->m_v.cwnd, pcb->snd_mss);
             
@@ -790,11 +1075,170 @@ public:
         }
     }
     
+    // Called from Input when a duplicate ACK has been received which did
+    // not reach the fast recovery threshold. With RACK (RFC 8985) the first
+    // unacknowledged segment is considered lost if enough time has passed
+    // since it was sent, because the duplicate ACK means that something sent
+    // later has been delivered. If not yet, the TlpTimer is set to check again.
+    static void pcb_rack_dup_ack_received (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->state().canOutput());
+        AIPSTACK_ASSERT(pcb_has_snd_unacked(pcb));
+        AIPSTACK_ASSERT(pcb->num_dupack > 0);
+        AIPSTACK_ASSERT(pcb->num_dupack < Constants::FastRtxDupAcks);
+        
+        RttType delay;
+        if (pcb->con == nullptr || !pcb_rack_loss_delay(pcb, delay)) {
+            return;
+        }
+        
+        if (delay == 0) {
+            pcb_rack_detected_loss(pcb);
+        } else {
+            pcb->tim(TlpTimer()).setAfter(TimeType(delay) << Constants::RttShift);
+        }
+    }
+    
+    // Called from Input for each duplicate ACK with BBR. Without SACK, a
+    // duplicate ACK is taken to mean that one segment beyond snd_una has been
+    // delivered, as in Linux's delivery rate estimation for non-SACK flows.
+    // Otherwise everything delivered while a hole is being repaired would be
+    // counted at once by the cumulative ACK which fills it, and the rate
+    // sample of that ACK would overestimate the bandwidth by far.
+    static void pcb_bbr_dup_ack_received (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        
+        TcpSeqInt flight_size = pcb->snd_nxt - pcb->snd_una;
+        if (con->m_v.dr_dup_delivered + pcb->snd_mss < flight_size) {
+            con->m_v.dr_dup_delivered += pcb->snd_mss;
+            con->m_v.dr_delivered += pcb->snd_mss;
+            con->m_v.dr_delivered_time = pcb_dr_time(pcb);
+        }
+    }
+    
+    // Called from Input when something new is acked while ECN is used, after
+    // pcb_output_handle_acked. ECE is responded to like a loss but without
+    // retransmission, at most once per window of data (RFC 3168 6.1.2).
+    static void pcb_ecn_ack_received (
+        TcpPcb *pcb, TcpSeqNum ack_num, TcpSeqInt acked, bool ece)
+    {
+        AIPSTACK_ASSERT(pcb->state().canOutput());
+        AIPSTACK_ASSERT(pcb->hasFlag(TcpPcbExtFlags::EcnOk));
+        
+        Connection *con = pcb->con;
+        if (AIPSTACK_UNLIKELY(con == nullptr)) {
+            return;
+        }
+        
+        // Update the DCTCP estimate of the fraction of marked data.
+        if (TcpProto::EcnDctcp) {
+            pcb_dctcp_update(pcb, ack_num, acked, ece);
+        }
+        
+        // Another reduction is allowed once data sent after the last one
+        // is acked. The first such segment carried CWR, so ECE from now on
+        // is due to new marks, while ECE on an ACK of just the older data
+        // may still be an echo of the marks already responded to.
+        if (pcb->hasFlag(TcpPcbExtFlags::EcnRecover) &&
+            con->m_v.ecn_recover.mod_lt(ack_num))
+        {
+            pcb->clearFlag(TcpPcbExtFlags::EcnRecover);
+        }
+        
+        // Reduce cwnd, unless already done in this window due to ECE or
+        // loss (Recover is also set in fast recovery).
+        if (ece && !pcb->hasFlag(TcpPcbExtFlags::EcnRecover) &&
+            !pcb->hasFlag(TcpPcbFlags::Recover))
+        {
+            pcb_ecn_reduce_cwnd(pcb);
+        }
+    }
+    
+    inline static void pcb_tlp_timer_handler (TcpPcb *pcb)
+    {
+        // Handle tail loss probe or RACK reordering timeout.
+        pcb_tlp_timer_handler_core(pcb);
+        
+        // Delayed timer update is needed by timer expiration and
+        // pcb_tlp_timer_handler_core.
+        pcb->doDelayedTimerUpdate();
+    }
+    
+    static void pcb_tlp_timer_handler_core (TcpPcb *pcb)
+    {
+        // The timer is not stopped on every change which makes it unnecessary
+        // (it is stopped when new data is acked), so check that we have
+        // unacknowledged data and are not already recovering.
+        if (!pcb->state().canOutput() || pcb->con == nullptr ||
+            !pcb_has_snd_unacked(pcb) || pcb->hasFlag(TcpPcbFlags::RtxActive))
+        {
+            return;
+        }
+        
+        // In fast recovery with BBR this is the RACK timeout for the last
+        // retransmission (see pcb_bbr_arm_rack_rtx_timer).
+        if (pcb->num_dupack >= Constants::FastRtxDupAcks) {
+            RttType delay;
+            if (TcpProto::EnableBbr && pcb_rack_loss_delay(pcb, delay)) {
+                if (delay == 0) {
+                    pcb_output_partial_ack_rtx(pcb, 0);
+                } else {
+                    pcb->tim(TlpTimer()).setAfter(TimeType(delay) << Constants::RttShift);
+                }
+            }
+            return;
+        }
+        
+        // With duplicate ACKs this is the RACK reordering timeout
+        // (see pcb_rack_dup_ack_received).
+        if (pcb->num_dupack > 0) {
+            RttType delay;
+            if (pcb_rack_loss_delay(pcb, delay)) {
+                if (delay == 0) {
+                    pcb_rack_detected_loss(pcb);
+                    
+                    // Output due to possible CWND increase, as pcb_input would.
+                    if (pcb->hasAndClearFlag(TcpPcbFlags::OutPending)) {
+                        pcb_output_active(pcb, false);
+                    }
+                } else {
+                    pcb->tim(TlpTimer()).setAfter(TimeType(delay) << Constants::RttShift);
+                }
+            }
+            return;
+        }
+        
+        // Otherwise this is the tail loss probe timeout (see pcb_arm_tlp_timer).
+        if (!pcb->hasFlag(TcpPcbExtFlags::TlpSent) && pcb->con->m_v.snd_wnd != 0) {
+            pcb_send_tlp(pcb);
+        }
+    }
+    
     static TimeType pcb_rto_time (TcpPcb *pcb)
     {
         return TimeType(pcb->rto) << Constants::RttShift;
     }
     
+    // Current time in RTT units (wrapping) as used for RACK transmit times.
+    // RttType wraps after about 67 seconds, which a backed-off RTO together
+    // with ACKs restarting it can exceed, so an age computed from these times
+    // may be reduced modulo the wrap period. That only makes segments look
+    // younger, delaying RACK detection (at worst until the RTO, which resets
+    // the transmit times) but never making it early.
+    inline static RttType pcb_rack_time (TcpPcb *pcb)
+    {
+        return RttType(pcb->platform().getTime() >> Constants::RttShift);
+    }
+    
+    // Current time in delivery rate time units (wrapping), for BBR.
+    inline static DrTimeType pcb_dr_time (TcpPcb *pcb)
+    {
+        return DrTimeType(pcb->platform().getTime() >> Constants::DrTimeShift);
+    }
+    
     static void pcb_end_rtt_measurement (TcpPcb *pcb)
     {
         AIPSTACK_ASSERT(pcb->hasFlag(TcpPcbFlags::RttPending));
@@ -891,6 +1335,12 @@ public:
             return;
         }
         
+        // If the PMTU was raised above where PLPMTUD stopped searching (the
+        // estimate timed out or another connection probed it), search again.
+        if (TcpProto::EnablePlpmtud && pmtu > pcb->con->m_v.mtu_search_high) {
+            pcb_plpmtud_init(pcb);
+        }
+        
         // Calculate the new snd_mss based on the PMTU.
         std::uint16_t new_snd_mss = pcb_calc_snd_mss_from_pmtu(pcb, pmtu);
         
@@ -911,7 +1361,7 @@ public:
         
         if (pcb->hasFlag(TcpPcbFlags::CwndInit)) {
             // Recalculate initial CWND (RFC 5681 page 5).
-            con->m_v.cwnd = CalcInitialTcpCwnd(pcb->snd_mss);
+            con->m_v.cwnd = pcb_initial_cwnd(pcb);
         } else {
             // The standards do not require updating cwnd for the new snd_mss,
             // but we have to make sure that cwnd does not become less than snd_mss.
@@ -936,6 +1386,87 @@ public:
         // handleLocalPacketTooBig -> pcb_pmtu_changed.
     }
     
+    // Initial cwnd (also the restart window after idle) for the current snd_mss.
+    inline static TcpSeqInt pcb_initial_cwnd (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        return CalcInitialTcpCwnd(pcb->snd_mss, pcb->con->m_v.iw_segs);
+    }
+    
+    // Called when the initial cwnd setting of the connection has changed,
+    // updates cwnd if it is still the initial cwnd.
+    static void pcb_initial_cwnd_changed (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        if (pcb->state().canOutput() && pcb->hasFlag(TcpPcbFlags::CwndInit)) {
+            pcb->con->m_v.cwnd = pcb_initial_cwnd(pcb);
+        }
+    }
+    
+    // Initialize the PLPMTUD (RFC 8899) search. Probes may be sent up to the
+    // interface MTU but no larger than base_snd_mss allows.
+    static void pcb_plpmtud_init (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        
+        std::uint16_t max_mtu = MinValueU(TypeMax<std::uint16_t>,
+            std::uint32_t(pcb->base_snd_mss) + Ip4TcpHeaderSize);
+        
+        IpRouteInfoIp4<StackArg> route_info;
+        if (pcb->tcp->m_stack->routeIp4(pcb->remote_addr, route_info)) {
+            max_mtu = MinValue(max_mtu, route_info.iface->getMtu());
+        }
+        
+        con->m_v.mtu_search_high = max_mtu;
+        con->m_v.mtu_rto_count = 0;
+    }
+    
+    // Initialize BBR (and the delivery rate estimation) for Startup, with the
+    // handshake RTT (rounded up, the minimum RTT is in delivery rate time
+    // units) as the initial minimum RTT.
+    static void pcb_bbr_init (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        RttType now = pcb_rack_time(pcb);
+        DrTimeType dr_now = pcb_dr_time(pcb);
+        
+        con->m_v.dr_delivered = 0;
+        con->m_v.dr_dup_delivered = 0;
+        con->m_v.dr_delivered_time = dr_now;
+        con->m_v.dr_first_sent_time = dr_now;
+        con->m_v.dr_app_limited = false;
+        con->m_v.dr_app_limited_end = pcb->snd_nxt;
+        
+        con->m_v.bbr_bw.reset(0, 0);
+        con->m_v.bbr_round_count = 0;
+        con->m_v.bbr_round_end = pcb->snd_nxt;
+        con->m_v.bbr_round_start = false;
+        con->m_v.bbr_min_rtt = pcb->hasFlag(TcpPcbFlags::RttValid) ?
+            (DrTimeType(con->m_v.srtt + 1) << RttToDrShift) : DrTimeTypeMax;
+        con->m_v.bbr_min_rtt_stamp = now;
+        con->m_v.bbr_full_bw = 0;
+        con->m_v.bbr_full_bw_cnt = 0;
+        con->m_v.bbr_full_bw_reached = false;
+        con->m_v.bbr_idle_restart = false;
+        con->m_v.bbr_probe_rtt_timing = false;
+        con->m_v.bbr_probe_rtt_round_done = false;
+        con->m_v.bbr_rto_restore = false;
+        con->m_v.bbr_prior_cwnd = 0;
+        con->m_v.bbr_cycle_idx = 0;
+        con->m_v.bbr_cycle_stamp = dr_now;
+        con->m_v.bbr_pacing_bw = 0;
+        con->m_v.bbr_pace_time = pcb->platform().getTime();
+        
+        pcb_bbr_enter_startup(pcb);
+        pcb_bbr_update_pacing_bw(pcb);
+    }
+    
     // Update the snd_wnd to the given value.
     // NOTE: doDelayedTimerUpdate must be called after return.
     static void pcb_update_snd_wnd (TcpPcb *pcb, TcpSeqInt new_snd_wnd)
@@ -1008,6 +1539,14 @@ public:
         send_rst(tcp, key, rst_seq_num, rst_ack, rst_ack_num);
     }
     
+    // Send an empty ACK for a connection in TIME_WAIT (which has no PCB).
+    static void send_ack (TcpProto *tcp, TcpPcbKey const &key, TcpSeqNum seq_num,
+                          TcpSeqNum ack_num, std::uint16_t window_size)
+    {
+        send_tcp_nodata(tcp, key, seq_num, ack_num, window_size, Tcp4Flags::Ack,
+                        /*opts=*/nullptr, /*retryReq=*/nullptr);
+    }
+    
     AIPSTACK_NO_INLINE
     static void send_rst (TcpProto *tcp,
         TcpPcbKey const &key, TcpSeqNum seq_num, bool ack, TcpSeqNum ack_num)
@@ -1020,42 +1559,307 @@ public:
 private:
     class PcbOutputHelper;
     
-    // Set the OutputTimer to expire after no longer than OutputTimerTicks.
-    // NOTE: doDelayedTimerUpdate must be called after return.
-    static void pcb_set_output_timer_for_output (TcpPcb *pcb)
+    // Set the TlpTimer for a tail loss probe (RFC 8985 section 7.2), such that
+    // a lost segment at the end of a flight is detected by the resulting ACK
+    // without waiting for the RTO. This is a no-op while the TlpTimer is used
+    // as the RACK reordering timeout.
+    static void pcb_arm_tlp_timer (TcpPcb *pcb)
     {
         AIPSTACK_ASSERT(pcb->state().canOutput());
-        AIPSTACK_ASSERT(pcb_has_snd_outstanding(pcb));
+        AIPSTACK_ASSERT(pcb->con != nullptr);
         
-        // If the OutRetry flag is set, clear it and ensure that
-        // the OutputTimer is stopped before the check below.
-        if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbFlags::OutRetry))) {
-            pcb->clearFlag(TcpPcbFlags::OutRetry);
-            pcb->tim(OutputTimer()).unset();
+        if (pcb->num_dupack > 0) {
+            return;
         }
         
-        // Set the timer if it is not running already.
-        if (!pcb->tim(OutputTimer()).isSet()) {
-            pcb->tim(OutputTimer()).setAfter(Constants::OutputTimerTicks);
+        Connection *con = pcb->con;
+        
+        // A probe needs an RTT estimate and is not sent while the RTO is handling
+        // a loss, after one probe was already sent or for zero window.
+        if (!pcb->tim(RtxTimer()).isSet() || !pcb->hasFlag(TcpPcbFlags::RttValid) ||
+            pcb->hasFlag(TcpPcbFlags::RtxActive) ||
+            pcb->hasFlag(TcpPcbExtFlags::TlpSent) ||
+            !pcb_has_snd_unacked(pcb) || con->m_v.snd_wnd == 0)
+        {
+            pcb->tim(TlpTimer()).unset();
+            return;
+        }
+        
+        // The probe timeout is two RTTs, plus the worst case delayed ACK time if
+        // the receiver may be waiting for a second segment.
+        RttNextType pto = 2 * RttNextType(con->m_v.srtt);
+        if (pcb->snd_nxt - pcb->snd_una <= pcb->snd_mss) {
+            pto += Constants::TlpDelAckTime;
+        }
+        pto = MaxValue(pto, RttNextType(Constants::MinTlpTime));
+        
+        // Only use the probe if it would happen before the RTO.
+        TimeType now = pcb->platform().getTime();
+        TimeType pto_ticks = TimeType(pto) << Constants::RttShift;
+        TimeType rtx_ticks = pcb->tim(RtxTimer()).getSetTime() - now;
+        if (rtx_ticks <= pto_ticks || rtx_ticks > TypeMax<TimeType> / 2) {
+            pcb->tim(TlpTimer()).unset();
+        } else {
+            pcb->tim(TlpTimer()).setAt(now + pto_ticks);
         }
     }
     
-    // Set the OutputTimer for retrying sending.
-    // NOTE: doDelayedTimerUpdate must be called after return.
-    static void pcb_set_output_timer_for_retry (TcpPcb *pcb, IpErr err)
+    // Send a tail loss probe. This is a new segment if there is unsent data
+    // and the receive window allows, otherwise the last segment sent is
+    // retransmitted. After this the RTO is restarted.
+    static void pcb_send_tlp (TcpPcb *pcb)
     {
-        // Set the timer based on the error. Also set the flag OutRetry which
-        // allows pcb_set_output_timer_for_output to reset the timer it despite
-        // being already set, avoiding undesired delays.
-        TimeType after = (err == IpErr::OutputBufferFull) ?
-            Constants::OutputRetryFullTicks : Constants::OutputRetryOtherTicks;
-        pcb->tim(OutputTimer()).setAfter(after);
-        pcb->setFlag(TcpPcbFlags::OutRetry);
-    }
-    
-    // This function sends data/FIN for referenced PCBs. It is designed to be
-    // inlined into pcb_output_active and should not be called from elsewhere.
-    AIPSTACK_ALWAYS_INLINE
+        AIPSTACK_ASSERT(pcb->state().canOutput());
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        AIPSTACK_ASSERT(pcb_has_snd_unacked(pcb));
+        
+        Connection *con = pcb->con;
+        
+        std::size_t sent_len = con->m_v.snd_buf.tot_len - con->m_v.snd_buf_cur.tot_len;
+        bool fin_sent = pcb->hasFlag(TcpPcbFlags::FinSent) &&
+            !pcb->hasFlag(TcpPcbFlags::FinPending);
+        
+        IpBufRef data;
+        bool fin;
+        TcpSeqInt rem_wnd;
+        bool new_data;
+        
+        if ((con->m_v.snd_buf_cur.tot_len > 0 || pcb->hasFlag(TcpPcbFlags::FinPending)) &&
+            sent_len < con->m_v.snd_wnd)
+        {
+            // Send a new segment (ignoring cwnd).
+            data = con->m_v.snd_buf_cur;
+            fin = pcb->hasFlag(TcpPcbFlags::FinPending);
+            rem_wnd = TcpSeqInt(con->m_v.snd_wnd - sent_len);
+            new_data = true;
+        }
+        else if (sent_len > 0 || fin_sent) {
+            // Retransmit up to snd_mss of the last sent data and any FIN.
+            std::size_t offset = sent_len - MinValueU(sent_len, pcb->snd_mss);
+            data = ipBufSkipBytes(con->m_v.snd_buf, offset);
+            fin = fin_sent;
+            rem_wnd = TcpSeqInt(sent_len - offset) + fin_sent;
+            new_data = false;
+        }
+        else {
+            // Nothing is known to have been sent (everything was requeued),
+            // leave it to the RTO.
+            return;
+        }
+        
+        PcbOutputHelper output_helper;
+        TcpSeqInt seg_seqlen;
+        IpErr err = pcb_output_segment(pcb, output_helper, data, fin, rem_wnd, &seg_seqlen);
+        
+        if (AIPSTACK_UNLIKELY(err != IpErr::Success)) {
+            // See pcb_output_active, the RTO will take care of retransmission.
+            if (err == IpErr::FragmentationNeeded) {
+                pcb->tcp->m_stack->handleLocalPacketTooBig(pcb->remote_addr);
+            }
+            return;
+        }
+        
+        // For a new segment advance the queue position like pcb_output_active.
+        if (new_data) {
+            std::size_t data_sent = seg_seqlen;
+            if (AIPSTACK_UNLIKELY(seg_seqlen > data.tot_len)) {
+                pcb->clearFlag(TcpPcbFlags::FinPending);
+                data_sent = data.tot_len;
+            }
+            if (data_sent > 0) {
+                con->m_v.snd_buf_cur = ipBufSkipBytes(con->m_v.snd_buf_cur, data_sent);
+            }
+        }
+        
+        pcb->setFlag(TcpPcbExtFlags::TlpSent);
+        pcb->tim(RtxTimer()).setAfter(pcb_rto_time(pcb));
+    }
+    
+    // Get the time until the first unacknowledged segment is considered lost
+    // by RACK (zero if already), this is false if not known. The RFC uses the
+    // RTT of the most recently delivered segment plus a reordering window of
+    // a quarter of the minimum RTT, but since without SACK we do not know which
+    // segment was delivered, we use the smoothed RTT instead. With BBR, twice
+    // the minimum RTT is used, since the cwnd gain of 2 limits the queue to
+    // about the BDP, while the smoothed RTT is inflated during loss recovery
+    // by ACKs which had to wait for retransmissions.
+    static bool pcb_rack_loss_delay (TcpPcb *pcb, RttType &out_delay)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        
+        RttType sent_time;
+        if (!pcb->hasFlag(TcpPcbFlags::RttValid) ||
+            !con->m_v.seg_times.getFirstTime(sent_time))
+        {
+            return false;
+        }
+        
+        RttNextType rtt = con->m_v.srtt;
+        if (TcpProto::EnableBbr && con->m_v.bbr_min_rtt != DrTimeTypeMax) {
+            rtt = 2 * ((RttNextType(con->m_v.bbr_min_rtt) >> RttToDrShift) + 1);
+        }
+        RttNextType threshold = MaxValue(RttNextType(Constants::MinRackLossTime),
+            RttNextType(rtt + rtt / 4));
+        RttType age = RttType(pcb_rack_time(pcb) - sent_time);
+        
+        out_delay = (age >= threshold) ? 0 : RttType(threshold - age);
+        return true;
+    }
+    
+    // Enter fast recovery as if FastRtxDupAcks duplicate ACKs were received.
+    static void pcb_rack_detected_loss (TcpPcb *pcb)
+    {
+        pcb->num_dupack = Constants::FastRtxDupAcks;
+        pcb_fast_rtx_dup_acks_received(pcb);
+    }
+    
+    // Get the size (MTU) of a PLPMTUD probe to send at snd_nxt, or zero if no
+    // probe should be sent now. A probe is only sent when there is enough data
+    // and window for it and no loss recovery is going on, and then it bisects
+    // the range from the current MTU to mtu_search_high.
+    static std::uint16_t pcb_mtu_probe_size (
+        TcpPcb *pcb, std::size_t rem_data_len, TcpSeqInt rem_wnd)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        
+        if (pcb->hasFlag(TcpPcbExtFlags::MtuProbe) || pcb->num_dupack > 0 ||
+            pcb->hasFlag(TcpPcbFlags::RtxActive|TcpPcbFlags::Recover))
+        {
+            return 0;
+        }
+        
+        std::uint16_t cur_mtu = pcb->snd_mss + Ip4TcpHeaderSize;
+        std::uint16_t high_mtu = con->m_v.mtu_search_high;
+        if (high_mtu < cur_mtu || high_mtu - cur_mtu < Constants::PlpmtudMinProbeStep) {
+            return 0;
+        }
+        
+        std::uint16_t probe_mtu = cur_mtu + (high_mtu - cur_mtu + 1) / 2;
+        std::uint16_t probe_mss = probe_mtu - Ip4TcpHeaderSize;
+        if (rem_data_len < probe_mss || rem_wnd < probe_mss) {
+            return 0;
+        }
+        
+        return probe_mtu;
+    }
+    
+    // Sequence number after the data of the PLPMTUD probe segment.
+    inline static TcpSeqNum pcb_mtu_probe_end (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->hasFlag(TcpPcbExtFlags::MtuProbe));
+        
+        Connection *con = pcb->con;
+        return con->m_v.mtu_probe_seq + (con->m_v.mtu_probe_size - Ip4TcpHeaderSize);
+    }
+    
+    // The PLPMTUD probe was lost, stop searching at its size. This does not
+    // reduce the current PMTU since it says nothing about smaller segments.
+    static void pcb_mtu_probe_failed (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->hasFlag(TcpPcbExtFlags::MtuProbe));
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        pcb->clearFlag(TcpPcbExtFlags::MtuProbe);
+        pcb->con->m_v.mtu_search_high = pcb->con->m_v.mtu_probe_size - 1;
+    }
+    
+    // Called for new ACKs with PLPMTUD. If the probe segment has been acked,
+    // the PMTU estimate is raised to its size for all connections to the same
+    // address (this calls pcb_pmtu_changed).
+    static void pcb_plpmtud_ack_received (TcpPcb *pcb, TcpSeqNum ack_num)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        
+        con->m_v.mtu_rto_count = 0;
+        
+        if (pcb->hasFlag(TcpPcbExtFlags::MtuProbe) &&
+            !ack_num.mod_lt(pcb_mtu_probe_end(pcb)))
+        {
+            pcb->clearFlag(TcpPcbExtFlags::MtuProbe);
+            pcb->tcp->m_stack->handlePathMtuProbed(
+                pcb->remote_addr, con->m_v.mtu_probe_size);
+        }
+    }
+    
+    // Called on a retransmission timeout for data with PLPMTUD. If this keeps
+    // happening with full-sized segments and no ICMP message lowers the PMTU,
+    // full-sized segments are probably being dropped (a PMTU black hole, RFC
+    // 8899 section 4.3). Then the PMTU estimate is lowered for all connections
+    // to the same address and probing resumes from there.
+    static void pcb_plpmtud_rtx_timeout (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        
+        // A lost probe is handled when it is retransmitted (pcb_output_segment)
+        // and does not count, neither do timeouts with less than snd_mss queued.
+        if (pcb->hasFlag(TcpPcbExtFlags::MtuProbe) ||
+            con->m_v.snd_buf.tot_len < pcb->snd_mss)
+        {
+            return;
+        }
+        
+        if (++con->m_v.mtu_rto_count < Constants::PlpmtudBlackHoleRtos) {
+            return;
+        }
+        con->m_v.mtu_rto_count = 0;
+        
+        std::uint16_t cur_mtu = pcb->snd_mss + Ip4TcpHeaderSize;
+        if (cur_mtu <= IpStack<StackArg>::MinMTU) {
+            return;
+        }
+        
+        std::uint16_t lower_mtu = (cur_mtu > Constants::PlpmtudBaseMtu) ?
+            Constants::PlpmtudBaseMtu : IpStack<StackArg>::MinMTU;
+        
+        con->m_v.mtu_search_high = cur_mtu - 1;
+        pcb->tcp->m_stack->handleIcmpPacketTooBig(pcb->remote_addr, lower_mtu);
+    }
+    
+    // Set the OutputTimer to expire after no longer than OutputTimerTicks.
+    // NOTE: doDelayedTimerUpdate must be called after return.
+    static void pcb_set_output_timer_for_output (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->state().canOutput());
+        AIPSTACK_ASSERT(pcb_has_snd_outstanding(pcb));
+        
+        // If the OutRetry flag is set, clear it and ensure that
+        // the OutputTimer is stopped before the check below.
+        if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbFlags::OutRetry))) {
+            pcb->clearFlag(TcpPcbFlags::OutRetry);
+            pcb->tim(OutputTimer()).unset();
+        }
+        
+        // Set the timer if it is not running already.
+        if (!pcb->tim(OutputTimer()).isSet()) {
+            pcb->tim(OutputTimer()).setAfter(Constants::OutputTimerTicks);
+        }
+    }
+    
+    // Set the OutputTimer for retrying sending.
+    // NOTE: doDelayedTimerUpdate must be called after return.
+    static void pcb_set_output_timer_for_retry (TcpPcb *pcb, IpErr err)
+    {
+        // Set the timer based on the error. Also set the flag OutRetry which
+        // allows pcb_set_output_timer_for_output to reset the timer it despite
+        // being already set, avoiding undesired delays.
+        TimeType after = (err == IpErr::OutputBufferFull) ?
+            Constants::OutputRetryFullTicks : Constants::OutputRetryOtherTicks;
+        pcb->tim(OutputTimer()).setAfter(after);
+        pcb->setFlag(TcpPcbFlags::OutRetry);
+    }
+    
+    // This function sends data/FIN for referenced PCBs. It is designed to be
+    // inlined into pcb_output_active, other callers are the rarely used
+    // pcb_send_tlp and pcb_output_partial_ack_rtx.
+    AIPSTACK_ALWAYS_INLINE
     static IpErr pcb_output_segment (TcpPcb *pcb, PcbOutputHelper &helper,
         IpBufRef data, bool fin, TcpSeqInt rem_wnd, TcpSeqInt *out_seg_seqlen)
     {
@@ -1068,12 +1872,36 @@ private:
         
         std::size_t rem_data_len = data.tot_len;
         
+        // Determine offset from start of send buffer.
+        std::size_t offset = pcb->con->m_v.snd_buf.tot_len - rem_data_len;
+        
+        // Calculate the sequence number.
+        TcpSeqNum seq_num = pcb->snd_una + offset;
+        
+        // With PLPMTUD, new data may be sent as a larger probe segment, and
+        // retransmitting any of a probe segment means that it was lost.
+        std::uint16_t seg_mss = pcb->snd_mss;
+        std::uint16_t probe_mtu = 0;
+        if (TcpProto::EnablePlpmtud) {
+            if (seq_num == pcb->snd_nxt) {
+                probe_mtu = pcb_mtu_probe_size(pcb, rem_data_len, rem_wnd);
+                if (probe_mtu != 0) {
+                    seg_mss = probe_mtu - Ip4TcpHeaderSize;
+                }
+            }
+            else if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbExtFlags::MtuProbe)) &&
+                     seq_num.mod_lt(pcb_mtu_probe_end(pcb)))
+            {
+                pcb_mtu_probe_failed(pcb);
+            }
+        }
+        
         // Calculate segment data length and adjust data to contain only that.
         // We send the minimum of:
         // - remaining data in the send buffer,
         // - remaining available window,
-        // - maximum segment size.
-        data.tot_len = MinValueU(rem_data_len, MinValueU(rem_wnd, pcb->snd_mss));
+        // - maximum segment size (or the probe size).
+        data.tot_len = MinValueU(rem_data_len, MinValueU(rem_wnd, seg_mss));
         
         // We always send the ACK flag, others may be added below.
         Tcp4Flags seg_flags = Tcp4Flags::Ack;
@@ -1089,24 +1917,50 @@ private:
             }
         }
         
-        // Determine offset from start of send buffer.
-        std::size_t offset = pcb->con->m_v.snd_buf.tot_len - rem_data_len;
-        
         // Set the PSH flag if the push index is within this segment.
         std::size_t psh_index = pcb->con->m_v.snd_psh_index;
         if (InOpenClosedIntervalStartLen(offset, data.tot_len, psh_index)) {
             seg_flags |= Tcp4Flags::Psh;
         }
         
-        // Calculate the sequence number.
-        TcpSeqNum seq_num = pcb->snd_una + offset;
+        // With ECN, echo any CE mark and send new data as ECN-capable, with CWR
+        // after a cwnd reduction. Retransmissions are not ECN-capable because
+        // a CE mark could not be attributed to one transmission (RFC 3168 6.1.5).
+        IpSendFlags ip_send_flags = Constants::TcpIpSendFlags;
+        if (AIPSTACK_UNLIKELY(pcb->hasFlag(TcpPcbExtFlags::EcnOk))) {
+            if (pcb->hasFlag(TcpPcbExtFlags::EcnEcho)) {
+                seg_flags |= Tcp4Flags::Ece;
+            }
+            if (data.tot_len > 0 && seq_num == pcb->snd_nxt) {
+                ip_send_flags |= IpSendFlags::EcnCapableFlag;
+                if (pcb->hasFlag(TcpPcbExtFlags::EcnCwr)) {
+                    seg_flags |= Tcp4Flags::Cwr;
+                }
+            }
+        }
         
         // Send the segment.
-        IpErr err = helper.sendSegment(pcb, seq_num, seg_flags, data);
+        IpErr err = helper.sendSegment(pcb, seq_num, seg_flags, data, ip_send_flags);
         if (AIPSTACK_UNLIKELY(err != IpErr::Success)) {
+            // A probe exceeding the interface MTU must not be retried.
+            if (probe_mtu != 0 && err == IpErr::FragmentationNeeded) {
+                pcb->con->m_v.mtu_search_high = probe_mtu - 1;
+            }
             return err;
         }
         
+        // Remember the probe segment to see whether it is acked or lost.
+        if (AIPSTACK_UNLIKELY(probe_mtu != 0)) {
+            pcb->setFlag(TcpPcbExtFlags::MtuProbe);
+            pcb->con->m_v.mtu_probe_seq = seq_num;
+            pcb->con->m_v.mtu_probe_size = probe_mtu;
+        }
+        
+        // CWR has been sent.
+        if (AIPSTACK_UNLIKELY((seg_flags & Tcp4Flags::Cwr) != Enum0)) {
+            pcb->clearFlag(TcpPcbExtFlags::EcnCwr);
+        }
+        
         // Calculate the sequence length of the segment and set
         // the FinSent flag if a FIN was sent.
         TcpSeqInt seg_seqlen = TcpSeqInt(data.tot_len);
@@ -1129,6 +1983,17 @@ private:
         // Calculate the end sequence number of the sent segment.
         TcpSeqNum seg_endseq = seq_num + seg_seqlen;
         
+        // Remember the transmit time for RACK loss detection. For HyStart++
+        // and BBR the segment is also sampled if possible, with BBR along
+        // with the delivery rate snapshot.
+        RttType send_time = pcb_rack_time(pcb);
+        pcb->con->m_v.seg_times.sent(pcb->snd_una, seq_num, seg_endseq, send_time);
+        if (TcpProto::EnableBbr || pcb_hystart_sampling(pcb)) {
+            bool rtx = seq_num.mod_lt(pcb->snd_nxt);
+            pcb->con->m_v.seg_samples.sent(pcb->snd_una, seq_num, seg_endseq, send_time,
+                                           pcb_seg_info(pcb, rtx));
+        }
+        
         // Did we send anything new?
         if (AIPSTACK_LIKELY(pcb->snd_nxt.mod_lt(seg_endseq))) {
             // Start a round-trip-time measurement if not already started
@@ -1187,6 +2052,90 @@ private:
         pcb->clearFlag(TcpPcbFlags::CwndInit);
     }
     
+    // Whether segments are sampled for the RTT samples of HyStart++, which is
+    // in the initial slow start.
+    inline static bool pcb_hystart_sampling (TcpPcb *pcb)
+    {
+        return TcpProto::EnableHyStart && !TcpProto::EnableBbr &&
+            pcb->con->m_v.ssthresh == Constants::MaxWindow;
+    }
+    
+    // Slow start with HyStart++ (RFC 9406). If the minimum RTT of a round
+    // has increased enough compared to the previous round, cwnd grows more
+    // slowly (Conservative Slow Start), and if the increase persists for
+    // HyStartCssRounds rounds, slow start ends without waiting for a loss.
+    static void pcb_hystart_ack (TcpPcb *pcb, TcpSeqNum ack_num, TcpSeqInt acked,
+                                 RttType rtt, std::size_t num_samples)
+    {
+        AIPSTACK_ASSERT(pcb->state().canOutput());
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        
+        if (num_samples > 0) {
+            con->m_v.hs_cur_min_rtt = MinValue(con->m_v.hs_cur_min_rtt, rtt);
+            con->m_v.hs_rtt_samples = MinValueU(TypeMax<std::uint8_t>,
+                                                con->m_v.hs_rtt_samples + num_samples);
+        }
+        
+        RttType cur_min_rtt = con->m_v.hs_cur_min_rtt;
+        RttType last_min_rtt = con->m_v.hs_last_min_rtt;
+        
+        if (con->m_v.hs_rtt_samples >= Constants::HyStartRttSamples &&
+            cur_min_rtt != RttTypeMax && last_min_rtt != RttTypeMax)
+        {
+            if (con->m_v.hs_css_rounds == 0) {
+                RttType rtt_thresh = MaxValue(Constants::HyStartMinRttThresh,
+                    MinValue(Constants::HyStartMaxRttThresh,
+                             RttType(last_min_rtt / Constants::HyStartMinRttDivisor)));
+                if (cur_min_rtt >= RttNextType(last_min_rtt) + rtt_thresh) {
+                    con->m_v.hs_css_base_rtt = cur_min_rtt;
+                    con->m_v.hs_css_rounds = 1;
+                }
+            }
+            else if (cur_min_rtt < con->m_v.hs_css_base_rtt) {
+                // The RTT increase was spurious, resume slow start.
+                con->m_v.hs_css_rounds = 0;
+            }
+        }
+        
+        // Increase cwnd as in slow start, but less in Conservative Slow Start.
+        // There the increase is collected in cwnd_acked and cwnd grows by
+        // whole segments, so that the sender is not left with a window for
+        // less than a full segment.
+        TcpSeqInt cwnd_inc = MinValueU(acked, pcb->snd_mss);
+        if (con->m_v.hs_css_rounds > 0) {
+            AddToSat(con->m_v.cwnd_acked, cwnd_inc);
+            TcpSeqInt css_seg = Constants::HyStartCssGrowthDivisor * TcpSeqInt(pcb->snd_mss);
+            if (con->m_v.cwnd_acked >= css_seg) {
+                con->m_v.cwnd_acked -= css_seg;
+                cwnd_inc = pcb->snd_mss;
+            } else {
+                cwnd_inc = 0;
+            }
+        }
+        AddToSat(con->m_v.cwnd, cwnd_inc);
+        pcb->clearFlag(TcpPcbFlags::CwndInit);
+        
+        // At the end of a round, start another one ending at snd_nxt.
+        if (!ack_num.mod_lt(con->m_v.hs_round_end)) {
+            con->m_v.hs_round_end = pcb->snd_nxt;
+            con->m_v.hs_last_min_rtt = cur_min_rtt;
+            con->m_v.hs_cur_min_rtt = RttTypeMax;
+            con->m_v.hs_rtt_samples = 0;
+            
+            // After enough rounds of Conservative Slow Start, enter
+            // congestion avoidance.
+            if (con->m_v.hs_css_rounds > 0 &&
+                ++con->m_v.hs_css_rounds > Constants::HyStartCssRounds)
+            {
+                con->m_v.ssthresh = MaxValue(con->m_v.cwnd, TcpSeqInt(pcb->snd_mss));
+                con->m_v.cwnd_acked = 0;
+                con->m_v.hs_css_rounds = 0;
+            }
+        }
+    }
+    
     // Sets sshthresh according to RFC 5681 equation (4).
     static void pcb_update_ssthresh_for_rtx (TcpPcb *pcb)
     {
@@ -1198,6 +2147,536 @@ private:
         pcb->con->m_v.ssthresh = MaxValue(half_flight_size, two_smss);
     }
     
+    static void pcb_ecn_reduce_cwnd (TcpPcb *pcb)
+    {
+        AIPSTACK_ASSERT(pcb->state().canOutput());
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        
+        if (TcpProto::EnableBbr) {
+            // BBR does not reduce cwnd due to ECN (like for loss), but CWR is
+            // still sent so that the receiver stops echoing ECE.
+        }
+        else if (TcpProto::EcnDctcp) {
+            // Reduce cwnd by the fraction alpha/2 (RFC 8257 3.3), but not
+            // below two segments.
+            TcpSeqInt cwnd = con->m_v.cwnd;
+            TcpSeqInt reduction = TcpSeqInt((std::uint64_t(cwnd) * con->m_v.dctcp_alpha) >>
+                (Constants::DctcpAlphaBits + 1));
+            TcpSeqInt two_smss = 2u * TcpSeqInt(pcb->snd_mss);
+            con->m_v.cwnd = MinValue(cwnd, MaxValue(TcpSeqInt(cwnd - reduction), two_smss));
+            con->m_v.ssthresh = con->m_v.cwnd;
+        } else {
+            // Like for fast retransmit but without the inflation.
+            pcb_update_ssthresh_for_rtx(pcb);
+            con->m_v.cwnd = con->m_v.ssthresh;
+        }
+        
+        con->m_v.cwnd_acked = 0;
+        pcb->clearFlag(TcpPcbFlags::CwndInit);
+        
+        // No further reduction until the data sent so far is acked,
+        // and tell the receiver with CWR.
+        pcb->setFlag(TcpPcbExtFlags::EcnRecover);
+        con->m_v.ecn_recover = pcb->snd_nxt;
+        pcb->setFlag(TcpPcbExtFlags::EcnCwr);
+    }
+    
+    // Account acked data toward the DCTCP estimate and once per window of
+    // data update alpha, a moving average of the fraction of data which was
+    // acked with ECE (RFC 8257 3.3).
+    static void pcb_dctcp_update (TcpPcb *pcb, TcpSeqNum ack_num, TcpSeqInt acked, bool ece)
+    {
+        Connection *con = pcb->con;
+        
+        AddToSat(con->m_v.dctcp_acked, acked);
+        if (ece) {
+            AddToSat(con->m_v.dctcp_marked, acked);
+        }
+        
+        if (ack_num.mod_lt(con->m_v.dctcp_wnd_end)) {
+            return;
+        }
+        
+        constexpr int AlphaBits = Constants::DctcpAlphaBits;
+        constexpr int GainShift = Constants::DctcpGainShift;
+        
+        std::uint16_t alpha = con->m_v.dctcp_alpha;
+        alpha -= alpha >> GainShift;
+        if (con->m_v.dctcp_marked > 0) {
+            alpha += std::uint16_t(
+                (std::uint64_t(con->m_v.dctcp_marked) << (AlphaBits - GainShift)) /
+                con->m_v.dctcp_acked);
+        }
+        con->m_v.dctcp_alpha = MinValue(alpha, std::uint16_t(1u << AlphaBits));
+        
+        con->m_v.dctcp_wnd_end = pcb->snd_nxt;
+        con->m_v.dctcp_acked = 0;
+        con->m_v.dctcp_marked = 0;
+    }
+    
+    // Delivery rate sample from an ACK, see pcb_bbr_rate_sample. There is no
+    // sample if delivered is zero. The RTT of the sampled segment is given
+    // separately, DrTimeTypeMax if none.
+    struct BbrRateSample {
+        TcpSeqInt delivered;
+        DrTimeType interval;
+        DrTimeType rtt;
+        bool app_limited;
+    };
+    
+    // Get the delivery rate snapshot for a segment which is being sent
+    // (draft-cheng-iccrg-delivery-rate-estimation section 3.2). If nothing
+    // is in flight, the intervals for rate samples start now, and if sending
+    // was app-limited, BBR is restarting after idle. Retransmitted segments
+    // give no RTT sample since the ACK may be for an earlier transmission.
+    static SegInfo pcb_seg_info (TcpPcb *pcb, bool retransmitted)
+    {
+        if constexpr (!TcpProto::EnableBbr) {
+            return SegInfo();
+        } else {
+            Connection *con = pcb->con;
+            DrTimeType now = pcb_dr_time(pcb);
+            
+            if (pcb->snd_nxt == pcb->snd_una) {
+                con->m_v.dr_first_sent_time = now;
+                con->m_v.dr_delivered_time = now;
+                
+                if (con->m_v.dr_app_limited) {
+                    pcb_bbr_idle_restart(pcb);
+                }
+            }
+            
+            return SegInfo{con->m_v.dr_delivered, now, con->m_v.dr_delivered_time,
+                           con->m_v.dr_first_sent_time, bool(con->m_v.dr_app_limited),
+                           retransmitted};
+        }
+    }
+    
+    // Account newly acked data and take a delivery rate sample based on the
+    // snapshot of the last fully acked sampled segment (see TcpSegSamples).
+    // This is called before the samples are removed. The rate is the data
+    // delivered since that segment was sent divided by the longer of the send
+    // and ACK intervals. Without SACK only cumulative ACKs give samples, and
+    // data already counted for duplicate ACKs (see pcb_bbr_dup_ack_received)
+    // is not counted again.
+    // The intervals and the RTT are measured in delivery rate time units,
+    // because with an RTT below the RTT time unit, rounding them up would
+    // underestimate the rate and overestimate the BDP.
+    static void pcb_bbr_rate_sample (
+        TcpPcb *pcb, TcpSeqNum ack_num, TcpSeqInt acked, BbrRateSample &rs)
+    {
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        DrTimeType now = pcb_dr_time(pcb);
+        
+        rs.delivered = 0;
+        rs.interval = 0;
+        rs.rtt = DrTimeTypeMax;
+        rs.app_limited = false;
+        
+        RttType rack_sent_time;
+        SegInfo info;
+        bool have_info = con->m_v.seg_samples.getLastAcked(
+            pcb->snd_una, ack_num, rack_sent_time, info) > 0;
+        
+        TcpSeqInt dup_credit = MinValue(acked, con->m_v.dr_dup_delivered);
+        con->m_v.dr_dup_delivered -= dup_credit;
+        con->m_v.dr_delivered += acked - dup_credit;
+        con->m_v.dr_delivered_time = now;
+        
+        if (con->m_v.dr_app_limited && con->m_v.dr_app_limited_end.mod_lt(ack_num)) {
+            con->m_v.dr_app_limited = false;
+        }
+        
+        if (!have_info) {
+            return;
+        }
+        
+        con->m_v.dr_first_sent_time = info.sent_time;
+        
+        if (!info.retransmitted) {
+            rs.rtt = now - info.sent_time;
+        }
+        
+        DrTimeType send_elapsed = info.sent_time - info.first_sent_time;
+        DrTimeType ack_elapsed = now - info.delivered_time;
+        DrTimeType interval = MaxValue(send_elapsed, ack_elapsed);
+        
+        // An interval shorter than the minimum RTT means that ACKs were
+        // compressed, the sample would overestimate the rate.
+        if (con->m_v.bbr_min_rtt != DrTimeTypeMax && interval < con->m_v.bbr_min_rtt) {
+            return;
+        }
+        
+        rs.delivered = con->m_v.dr_delivered - info.delivered;
+        rs.interval = MaxValue(interval, DrTimeType(1));
+        rs.app_limited = info.app_limited;
+    }
+    
+    // BBR congestion control (draft-cardwell-iccrg-bbr-congestion-control),
+    // called for new ACKs with the delivery rate sample. This updates the model
+    // (maximum bandwidth over recent rounds and minimum RTT), advances the
+    // state machine and sets cwnd and the pacing rate from the model. Loss
+    // does not affect the model.
+    static void pcb_bbr_ack_received (TcpPcb *pcb, TcpSeqNum ack_num, TcpSeqInt acked,
+                                      BbrRateSample const &rs)
+    {
+        AIPSTACK_ASSERT(pcb->state().canOutput());
+        AIPSTACK_ASSERT(pcb->con != nullptr);
+        
+        Connection *con = pcb->con;
+        RttType now = pcb_rack_time(pcb);
+        DrTimeType dr_now = pcb_dr_time(pcb);
+        TcpSeqInt inflight = pcb->snd_nxt - ack_num;
+        
+        // A round ends when data sent at its start is acked.
+        con->m_v.bbr_round_start = false;
+        if (!ack_num.mod_lt(con->m_v.bbr_round_end)) {
+            con->m_v.bbr_round_end = pcb->snd_nxt;
+            con->m_v.bbr_round_count++;
+            con->m_v.bbr_round_start = true;
+        }
+        
+        // Update the bandwidth filter. App-limited samples are only used if
+        // they raise the estimate.
+        if (rs.delivered > 0) {
+            constexpr int BwShift = Constants::BbrBwBits + RttToDrShift;
+            std::uint32_t bw = MinValueU(TypeMax<std::uint32_t>,
+                (std::uint64_t(rs.delivered) << BwShift) / rs.interval);
+            if (!rs.app_limited || bw >= con->m_v.bbr_bw.get()) {
+                con->m_v.bbr_bw.update(con->m_v.bbr_round_count, bw,
+                                       Constants::BbrBwFilterRounds);
+            }
+            con->m_v.bbr_idle_restart = false;
+        }
+        
+        // In ProbeBW, advance the pacing gain cycle.
+        if (con->m_v.bbr_mode == TcpBbrMode::ProbeBw &&
+            pcb_bbr_is_next_cycle_phase(pcb, inflight, dr_now))
+        {
+            pcb_bbr_advance_cycle_phase(pcb, dr_now);
+        }
+        
+        // Startup ends when the bandwidth estimate stops growing.
+        if (!con->m_v.bbr_full_bw_reached && con->m_v.bbr_round_start && !rs.app_limited) {
+            std::uint32_t bw = con->m_v.bbr_bw.get();
+            std::uint64_t bw_thresh = (std::uint64_t(con->m_v.bbr_full_bw) *
+                Constants::BbrFullBwGain) >> Constants::BbrGainBits;
+            if (bw >= bw_thresh) {
+                con->m_v.bbr_full_bw = bw;
+                con->m_v.bbr_full_bw_cnt = 0;
+            }
+            else if (++con->m_v.bbr_full_bw_cnt >= Constants::BbrFullBwRounds) {
+                con->m_v.bbr_full_bw_reached = true;
+            }
+        }
+        
+        // After Startup, Drain the queue which was created, until inflight
+        // is down to the estimated BDP.
+        if (con->m_v.bbr_mode == TcpBbrMode::Startup && con->m_v.bbr_full_bw_reached) {
+            con->m_v.bbr_mode = TcpBbrMode::Drain;
+            con->m_v.bbr_pacing_gain = Constants::BbrDrainGain;
+            con->m_v.bbr_cwnd_gain = Constants::BbrHighGain;
+        }
+        if (con->m_v.bbr_mode == TcpBbrMode::Drain &&
+            inflight <= pcb_bbr_bdp(pcb, Constants::BbrUnitGain))
+        {
+            pcb_bbr_enter_probe_bw(pcb, dr_now);
+        }
+        
+        // Update the minimum RTT and handle ProbeRTT.
+        pcb_bbr_update_min_rtt(pcb, rs.rtt, inflight, now, dr_now);
+        
+        // Restore cwnd after an RTO once the data sent before it is acked.
+        if (con->m_v.bbr_rto_restore && (!pcb->hasFlag(TcpPcbFlags::Recover) ||
+                                         !ack_num.mod_lt(con->m_v.recover)))
+        {
+            con->m_v.bbr_rto_restore = false;
+            con->m_v.cwnd = MaxValue(con->m_v.cwnd, con->m_v.bbr_prior_cwnd);
+        }
+        
+        pcb_bbr_update_pacing_bw(pcb);
+        pcb_bbr_set_cwnd(pcb, acked);
+    }
+    
+    // Whether to move to the next phase of the ProbeBW gain cycle. Each
+    // phase lasts at least the minimum RTT. A phase probing for more
+    // bandwidth also lasts until inflight has been raised accordingly, and
+    // the following phase ends early when inflight is down to the BDP.
+    static bool pcb_bbr_is_next_cycle_phase (
+        TcpPcb *pcb, TcpSeqInt inflight, DrTimeType dr_now)
+    {
+        Connection *con = pcb->con;
+        
+        bool full_length = con->m_v.bbr_min_rtt != DrTimeTypeMax &&
+            DrTimeType(dr_now - con->m_v.bbr_cycle_stamp) > con->m_v.bbr_min_rtt;
+        std::uint16_t gain = con->m_v.bbr_pacing_gain;
+        
+        if (gain == Constants::BbrUnitGain) {
+            return full_length;
+        }
+        if (gain > Constants::BbrUnitGain) {
+            return full_length && inflight >= pcb_bbr_bdp(pcb, gain);
+        }
+        return full_length || inflight <= pcb_bbr_bdp(pcb, Constants::BbrUnitGain);
+    }
+    
+    static void pcb_bbr_advance_cycle_phase (TcpPcb *pcb, DrTimeType dr_now)
+    {
+        Connection *con = pcb->con;
+        
+        con->m_v.bbr_cycle_idx = (con->m_v.bbr_cycle_idx + 1) % Constants::BbrGainCycleLen;
+        con->m_v.bbr_cycle_stamp = dr_now;
+        con->m_v.bbr_pacing_gain = Constants::BbrPacingGainCycle[con->m_v.bbr_cycle_idx];
+    }
+    
+    static void pcb_bbr_enter_startup (TcpPcb *pcb)
+    {
+        Connection *con = pcb->con;
+        
+        con->m_v.bbr_mode = TcpBbrMode::Startup;
+        con->m_v.bbr_pacing_gain = Constants::BbrHighGain;
+        con->m_v.bbr_cwnd_gain = Constants::BbrHighGain;
+    }
+    
+    // Enter ProbeBW at a pseudo-random phase of the gain cycle other than
+    // the one below unity, so that flows do not probe in sync. The initial
+    // sequence number is random so snd_nxt serves as the random value.
+    static void pcb_bbr_enter_probe_bw (TcpPcb *pcb, DrTimeType dr_now)
+    {
+        Connection *con = pcb->con;
+        
+        constexpr std::uint8_t CycleLen = Constants::BbrGainCycleLen;
+        
+        con->m_v.bbr_mode = TcpBbrMode::ProbeBw;
+        con->m_v.bbr_cwnd_gain = Constants::BbrCwndGain;
+        con->m_v.bbr_cycle_idx = CycleLen - 1 - pcb->snd_nxt.value() % (CycleLen - 1);
+        pcb_bbr_advance_cycle_phase(pcb, dr_now);
+    }
+    
+    // Update the minimum RTT from an RTT sample. If it has not been seen for
+    // BbrMinRttWindow, it is probed for in ProbeRTT by reducing cwnd to
+    // BbrMinCwndSegs for BbrProbeRttTime and at least a round.
+    static void pcb_bbr_update_min_rtt (TcpPcb *pcb, DrTimeType rtt, TcpSeqInt inflight,
+                                        RttType now, DrTimeType dr_now)
+    {
+        Connection *con = pcb->con;
+        
+        bool expired =
+            RttType(now - con->m_v.bbr_min_rtt_stamp) > Constants::BbrMinRttWindow;
+        
+        if (rtt != DrTimeTypeMax && (rtt <= con->m_v.bbr_min_rtt || expired)) {
+            con->m_v.bbr_min_rtt = rtt;
+            con->m_v.bbr_min_rtt_stamp = now;
+        }
+        
+        if (expired && !con->m_v.bbr_idle_restart &&
+            con->m_v.bbr_mode != TcpBbrMode::ProbeRtt)
+        {
+            pcb_bbr_save_cwnd(pcb);
+            con->m_v.bbr_mode = TcpBbrMode::ProbeRtt;
+            con->m_v.bbr_pacing_gain = Constants::BbrUnitGain;
+            con->m_v.bbr_cwnd_gain = Constants::BbrUnitGain;
+            con->m_v.bbr_probe_rtt_timing = false;
+        }
+        
+        if (con->m_v.bbr_mode != TcpBbrMode::ProbeRtt) {
+            return;
+        }
+        
+        // Rate samples are app-limited during ProbeRTT.
+        con->m_v.dr_app_limited = true;
+        con->m_v.dr_app_limited_end = pcb->snd_nxt;
+        
+        if (!con->m_v.bbr_probe_rtt_timing) {
+            // Start timing once inflight is down to the ProbeRTT cwnd.
+            if (inflight <= pcb_bbr_min_cwnd(pcb)) {
+                con->m_v.bbr_probe_rtt_timing = true;
+                con->m_v.bbr_probe_rtt_done = now + Constants::BbrProbeRttTime;
+                con->m_v.bbr_probe_rtt_round_done = false;
+                con->m_v.bbr_round_end = pcb->snd_nxt;
+            }
+        } else {
+            if (con->m_v.bbr_round_start) {
+                con->m_v.bbr_probe_rtt_round_done = true;
+            }
+            if (con->m_v.bbr_probe_rtt_round_done &&
+                RttType(now - con->m_v.bbr_probe_rtt_done) <= RttTypeMax / 2)
+            {
+                con->m_v.bbr_min_rtt_stamp = now;
+                con->m_v.cwnd = MaxValue(con->m_v.cwnd, con->m_v.bbr_prior_cwnd);
+                
+                if (con->m_v.bbr_full_bw_reached) {
+                    pcb_bbr_enter_probe_bw(pcb, dr_now);
+                } else {
+                    pcb_bbr_enter_startup(pcb);
+                }
+            }
+        }
+    }
+    
+    // Remember cwnd to be restored after ProbeRTT or an RTO.
+    static void pcb_bbr_save_cwnd (TcpPcb *pcb)
+    {
+        Connection *con = pcb->con;
+        
+        if (con->m_v.bbr_mode != TcpBbrMode::ProbeRtt && !con->m_v.bbr_rto_restore) {
+            con->m_v.bbr_prior_cwnd = con->m_v.cwnd;
+        } else {
+            con->m_v.bbr_prior_cwnd = MaxValue(con->m_v.bbr_prior_cwnd, con->m_v.cwnd);
+        }
+    }
+    
+    // Sending restarts after the connection was idle. In ProbeBW this is at
+    // the estimated bandwidth, and ProbeRTT is not entered until an ACK gives
+    // a new rate sample.
+    static void pcb_bbr_idle_restart (TcpPcb *pcb)
+    {
+        Connection *con = pcb->con;
+        
+        con->m_v.bbr_idle_restart = true;
+        
+        if (con->m_v.bbr_mode == TcpBbrMode::ProbeBw) {
+            con->m_v.bbr_pacing_bw = con->m_v.bbr_bw.get();
+        }
+    }
+    
+    static TcpSeqInt pcb_bbr_min_cwnd (TcpPcb *pcb)
+    {
+        return Constants::BbrMinCwndSegs * TcpSeqInt(pcb->snd_mss);
+    }
+    
+    // The estimated bandwidth-delay product scaled by a gain. This is the
+    // initial cwnd while the minimum RTT is not known.
+    static TcpSeqInt pcb_bbr_bdp (TcpPcb *pcb, std::uint16_t gain)
+    {
+        Connection *con = pcb->con;
+        
+        if (con->m_v.bbr_min_rtt == DrTimeTypeMax) {
+            return pcb_initial_cwnd(pcb);
+        }
+        
+        // The bandwidth is per RTT time unit and the minimum RTT is in delivery
+        // rate time units. The product is limited before applying the gain.
+        constexpr int Shift = Constants::BbrBwBits + Constants::BbrGainBits;
+        std::uint64_t bw_rtt = (std::uint64_t(con->m_v.bbr_bw.get()) *
+            MaxValue(con->m_v.bbr_min_rtt, DrTimeType(1))) >> RttToDrShift;
+        bw_rtt = MinValueU(bw_rtt,
+            std::uint64_t(Constants::MaxWindow) << Constants::BbrBwBits);
+        std::uint64_t bdp = bw_rtt * gain;
+        bdp = (bdp + ((std::uint64_t(1) << Shift) - 1)) >> Shift;
+        
+        return MinValueU(Constants::MaxWindow, bdp);
+    }
+    
+    // Set cwnd toward cwnd_gain times the BDP. In Startup cwnd grows with
+    // each ACK as in slow start.
+    static void pcb_bbr_set_cwnd (TcpPcb *pcb, TcpSeqInt acked)
+    {
+        Connection *con = pcb->con;
+        
+        TcpSeqInt target = pcb_bbr_bdp(pcb, con->m_v.bbr_cwnd_gain);
+        AddToSat(target, Constants::BbrCwndQuantumSegs * TcpSeqInt(pcb->snd_mss));
+        
+        TcpSeqInt cwnd = con->m_v.cwnd;
+        if (con->m_v.bbr_full_bw_reached) {
+            AddToSat(cwnd, acked);
+            cwnd = MinValue(cwnd, target);
+        }
+        else if (cwnd < target || con->m_v.dr_delivered < pcb_initial_cwnd(pcb)) {
+            AddToSat(cwnd, acked);
+        }
+        
+        TcpSeqInt min_cwnd = pcb_bbr_min_cwnd(pcb);
+        cwnd = MinValue(Constants::MaxWindow, MaxValue(cwnd, min_cwnd));
+        if (con->m_v.bbr_mode == TcpBbrMode::ProbeRtt) {
+            cwnd = MinValue(cwnd, min_cwnd);
+        }
+        
+        con->m_v.cwnd = cwnd;
+        pcb->clearFlag(TcpPcbFlags::CwndInit);
+    }
+    
+    // Set the pacing rate to pacing_gain times the estimated bandwidth, or
+    // before any bandwidth sample, the initial cwnd over the SRTT. In Startup
+    // the pacing rate is not lowered.
+    static void pcb_bbr_update_pacing_bw (TcpPcb *pcb)
+    {
+        Connection *con = pcb->con;
+        
+        std::uint32_t bw = con->m_v.bbr_bw.get();
+        if (bw == 0) {
+            if (!pcb->hasFlag(TcpPcbFlags::RttValid)) {
+                return;
+            }
+            bw = MinValueU(TypeMax<std::uint32_t>,
+                (std::uint64_t(con->m_v.cwnd) << Constants::BbrBwBits) /
+                MaxValue(con->m_v.srtt, RttType(1)));
+        }
+        
+        std::uint32_t pacing_bw = MinValueU(TypeMax<std::uint32_t>,
+            (std::uint64_t(bw) * con->m_v.bbr_pacing_gain) >> Constants::BbrGainBits);
+        
+        if (con->m_v.bbr_full_bw_reached || pacing_bw > con->m_v.bbr_pacing_bw) {
+            con->m_v.bbr_pacing_bw = pacing_bw;
+        }
+    }
+    
+    // Check whether sending a segment is allowed by the pacing rate, else set
+    // the OutputTimer for when it is. Sending may get ahead of the pacing
+    // schedule by up to BbrPacingBurstTicks.
+    // NOTE: doDelayedTimerUpdate must be called after return.
+    static bool pcb_bbr_pacing_allows (TcpPcb *pcb)
+    {
+        Connection *con = pcb->con;
+        
+        if (con->m_v.bbr_pacing_bw == 0) {
+            return true;
+        }
+        
+        TimeType now = pcb->platform().getTime();
+        
+        // With nothing in flight the schedule restarts, this also keeps it
+        // from falling too far behind the current time.
+        if (pcb->snd_nxt == pcb->snd_una) {
+            con->m_v.bbr_pace_time = now;
+            return true;
+        }
+        
+        TimeType send_time = con->m_v.bbr_pace_time - Constants::BbrPacingBurstTicks;
+        if (pcb->platform().timeGreaterOrEqual(now, send_time)) {
+            return true;
+        }
+        
+        // The OutputTimer is now for pacing, not for retrying sending.
+        pcb->tim(OutputTimer()).setAt(send_time);
+        pcb->clearFlag(TcpPcbFlags::OutRetry);
+        return false;
+    }
+    
+    // Advance the pacing schedule for a segment which was sent.
+    static void pcb_bbr_paced_sent (TcpPcb *pcb, TcpSeqInt seg_seqlen)
+    {
+        Connection *con = pcb->con;
+        
+        if (con->m_v.bbr_pacing_bw == 0) {
+            return;
+        }
+        
+        // Unused time when sending was not possible does not add up.
+        TimeType now = pcb->platform().getTime();
+        if (pcb->platform().timeGreaterOrEqual(now, con->m_v.bbr_pace_time)) {
+            con->m_v.bbr_pace_time = now;
+        }
+        
+        constexpr int Shift = Constants::BbrBwBits + Constants::RttShift;
+        con->m_v.bbr_pace_time += TimeType(
+            (std::uint64_t(seg_seqlen) << Shift) / con->m_v.bbr_pacing_bw);
+    }
+    
     static void pcb_start_rtt_measurement (TcpPcb *pcb, bool syn)
     {
         AIPSTACK_ASSERT(!syn ||
@@ -1215,9 +2694,56 @@ private:
         }
     }
     
+    // Fill in the Fast Open option of a SYN or SYN-ACK and determine any data
+    // to be sent with the SYN (RFC 7413).
+    static void pcb_syn_fast_open (TcpPcb *pcb, TcpOptions &tcp_opts, IpBufRef &syn_data)
+    {
+        TcpProto *tcp = pcb->tcp;
+        
+        tcp_opts.options |= TcpOptionFlags::FastOpen;
+        
+        // In a SYN-ACK, give the client a cookie for future connections.
+        if (pcb->state() == TcpStates::SYN_RCVD) {
+            tcp_opts.fast_open_cookie_len = TcpFastOpenCookieGen::CookieLen;
+            tcp->m_fast_open_gen.makeCookie(pcb->remote_addr, tcp_opts.fast_open_cookie);
+            return;
+        }
+        
+        // Without a cached cookie, send a cookie request (empty cookie).
+        auto *entry = tcp->m_fast_open_cache.find(pcb->remote_addr);
+        if (entry == nullptr) {
+            tcp_opts.fast_open_cookie_len = 0;
+            return;
+        }
+        
+        tcp_opts.fast_open_cookie_len = entry->cookie_len;
+        std::memcpy(tcp_opts.fast_open_cookie, entry->cookie, entry->cookie_len);
+        
+        // Data is only sent with the first SYN, retransmissions are plain SYNs
+        // in case the SYN was dropped due to the data or option.
+        if (pcb->snd_nxt != pcb->snd_una) {
+            return;
+        }
+        
+        // Send what fits into a segment according to the MSS previously received
+        // from the server, our interface MSS and the PMTU (stored in snd_mss), less
+        // the options.
+        std::uint16_t pmtu = pcb->snd_mss;
+        std::size_t max_seg = MinValueU(MinValue(entry->mss, pcb->base_snd_mss),
+                                        pmtu - Ip4TcpHeaderSize);
+        std::size_t opts_len = CalcTcpOptionsLength(tcp_opts);
+        if (max_seg <= opts_len) {
+            return;
+        }
+        
+        IpBufRef snd_buf = pcb->con->m_v.snd_buf;
+        syn_data = snd_buf.subTo(MinValueU(snd_buf.tot_len, max_seg - opts_len));
+    }
+    
     class PcbOutputHelper {
     private:
         bool prepared;
+        IpSendFlags prepared_send_flags;
         IpChksumAccumulator::State partial_chksum_state;
         IpSendPreparedIp4<StackArg> ip_prep;
         TxAllocHelper<Tcp4Header::Size, HeaderBeforeIp4Dgram> dgram_alloc;
@@ -1233,15 +2759,16 @@ private:
             // things, to optimize sending multiple segments at a time.
         }
         
-        IpErr sendSegment (TcpPcb *pcb,
-            TcpSeqNum seq_num, Tcp4Flags seg_flags, IpBufRef data)
+        IpErr sendSegment (TcpPcb *pcb, TcpSeqNum seq_num, Tcp4Flags seg_flags,
+            IpBufRef data, IpSendFlags ip_send_flags)
         {
             // Reset the TxAllocHelper.
             dgram_alloc.reset(Tcp4Header::Size);
             
-            // If this is the first tranamission, prepare common things.
-            if (!prepared) {
-                IpErr err = prepareCommon(pcb);
+            // If this is the first tranamission, prepare common things. This is
+            // also needed if the IP send flags change (ECN-capable or not).
+            if (!prepared || AIPSTACK_UNLIKELY(ip_send_flags != prepared_send_flags)) {
+                IpErr err = prepareCommon(pcb, ip_send_flags);
                 if (AIPSTACK_UNLIKELY(err != IpErr::Success)) {
                     return err;
                 }
@@ -1284,7 +2811,7 @@ private:
         }
         
     private:
-        IpErr prepareCommon (TcpPcb *pcb)
+        IpErr prepareCommon (TcpPcb *pcb, IpSendFlags ip_send_flags)
         {
             // We will calculate part of the checksum.
             IpChksumAccumulator chksum;
@@ -1323,12 +2850,13 @@ private:
             // Perform IP level preparation.
             IpErr err = pcb->tcp->m_stack->prepareSendIp4Dgram(
                 dgram_alloc.getPtr(), ip_prep, Ip4CommonSendParams{
-                    *pcb, TcpProto::TcpTTL, Ip4Protocol::Tcp, Constants::TcpIpSendFlags});
+                    *pcb, TcpProto::TcpTTL, Ip4Protocol::Tcp, ip_send_flags});
             if (AIPSTACK_UNLIKELY(err != IpErr::Success)) {
                 return err;
             }
             
             prepared = true;
+            prepared_send_flags = ip_send_flags;
             
             return IpErr::Success;
         }
@@ -1337,7 +2865,8 @@ private:
     AIPSTACK_NO_INLINE
     static IpErr send_tcp_nodata (TcpProto *tcp, TcpPcbKey const &key,
         TcpSeqNum seq_num, TcpSeqNum ack_num, std::uint16_t window_size,
-        Tcp4Flags flags, TcpOptions *opts, IpSendRetryRequest *retryReq)
+        Tcp4Flags flags, TcpOptions *opts, IpSendRetryRequest *retryReq,
+        IpBufRef syn_data = IpBufRef{})
     {
         // Compute length of TCP options.
         std::uint8_t opts_len = (opts != nullptr) ? CalcTcpOptionsLength(*opts) : 0;
@@ -1384,6 +2913,13 @@ private:
             WriteTcpOptions(*opts, dgram_alloc.getPtr() + Tcp4Header::Size);
         }
         
+        // Include any data sent with a SYN (TCP Fast Open).
+        IpBufNode data_node;
+        if (AIPSTACK_UNLIKELY(syn_data.tot_len > 0)) {
+            data_node = ipBufRefToNode(syn_data);
+            dgram_alloc.setNext(&data_node, syn_data.tot_len);
+        }
+        
         // Construct the datagram reference including any data.
         IpBufRef dgram = dgram_alloc.getBufRef();
         
@@ -25,7 +25,11 @@
 #ifndef AIPSTACK_TCP_API_H
 #define AIPSTACK_TCP_API_H
 
+#include <cstddef>
+
 #include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/SipHash.h>
 #include <aipstack/platform/PlatformFacade.h>
 #include <aipstack/tcp/TcpSeqNum.h>
 #include <aipstack/tcp/TcpListener.h>
@@ -73,6 +77,68 @@ public:
     {
         return proto().platform();
     }
+    
+    /**
+     * Return the number of PCBs which currently exist.
+     * 
+     * With a static PCB array this is always the NumTcpPcbs option. If the
+     * PcbArrayService option is used, PCBs are created as needed up to
+     * NumTcpPcbs and this returns the number created so far.
+     * 
+     * @return Number of PCBs.
+     */
+    inline int getNumPcbs () const
+    {
+        return proto().get_num_pcbs();
+    }
+    
+    /**
+     * Make sure that at least the given number of PCBs exist.
+     * 
+     * If the PcbArrayService option is used, this creates PCBs up front so
+     * that the memory for them is committed before it is needed. With a
+     * static PCB array this does nothing.
+     * 
+     * @param num_pcbs Number of PCBs requested. Must be non-negative.
+     * @return True if at least `num_pcbs` PCBs exist after the call, false if
+     *         this exceeds NumTcpPcbs or memory could not be committed.
+     */
+    inline bool reservePcbs (int num_pcbs)
+    {
+        AIPSTACK_ASSERT(num_pcbs >= 0);
+        return proto().grow_pcbs(std::size_t(num_pcbs));
+    }
+    
+    /**
+     * Set the secret key used to generate and check TCP Fast Open cookies.
+     * 
+     * Cookies are a MAC of the client address keyed by this key, so it must be
+     * random. There is no default key; @ref TcpListener::startListening refuses
+     * to enable Fast Open until a key has been set using this function. Cookies
+     * given out with the previous key become invalid.
+     * 
+     * @param key New key.
+     */
+    inline void setFastOpenKey (SipHashKey const &key)
+    {
+        proto().m_fast_open_gen.setKey(key);
+        proto().m_fast_open_key_set = true;
+    }
+    
+    /**
+     * Set the secret key used to select ephemeral ports for active connections.
+     * 
+     * Ports are selected as in RFC 6056 Algorithm 4, using a hash keyed by this
+     * key. Until a random key is set the port sequences are predictable, so a key
+     * must be set before the first connection with an ephemeral port is made (this is
+     * checked by an assertion).
+     * 
+     * @param key New key, which should be random.
+     */
+    inline void setEphemeralPortKey (SipHashKey const &key)
+    {
+        proto().m_ephemeral_ports.setKey(key);
+    }
 };
 
 }
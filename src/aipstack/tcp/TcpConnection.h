@@ -41,6 +41,7 @@
 #include <aipstack/ip/IpMtuRef.h>
 #include <aipstack/tcp/TcpState.h>
 #include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/tcp/TcpMiscUtils.h>
 #include <aipstack/tcp/TcpListener.h>
 
 namespace AIpStack {
@@ -60,6 +61,26 @@ struct TcpStartConnectionArgs {
     Ip4Addr addr = Ip4Addr::ZeroAddr();
     std::uint16_t port = 0;
     std::size_t rcv_wnd = 0;
+    
+    /**
+     * Use TCP Fast Open (RFC 7413).
+     * 
+     * The SYN carries a Fast Open cookie previously received from the server, or
+     * a cookie request if none is cached. With a cookie, sending of the SYN is
+     * deferred until the application calls @ref TcpConnection::sendPush or
+     * @ref TcpConnection::closeSending (or briefly if it does not), and the SYN
+     * then carries the leading part of the send buffer. Data not acknowledged by
+     * the SYN-ACK is sent normally after the connection is established.
+     */
+    bool fast_open = false;
+    
+    /**
+     * Initial congestion window in segments, or zero for the default of the
+     * stack (IpTcpProtoOptions::InitialCwndSegments).
+     * 
+     * See @ref TcpConnection::setInitialCwnd.
+     */
+    std::uint8_t initial_cwnd_segs = 0;
 };
 
 /**
@@ -89,6 +110,9 @@ class TcpConnection :
     using TcpConOutput = typename TcpConProto::Output;
     using TcpConConstants = typename TcpConProto::Constants;
     using TcpConOosBuffer = typename TcpConProto::OosBuffer;
+    using TcpConSegTimes = typename TcpConProto::SegTimes;
+    using TcpConSegSamples = typename TcpConProto::SegSamples;
+    using TcpConBwFilter = typename TcpConProto::BwFilter;
 
 public:
     /**
@@ -218,6 +242,11 @@ public:
         // Initialize TcpConnection variables, set STARTED flag.
         setup_common_started();
         
+        // Use any initial cwnd requested for this connection.
+        if (args.initial_cwnd_segs != 0) {
+            m_v.iw_segs = args.initial_cwnd_segs;
+        }
+        
         return IpErr::Success;
     }
     
@@ -233,6 +262,8 @@ public:
         src_con->assert_connected();
         
         static_assert(std::is_trivially_copy_constructible_v<TcpConOosBuffer>);
+        static_assert(std::is_trivially_copy_constructible_v<TcpConSegTimes>);
+        static_assert(std::is_trivially_copy_constructible_v<TcpConSegSamples>);
         
         // Byte-copy the whole m_v.
         std::memcpy(&m_v, &src_con->m_v, sizeof(m_v));
@@ -359,6 +390,30 @@ public:
         setWindowUpdateThreshold(thres);
     }
     
+    /**
+     * Sets the initial congestion window in segments.
+     * 
+     * The initial window is used when the connection is established and when
+     * sending is restarted after an idle period (RFC 5681 section 4.1). If the
+     * congestion window is still the initial window, it is updated immediately,
+     * so this can be called just after @ref acceptConnection. The byte limit
+     * of RFC 6928 applies, see @ref TcpStartConnectionArgs::initial_cwnd_segs
+     * for setting this before the connection is established.
+     * May only be called in CONNECTED or CLOSED state.
+     * The value must be positive.
+     */
+    void setInitialCwnd (std::uint8_t iw_segs)
+    {
+        assert_started();
+        AIPSTACK_ASSERT(iw_segs > 0);
+        
+        m_v.iw_segs = iw_segs;
+        
+        if (m_v.pcb != nullptr) {
+            TcpConOutput::pcb_initial_cwnd_changed(m_v.pcb);
+        }
+    }
+    
     /**
      * Returns the last announced receive window.
      * May only be called in CONNECTED state.
@@ -424,6 +479,91 @@ public:
         }
     }
     
+    /**
+     * Enables or disables automatic tuning of the receive buffer size.
+     * 
+     * While enabled, the amount of data received per round-trip time is
+     * measured, and when the receive buffer would limit the sender, the
+     * @ref recvBufGrowRequested callback is called with a larger desired
+     * buffer size, not exceeding max_buf_size. The application may then grow
+     * the buffer using @ref setRecvBuf (see also RecvRingBuffer::resize).
+     * 
+     * The buf_size is the current size of the application's receive buffer,
+     * including any received data not yet consumed. Passing zero max_buf_size
+     * disables auto-tuning, which is the default.
+     * May only be called in CONNECTED or CLOSED state.
+     */
+    void setRecvBufAutoTuning (std::size_t buf_size, std::size_t max_buf_size)
+    {
+        assert_started();
+        
+        m_v.rcv_at_size = buf_size;
+        m_v.rcv_at_max = max_buf_size;
+        m_v.rcv_at_measuring = false;
+    }
+    
+    /**
+     * Returns by how much the receive buffer may be reduced using
+     * @ref shrinkRecvBuf.
+     * 
+     * The receive buffer cannot be reduced below the receive window which
+     * has already been announced, since the window must not be shrunk, nor
+     * below any buffered out-of-sequence data.
+     * May only be called in CONNECTED or CLOSED state.
+     */
+    std::size_t getRecvBufShrinkable () const
+    {
+        assert_started();
+        
+        std::size_t rcv_buf_len = m_v.rcv_buf.tot_len;
+        if (m_v.pcb == nullptr) {
+            return rcv_buf_len;
+        }
+        
+        TcpSeqInt keep_len = MaxValue(m_v.pcb->rcv_ann_wnd,
+            m_v.ooseq.getBufferedExtent(m_v.pcb->rcv_nxt));
+        
+        return (keep_len >= rcv_buf_len) ? 0 : std::size_t(rcv_buf_len - keep_len);
+    }
+    
+    /**
+     * Returns the length of the initial part of the receive buffer which holds
+     * out-of-sequence data.
+     * 
+     * The data within this part may have gaps. The rest of the receive buffer
+     * contains nothing of use, so only this part needs to be preserved when
+     * moving the receive buffer to different memory.
+     * May only be called in CONNECTED or CLOSED state.
+     */
+    std::size_t getRecvBufOosExtent () const
+    {
+        assert_started();
+        
+        if (m_v.pcb == nullptr) {
+            return 0;
+        }
+        
+        return std::size_t(m_v.ooseq.getBufferedExtent(m_v.pcb->rcv_nxt));
+    }
+    
+    /**
+     * Reduces the receive buffer by the specified amount.
+     * 
+     * This is intended for releasing receive buffer memory under memory
+     * pressure. The amount must not exceed @ref getRecvBufShrinkable. It is
+     * also deducted from the buffer size used for auto-tuning. Note that
+     * RecvRingBuffer must instead be shrunk using RecvRingBuffer::resize.
+     * May only be called in CONNECTED or CLOSED state.
+     */
+    void shrinkRecvBuf (std::size_t amount)
+    {
+        assert_started();
+        AIPSTACK_ASSERT(amount <= getRecvBufShrinkable());
+        
+        m_v.rcv_buf.tot_len -= amount;
+        m_v.rcv_at_size -= MinValue(amount, m_v.rcv_at_size);
+    }
+    
     /**
      * Returns the current receive buffer.
      * May only be called in CONNECTED or CLOSED state.
@@ -495,7 +635,7 @@ public:
         // Set snd_buf_cur to snd_buf advanced to the send offset.
         m_v.snd_buf_cur = ipBufSkipBytes(snd_buf, snd_offset);
         
-        if (AIPSTACK_LIKELY(m_v.pcb != nullptr && extended)) {
+        if (AIPSTACK_LIKELY(m_v.pcb != nullptr && extended && !m_v.snd_corked)) {
             // Inform the output code, so it may send the data.
             TcpConOutput::pcb_snd_buf_extended(m_v.pcb);
         }
@@ -518,12 +658,40 @@ public:
         // Also adjust snd_buf_cur.
         m_v.snd_buf_cur.tot_len += amount;
     
-        if (AIPSTACK_LIKELY(m_v.pcb != nullptr && amount > 0)) {
+        if (AIPSTACK_LIKELY(m_v.pcb != nullptr && amount > 0 && !m_v.snd_corked)) {
             // Inform the output code, so it may send the data.
             TcpConOutput::pcb_snd_buf_extended(m_v.pcb);
         }
     }
     
+    /**
+     * Sets the low watermark for @ref dataSent notifications.
+     * 
+     * With a nonzero low watermark, the amounts of acknowledged data are
+     * accumulated and @ref dataSent is only called once at least low_wmark
+     * bytes are unreported or all data in the send buffer has been
+     * acknowledged. The call is made after the processing of received segments
+     * completes, so that data acknowledged by multiple ACKs processed together
+     * is reported at once. Any unreported data is reported just before the
+     * acknowledgement of a FIN. Zero (the default) means that acknowledged
+     * data is reported immediately for each ACK.
+     * May only be called in CONNECTED or CLOSED state.
+     */
+    void setSendLowWatermark (std::size_t low_wmark)
+    {
+        assert_started();
+        
+        m_v.snd_low_wmark = low_wmark;
+        
+        // If there is unreported data which should now be reported, make
+        // sure that it will be.
+        if (m_v.pcb != nullptr && m_v.snd_unreported > 0 &&
+            m_v.snd_unreported >= low_wmark)
+        {
+            TcpConInput::pcb_sent_report_needed(m_v.pcb);
+        }
+    }
+    
     /**
      * Returns the current send buffer.
      * May only be called in CONNECTED or CLOSED state.
@@ -552,14 +720,20 @@ public:
         // Set the push index to the end of the send buffer.
         m_v.snd_psh_index = m_v.snd_buf.tot_len;
         
-        // Remember that sending is closed.
+        // Remember that sending is closed. This also ends corking.
         m_v.snd_closed = true;
+        m_v.snd_corked = false;
         
         // Inform the output code, e.g. to adjust the PCB state
         // and send a FIN. But not in SYN_SENT, in that case the
-        // input code will take care of it when the SYN is received.
-        if (m_v.pcb != nullptr && m_v.pcb->state() != TcpStates::SYN_SENT) {
-            TcpConOutput::pcb_end_sending(m_v.pcb);
+        // input code will take care of it when the SYN is received,
+        // but a SYN deferred for Fast Open is sent now.
+        if (m_v.pcb != nullptr) {
+            if (m_v.pcb->state() != TcpStates::SYN_SENT) {
+                TcpConOutput::pcb_end_sending(m_v.pcb);
+            } else {
+                TcpConOutput::pcb_fast_open_push(m_v.pcb);
+            }
         }
     }
     
@@ -587,12 +761,92 @@ public:
     
     /**
      * Push sending of currently queued data.
+     * While corked (see @ref cork), this does nothing and the data is
+     * pushed by @ref uncork or @ref flush.
      * May only be called in CONNECTED or CLOSED state.
      */
     void sendPush ()
     {
         assert_started();
         
+        // No need to do anything after closeSending or while corked.
+        if (m_v.snd_closed || m_v.snd_corked) {
+            return;
+        }
+        
+        // Set the push index to the current send buffer size.
+        m_v.snd_psh_index = m_v.snd_buf.tot_len;
+        
+        // Tell the output code to push, if necessary. In SYN_SENT
+        // this sends a SYN deferred for Fast Open.
+        if (m_v.pcb != nullptr && m_v.snd_buf.tot_len > 0) {
+            if (m_v.pcb->state().isSndOpen()) {
+                TcpConOutput::pcb_push_output(m_v.pcb);
+            }
+            else if (m_v.pcb->state() == TcpStates::SYN_SENT) {
+                TcpConOutput::pcb_fast_open_push(m_v.pcb);
+            }
+        }
+    }
+    
+    /**
+     * Corks the connection, so that data added to the send buffer is held
+     * back until @ref uncork or @ref flush is called.
+     * 
+     * While corked, extending the send buffer does not schedule output and
+     * @ref sendPush does nothing. Queued data may still be sent in full-sized
+     * segments when output is done for other reasons (such as received ACKs).
+     * This allows building a response over multiple calls and sending it in
+     * full segments without the delay of the output timer. Corking ends when
+     * @ref closeSending is called.
+     * May only be called in CONNECTED or CLOSED state.
+     * May only be called before endSending is called.
+     */
+    void cork ()
+    {
+        assert_sending();
+        
+        m_v.snd_corked = true;
+    }
+    
+    /**
+     * Ends corking (see @ref cork) and sends all queued data as by @ref flush.
+     * May only be called in CONNECTED or CLOSED state.
+     */
+    void uncork ()
+    {
+        assert_started();
+        
+        if (m_v.snd_corked) {
+            m_v.snd_corked = false;
+            flush();
+        }
+    }
+    
+    /**
+     * Returns whether the connection is corked (see @ref cork).
+     * May only be called in CONNECTED or CLOSED state.
+     */
+    inline bool isCorked () const
+    {
+        assert_started();
+        
+        return m_v.snd_corked;
+    }
+    
+    /**
+     * Pushes all queued data and sends it immediately.
+     * 
+     * Unlike @ref sendPush, this does not wait for the output timer. When
+     * called from a callback during processing of a received segment, the
+     * data is sent at the end of that processing. This works the same whether
+     * corked or not and does not end corking.
+     * May only be called in CONNECTED or CLOSED state.
+     */
+    void flush ()
+    {
+        assert_started();
+        
         // No need to do anything after closeSending.
         if (m_v.snd_closed) {
             return;
@@ -601,11 +855,15 @@ public:
         // Set the push index to the current send buffer size.
         m_v.snd_psh_index = m_v.snd_buf.tot_len;
         
-        // Tell the output code to push, if necessary.
-        if (m_v.pcb != nullptr && m_v.pcb->state().isSndOpen() &&
-            m_v.snd_buf.tot_len > 0)
-        {
-            TcpConOutput::pcb_push_output(m_v.pcb);
+        // Tell the output code to send now. In SYN_SENT this sends
+        // a SYN deferred for Fast Open.
+        if (m_v.pcb != nullptr && m_v.snd_buf.tot_len > 0) {
+            if (m_v.pcb->state().isSndOpen()) {
+                TcpConOutput::pcb_flush_output(m_v.pcb);
+            }
+            else if (m_v.pcb->state() == TcpStates::SYN_SENT) {
+                TcpConOutput::pcb_fast_open_push(m_v.pcb);
+            }
         }
     }
     
@@ -650,10 +908,23 @@ protected:
      * Called when some data or FIN has been sent and acknowledged.
      * 
      * Each dataSent callback corresponds to shifting of the send buffer
-     * by that amount. Zero amount indicates that FIN was acknowledged.
+     * by that amount, or by several amounts adding up to it when a low
+     * watermark is used (see @ref setSendLowWatermark). Zero amount
+     * indicates that FIN was acknowledged.
      */
     virtual void dataSent (std::size_t amount) = 0;
     
+    /**
+     * Called when receive buffer auto-tuning determines that a larger
+     * receive buffer is needed (see @ref setRecvBufAutoTuning).
+     * 
+     * The buf_size is the desired total size of the receive buffer including
+     * any received data not yet consumed. Successive calls request increasing
+     * sizes. The application may grow the buffer from within the callback or
+     * later, or ignore the request.
+     */
+    virtual void recvBufGrowRequested ([[maybe_unused]] std::size_t buf_size) {}
+    
 private:
     inline IpMtuRef<TcpConStackArg> & mtu_ref () {
         return *this;
@@ -700,9 +971,27 @@ private:
         // Initialize rcv_ann_thres.
         m_v.rcv_ann_thres = TcpConConstants::DefaultWndAnnThreshold;
         
+        // Use the initial cwnd of the stack.
+        m_v.iw_segs = TcpConProto::InitialCwndSegments;
+        
+        // Receive buffer auto-tuning is disabled by default.
+        m_v.rcv_at_max = 0;
+        
+        // Report sent data immediately by default.
+        m_v.snd_low_wmark = 0;
+        m_v.snd_unreported = 0;
+        
+        // Not corked initially.
+        m_v.snd_corked = false;
+        
         // Initialize the out-of-sequence information.
         m_v.ooseq.init();
         
+        // Clear the transmit times used for RACK loss detection and the
+        // sampled segments.
+        m_v.seg_times.reset();
+        m_v.seg_samples.reset();
+        
         // Set STARTED flag to indicate we're no longer in INIT state.
         m_v.started = true;
     }
@@ -745,8 +1034,31 @@ private:
         AIPSTACK_ASSERT(!m_v.end_sent);
         AIPSTACK_ASSERT(amount > 0);
         
-        // Call the application callback.
-        dataSent(amount);
+        // Without a low watermark, call the application callback now.
+        if (m_v.snd_low_wmark == 0) {
+            dataSent(amount);
+            return;
+        }
+        
+        // Accumulate the amount, and when the low watermark is reached or the
+        // send buffer has drained, have it reported from the SentTimer.
+        m_v.snd_unreported += amount;
+        if (m_v.snd_unreported >= m_v.snd_low_wmark || m_v.snd_buf.tot_len == 0) {
+            TcpConInput::pcb_sent_report_needed(m_v.pcb);
+        }
+    }
+    
+    void report_sent ()
+    {
+        assert_connected();
+        
+        std::size_t amount = m_v.snd_unreported;
+        if (amount > 0) {
+            m_v.snd_unreported = 0;
+            
+            // Call the application callback.
+            dataSent(amount);
+        }
     }
     
     void end_sent ()
@@ -754,6 +1066,8 @@ private:
         assert_connected();
         AIPSTACK_ASSERT(!m_v.end_sent);
         AIPSTACK_ASSERT(m_v.snd_closed);
+        // Any unreported data must have been reported via report_sent.
+        AIPSTACK_ASSERT(m_v.snd_unreported == 0);
         
         // Remember that end was sent.
         m_v.end_sent = true;
@@ -772,6 +1086,14 @@ private:
         dataReceived(amount);
     }
     
+    void recv_buf_grow_requested (std::size_t buf_size)
+    {
+        assert_connected();
+        
+        // Call the application callback.
+        recvBufGrowRequested(buf_size);
+    }
+    
     void end_received ()
     {
         assert_connected();
@@ -801,11 +1123,23 @@ private:
     }
     
 private:
+    // The fields are ordered such that those used for each segment come
+    // first: the base sender and receiver state, the segment send times and
+    // the state for deferred send reporting and receive auto-tuning. Next are
+    // the sampled segments and the state of the optional algorithms (ECN/DCTCP,
+    // PLPMTUD, HyStart++, BBR), which are also used for each segment when they
+    // are enabled. The out-of-sequence information is last, since its size
+    // depends on NumOosSegs and only its header is normally checked.
     struct TcpConVars {
         TcpConPcb *pcb;
         IpBufRef snd_buf;
         IpBufRef rcv_buf;
         IpBufRef snd_buf_cur;
+        std::size_t snd_psh_index;
+        std::size_t snd_low_wmark;
+        std::size_t snd_unreported;
+        std::size_t rcv_at_max;
+        std::size_t rcv_at_size;
         TcpSeqInt snd_wnd : 30;
         TcpSeqInt started : 1;
         TcpSeqInt snd_closed : 1;
@@ -819,10 +1153,75 @@ private:
         TcpSeqNum rtt_test_seq;
         typename TcpConConstants::RttType rttvar;
         typename TcpConConstants::RttType srtt;
+        TcpSeqNum rcv_at_seq;
+        typename TcpConConstants::RttType rcv_at_time;
+        std::uint8_t iw_segs;
+        std::uint8_t dr_app_limited : 1;
+        std::uint8_t bbr_full_bw_reached : 1;
+        std::uint8_t bbr_round_start : 1;
+        std::uint8_t bbr_idle_restart : 1;
+        std::uint8_t bbr_probe_rtt_timing : 1;
+        std::uint8_t bbr_probe_rtt_round_done : 1;
+        std::uint8_t bbr_rto_restore : 1;
+        std::uint8_t rcv_at_measuring : 1;
+        std::uint8_t snd_corked : 1;
+        TcpConSegTimes seg_times;
+        TcpConSegSamples seg_samples;
+        TcpSeqNum ecn_recover;
+        TcpSeqNum dctcp_wnd_end;
+        TcpSeqInt dctcp_acked;
+        TcpSeqInt dctcp_marked;
+        std::uint16_t dctcp_alpha;
+        std::uint16_t mtu_probe_size;
+        TcpSeqNum mtu_probe_seq;
+        std::uint16_t mtu_search_high;
+        std::uint8_t mtu_rto_count;
+        std::uint8_t hs_rtt_samples;
+        std::uint8_t hs_css_rounds;
+        TcpSeqNum hs_round_end;
+        typename TcpConConstants::RttType hs_last_min_rtt;
+        typename TcpConConstants::RttType hs_cur_min_rtt;
+        typename TcpConConstants::RttType hs_css_base_rtt;
+        TcpSeqInt dr_delivered;
+        TcpSeqInt dr_dup_delivered;
+        TcpSeqNum dr_app_limited_end;
+        typename TcpConConstants::DrTimeType dr_delivered_time;
+        typename TcpConConstants::DrTimeType dr_first_sent_time;
+        typename TcpConConstants::DrTimeType bbr_min_rtt;
+        typename TcpConConstants::DrTimeType bbr_cycle_stamp;
+        TcpConBwFilter bbr_bw;
+        std::uint32_t bbr_full_bw;
+        std::uint32_t bbr_pacing_bw;
+        typename TcpConProto::TimeType bbr_pace_time;
+        TcpSeqInt bbr_prior_cwnd;
+        TcpSeqNum bbr_round_end;
+        typename TcpConConstants::RttType bbr_min_rtt_stamp;
+        typename TcpConConstants::RttType bbr_probe_rtt_done;
+        std::uint16_t bbr_round_count;
+        std::uint16_t bbr_pacing_gain;
+        std::uint16_t bbr_cwnd_gain;
+        TcpBbrMode bbr_mode;
+        std::uint8_t bbr_cycle_idx;
+        std::uint8_t bbr_full_bw_cnt;
         TcpConOosBuffer ooseq;
-        std::size_t snd_psh_index;
     };
     
+    static_assert(std::is_standard_layout_v<TcpConVars>);
+    
+    // The out-of-sequence information must be the last member.
+    static_assert(sizeof(TcpConVars) - offsetof(TcpConVars, ooseq) - sizeof(TcpConOosBuffer)
+                  < alignof(TcpConVars));
+    
+    // The base fields used for each segment fit within three cache lines, and
+    // together with the fields of the optional algorithms (excluding the
+    // segment times, the sampled segments and the bandwidth filter, which are
+    // arrays whose sizes depend on the configuration) and the header of the
+    // out-of-sequence information within five.
+    static_assert(offsetof(TcpConVars, seg_times) <= 3 * TcpConConstants::CacheLineSize);
+    static_assert(offsetof(TcpConVars, ooseq) + 2 * sizeof(TcpSeqNum)
+                  - sizeof(TcpConSegTimes) - sizeof(TcpConSegSamples)
+                  - sizeof(TcpConBwFilter) <= 5 * TcpConConstants::CacheLineSize);
+    
     TcpConVars m_v;
 };
 
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef AIPSTACK_TCP_FAST_OPEN_H
+#define AIPSTACK_TCP_FAST_OPEN_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/BinaryTools.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/tcp/TcpOptions.h>
+
+namespace AIpStack {
+
+#ifndef IN_DOXYGEN
+
+/**
+ * Generates and verifies TCP Fast Open cookies (RFC 7413 section 4.1.2).
+ * 
+ * A cookie is the SipHash-2-4 of the client IP address under a secret key,
+ * so no per-client state is needed to verify it.
+ */
+class TcpFastOpenCookieGen {
+public:
+    // Length of the cookies that we generate.
+    inline static constexpr std::uint8_t CookieLen = 8;
+    
+    void setKey (SipHashKey const &key)
+    {
+        m_key = key;
+    }
+    
+    void makeCookie (Ip4Addr client_addr, char *out) const
+    {
+        char msg[4];
+        WriteBinaryInt<std::uint32_t, BinaryBigEndian>(client_addr.value(), msg);
+        std::uint64_t mac = SipHash24(m_key, msg, sizeof(msg));
+        WriteBinaryInt<std::uint64_t, BinaryBigEndian>(mac, out);
+    }
+    
+    bool checkCookie (Ip4Addr client_addr, char const *cookie, std::uint8_t len) const
+    {
+        if (len != CookieLen) {
+            return false;
+        }
+        char expected[CookieLen];
+        makeCookie(client_addr, expected);
+        return std::memcmp(cookie, expected, CookieLen) == 0;
+    }
+    
+private:
+    SipHashKey m_key;
+};
+
+/**
+ * Cache of TCP Fast Open cookies received from servers, keyed by server address.
+ * 
+ * The least recently used entry is replaced when the cache is full.
+ * 
+ * @tparam NumEntries Capacity of the cache (may be zero).
+ */
+template<int NumEntries>
+class TcpFastOpenCookieCache
+{
+    static_assert(NumEntries >= 0);
+    
+public:
+    struct Entry {
+        Ip4Addr addr;
+        // MSS option received from the server, limits data in the SYN.
+        std::uint16_t mss;
+        std::uint8_t cookie_len;
+        char cookie[TcpMaxFastOpenCookieLen];
+        // Value of m_use_counter at last use, zero if the entry is unused.
+        std::uint32_t last_use;
+    };
+    
+    TcpFastOpenCookieCache () :
+        m_use_counter(0)
+    {
+        for (Entry &entry : m_entries) {
+            entry.last_use = 0;
+        }
+    }
+    
+    Entry const * find (Ip4Addr addr)
+    {
+        Entry *entry = find_entry(addr);
+        if (entry != nullptr) {
+            entry->last_use = next_use();
+        }
+        return entry;
+    }
+    
+    void store (Ip4Addr addr, std::uint16_t mss, char const *cookie, std::uint8_t cookie_len)
+    {
+        AIPSTACK_ASSERT(cookie_len >= TcpMinFastOpenCookieLen);
+        AIPSTACK_ASSERT(cookie_len <= TcpMaxFastOpenCookieLen);
+        
+        if constexpr (NumEntries > 0) {
+            // Update an existing entry for the address or replace the LRU entry.
+            Entry *entry = find_entry(addr);
+            if (entry == nullptr) {
+                entry = &m_entries[0];
+                for (Entry &other : m_entries) {
+                    if (other.last_use < entry->last_use) {
+                        entry = &other;
+                    }
+                }
+            }
+            
+            entry->addr = addr;
+            entry->mss = mss;
+            entry->cookie_len = cookie_len;
+            std::memcpy(entry->cookie, cookie, cookie_len);
+            entry->last_use = next_use();
+        }
+    }
+    
+    void remove (Ip4Addr addr)
+    {
+        Entry *entry = find_entry(addr);
+        if (entry != nullptr) {
+            entry->last_use = 0;
+        }
+    }
+    
+private:
+    Entry * find_entry (Ip4Addr addr)
+    {
+        for (Entry &entry : m_entries) {
+            if (entry.last_use != 0 && entry.addr == addr) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+    
+    std::uint32_t next_use ()
+    {
+        // On wrap-around, forget the ordering rather than treat entries as unused.
+        if (++m_use_counter == 0) {
+            for (Entry &entry : m_entries) {
+                if (entry.last_use != 0) {
+                    entry.last_use = 1;
+                }
+            }
+            m_use_counter = 2;
+        }
+        return m_use_counter;
+    }
+    
+private:
+    std::uint32_t m_use_counter;
+    Entry m_entries[NumEntries > 0 ? NumEntries : 1];
+};
+
+#endif
+
+}
+
+#endif
@@ -54,6 +54,19 @@ struct TcpListenParams {
     Ip4Addr addr = Ip4Addr::ZeroAddr();
     PortNum port = 0;
     int max_pcbs = 0;
+    
+    /**
+     * Whether to support TCP Fast Open (RFC 7413) for this listener.
+     * 
+     * If enabled, clients requesting a cookie receive one in the SYN-ACK, and a
+     * SYN with data and a valid cookie results in the @ref
+     * TcpListener::EstablishedHandler being called right away, with the data
+     * reported to the accepted connection as soon as it is accepted.
+     * 
+     * A Fast Open key must have been set using @ref TcpApi::setFastOpenKey,
+     * otherwise @ref TcpListener::startListening fails.
+     */
+    bool fast_open = false;
 };
 
 /**
@@ -99,7 +112,8 @@ public:
         m_established_handler(established_handler),
         m_initial_rcv_wnd(0),
         m_accept_pcb(nullptr),
-        m_listening(false)
+        m_listening(false),
+        m_fast_open(false)
     {}
     
     /**
@@ -132,6 +146,7 @@ public:
         m_initial_rcv_wnd = 0;
         m_accept_pcb = nullptr;
         m_listening = false;
+        m_fast_open = false;
     }
     
     /**
@@ -167,8 +182,9 @@ public:
      * 
      * Listening on the all-zeros address listens on all local addresses.
      * Must not be called when already listening.
-     * Return success/failure to start listening. It can fail only if there
-     * is another listener listening on the same pair of address and port.
+     * Return success/failure to start listening. It fails if there is another
+     * listener listening on the same pair of address and port, or if Fast Open
+     * is requested but no Fast Open key has been set.
      */
     bool startListening (TcpApi<Arg> &api, TcpListenParams const &params)
     {
@@ -182,6 +198,11 @@ public:
             return false;
         }
         
+        // Fast Open cookies would be forgeable without a secret key.
+        if (params.fast_open && !tcp.m_fast_open_key_set) {
+            return false;
+        }
+        
         // Start listening.
         m_tcp = &tcp;
         m_addr = params.addr;
@@ -189,6 +210,7 @@ public:
         m_max_pcbs = params.max_pcbs;
         m_num_pcbs = 0;
         m_listening = true;
+        m_fast_open = params.fast_open;
         m_tcp->m_listeners_list.prepend(*this);
         
         return true;
@@ -224,6 +246,7 @@ private:
     int m_max_pcbs;
     int m_num_pcbs;
     bool m_listening;
+    bool m_fast_open;
 };
 
 }
@@ -45,6 +45,7 @@ struct TcpSegMeta {
     std::uint16_t window_size;
     Tcp4Flags flags;
     TcpOptions *opts; // not used for RX (undefined), may be null for TX
+    bool ecn_ce; // RX only, the IP header had the CE codepoint
 };
 
 inline std::size_t CalcTcpSeqLen (Tcp4Flags flags, std::size_t tcp_data_len)
@@ -66,19 +67,17 @@ bool CalcTcpSndMss (
     return true;
 }
 
-inline TcpSeqInt CalcInitialTcpCwnd (std::uint16_t snd_mss)
+// Initial congestion window for iw_segs segments, limited in bytes as in
+// RFC 6928: min(iw_segs*MSS, max(2*MSS, iw_segs*1460)).
+inline TcpSeqInt CalcInitialTcpCwnd (std::uint16_t snd_mss, std::uint8_t iw_segs)
 {
-    if (snd_mss > 2190u) {
-        return 2u * TcpSeqInt(snd_mss);
-    }
-    else if (snd_mss > 1095u) {
-        return 3u * TcpSeqInt(snd_mss);
-    }
-    else {
-        return 4u * TcpSeqInt(snd_mss);
-    }
+    TcpSeqInt max_bytes = MaxValue(2u * TcpSeqInt(snd_mss), iw_segs * TcpSeqInt(1460));
+    return MinValue(iw_segs * TcpSeqInt(snd_mss), max_bytes);
 }
 
+// Modes of BBR congestion control.
+enum class TcpBbrMode : std::uint8_t {Startup, Drain, ProbeBw, ProbeRtt};
+
 }
 
 #endif
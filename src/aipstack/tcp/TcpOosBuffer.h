@@ -27,10 +27,13 @@
 
 #include <cstdint>
 #include <cstddef>
-#include <algorithm>
 
 #include <aipstack/meta/ChooseInt.h>
 #include <aipstack/misc/Assert.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/structure/AvlTree.h>
+#include <aipstack/structure/LinkModel.h>
+#include <aipstack/structure/Accessor.h>
 #include <aipstack/infra/Options.h>
 #include <aipstack/infra/Instance.h>
 #include <aipstack/tcp/TcpSeqNum.h>
@@ -43,7 +46,14 @@ namespace AIpStack {
  * 
  * It keeps information about up to a statically
  * configured number of received contiguous ranges
- * of data or FIN.
+ * of data, plus the sequence number of a received FIN.
+ * 
+ * The ranges are kept in an AVL tree ordered by sequence
+ * number (relative to rcv_nxt), so updates are logarithmic
+ * in the number of ranges. The tree nodes live in a fixed
+ * array within the object and are linked using array
+ * indices, so the object is trivially copyable and does
+ * not depend on its own address.
  */
 template<typename Arg>
 class TcpOosBuffer
@@ -51,63 +61,98 @@ class TcpOosBuffer
     static_assert(Arg::NumOosSegs > 0);
     using IndexType = ChooseIntForMax<Arg::NumOosSegs, false>;
     inline static constexpr IndexType NumOosSegs = Arg::NumOosSegs;
+    inline static constexpr IndexType NullIndex = TypeMax<IndexType>;
     
-    // Represents one contiguous region of buffered data or
-    // a FIN or an end marker.
-    struct OosSeg {
-        // First sequence number (for data segments).
-        TcpSeqNum start;
-        
-        // One-past-last sequence number (for data segments).
-        TcpSeqNum end;
+    struct OosSeg;
+    
+    // State for the link model, also carrying the rcv_nxt which
+    // is the reference point for comparing sequence numbers.
+    class OosState {
+    public:
+        inline OosState (OosSeg *segs, TcpSeqNum rcv_nxt) :
+            m_segs(segs), m_rcv_nxt(rcv_nxt)
+        {}
         
-        // Entry with start==end+1 marks the end of segments.
-        // In reality only {1, 0} will be used but checking this
-        // more general property is probably more efficient.
-        inline bool isEnd () const {
-            return start == end + 1u;
+        inline OosSeg & getEntryAt (std::size_t index)
+        {
+            return m_segs[index];
         }
         
-        // Make an end segment.
-        inline static OosSeg MakeEnd () {
-            return OosSeg{TcpSeqNum(1u), TcpSeqNum(0u)};
+        inline std::size_t getEntryIndex (OosSeg &seg)
+        {
+            return std::size_t(&seg - m_segs);
         }
         
-        // Entry with start==end represents a FIN.
-        // For a FIN, start and end will be the FIN sequence number
-        // plus 1. This simplifies algorithms because a FIN is not
-        // considerded to touch any preceding segment, just as data
-        // segments never touch each other.
-        inline bool isFin () const {
-            return start == end;
+        inline TcpSeqNum rcvNxt () const
+        {
+            return m_rcv_nxt;
         }
         
-        // Get the FIN sequence number of a FIN segment.
-        // It is only valid to call this on an isFin segment.
-        inline TcpSeqNum getFinSeq () const {
-            return start - 1u;
-        }
+    private:
+        OosSeg *m_segs;
+        TcpSeqNum m_rcv_nxt;
+    };
+    
+    using LinkModel = ArrayLinkModel<OosSeg, IndexType, NullIndex, OosState>;
+    using Link = typename LinkModel::Link;
+    using Ref = typename LinkModel::Ref;
+    
+    // Represents one contiguous range of buffered data.
+    // Ranges in the tree never intersect or touch each other.
+    struct OosSeg {
+        // First sequence number.
+        TcpSeqNum start;
+        
+        // One-past-last sequence number.
+        TcpSeqNum end;
         
-        // Make a FIN segment, with the given FIN sequence number.
-        inline static OosSeg MakeFin (TcpSeqNum fin_seq) {
-            TcpSeqNum seg_seq = fin_seq + 1u;
-            return OosSeg{seg_seq, seg_seq};
+        // Node in the tree of ranges (when in use).
+        AvlTreeNode<LinkModel> tree_node;
+        
+        // Next free entry (when free).
+        Link free_next;
+    };
+    
+    // Compares ranges by their start, and implements the lower-bound lookup
+    // which finds the first range that does not end strictly before a given
+    // sequence number (the lookup never finds an exact match).
+    struct OosCompare {
+        inline static int compareEntries (OosState st, Ref ref1, Ref ref2)
+        {
+            TcpSeqNum start1 = (*ref1).start;
+            TcpSeqNum start2 = (*ref2).start;
+            return (start1 == start2) ? 0 : st.rcvNxt().ref_lt(start1, start2) ? -1 : 1;
         }
         
-        // Check if segment is an end of FIN.
-        // This is supposed to be more efficient than isEnd||isFin.
-        inline bool isEndOrFin () const {
-            return start - end <= 1u;
+        inline static int compareKeyEntry (OosState st, TcpSeqNum seq, Ref ref)
+        {
+            return st.rcvNxt().ref_lt((*ref).end, seq) ? 1 : -1;
         }
     };
     
+    struct TreeNodeAccessor : public
+        MemberAccessor<OosSeg, AvlTreeNode<LinkModel>, &OosSeg::tree_node> {};
+    
+    using OosTree = AvlTree<TreeNodeAccessor, OosCompare, LinkModel>;
+    
 private:
-    // List of buffered segments.
-    // If there are less than NumOosSegs used, then the first
-    // end segment (isEnd()) marks the end. The end segment is
-    // not logically a valid segment, and segments following
-    // the end segment are undefined.
-    OosSeg m_ooseq[NumOosSegs];
+    // Whether a FIN has been received, and its sequence number.
+    // These and m_tree come first since isNothingBuffered is checked
+    // in the fast path.
+    bool m_fin_valid;
+    TcpSeqNum m_fin_seq;
+    
+    // Tree of buffered ranges.
+    OosTree m_tree;
+    
+    // Entries at or above m_num_alloc have never been used since
+    // the tree was last empty; other unused entries are in the
+    // free list starting at m_free_first.
+    IndexType m_num_alloc;
+    Link m_free_first;
+    
+    // Storage for the ranges.
+    OosSeg m_segs[NumOosSegs];
     
 public:
     /**
@@ -115,8 +160,9 @@ public:
      */
     inline void init ()
     {
-        // Set the first element to an end segment.
-        m_ooseq[0] = OosSeg::MakeEnd();
+        m_fin_valid = false;
+        m_tree.init();
+        reset_alloc();
     }
     
     /**
@@ -126,8 +172,7 @@ public:
      */
     inline bool isNothingBuffered () const
     {
-        // Check if the first element is an end segment.
-        return m_ooseq[0].isEnd();
+        return m_tree.isEmpty() && !m_fin_valid;
     }
     
     /**
@@ -152,6 +197,8 @@ public:
     bool updateForSegmentReceived (TcpSeqNum rcv_nxt, TcpSeqNum seg_start,
         std::size_t seg_datalen, bool seg_fin, bool &need_ack)
     {
+        OosState st(m_segs, rcv_nxt);
+        
         // Initialize need_ack to whether the segment is out of sequence.
         // If the segment fills in a gap this will be set to true below.
         need_ack = seg_start != rcv_nxt;
@@ -159,140 +206,98 @@ public:
         // Calculate sequence number for end of data.
         TcpSeqNum seg_end = seg_start + seg_datalen;
         
-        // Count the number of valid segments (this may include a FIN segment).
-        IndexType num_ooseq = count_ooseq();
-        
         // Check for FIN-related inconsistencies.
-        if (num_ooseq > 0 && m_ooseq[num_ooseq - 1].isFin()) {
-            // Have a buffered FIN, get its sequence number.
-            TcpSeqNum fin_seq = m_ooseq[num_ooseq - 1].getFinSeq();
-            
+        if (m_fin_valid) {
             // Check if we just received data beyond the buffered FIN. (A)
-            if (seg_datalen > 0 && !rcv_nxt.ref_lte(seg_end, fin_seq)) {
+            if (seg_datalen > 0 && !rcv_nxt.ref_lte(seg_end, m_fin_seq)) {
                 return false;
             }
             
             // Check if we just received a FIN at a different position.
-            if (seg_fin && seg_end != fin_seq) {
+            if (seg_fin && seg_end != m_fin_seq) {
                 return false;
             }
-        } else {
+        } else if (seg_fin) {
             // Check if we just received a FIN that is before already received data.
-            if (seg_fin && num_ooseq > 0 &&
-                !rcv_nxt.ref_lte(m_ooseq[num_ooseq - 1].end, seg_end)) {
+            Ref last = m_tree.last(st);
+            if (!last.isNull() && !rcv_nxt.ref_lte((*last).end, seg_end)) {
                 return false;
             }
         }
         
-        // If the new segment has any data, update the segments.
+        // If the new segment has any data, update the ranges.
         if (seg_datalen > 0) {
-            // Skip over segments strictly before this one.
-            // Note: we would never skip over a FIN segment due to check (A) above.
-            IndexType pos = 0;
-            while (pos < num_ooseq && rcv_nxt.ref_lt(m_ooseq[pos].end, seg_start)) {
-                pos++;
-            }
+            // Find the first range that is not strictly before this one.
+            Ref pos = find_first_not_before(st, seg_start);
             
-            // If there are no more segments or the segment [pos] is strictly
-            // after the new segment, we insert a new segment here. Otherwise
-            // the new segment intersects or touches [pos] and we merge the
-            // new segment with [pos] and possibly subsequent segments.
-            // No special accomodation of FIN segments is needed because a FIN
-            // appears with start==end equal to the FIN sequence number plus one.
-            if (pos == num_ooseq || rcv_nxt.ref_lt(seg_end, m_ooseq[pos].start)) {
-                // If all segment slots are used and we are not inserting to the end,
-                // release the last slot. This ensures that we can always accept
-                // in-sequence data, and not stall after all slots are exhausted.
-                // More generally, it means that if all slots are used we will
-                // discard existing data in favor of newly received data that
-                // precedes the existing data in terms of sequence numbers.
-                // Note that we may discard a FIN here, this is not a problem
-                // other than missing a chance to detect a FIN inconsistency.
-                if (num_ooseq == NumOosSegs && pos < NumOosSegs) {
-                    num_ooseq--;
+            // If there is no such range or it is strictly after the new segment,
+            // we insert a new range. Otherwise the new segment intersects or
+            // touches [pos] and we merge the new segment with [pos] and possibly
+            // subsequent ranges.
+            if (pos.isNull() || rcv_nxt.ref_lt(seg_end, (*pos).start)) {
+                // Allocate an entry. If all entries are used and we are not
+                // inserting to the end, release the last range. This ensures that
+                // we can always accept in-sequence data, and not stall after all
+                // entries are exhausted. More generally, it means that if all
+                // entries are used we will discard existing data in favor of newly
+                // received data that precedes the existing data in terms of
+                // sequence numbers.
+                Ref seg = alloc_seg(st);
+                if (seg.isNull() && !pos.isNull()) {
+                    Ref last = m_tree.last(st);
+                    m_tree.remove(last, st);
+                    free_seg(st, last);
+                    seg = alloc_seg(st);
                 }
                 
-                // Insert a segment to this spot only if there is space.
-                if (num_ooseq < NumOosSegs) {
-                    if (pos < num_ooseq) {
+                // Insert the range only if we got an entry. If it was inserted
+                // before an existing range, it filled a gap.
+                if (!seg.isNull()) {
+                    (*seg).start = seg_start;
+                    (*seg).end = seg_end;
+                    m_tree.insert(seg, nullptr, st);
+                    
+                    if (!m_tree.next(seg, st).isNull()) {
                         need_ack = true;
-                        std::move_backward(
-                            &m_ooseq[pos], &m_ooseq[num_ooseq], &m_ooseq[num_ooseq + 1]);
                     }
-                    m_ooseq[pos] = OosSeg{seg_start, seg_end};
-                    num_ooseq++;
                 }
             } else {
-                // The segment at [pos] cannot be a FIN.
-                // Proof: else branch implies seg_end >= [pos].start, therefore
-                // seg_end > [pos].start - 1 which is equivalent to the consistency
-                // check (A) assuming [pos] is the FIN, therefore the check would
-                // have failed and we wouldn't be here.
-                AIPSTACK_ASSERT(!m_ooseq[pos].isFin());
-                
-                // Extend the existing segment to the left if needed.
-                if (rcv_nxt.ref_lt(seg_start, m_ooseq[pos].start)) {
+                // Extend the existing range to the left if needed. This does not
+                // affect the ordering since the preceding range ends strictly
+                // before seg_start.
+                if (rcv_nxt.ref_lt(seg_start, (*pos).start)) {
                     need_ack = true;
-                    m_ooseq[pos].start = seg_start;
+                    (*pos).start = seg_start;
                 }
                 
-                // Extend the existing segment to the right if needed.
-                if (!rcv_nxt.ref_lte(seg_end, m_ooseq[pos].end)) {
+                // Extend the existing range to the right if needed.
+                if (!rcv_nxt.ref_lte(seg_end, (*pos).end)) {
                     need_ack = true;
-                    m_ooseq[pos].end = seg_end;
+                    (*pos).end = seg_end;
                     
-                    // Merge the extended segment [pos] with any subsequent segments
+                    // Merge the extended range [pos] with any subsequent ranges
                     // that it now intersects or touches.
-                    IndexType merge_pos = pos + 1;
-                    while (merge_pos < num_ooseq &&
-                           !rcv_nxt.ref_lt(seg_end, m_ooseq[merge_pos].start))
-                    {
-                        // Segment at [merge_pos] cannot be a FIN, for similar reasons that
-                        // [pos] could not be above.
-                        AIPSTACK_ASSERT(!m_ooseq[merge_pos].isFin());
-                        
-                        // If the extended segment [pos] extends no more than to the end of
-                        // [merge_pos], then [merge_pos] is the last segment to be merged.
-                        if (rcv_nxt.ref_lte(seg_end, m_ooseq[merge_pos].end)) {
-                            // Make sure [pos] includes the entire [merge_pos].
-                            m_ooseq[pos].end = m_ooseq[merge_pos].end;
-                            merge_pos++;
-                            break;
+                    Ref next = m_tree.next(pos, st);
+                    while (!next.isNull() && !rcv_nxt.ref_lt(seg_end, (*next).start)) {
+                        // Make sure [pos] includes the entire [next].
+                        if (!rcv_nxt.ref_lte((*next).end, seg_end)) {
+                            (*pos).end = (*next).end;
                         }
                         
-                        // The segment [merge_pos] is extends strictly over the end of
-                        // [merge_pos], continue looking for segments to merge.
-                        merge_pos++;
-                    }
-                    
-                    // If we merged [pos] with any subsequent segments, move any
-                    // remaining segments left over those merged segments and adjust
-                    // num_ooseq.
-                    IndexType num_merged = merge_pos - (pos + 1);
-                    if (num_merged > 0) {
-                        if (merge_pos < num_ooseq) {
-                            std::move(&m_ooseq[merge_pos],
-                                &m_ooseq[num_ooseq], &m_ooseq[pos + 1]);
-                        }
-                        num_ooseq -= num_merged;
+                        m_tree.remove(next, st);
+                        free_seg(st, next);
+                        
+                        next = m_tree.next(pos, st);
                     }
                 }
             }
         }
         
-        // If we got a FIN, remember it if not already and there is space.
-        if (seg_fin && (num_ooseq == 0 || !m_ooseq[num_ooseq - 1].isFin()) &&
-            num_ooseq < NumOosSegs)
-        {
-            m_ooseq[num_ooseq] = OosSeg::MakeFin(seg_end);
-            num_ooseq++;
-        }
-        
-        // If not all segments are used, terminate the list.
-        if (num_ooseq < NumOosSegs) {
-            m_ooseq[num_ooseq] = OosSeg::MakeEnd();
+        // If we got a FIN, remember it if not already.
+        if (seg_fin && !m_fin_valid) {
+            m_fin_valid = true;
+            m_fin_seq = seg_end;
         }
-        AIPSTACK_ASSERT(num_ooseq == count_ooseq());
         
         return true;
     }
@@ -312,47 +317,99 @@ public:
      */
     void shiftAvailable (TcpSeqNum rcv_nxt, std::size_t &datalen, bool &fin)
     {
-        // Check if we have a data segment starting at rcv_nxt.
-        if (!m_ooseq[0].isEndOrFin() && m_ooseq[0].start == rcv_nxt) {
+        OosState st(m_segs, rcv_nxt);
+        
+        // Check if we have a range starting at rcv_nxt.
+        Ref first = m_tree.first(st);
+        if (!first.isNull() && (*first).start == rcv_nxt) {
             // Return the data length to the caller.
-            TcpSeqNum seq_end = m_ooseq[0].end;
-            datalen = std::size_t(seq_end - m_ooseq[0].start);
+            TcpSeqNum seq_end = (*first).end;
+            datalen = std::size_t(seq_end - (*first).start);
             
-            // Shift the segment out of the buffer.
-            IndexType num_ooseq = count_ooseq();
-            if (num_ooseq > 1) {
-                std::move(&m_ooseq[1], &m_ooseq[num_ooseq], &m_ooseq[0]);
-            }
-            num_ooseq--;
-            m_ooseq[num_ooseq] = OosSeg::MakeEnd();
+            // Remove the range from the buffer.
+            m_tree.remove(first, st);
+            free_seg(st, first);
             
-            // The next segment is not supposed to have any data that we
+            // The next range is not supposed to have any data that we
             // could immediately consume since there are always gaps
-            // between segments.
-            AIPSTACK_ASSERT(m_ooseq[0].isEndOrFin() ||
-                            !rcv_nxt.ref_lte(m_ooseq[0].start, seq_end));
+            // between ranges.
+            AIPSTACK_ASSERT(m_tree.isEmpty() ||
+                !rcv_nxt.ref_lte((*m_tree.first(st)).start, seq_end));
         } else {
             // Not returning any data.
             datalen = 0;
         }
         
         // Check if we have a FIN with sequence number rcv_nxt+datalen.
-        // Note: no need to check !isEnd because isFin implies !isEnd.
         // There is no need to consume the FIN.
-        fin = m_ooseq[0].isFin() &&
-            m_ooseq[0].getFinSeq() == rcv_nxt + datalen;
+        fin = m_fin_valid && m_fin_seq == rcv_nxt + datalen;
+    }
+    
+    /**
+     * Return how far beyond rcv_nxt out-of-sequence data is buffered.
+     * 
+     * @param rcv_nxt The first sequence number that has not been received.
+     * @return The end of the last buffered range relative to rcv_nxt,
+     *         or zero if no data is buffered.
+     */
+    TcpSeqInt getBufferedExtent (TcpSeqNum rcv_nxt) const
+    {
+        // The tree is only read here, the state just needs a non-const pointer.
+        OosState st(const_cast<OosSeg *>(m_segs), rcv_nxt);
+        
+        Ref last = m_tree.last(st);
+        return last.isNull() ? 0 : TcpSeqInt((*last).end - rcv_nxt);
     }
     
 private:
-    // Return the number of out-of-sequence segments by counting
-    // until an end marker is found or the end of segments is reached.
-    IndexType count_ooseq () const
+    // Find the first range which does not end strictly before seq.
+    Ref find_first_not_before (OosState st, TcpSeqNum seq) const
     {
-        IndexType num_ooseq = 0;
-        while (num_ooseq < NumOosSegs && !m_ooseq[num_ooseq].isEnd()) {
-            num_ooseq++;
+        int comp;
+        Ref ref = m_tree.lookupInexact(seq, comp, st);
+        
+        // If the search ended at a range before seq, the result is the
+        // successor of that range.
+        if (!ref.isNull() && comp > 0) {
+            ref = m_tree.next(ref, st);
         }
-        return num_ooseq;
+        
+        return ref;
+    }
+    
+    // Allocate an entry, returns null if none is available.
+    Ref alloc_seg (OosState st)
+    {
+        if (!m_free_first.isNull()) {
+            Ref seg = m_free_first.ref(st);
+            m_free_first = (*seg).free_next;
+            return seg;
+        }
+        
+        if (m_num_alloc < NumOosSegs) {
+            return Ref(m_segs[m_num_alloc++]);
+        }
+        
+        return Ref::null();
+    }
+    
+    // Release an entry which has already been removed from the tree.
+    void free_seg (OosState st, Ref seg)
+    {
+        // If the tree is now empty, just reset allocation which avoids
+        // building up a long free list.
+        if (m_tree.isEmpty()) {
+            reset_alloc();
+        } else {
+            (*seg).free_next = m_free_first;
+            m_free_first = seg.link(st);
+        }
+    }
+    
+    void reset_alloc ()
+    {
+        m_num_alloc = 0;
+        m_free_first = Link::null();
     }
 };
 
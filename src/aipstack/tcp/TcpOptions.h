@@ -27,6 +27,7 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
 
 #include <aipstack/misc/Assert.h>
 #include <aipstack/misc/EnumUtils.h>
@@ -42,23 +43,34 @@ namespace AIpStack {
 enum class TcpOptionFlags : std::uint8_t {
     Mss      = 1 << 0,
     WndScale = 1 << 1,
+    FastOpen = 1 << 2,
 };
 AIPSTACK_ENUM_BITFIELD(TcpOptionFlags)
 
+// Allowed lengths of a TCP Fast Open cookie (RFC 7413 section 2).
+inline constexpr std::uint8_t TcpMinFastOpenCookieLen = 4;
+inline constexpr std::uint8_t TcpMaxFastOpenCookieLen = 16;
+
 // Container for TCP options that we care about.
 struct TcpOptions {
     TcpOptionFlags options;
     std::uint8_t wnd_scale;
     std::uint16_t mss;
+    // Fast Open cookie, a zero length with the FastOpen flag is a cookie request.
+    std::uint8_t fast_open_cookie_len;
+    char fast_open_cookie[TcpMaxFastOpenCookieLen];
 };
 
 namespace TcpOptionWriteLen {
     inline constexpr std::size_t MSS = 4;
     inline constexpr std::size_t WndScale = 4;
+    // Including the NOP padding to a multiple of 4 bytes.
+    inline constexpr std::size_t FastOpenMax = (2 + TcpMaxFastOpenCookieLen + 3) / 4 * 4;
 }
 
 inline constexpr std::size_t MaxTcpOptionsWriteLen =
-    TcpOptionWriteLen::MSS + TcpOptionWriteLen::WndScale;
+    TcpOptionWriteLen::MSS + TcpOptionWriteLen::WndScale +
+    TcpOptionWriteLen::FastOpenMax;
 
 inline void ParseTcpOptions (IpBufRef buf, TcpOptions &out_opts)
 {
@@ -115,6 +127,18 @@ inline void ParseTcpOptions (IpBufRef buf, TcpOptions &out_opts)
                 out_opts.wnd_scale = value;
             } break;
             
+            // Fast Open Cookie
+            case TcpOption::FastOpen: {
+                if (opt_data_len != 0 && (opt_data_len < TcpMinFastOpenCookieLen ||
+                    opt_data_len > TcpMaxFastOpenCookieLen || opt_data_len % 2 != 0))
+                {
+                    goto skip_option;
+                }
+                buf = ipBufTakeBytes(buf, opt_data_len, out_opts.fast_open_cookie);
+                out_opts.options |= TcpOptionFlags::FastOpen;
+                out_opts.fast_open_cookie_len = opt_data_len;
+            } break;
+            
             // Unknown option (also used to handle bad options).
             skip_option:
             default: {
@@ -133,6 +157,10 @@ inline std::uint8_t CalcTcpOptionsLength (TcpOptions const &tcp_opts)
     if ((tcp_opts.options & TcpOptionFlags::WndScale) != Enum0) {
         opts_len += TcpOptionWriteLen::WndScale;
     }
+    if ((tcp_opts.options & TcpOptionFlags::FastOpen) != Enum0) {
+        // Padded with NOPs to a multiple of 4 bytes.
+        opts_len += (2 + tcp_opts.fast_open_cookie_len + 3) / 4 * 4;
+    }
     AIPSTACK_ASSERT(opts_len <= MaxTcpOptionsWriteLen);
     AIPSTACK_ASSERT(opts_len % 4 == 0); // caller needs padding to 4-byte alignment
     return opts_len;
@@ -154,6 +182,23 @@ inline void WriteTcpOptions (TcpOptions const &tcp_opts, char *out)
         WriteSingleField<std::uint8_t>(out + 3, tcp_opts.wnd_scale);
         out += TcpOptionWriteLen::WndScale;
     }
+
+    if ((tcp_opts.options & TcpOptionFlags::FastOpen) != Enum0) {
+        std::uint8_t cookie_len = tcp_opts.fast_open_cookie_len;
+        AIPSTACK_ASSERT(cookie_len <= TcpMaxFastOpenCookieLen);
+        
+        // Pad with NOPs in front so that the option ends 4-byte aligned.
+        std::size_t pad_len = (4 - (2 + cookie_len) % 4) % 4;
+        for (std::size_t i = 0; i < pad_len; i++) {
+            WriteSingleField<std::uint8_t>(out + i, AsUnderlying(TcpOption::Nop));
+        }
+        out += pad_len;
+        
+        WriteSingleField<std::uint8_t>(out + 0, AsUnderlying(TcpOption::FastOpen));
+        WriteSingleField<std::uint8_t>(out + 1, std::uint8_t(2 + cookie_len));
+        std::memcpy(out + 2, tcp_opts.fast_open_cookie, cookie_len);
+        out += 2 + cookie_len;
+    }
 }
 
 }
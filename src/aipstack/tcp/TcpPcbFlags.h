@@ -71,6 +71,33 @@ enum class TcpPcbFlags : TcpPcbFlagsBaseType {
 };
 AIPSTACK_ENUM_BITFIELD(TcpPcbFlags)
 
+// Flags which did not fit into TcpPcbFlags, see TcpPcb::ext_flags.
+enum class TcpPcbExtFlags : std::uint8_t {
+    // TCP Fast Open (RFC 7413) is being used, meaning depends on the state:
+    // - SYN_SENT: the SYN carries a cookie or cookie request, and if a cookie is
+    //   cached the first SYN is deferred so that it can carry data.
+    // - SYN_RCVD: the SYN carried the option so our cookie goes in the SYN-ACK.
+    // - Other: the connection was accepted from the SYN and a retransmitted SYN
+    //   must be answered with a SYN-ACK (pcb_send_fast_open_syn_ack).
+    FastOpen   = std::uint8_t(1) << 0,
+    // A tail loss probe has been sent and nothing new has been acked since
+    TlpSent    = std::uint8_t(1) << 1,
+    // ECN (RFC 3168) is used, meaning depends on the state:
+    // - SYN_SENT: the SYN requests ECN.
+    // - SYN_RCVD: the SYN requested ECN and the SYN-ACK agrees.
+    // - Other: ECN has been negotiated, new data is sent as ECN-capable.
+    EcnOk      = std::uint8_t(1) << 2,
+    // CE has been received and ECE is to be sent
+    EcnEcho    = std::uint8_t(1) << 3,
+    // cwnd was reduced due to ECE and CWR is to be sent with new data
+    EcnCwr     = std::uint8_t(1) << 4,
+    // cwnd was reduced due to ECE and ecn_recover is valid (>=snd_una)
+    EcnRecover = std::uint8_t(1) << 5,
+    // A PLPMTUD probe segment starting at mtu_probe_seq is unacknowledged
+    MtuProbe   = std::uint8_t(1) << 6,
+};
+AIPSTACK_ENUM_BITFIELD(TcpPcbExtFlags)
+
 }
 
 #endif
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_TCP_SEG_SAMPLES_H
+#define AIPSTACK_TCP_SEG_SAMPLES_H
+
+#include <cstddef>
+
+#include <aipstack/meta/ChooseInt.h>
+#include <aipstack/misc/Assert.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+
+namespace AIpStack {
+
+#ifndef IN_DOXYGEN
+
+struct TcpSegSamplesNoInfo {};
+
+/**
+ * Keeps the exact transmit times of some outstanding TCP segments, for RTT
+ * samples (HyStart++) and delivery rate samples (BBR).
+ * 
+ * Unlike @ref TcpSegTimes, entries are never merged. A newly sent segment is
+ * sampled only if an entry is free, and an entry is freed when its segment is
+ * acknowledged, so with a large window a subset of the segments in each round
+ * is sampled. Each entry holds the end sequence number of the segment, the
+ * time it was last (re)transmitted and an InfoT value given at that time. The
+ * default InfoT is an empty type.
+ */
+template<typename TimeT, int NumEntries, typename InfoT = TcpSegSamplesNoInfo>
+class TcpSegSamples
+{
+    static_assert(NumEntries > 0);
+    using IndexType = ChooseIntForMax<NumEntries, false>;
+    
+public:
+    using Info = InfoT;
+    
+    inline void reset ()
+    {
+        m_num = 0;
+    }
+    
+    // Record that [seq, end_seq) has been sent at the given time. Entries
+    // whose segment ends within the range are being retransmitted and get the
+    // new time and info. If the range extends beyond the last entry and an
+    // entry is free, it is added as a new entry.
+    void sent (TcpSeqNum snd_una, TcpSeqNum seq, TcpSeqNum end_seq, TimeT time,
+               InfoT const &info = InfoT())
+    {
+        AIPSTACK_ASSERT(snd_una.ref_lt(seq, end_seq));
+        
+        TcpSeqInt rel_seq = seq - snd_una;
+        TcpSeqInt rel_end = end_seq - snd_una;
+        
+        for (IndexType i = 0; i < m_num; i++) {
+            TcpSeqInt entry_end = m_ends[i] - snd_una;
+            if (entry_end > rel_end) {
+                return;
+            }
+            if (entry_end > rel_seq) {
+                m_times[i] = time;
+                m_infos[i] = info;
+            }
+        }
+        
+        if (m_num < NumEntries &&
+            (m_num == 0 || m_ends[m_num - 1] - snd_una < rel_end))
+        {
+            m_ends[m_num] = end_seq;
+            m_times[m_num] = time;
+            m_infos[m_num] = info;
+            m_num++;
+        }
+    }
+    
+    // Get the transmit time and info of the last entry which is fully
+    // acknowledged by ack_num, to be called before acked(). Returns the
+    // number of fully acknowledged entries, if zero the outputs are not set.
+    std::size_t getLastAcked (TcpSeqNum snd_una, TcpSeqNum ack_num,
+                              TimeT &out_time, InfoT &out_info) const
+    {
+        IndexType num_acked = numAcked(snd_una, ack_num);
+        
+        if (num_acked > 0) {
+            out_time = m_times[num_acked - 1];
+            out_info = m_infos[num_acked - 1];
+        }
+        return num_acked;
+    }
+    
+    // Remove the entries which are fully acknowledged by ack_num.
+    void acked (TcpSeqNum snd_una, TcpSeqNum ack_num)
+    {
+        IndexType num_acked = numAcked(snd_una, ack_num);
+        
+        if (num_acked > 0) {
+            for (IndexType i = num_acked; i < m_num; i++) {
+                m_ends[i - num_acked] = m_ends[i];
+                m_times[i - num_acked] = m_times[i];
+                m_infos[i - num_acked] = m_infos[i];
+            }
+            m_num -= num_acked;
+        }
+    }
+    
+private:
+    IndexType numAcked (TcpSeqNum snd_una, TcpSeqNum ack_num) const
+    {
+        TcpSeqInt rel_ack = ack_num - snd_una;
+        
+        IndexType num_acked = 0;
+        while (num_acked < m_num && m_ends[num_acked] - snd_una <= rel_ack) {
+            num_acked++;
+        }
+        return num_acked;
+    }
+    
+private:
+    IndexType m_num;
+    TcpSeqNum m_ends[NumEntries];
+    TimeT m_times[NumEntries];
+    InfoT m_infos[NumEntries];
+};
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_TCP_SEG_TIMES_H
+#define AIPSTACK_TCP_SEG_TIMES_H
+
+#include <cstddef>
+
+#include <aipstack/meta/ChooseInt.h>
+#include <aipstack/misc/Assert.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+
+namespace AIpStack {
+
+#ifndef IN_DOXYGEN
+
+/**
+ * Keeps the transmit times of outstanding TCP data for time-based loss
+ * detection (RACK, RFC 8985).
+ * 
+ * Each entry covers a range of sequence numbers, starting where the previous
+ * entry ends (or at snd_una for the first entry), along with the time the range
+ * was last (re)transmitted. When more segments are outstanding than there are
+ * entries, the last entry is extended and takes the later time, so that loss
+ * is never detected too early.
+ */
+template<typename TimeT, int NumEntries>
+class TcpSegTimes
+{
+    static_assert(NumEntries > 0);
+    using IndexType = ChooseIntForMax<NumEntries, false>;
+    
+public:
+    inline void reset ()
+    {
+        m_num = 0;
+    }
+    
+    // Record that [seq, end_seq) has been sent at the given time. Entries
+    // covering retransmitted sequence numbers get the new time and any part
+    // beyond the last entry is added as a new entry.
+    void sent (TcpSeqNum snd_una, TcpSeqNum seq, TcpSeqNum end_seq, TimeT time)
+    {
+        AIPSTACK_ASSERT(snd_una.ref_lt(seq, end_seq));
+        
+        TcpSeqInt rel_seq = seq - snd_una;
+        TcpSeqInt rel_end = end_seq - snd_una;
+        
+        TcpSeqInt entry_start = 0;
+        for (IndexType i = 0; i < m_num; i++) {
+            TcpSeqInt entry_end = m_ends[i] - snd_una;
+            if (entry_start >= rel_end) {
+                return;
+            }
+            if (entry_end > rel_seq) {
+                m_times[i] = time;
+            }
+            entry_start = entry_end;
+        }
+        
+        if (entry_start < rel_end) {
+            if (m_num < NumEntries) {
+                m_num++;
+            }
+            m_ends[m_num - 1] = end_seq;
+            m_times[m_num - 1] = time;
+        }
+    }
+    
+    // Remove the entries which are fully acknowledged by ack_num.
+    void acked (TcpSeqNum snd_una, TcpSeqNum ack_num)
+    {
+        TcpSeqInt rel_ack = ack_num - snd_una;
+        
+        IndexType num_acked = 0;
+        while (num_acked < m_num && m_ends[num_acked] - snd_una <= rel_ack) {
+            num_acked++;
+        }
+        
+        if (num_acked > 0) {
+            for (IndexType i = num_acked; i < m_num; i++) {
+                m_ends[i - num_acked] = m_ends[i];
+                m_times[i - num_acked] = m_times[i];
+            }
+            m_num -= num_acked;
+        }
+    }
+    
+    // Get the transmit time of the first unacknowledged sequence number.
+    inline bool getFirstTime (TimeT &out_time) const
+    {
+        if (m_num == 0) {
+            return false;
+        }
+        out_time = m_times[0];
+        return true;
+    }
+    
+private:
+    IndexType m_num;
+    TcpSeqNum m_ends[NumEntries];
+    TimeT m_times[NumEntries];
+};
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_TCP_TIME_WAIT_TABLE_H
+#define AIPSTACK_TCP_TIME_WAIT_TABLE_H
+
+#include <cstdint>
+
+#include <aipstack/meta/ChooseInt.h>
+#include <aipstack/misc/Use.h>
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/structure/LinkModel.h>
+#include <aipstack/structure/LinkedList.h>
+#include <aipstack/structure/StructureRaiiWrapper.h>
+#include <aipstack/structure/Accessor.h>
+#include <aipstack/infra/Instance.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/tcp/TcpPcbKey.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+
+namespace AIpStack {
+
+#ifndef IN_DOXYGEN
+
+/**
+ * Compact storage for connections in TIME_WAIT state.
+ * 
+ * A connection entering TIME_WAIT only needs its address tuple and the
+ * sequence numbers required to acknowledge a retransmitted FIN and to validate
+ * a new SYN. Keeping these in this table instead of in a TcpPcb allows the PCB
+ * to be reused immediately.
+ * 
+ * All entries have the same timeout, so the expiry list is kept in order of
+ * expiration simply by appending and a single timer handles all entries. When
+ * the table is full, the entry closest to expiring is recycled.
+ * 
+ * @tparam PlatformImpl Platform implementation class.
+ * @tparam IndexService Index service for looking up entries by TcpPcbKey.
+ * @tparam NumEntries Capacity of the table.
+ */
+template<typename PlatformImpl, typename IndexService, int NumEntries>
+class TcpTimeWaitTable :
+    private NonCopyable<TcpTimeWaitTable<PlatformImpl, IndexService, NumEntries>>
+{
+    static_assert(NumEntries > 0);
+    
+    using Platform = PlatformFacade<PlatformImpl>;
+    AIPSTACK_USE_TYPES(Platform, (TimeType))
+    
+public:
+    struct Entry;
+    
+private:
+    // Array index type for entries and null value.
+    using EntryIndexType = ChooseIntForMax<NumEntries, false>;
+    inline static constexpr EntryIndexType EntryIndexNull = TypeMax<EntryIndexType>;
+    
+    // Link model for entries: array indices.
+    struct EntriesAccessor;
+    using EntryLinkModel = ArrayLinkModelWithAccessor<
+        Entry, EntryIndexType, EntryIndexNull, TcpTimeWaitTable, EntriesAccessor>;
+    using EntryRef = typename EntryLinkModel::Ref;
+    
+    // Index of used entries by address tuple.
+    struct EntryIndexAccessor;
+    using EntryIndexLookupKeyArg = TcpPcbKey const &;
+    struct EntryIndexKeyFuncs;
+    AIPSTACK_MAKE_INSTANCE(EntryIndex, (IndexService::template Index<
+        EntryIndexAccessor, EntryIndexLookupKeyArg, EntryIndexKeyFuncs, EntryLinkModel,
+        /*Duplicates=*/false>))
+    
+    // Used entries are in the expiry list ordered by expiration time,
+    // unused entries are in the free list.
+    struct EntryListAccessor;
+    using EntryList = LinkedList<EntryListAccessor, EntryLinkModel, true>;
+    
+public:
+    /**
+     * TIME_WAIT entry.
+     * 
+     * Only the fields inherited from @ref TcpPcbKey and the fields below
+     * may be used outside of this class.
+     */
+    struct Entry : public TcpPcbKey {
+        // Next sequence number expected from the peer (just after its FIN).
+        TcpSeqNum rcv_nxt;
+        
+        // Our next sequence number (just after our FIN).
+        TcpSeqNum snd_nxt;
+        
+        // Window size field for ACKs sent from TIME_WAIT.
+        std::uint16_t hdr_wnd;
+        
+    private:
+        friend TcpTimeWaitTable;
+        
+        typename EntryIndex::Node index_node;
+        LinkedListNode<EntryLinkModel> list_node;
+        TimeType expire_time;
+    };
+    
+private:
+    // Node accessors for the data structures.
+    struct EntryIndexAccessor : public
+        MemberAccessor<Entry, typename EntryIndex::Node, &Entry::index_node> {};
+    struct EntryListAccessor : public
+        MemberAccessor<Entry, LinkedListNode<EntryLinkModel>, &Entry::list_node> {};
+    
+    struct EntryIndexKeyFuncs : public TcpPcbKeyCompare {
+        inline static TcpPcbKey const & GetKeyOfEntry (Entry const &entry)
+        {
+            return entry;
+        }
+    };
+    
+public:
+    TcpTimeWaitTable (Platform platform, TimeType timeout_ticks) :
+        m_timer(platform, AIPSTACK_BIND_MEMBER_TN(&TcpTimeWaitTable::timerHandler, this)),
+        m_timeout_ticks(timeout_ticks)
+    {
+        for (Entry &entry : m_entries) {
+            m_free_list.append({entry, *this}, *this);
+        }
+    }
+    
+    /**
+     * Look up the entry for an address tuple.
+     * 
+     * @return The entry or null if there is none.
+     */
+    Entry * find (TcpPcbKey const &key)
+    {
+        EntryRef ref = m_index.findEntry(key, *this);
+        return ref.isNull() ? nullptr : &*ref;
+    }
+    
+    /**
+     * Add an entry for a connection which has entered TIME_WAIT.
+     * 
+     * If the table is full the oldest entry is removed to make space.
+     * There must not already be an entry with the same key.
+     */
+    void add (TcpPcbKey const &key, TcpSeqNum rcv_nxt, TcpSeqNum snd_nxt,
+              std::uint16_t hdr_wnd)
+    {
+        AIPSTACK_ASSERT(m_index.findEntry(key, *this).isNull());
+        
+        EntryRef ref;
+        if (!m_free_list.isEmpty()) {
+            ref = m_free_list.first(*this);
+            m_free_list.removeFirst(*this);
+        } else {
+            ref = m_expiry_list.first(*this);
+            m_expiry_list.removeFirst(*this);
+            m_index.removeEntry(ref, *this);
+        }
+        
+        Entry &entry = *ref;
+        static_cast<TcpPcbKey &>(entry) = key;
+        entry.rcv_nxt = rcv_nxt;
+        entry.snd_nxt = snd_nxt;
+        entry.hdr_wnd = hdr_wnd;
+        
+        m_index.addEntry(ref, *this);
+        insert_expiry(ref);
+    }
+    
+    /**
+     * Restart the timeout of an entry (when a retransmitted FIN is received).
+     */
+    void restartTimeout (Entry &entry)
+    {
+        m_expiry_list.remove({entry, *this}, *this);
+        insert_expiry({entry, *this});
+    }
+    
+    /**
+     * Remove an entry (when the old connection is replaced by a new one).
+     */
+    void remove (Entry &entry)
+    {
+        release_entry({entry, *this});
+    }
+    
+private:
+    void insert_expiry (EntryRef ref)
+    {
+        (*ref).expire_time = m_timer.platform().getTime() + m_timeout_ticks;
+        m_expiry_list.append(ref, *this);
+        
+        // The timer may already be set for an earlier time, in that case
+        // timerHandler will reschedule it.
+        if (!m_timer.isSet()) {
+            m_timer.setAt((*ref).expire_time);
+        }
+    }
+    
+    void release_entry (EntryRef ref)
+    {
+        m_index.removeEntry(ref, *this);
+        m_expiry_list.remove(ref, *this);
+        m_free_list.prepend(ref, *this);
+    }
+    
+    void timerHandler ()
+    {
+        TimeType now = m_timer.platform().getEventTime();
+        
+        // Release all expired entries, they are at the front of the expiry list.
+        while (!m_expiry_list.isEmpty()) {
+            EntryRef ref = m_expiry_list.first(*this);
+            if (!Platform::timeGreaterOrEqual(now, (*ref).expire_time)) {
+                m_timer.setAt((*ref).expire_time);
+                break;
+            }
+            release_entry(ref);
+        }
+    }
+    
+private:
+    typename Platform::Timer m_timer;
+    TimeType m_timeout_ticks;
+    StructureRaiiWrapper<typename EntryIndex::Index> m_index;
+    StructureRaiiWrapper<EntryList> m_expiry_list;
+    StructureRaiiWrapper<EntryList> m_free_list;
+    Entry m_entries[NumEntries];
+    
+    struct EntriesAccessor : public
+        MemberAccessor<TcpTimeWaitTable, Entry[NumEntries], &TcpTimeWaitTable::m_entries> {};
+};
+
+#endif
+
+}
+
+#endif
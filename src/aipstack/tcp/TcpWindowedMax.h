@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_TCP_WINDOWED_MAX_H
+#define AIPSTACK_TCP_WINDOWED_MAX_H
+
+namespace AIpStack {
+
+#ifndef IN_DOXYGEN
+
+/**
+ * Running maximum of samples over a window of rounds, used for the bandwidth
+ * estimate of BBR.
+ * 
+ * This is the algorithm by Kathleen Nichols which keeps the best, second best
+ * and third best samples from successive parts of the window, so that when the
+ * best sample expires a recent good one is known without storing all samples.
+ */
+template<typename ValueT, typename RoundT>
+class TcpWindowedMax
+{
+    struct Sample {
+        RoundT round;
+        ValueT value;
+    };
+    
+public:
+    // Forget all samples and start with the given one.
+    inline void reset (RoundT round, ValueT value)
+    {
+        m_s[0] = m_s[1] = m_s[2] = Sample{round, value};
+    }
+    
+    // Get the maximum of the samples in the window.
+    inline ValueT get () const
+    {
+        return m_s[0].value;
+    }
+    
+    // Add a sample taken in the given round. Samples more than window rounds
+    // older than this round are expired.
+    void update (RoundT round, ValueT value, RoundT window)
+    {
+        Sample sample{round, value};
+        
+        if (value >= m_s[0].value || RoundT(round - m_s[2].round) > window) {
+            reset(round, value);
+            return;
+        }
+        
+        if (value >= m_s[1].value) {
+            m_s[2] = m_s[1] = sample;
+        }
+        else if (value >= m_s[2].value) {
+            m_s[2] = sample;
+        }
+        
+        // Expire the best sample, or take a new second or third best sample
+        // when the current ones are from too early a part of the window.
+        RoundT age = round - m_s[0].round;
+        if (age > window) {
+            m_s[0] = m_s[1];
+            m_s[1] = m_s[2];
+            m_s[2] = sample;
+            if (RoundT(round - m_s[0].round) > window) {
+                m_s[0] = m_s[1];
+                m_s[1] = m_s[2];
+            }
+        }
+        else if (m_s[1].round == m_s[0].round && age > window / 4) {
+            m_s[2] = m_s[1] = sample;
+        }
+        else if (m_s[2].round == m_s[1].round && age > window / 2) {
+            m_s[2] = sample;
+        }
+    }
+    
+private:
+    Sample m_s[3];
+};
+
+#endif
+
+}
+
+#endif
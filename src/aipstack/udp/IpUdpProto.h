@@ -27,6 +27,7 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
 
 #include <aipstack/meta/BasicMetaUtils.h>
 #include <aipstack/misc/Use.h>
@@ -34,9 +35,9 @@
 #include <aipstack/misc/Assert.h>
 #include <aipstack/misc/Hints.h>
 #include <aipstack/misc/MinMax.h>
-#include <aipstack/misc/IntRange.h>
 #include <aipstack/misc/Function.h>
 #include <aipstack/misc/EnumUtils.h>
+#include <aipstack/misc/SipHash.h>
 #include <aipstack/structure/LinkedList.h>
 #include <aipstack/structure/LinkModel.h>
 #include <aipstack/structure/StructureRaiiWrapper.h>
@@ -54,6 +55,7 @@
 #include <aipstack/platform/PlatformFacade.h>
 #include <aipstack/ip/IpAddr.h>
 #include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpEphemeralPortAllocator.h>
 
 namespace AIpStack {
 
@@ -110,6 +112,7 @@ template<typename Arg>
 struct UdpAssociationParams {
     UdpAssociationKey key;
     bool accept_nonlocal_dst = false;
+    IpSendFlags send_flags = IpSendFlags();
 };
 
 template<typename Arg>
@@ -182,6 +185,142 @@ public:
         return proto().m_stack->sendIp4Dgram(dgram, iface, retryReq,
             Ip4CommonSendParams{addrs, UdpTTL, Ip4Protocol::Udp, send_flags});
     }
+
+    /**
+     * Send multiple UDP datagrams with the same addresses and ports.
+     * 
+     * Routing is determined and the common IP header fields are prepared once for
+     * the whole batch (see @ref IpStack::prepareSendIp4Dgram), and the packets are
+     * passed to the interface driver in a single call if the driver provides
+     * @ref IpIfaceDriverParams::send_ip4_packets. Otherwise the driver's
+     * @ref IpIfaceDriverParams::send_ip4_packet is called for each packet. An
+     * Ethernet interface (@ref EthIpIface) resolves the next hop MAC address once
+     * for the batch.
+     * 
+     * The datagrams are sent in order and sending stops at the first datagram which
+     * cannot be sent; the following ones are not attempted. If routing fails or
+     * sending is not allowed, nothing is sent. Unlike @ref sendUdpIp4Packet, this
+     * does not fragment; a datagram which does not fit into the interface MTU fails
+     * with @ref IpErr::FragmentationNeeded. To retry after a failure, the caller
+     * would call this again with the datagrams starting at index `num_sent`, whose
+     * data references it must have kept, since the array is modified.
+     * 
+     * @param addrs Local and remote address for all datagrams.
+     * @param udp_info Source and destination ports for all datagrams.
+     * @param udp_datas Pointer to the first element of an array of the UDP data of
+     *        the datagrams. Each must have at least @ref HeaderBeforeUdpData bytes
+     *        available before the data and must not exceed @ref MaxUdpDataLenIp4
+     *        bytes. The elements are used as temporary storage and their values are
+     *        unspecified on return.
+     * @param num_dgrams Number of datagrams in the array (may be zero).
+     * @param retryReq If not null, this may provide notification when to retry
+     *        sending after the first datagram that could not be sent failed, for
+     *        example when an ARP query completes (notification is not guaranteed).
+     *        It is passed to the driver for the whole batch.
+     * @param send_flags IP send flags, see @ref IpStack::prepareSendIp4Dgram.
+     * @param num_sent Set to the number of datagrams which were sent, which are the
+     *        first datagrams in the array.
+     * @return Success if all datagrams were sent, otherwise the error code for the
+     *         first datagram which was not sent.
+     */
+    IpErr sendUdpIp4Packets (Ip4AddrPair const &addrs, UdpTxInfo<Arg> const &udp_info,
+                             IpBufRef *udp_datas, std::size_t num_dgrams,
+                             IpSendRetryRequest *retryReq, IpSendFlags send_flags,
+                             std::size_t &num_sent)
+    {
+        num_sent = 0;
+
+        if (AIPSTACK_UNLIKELY(num_dgrams == 0)) {
+            return IpErr::Success;
+        }
+
+        AIPSTACK_ASSERT(udp_datas[0].offset >= Ip4Header::Size + Udp4Header::Size);
+
+        // Determine routing and write the common IP header fields into the first
+        // datagram, from where they are copied into the others when sending.
+        IpSendPreparedIp4<StackArg> prep;
+        IpErr prep_err = proto().m_stack->prepareSendIp4Dgram(
+            udp_datas[0].getChunkPtr() - Udp4Header::Size, prep,
+            Ip4CommonSendParams{addrs, UdpTTL, Ip4Protocol::Udp, send_flags});
+        if (AIPSTACK_UNLIKELY(prep_err != IpErr::Success)) {
+            return prep_err;
+        }
+
+        // Calculate the part of the checksum common to all datagrams.
+        IpChksumAccumulator::State common_chksum_state =
+            commonChksumState(addrs, udp_info);
+
+        // Write the UDP headers, replacing the data references with datagram
+        // references in the array.
+        for (std::size_t i = 0; i < num_dgrams; i++) {
+            udp_datas[i] = writeUdpHeader(udp_datas[i], udp_info, common_chksum_state);
+        }
+
+        // Send the datagrams.
+        return proto().m_stack->sendIp4DgramsFast(
+            prep, udp_datas, num_dgrams, retryReq, num_sent);
+    }
+
+    /**
+     * Set the secret key used to select ephemeral ports for associations.
+     * 
+     * Ports are selected as in RFC 6056 Algorithm 4, using a hash keyed by this
+     * key. Until a random key is set the port sequences are predictable, so a key
+     * must be set before the first association with an ephemeral port is made (this is
+     * checked by an assertion).
+     * 
+     * @param key New key, which should be random.
+     */
+    inline void setEphemeralPortKey (SipHashKey const &key)
+    {
+        proto().m_ephemeral_ports.setKey(key);
+    }
+
+private:
+    // Calculate the part of the UDP checksum which depends only on the addresses
+    // and ports.
+    inline static IpChksumAccumulator::State commonChksumState (
+        Ip4AddrPair const &addrs, UdpTxInfo<Arg> const &udp_info)
+    {
+        IpChksumAccumulator chksum_accum;
+        chksum_accum.addWord(WrapType<std::uint32_t>(), addrs.local_addr.value());
+        chksum_accum.addWord(WrapType<std::uint32_t>(), addrs.remote_addr.value());
+        chksum_accum.addWord(WrapType<std::uint16_t>(), AsUnderlying(Ip4Protocol::Udp));
+        chksum_accum.addWord(WrapType<std::uint16_t>(), udp_info.src_port);
+        chksum_accum.addWord(WrapType<std::uint16_t>(), udp_info.dst_port);
+        return chksum_accum.getState();
+    }
+
+    // Reveal and write the UDP header using the result of commonChksumState for the
+    // checksum, returning the reference to the datagram.
+    inline static IpBufRef writeUdpHeader (IpBufRef udp_data,
+        UdpTxInfo<Arg> const &udp_info, IpChksumAccumulator::State common_chksum_state)
+    {
+        AIPSTACK_ASSERT(udp_data.tot_len <= MaxUdpDataLenIp4);
+        AIPSTACK_ASSERT(udp_data.offset >= Ip4Header::Size + Udp4Header::Size);
+
+        // Reveal the UDP header.
+        IpBufRef dgram = udp_data.revealHeader(Udp4Header::Size);
+
+        // Write the UDP header.
+        auto udp_header = Udp4Header::MakeRef(dgram.getChunkPtr());
+        udp_header.set(Udp4Header::SrcPort(),  udp_info.src_port);
+        udp_header.set(Udp4Header::DstPort(),  udp_info.dst_port);
+        udp_header.set(Udp4Header::Length(),   std::uint16_t(dgram.tot_len));
+
+        // Calculate UDP checksum. The length appears both in the pseudo-header
+        // and in the UDP header.
+        IpChksumAccumulator chksum_accum(common_chksum_state);
+        chksum_accum.addWord(WrapType<std::uint16_t>(), std::uint16_t(dgram.tot_len));
+        chksum_accum.addWord(WrapType<std::uint16_t>(), std::uint16_t(dgram.tot_len));
+        std::uint16_t checksum = chksum_accum.getChksum(udp_data);
+        if (checksum == 0) {
+            checksum = TypeMax<std::uint16_t>;
+        }
+        udp_header.set(Udp4Header::Checksum(), checksum);
+
+        return dgram;
+    }
 };
 
 template<typename Arg>
@@ -212,10 +351,7 @@ public:
     void reset ()
     {
         if (m_udp != nullptr) {
-            if (m_udp->m_next_listener == this) {
-                m_udp->m_next_listener = m_udp->m_listeners_list.next(*this);
-            }
-            m_udp->m_listeners_list.remove(*this);
+            m_udp->remove_listener(*this);
             m_udp = nullptr;
         }
     }
@@ -246,7 +382,7 @@ public:
         m_udp = &udp.proto();
         m_params = params;
         
-        m_udp->m_listeners_list.prepend(*this);
+        m_udp->add_listener(*this);
 
         return IpErr::Success;
     }
@@ -292,6 +428,7 @@ private:
     UdpIp4PacketHandler m_handler;
     LinkedListNode<ListenersLinkModel> m_list_node;
     IpUdpProto<Arg> *m_udp;
+    std::uint64_t m_seq;
     UdpListenParams<Arg> m_params;
 };
 
@@ -300,6 +437,8 @@ class UdpAssociation :
     private NonCopyable<UdpAssociation<Arg>>
 {
     template<typename> friend class IpUdpProto;
+
+    AIPSTACK_USE_VALS(Arg::Params, (UdpTTL))
     
 public:
     using StackArg = typename Arg::StackArg;
@@ -310,7 +449,8 @@ public:
     
     UdpAssociation (UdpIp4PacketHandler handler) :
         m_handler(handler),
-        m_udp(nullptr)
+        m_udp(nullptr),
+        m_prep_valid(false)
     {}
 
     ~UdpAssociation ()
@@ -323,6 +463,7 @@ public:
         if (m_udp != nullptr) {
             m_udp->m_associations_index.removeEntry(*this);
             m_udp = nullptr;
+            m_prep_valid = false;
         }
     }
 
@@ -380,10 +521,104 @@ public:
         return IpErr::Success;
     }
 
+    /**
+     * Send a UDP datagram to the associated remote address and port.
+     * 
+     * The routing information and the IP header fields which are the same for all
+     * datagrams are determined at the first send and reused for subsequent sends,
+     * until the routing configuration changes (see @ref
+     * IpStack::getRouteConfigGeneration), so that a datagram normally costs only
+     * the UDP checksum and a call to the driver.
+     * 
+     * Datagrams larger than the MTU of the interface are fragmented, as with @ref
+     * UdpApi::sendUdpIp4Packet. The path MTU is not considered since UDP does not
+     * use the path MTU cache.
+     * 
+     * @param udp_data The UDP data to send. There must be space before the data
+     *        for headers (reserving @ref UdpApi::HeaderBeforeUdpData will suffice)
+     *        and tot_len must not exceed @ref UdpApi::MaxUdpDataLenIp4.
+     * @param retryReq If not null, this may provide notification when to retry
+     *        sending after an unsuccessful attempt (notification is not guaranteed).
+     * @return Success or error code. If preparing the send fails (e.g.
+     *         @ref IpErr::NoIpRoute), preparation is attempted again at the next send.
+     */
+    IpErr sendUdpIp4Packet (IpBufRef udp_data, IpSendRetryRequest *retryReq)
+    {
+        AIPSTACK_ASSERT(isAssociated());
+
+        IpStack<StackArg> *stack = m_udp->m_stack;
+
+        // Routing information and common header fields are prepared at the first send
+        // and reused while the routing configuration does not change.
+        if (AIPSTACK_UNLIKELY(!m_prep_valid ||
+                m_prep_route_config_gen != stack->getRouteConfigGeneration()))
+        {
+            IpErr prep_err = prepareSend();
+            if (AIPSTACK_UNLIKELY(prep_err != IpErr::Success)) {
+                return prep_err;
+            }
+        }
+
+        // Write the UDP header.
+        UdpTxInfo<Arg> udp_info{m_params.key.local_port, m_params.key.remote_port};
+        IpBufRef dgram = UdpApi<Arg>::writeUdpHeader(
+            udp_data, udp_info, m_prep_udp_chksum_state);
+
+        // Datagrams which need fragmentation are sent the regular way.
+        if (AIPSTACK_UNLIKELY(
+                Ip4Header::Size + dgram.tot_len > m_prep.route_info.iface->getMtu()))
+        {
+            Ip4AddrPair addrs{m_params.key.local_addr, m_params.key.remote_addr};
+            return stack->sendIp4Dgram(dgram, /*iface=*/nullptr, retryReq,
+                Ip4CommonSendParams{addrs, UdpTTL, Ip4Protocol::Udp, m_params.send_flags});
+        }
+
+        // Copy the prepared IP header and send the datagram.
+        std::memcpy(dgram.getChunkPtr() - Ip4Header::Size, m_prep_ip_header,
+                    Ip4Header::Size);
+        return stack->sendIp4DgramFast(m_prep, dgram, retryReq);
+    }
+
+private:
+    IpErr prepareSend ()
+    {
+        m_prep_valid = false;
+
+        // Prepare the IP header in m_prep_ip_header, to be copied into datagrams.
+        IpStack<StackArg> *stack = m_udp->m_stack;
+        Ip4AddrPair addrs{m_params.key.local_addr, m_params.key.remote_addr};
+        IpErr err = stack->prepareSendIp4Dgram(m_prep_ip_header + Ip4Header::Size, m_prep,
+            Ip4CommonSendParams{addrs, UdpTTL, Ip4Protocol::Udp, m_params.send_flags});
+        if (AIPSTACK_UNLIKELY(err != IpErr::Success)) {
+            return err;
+        }
+
+        UdpTxInfo<Arg> udp_info{m_params.key.local_port, m_params.key.remote_port};
+        m_prep_udp_chksum_state = UdpApi<Arg>::commonChksumState(addrs, udp_info);
+        m_prep_route_config_gen = stack->getRouteConfigGeneration();
+        m_prep_valid = true;
+
+        return IpErr::Success;
+    }
+
 private:
     UdpIp4PacketHandler m_handler;
     typename IpUdpProto<Arg>::AssociationIndex::Node m_index_node;
     IpUdpProto<Arg> *m_udp;
+    // State cached by prepareSend for sendUdpIp4Packet: the route (interface and
+    // next hop IP address), the partial UDP checksum and the IP header fields
+    // common to all datagrams. It is valid while m_prep_valid is set and the
+    // routing configuration generation equals m_prep_route_config_gen; the
+    // generation changes with interface addresses, gateways and static routes.
+    // The interface MTU is read at each send. Path MTU changes (ICMP or PLPMTUD)
+    // do not affect it since UDP does not use the path MTU cache. Next hop MAC
+    // address resolution and link state are handled by the driver at each send
+    // and are not cached here.
+    bool m_prep_valid;
+    std::uint32_t m_prep_route_config_gen;
+    IpChksumAccumulator::State m_prep_udp_chksum_state;
+    IpSendPreparedIp4<StackArg> m_prep;
+    char m_prep_ip_header[Ip4Header::Size];
     UdpAssociationParams<Arg> m_params;
 };
 
@@ -398,18 +633,19 @@ class IpUdpProto :
     template<typename> friend class UdpListener;
     template<typename> friend class UdpAssociation;
 
-    AIPSTACK_USE_VALS(Arg::Params, (UdpTTL, EphemeralPortFirst, EphemeralPortLast))
+    AIPSTACK_USE_VALS(Arg::Params, (UdpTTL, EphemeralPortFirst, EphemeralPortLast,
+                                    NumListenerBuckets))
     AIPSTACK_USE_TYPES(Arg::Params, (UdpIndexService))
     AIPSTACK_USE_TYPES(Arg, (PlatformImpl, StackArg))
 
     static_assert(EphemeralPortFirst > 0);
     static_assert(EphemeralPortFirst <= EphemeralPortLast);
+    static_assert(NumListenerBuckets > 0);
+    static_assert((NumListenerBuckets & (NumListenerBuckets - 1)) == 0,
+                  "NumListenerBuckets must be a power of two");
 
     using Platform = PlatformFacade<PlatformImpl>;
 
-    inline static constexpr PortNum NumEphemeralPorts =
-        EphemeralPortLast - EphemeralPortFirst + 1;
-
     struct ListenerListNodeAccessor;
     using ListenersLinkModel = PointerLinkModel<UdpListener<Arg>>;
 
@@ -451,15 +687,22 @@ class IpUdpProto :
 public:
     IpUdpProto (IpProtocolHandlerArgs<StackArg> args) :
         m_stack(args.stack),
-        m_next_listener(nullptr),
-        m_next_ephemeral_port(EphemeralPortFirst)
-    {}
+        m_next_port_listener(nullptr),
+        m_next_wild_listener(nullptr),
+        m_next_listener_seq(0)
+    {
+        m_ephemeral_ports.init();
+    }
 
     ~IpUdpProto ()
     {
-        AIPSTACK_ASSERT(m_listeners_list.isEmpty());
+        for (ListenersList const &list : m_port_listeners) {
+            AIPSTACK_ASSERT(list.isEmpty());
+        }
+        AIPSTACK_ASSERT(m_wild_listeners.isEmpty());
         AIPSTACK_ASSERT(m_associations_index.isEmpty());
-        AIPSTACK_ASSERT(m_next_listener == nullptr);
+        AIPSTACK_ASSERT(m_next_port_listener == nullptr);
+        AIPSTACK_ASSERT(m_next_wild_listener == nullptr);
     }
 
     inline UdpApi<Arg> & getApi ()
@@ -560,14 +803,32 @@ public:
             updateCachedInfo();
         } while (false);
         
-        // Look for listeners which match the incoming packet.
-        // NOTE: `lis` must be properly adjusted at the end of each iteration!
-        for (UdpListener<Arg> *lis = m_listeners_list.first(); lis != nullptr;) {
+        // Look for listeners which match the incoming packet. Only listeners in the
+        // bucket for the destination port and listeners for any port need to be
+        // considered. These two lists are merged such that listeners are considered
+        // in the order of most recently started first, as if they were in one list.
+        // NOTE: `port_lis` and `wild_lis` must be properly adjusted in each iteration!
+        ListenersList &port_list = m_port_listeners[port_bucket(udp_info.dst_port)];
+        UdpListener<Arg> *port_lis = port_list.first();
+        UdpListener<Arg> *wild_lis = m_wild_listeners.first();
+
+        while (port_lis != nullptr || wild_lis != nullptr) {
+            // Take the next listener from the list where it was started more recently.
+            UdpListener<Arg> *lis;
+            if (wild_lis == nullptr ||
+                (port_lis != nullptr && port_lis->m_seq > wild_lis->m_seq))
+            {
+                lis = port_lis;
+                port_lis = port_list.next(*lis);
+            } else {
+                lis = wild_lis;
+                wild_lis = m_wild_listeners.next(*lis);
+            }
+
             AIPSTACK_ASSERT(lis->m_udp == this);
             
             // Check if the listener matches, if not skip it.
             if (!lis->incomingPacketMatches(ip_info, udp_info, dst_is_iface_addr)) {
-                lis = m_listeners_list.next(*lis);
                 continue;
             }
 
@@ -576,20 +837,24 @@ public:
                 return;
             }
 
-            // Set the m_next_listener pointer to the next listener on the list (if any).
-            // In case the following callback resets (or destructs) the next listener,
-            // UdpListener::reset() will advance m_next_listener so that we can safely
-            // continue iterating.
-            AIPSTACK_ASSERT(m_next_listener == nullptr);
-            m_next_listener = m_listeners_list.next(*lis);
+            // Set the m_next_*_listener pointers to the next listeners on the lists (if
+            // any). In case the following callback resets (or destructs) one of these
+            // listeners, UdpListener::reset() will advance the respective pointer so
+            // that we can safely continue iterating.
+            AIPSTACK_ASSERT(m_next_port_listener == nullptr);
+            AIPSTACK_ASSERT(m_next_wild_listener == nullptr);
+            m_next_port_listener = port_lis;
+            m_next_wild_listener = wild_lis;
 
             // Pass the packet to the listener.
             IpBufRef udp_data = dgram.hideHeader(Udp4Header::Size);
             UdpRecvResult recv_result = lis->m_handler(ip_info, udp_info, udp_data);
 
-            // Update `lis` to the next listener (if any) and clear m_next_listener.
-            lis = m_next_listener;
-            m_next_listener = nullptr;
+            // Update `port_lis` and `wild_lis` and clear the m_next_*_listener pointers.
+            port_lis = m_next_port_listener;
+            wild_lis = m_next_wild_listener;
+            m_next_port_listener = nullptr;
+            m_next_wild_listener = nullptr;
 
             // If the listener wants that we don't pass the packet to any further listener,
             // then return here.
@@ -628,6 +893,42 @@ public:
     }
 
 private:
+    inline static std::size_t port_bucket (PortNum port)
+    {
+        return port & (NumListenerBuckets - 1);
+    }
+
+    // Listeners for a specific port are in the bucket for the port, and listeners for
+    // any port are in a separate list.
+    ListenersList & listeners_list_for (UdpListener<Arg> const &lis)
+    {
+        return (lis.m_params.port == 0) ?
+            m_wild_listeners : m_port_listeners[port_bucket(lis.m_params.port)];
+    }
+
+    void add_listener (UdpListener<Arg> &lis)
+    {
+        // The sequence number defines the order in which listeners are considered
+        // for received packets (see recvIp4Dgram).
+        lis.m_seq = m_next_listener_seq++;
+
+        listeners_list_for(lis).prepend(lis);
+    }
+
+    void remove_listener (UdpListener<Arg> &lis)
+    {
+        ListenersList &list = listeners_list_for(lis);
+
+        if (m_next_port_listener == &lis) {
+            m_next_port_listener = list.next(lis);
+        }
+        if (m_next_wild_listener == &lis) {
+            m_next_wild_listener = list.next(lis);
+        }
+
+        list.remove(lis);
+    }
+
     static bool verifyChecksum (
         IpRxInfoIp4<StackArg> const &ip_info, Udp4Header::Ref udp_header,
         IpBufRef dgram, bool &has_checksum)
@@ -653,27 +954,26 @@ private:
 
     bool get_ephemeral_port (UdpAssociationKey &key)
     {
-        for ([[maybe_unused]] PortNum i : IntRange(NumEphemeralPorts)) {
-            PortNum port = m_next_ephemeral_port;
-            m_next_ephemeral_port = (port < EphemeralPortLast) ?
-                (port + 1) : EphemeralPortFirst;
-            
-            key.local_port = port;
-
-            if (m_associations_index.findEntry(key).isNull()) {
-                return true;
-            }
-        }
-        
-        return false;
+        PortNum port = m_ephemeral_ports.allocate(
+            key.local_addr, key.remote_addr, key.remote_port,
+            [&](PortNum candidate) {
+                key.local_port = candidate;
+                return m_associations_index.findEntry(key).isNull();
+            });
+
+        key.local_port = port;
+        return port != 0;
     }
     
 private:
     IpStack<StackArg> *m_stack;
-    StructureRaiiWrapper<ListenersList> m_listeners_list;
+    StructureRaiiWrapper<ListenersList> m_port_listeners[NumListenerBuckets];
+    StructureRaiiWrapper<ListenersList> m_wild_listeners;
     StructureRaiiWrapper<typename AssociationIndex::Index> m_associations_index;
-    UdpListener<Arg> *m_next_listener;
-    PortNum m_next_ephemeral_port;
+    UdpListener<Arg> *m_next_port_listener;
+    UdpListener<Arg> *m_next_wild_listener;
+    std::uint64_t m_next_listener_seq;
+    IpEphemeralPortAllocator<EphemeralPortFirst, EphemeralPortLast> m_ephemeral_ports;
 };
 
 #endif
@@ -682,6 +982,7 @@ struct IpUdpProtoOptions {
     AIPSTACK_OPTION_DECL_VALUE(UdpTTL, std::uint8_t, 64)
     AIPSTACK_OPTION_DECL_VALUE(EphemeralPortFirst, std::uint16_t, 49152)
     AIPSTACK_OPTION_DECL_VALUE(EphemeralPortLast, std::uint16_t, 65535)
+    AIPSTACK_OPTION_DECL_VALUE(NumListenerBuckets, std::size_t, 16)
     AIPSTACK_OPTION_DECL_TYPE(UdpIndexService, void)
 };
 
@@ -689,10 +990,12 @@ template<typename ...Options>
 class IpUdpProtoService {
     template<typename> friend class IpUdpProto;
     template<typename> friend class UdpApi;
+    template<typename> friend class UdpAssociation;
     
     AIPSTACK_OPTION_CONFIG_VALUE(IpUdpProtoOptions, UdpTTL)
     AIPSTACK_OPTION_CONFIG_VALUE(IpUdpProtoOptions, EphemeralPortFirst)
     AIPSTACK_OPTION_CONFIG_VALUE(IpUdpProtoOptions, EphemeralPortLast)
+    AIPSTACK_OPTION_CONFIG_VALUE(IpUdpProtoOptions, NumListenerBuckets)
     AIPSTACK_OPTION_CONFIG_TYPE(IpUdpProtoOptions, UdpIndexService)
     
 public:
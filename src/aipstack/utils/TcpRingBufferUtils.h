@@ -39,16 +39,40 @@
 
 namespace AIpStack {
 
+#ifndef IN_DOXYGEN
+namespace Private {
+    // Get the node to use for ranges given to the application. For a mirrored
+    // buffer this is a node covering the buffer and the mirror, so that any
+    // range starting within the buffer is contained in it.
+    inline IpBufNode const * RingBufferRangeNode (
+        IpBufNode const &buf_node, IpBufNode &mirror_node, bool mirrored)
+    {
+        if (!mirrored) {
+            return &buf_node;
+        }
+        mirror_node = IpBufNode{buf_node.ptr, 2 * buf_node.len, &buf_node};
+        return &mirror_node;
+    }
+}
+#endif
+
+// NOTE: If mirrored is true, the buffer must be followed by another buf_size
+// bytes which map to the same memory (see MirroredBuffer). Then the ranges
+// returned by getWriteRange / getReadRange consist of a single contiguous
+// buffer node, and RecvRingBuffer::updateMirrorAfterReceived is not needed.
+
 template<typename TcpArg>
 class SendRingBuffer {
 public:
-    void setup (TcpConnection<TcpArg> &con, char *buf, std::size_t buf_size)
+    void setup (TcpConnection<TcpArg> &con, char *buf, std::size_t buf_size,
+                bool mirrored = false)
     {
         AIPSTACK_ASSERT(buf != nullptr);
         AIPSTACK_ASSERT(buf_size > 0);
         AIPSTACK_ASSERT(buf_size >= con.getSendBuf().tot_len);
         
         m_buf_node = IpBufNode{buf, buf_size, &m_buf_node};
+        m_range_node = Private::RingBufferRangeNode(m_buf_node, m_mirror_node, mirrored);
         
         IpBufRef old_send_buf = con.getSendBuf();
 
@@ -75,7 +99,7 @@ public:
         std::size_t write_offset = getModulo().add(send_buf.offset, send_buf.tot_len);
         std::size_t free_len = getModulo().modulusComplement(send_buf.tot_len);
         
-        return IpBufRef{&m_buf_node, write_offset, free_len};
+        return IpBufRef{m_range_node, write_offset, free_len};
     }
     
     inline void provideData (TcpConnection<TcpArg> &con, std::size_t amount)
@@ -93,6 +117,8 @@ private:
     
 private:
     IpBufNode m_buf_node;
+    IpBufNode m_mirror_node;
+    IpBufNode const *m_range_node;
 };
 
 template<typename TcpArg>
@@ -102,7 +128,7 @@ public:
     // you may need to call updateMirrorAfterDataReceived to make sure initial
     // data is mirrored as applicable.
     void setup (TcpConnection<TcpArg> &con, char *buf, std::size_t buf_size, int wnd_upd_div,
-                IpBufRef initial_rx_data = IpBufRef{})
+                IpBufRef initial_rx_data = IpBufRef{}, bool mirrored = false)
     {
         AIPSTACK_ASSERT(buf != nullptr);
         AIPSTACK_ASSERT(buf_size > 0);
@@ -111,6 +137,8 @@ public:
         AIPSTACK_ASSERT(buf_size - initial_rx_data.tot_len >= con.getRecvBuf().tot_len);
         
         m_buf_node = IpBufNode{buf, buf_size, &m_buf_node};
+        m_range_node = Private::RingBufferRangeNode(m_buf_node, m_mirror_node, mirrored);
+        m_wnd_upd_div = wnd_upd_div;
         
         con.setProportionalWindowUpdateThreshold(buf_size, wnd_upd_div);
         
@@ -144,7 +172,7 @@ public:
         std::size_t read_offset = getModulo().add(recv_buf.offset, recv_buf.tot_len);
         std::size_t used_len = getModulo().modulusComplement(recv_buf.tot_len);
         
-        return IpBufRef{&m_buf_node, read_offset, used_len};
+        return IpBufRef{m_range_node, read_offset, used_len};
     }
     
     inline void consumeData (TcpConnection<TcpArg> &con, std::size_t amount)
@@ -154,6 +182,49 @@ public:
         con.extendRecvBuf(amount);
     }
     
+    // Moves the ring buffer to a new memory area of a different size, e.g. in
+    // response to TcpConnection::recvBufGrowRequested. The received data and
+    // any out-of-sequence data in the free space are copied, after which the
+    // old memory is no longer used. When shrinking, buf_size must leave room
+    // for the received data plus the free space that cannot be given up (see
+    // TcpConnection::getRecvBufShrinkable).
+    void resize (TcpConnection<TcpArg> &con, char *buf, std::size_t buf_size,
+                 bool mirrored = false)
+    {
+        AIPSTACK_ASSERT(buf != nullptr);
+        AIPSTACK_ASSERT(buf_size > 0);
+        
+        IpBufRef read_range = getReadRange(con);
+        IpBufRef recv_buf = con.getRecvBuf();
+        
+        AIPSTACK_ASSERT(buf_size >= read_range.tot_len);
+        std::size_t free_len = buf_size - read_range.tot_len;
+        
+        // When shrinking, first release free space from the connection.
+        if (free_len < recv_buf.tot_len) {
+            con.shrinkRecvBuf(recv_buf.tot_len - free_len);
+            recv_buf.tot_len = free_len;
+        }
+        
+        // Copy the received data to the start of the new buffer, followed by
+        // the part of the free space with out-of-sequence data.
+        std::size_t oos_len = con.getRecvBufOosExtent();
+        AIPSTACK_ASSERT(oos_len <= recv_buf.tot_len);
+        ipBufTakeBytes(read_range, read_range.tot_len, buf);
+        ipBufTakeBytes(recv_buf, oos_len, buf + read_range.tot_len);
+        
+        m_buf_node = IpBufNode{buf, buf_size, &m_buf_node};
+        m_range_node = Private::RingBufferRangeNode(m_buf_node, m_mirror_node, mirrored);
+        
+        con.setProportionalWindowUpdateThreshold(buf_size, m_wnd_upd_div);
+        
+        // The free space starts after the received data, wrapping to the
+        // start if the buffer is full.
+        std::size_t free_offset = (free_len == 0) ? 0 : read_range.tot_len;
+        
+        con.setRecvBuf(IpBufRef{&m_buf_node, free_offset, free_len});
+    }
+    
     void updateMirrorAfterReceived (
         TcpConnection<TcpArg> &con, std::size_t mirror_size, std::size_t amount)
     {
@@ -200,6 +271,9 @@ private:
     
 private:
     IpBufNode m_buf_node;
+    IpBufNode m_mirror_node;
+    IpBufNode const *m_range_node;
+    int m_wnd_upd_div;
 };
 
 }
@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef AIPSTACK_UDP_RECV_QUEUE_H
+#define AIPSTACK_UDP_RECV_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/MemRef.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/ip/IpStackTypes.h>
+#include <aipstack/udp/IpUdpProto.h>
+
+namespace AIpStack {
+
+/**
+ * Queue of received UDP datagrams stored in a contiguous ring buffer.
+ * 
+ * UDP receive handlers are called with data referencing the driver's receive
+ * buffer, so the data must be consumed before the handler returns. This class
+ * can be used as the handler of a @ref UdpListener or @ref UdpAssociation (see
+ * @ref enqueueIp4Dgram) in order to defer processing: each datagram is copied
+ * together with its metadata into a user-provided buffer, and can later be
+ * inspected in place and released in batches.
+ * 
+ * Each datagram occupies a record consisting of a header with the metadata
+ * followed by the data, and records never wrap around the end of the buffer.
+ * When there is not enough space for a datagram, it is dropped and counted.
+ * 
+ * @tparam UdpArg Template parameter of @ref IpUdpProto.
+ */
+template<typename UdpArg>
+class UdpRecvQueue :
+    private NonCopyable<UdpRecvQueue<UdpArg>>
+{
+    using StackArg = typename UdpArg::StackArg;
+
+    struct RecordHeader {
+        IpRxInfoIp4<StackArg> ip_info;
+        UdpRxInfo<UdpArg> udp_info;
+        std::size_t data_len;
+    };
+
+    static constexpr std::size_t RecordAlign = alignof(RecordHeader);
+
+public:
+    /**
+     * Handler type for notification that the queue has become non-empty.
+     */
+    using DatagramsQueuedHandler = Function<void()>;
+
+    /**
+     * View of a queued datagram as returned by @ref peekDatagrams.
+     * 
+     * Note that @ref IpRxInfoIp4::iface is a copy of the pointer from the time
+     * the datagram was received and the interface may have been removed since.
+     */
+    struct Datagram {
+        IpRxInfoIp4<StackArg> ip_info;
+        UdpRxInfo<UdpArg> udp_info;
+
+        /**
+         * The datagram payload, referencing memory within the queue buffer. It
+         * remains valid until the datagram is released using @ref consumeDatagrams
+         * or @ref clear.
+         */
+        MemRef data;
+    };
+
+    /**
+     * Counters of datagrams which were dropped by @ref enqueueIp4Dgram.
+     */
+    struct DropCounters {
+        /**
+         * Datagrams dropped because there was not enough free space.
+         */
+        std::uint32_t queue_full = 0;
+
+        /**
+         * Datagrams dropped because they could never fit into the buffer.
+         */
+        std::uint32_t too_large = 0;
+    };
+
+    /**
+     * Return the number of buffer bytes used by a datagram of the given size.
+     * 
+     * This can be used to dimension the buffer. Note that because records do not
+     * wrap, the usable capacity may be less than the sum of record sizes by up to
+     * the size of one record.
+     * 
+     * @param data_len Length of the UDP payload.
+     * @return Number of bytes.
+     */
+    static constexpr std::size_t recordSize (std::size_t data_len)
+    {
+        std::size_t size = sizeof(RecordHeader) + data_len;
+        return size + ((RecordAlign - size % RecordAlign) % RecordAlign);
+    }
+
+    /**
+     * Construct the queue.
+     * 
+     * @param buffer Buffer for storing datagrams. It must be aligned suitably for
+     *        any object (as by std::max_align_t) and must remain valid while the queue exists.
+     * @param buffer_size Size of the buffer in bytes.
+     * @param queued_handler Handler called from @ref enqueueIp4Dgram when the
+     *        queue transitions from empty to non-empty (may be null). It may call
+     *        any function of this class.
+     */
+    UdpRecvQueue (char *buffer, std::size_t buffer_size,
+                  DatagramsQueuedHandler queued_handler = nullptr) :
+        m_queued_handler(queued_handler),
+        m_buffer(buffer),
+        m_buffer_size(buffer_size - buffer_size % RecordAlign),
+        m_num_queued(0),
+        m_read_pos(0),
+        m_write_pos(0),
+        m_wrap_end(0),
+        m_wrapped(false)
+    {
+        AIPSTACK_ASSERT(buffer != nullptr || buffer_size == 0);
+        AIPSTACK_ASSERT(reinterpret_cast<std::uintptr_t>(buffer) % RecordAlign == 0);
+    }
+
+    /**
+     * Accept a received datagram into the queue.
+     * 
+     * The signature matches the packet handler of @ref UdpListener and
+     * @ref UdpAssociation, so the queue can be bound as the handler directly or
+     * called from an application handler. The datagram is accepted even if it
+     * has to be dropped due to lack of space, so that the stack does not respond
+     * with an ICMP Port Unreachable message.
+     * 
+     * @return Always @ref UdpRecvResult::AcceptStop.
+     */
+    UdpRecvResult enqueueIp4Dgram (IpRxInfoIp4<StackArg> const &ip_info,
+                                   UdpRxInfo<UdpArg> const &udp_info, IpBufRef udp_data)
+    {
+        std::size_t rec_size = recordSize(udp_data.tot_len);
+
+        if (rec_size > m_buffer_size) {
+            m_drop_counters.too_large++;
+            return UdpRecvResult::AcceptStop;
+        }
+
+        char *rec = allocate_record(rec_size);
+        if (rec == nullptr) {
+            m_drop_counters.queue_full++;
+            return UdpRecvResult::AcceptStop;
+        }
+
+        RecordHeader *header = new(rec) RecordHeader{ip_info, udp_info, udp_data.tot_len};
+        ipBufTakeBytes(udp_data, header->data_len, rec + sizeof(RecordHeader));
+
+        m_num_queued++;
+
+        if (m_num_queued == 1 && m_queued_handler) {
+            m_queued_handler();
+        }
+
+        return UdpRecvResult::AcceptStop;
+    }
+
+    /**
+     * Get views of the oldest queued datagrams without removing them.
+     * 
+     * @param dgrams Array to be filled with datagram views.
+     * @param max_dgrams Size of the array.
+     * @return Number of entries filled in, which is the lesser of @p max_dgrams
+     *         and the number of queued datagrams.
+     */
+    std::size_t peekDatagrams (Datagram *dgrams, std::size_t max_dgrams) const
+    {
+        std::size_t count = (max_dgrams < m_num_queued) ? max_dgrams : m_num_queued;
+
+        std::size_t pos = m_read_pos;
+        for (std::size_t i = 0; i < count; i++) {
+            pos = normalize_read_pos(pos);
+            RecordHeader const *header = record_at(pos);
+            dgrams[i] = Datagram{header->ip_info, header->udp_info,
+                MemRef(m_buffer + pos + sizeof(RecordHeader), header->data_len)};
+            pos += recordSize(header->data_len);
+        }
+
+        return count;
+    }
+
+    /**
+     * Release the oldest queued datagrams.
+     * 
+     * @param num_dgrams Number of datagrams to release. It must not exceed
+     *        @ref getNumQueued (this is an assert).
+     */
+    void consumeDatagrams (std::size_t num_dgrams)
+    {
+        AIPSTACK_ASSERT(num_dgrams <= m_num_queued);
+
+        for (std::size_t i = 0; i < num_dgrams; i++) {
+            m_read_pos = normalize_read_pos(m_read_pos);
+            m_read_pos += recordSize(record_at(m_read_pos)->data_len);
+
+            if (m_wrapped && m_read_pos == m_wrap_end) {
+                m_read_pos = 0;
+                m_wrapped = false;
+            }
+        }
+
+        m_num_queued -= num_dgrams;
+
+        if (m_num_queued == 0) {
+            m_read_pos = 0;
+            m_write_pos = 0;
+            m_wrapped = false;
+        }
+    }
+
+    /**
+     * Release all queued datagrams.
+     */
+    void clear ()
+    {
+        m_num_queued = 0;
+        m_read_pos = 0;
+        m_write_pos = 0;
+        m_wrapped = false;
+    }
+
+    /**
+     * Return the number of queued datagrams.
+     */
+    inline std::size_t getNumQueued () const
+    {
+        return m_num_queued;
+    }
+
+    /**
+     * Return the drop counters.
+     */
+    inline DropCounters const & getDropCounters () const
+    {
+        return m_drop_counters;
+    }
+
+    /**
+     * Reset the drop counters to zero.
+     */
+    void resetDropCounters ()
+    {
+        m_drop_counters = DropCounters();
+    }
+
+private:
+    // Find space for a new record. Data is written at m_write_pos which is either
+    // after the data (not wrapped) or before the data (wrapped); in the latter
+    // case m_wrap_end marks the end of the data at the end of the buffer.
+    char * allocate_record (std::size_t rec_size)
+    {
+        if (!m_wrapped) {
+            if (rec_size <= m_buffer_size - m_write_pos) {
+                // Fits after existing data.
+            }
+            else if (m_num_queued > 0 && rec_size <= m_read_pos) {
+                // Wrap around to the start of the buffer.
+                m_wrap_end = m_write_pos;
+                m_write_pos = 0;
+                m_wrapped = true;
+            }
+            else {
+                return nullptr;
+            }
+        } else {
+            if (rec_size > m_read_pos - m_write_pos) {
+                return nullptr;
+            }
+        }
+
+        char *rec = m_buffer + m_write_pos;
+        m_write_pos += rec_size;
+        return rec;
+    }
+
+    // When wrapped, a read position at the wrap point continues at the start.
+    std::size_t normalize_read_pos (std::size_t pos) const
+    {
+        return (m_wrapped && pos == m_wrap_end) ? 0 : pos;
+    }
+
+    RecordHeader * record_at (std::size_t pos) const
+    {
+        AIPSTACK_ASSERT(pos + sizeof(RecordHeader) <= m_buffer_size);
+
+        return reinterpret_cast<RecordHeader *>(m_buffer + pos);
+    }
+
+private:
+    DatagramsQueuedHandler m_queued_handler;
+    char *m_buffer;
+    std::size_t m_buffer_size;
+    std::size_t m_num_queued;
+    std::size_t m_read_pos;
+    std::size_t m_write_pos;
+    std::size_t m_wrap_end;
+    bool m_wrapped;
+    DropCounters m_drop_counters;
+};
+
+}
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+// Tests IpEphemeralPortAllocator: ports for different destinations are spread
+// over the range, consecutive allocations for one destination give consecutive
+// ports, ports which are in use (e.g. in TIME_WAIT) are skipped, and exhaustion
+// of the range gives port 0.
+
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpEphemeralPortAllocator.h>
+
+using namespace AIpStack;
+
+namespace aipstack_ip_ephemeral_port_test {
+
+constexpr Ip4Addr LocalAddr = Ip4Addr(10, 0, 0, 1);
+
+SipHashKey const TestKey = SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u};
+
+bool all_free (PortNum)
+{
+    return true;
+}
+
+// Ports for many destinations are spread evenly over the range.
+void test_distribution ()
+{
+    constexpr PortNum First = 49152;
+    constexpr PortNum Last = 65535;
+    constexpr std::size_t NumBins = 16;
+    constexpr std::size_t NumDests = 16000;
+
+    IpEphemeralPortAllocator<First, Last> alloc;
+    alloc.init();
+    AIPSTACK_ASSERT_FORCE(!alloc.isKeySet());
+    alloc.setKey(TestKey);
+    AIPSTACK_ASSERT_FORCE(alloc.isKeySet());
+
+    std::size_t bins[NumBins] = {};
+    for (std::size_t i = 0; i < NumDests; i++) {
+        Ip4Addr remote = Ip4Addr(std::uint32_t(0xc0a80000u + i));
+        PortNum port = alloc.allocate(LocalAddr, remote, 80, &all_free);
+        AIPSTACK_ASSERT_FORCE(port >= First && port <= Last);
+        bins[(port - First) * NumBins / (std::size_t(Last - First) + 1)]++;
+    }
+
+    // Each bin expects 1000; allow a generous deviation.
+    for (std::size_t count : bins) {
+        AIPSTACK_ASSERT_FORCE(count > 800 && count < 1200);
+    }
+}
+
+// Consecutive allocations for one destination give consecutive ports, also
+// after the counter wraps around, while another destination has its own
+// sequence.
+void test_sequence ()
+{
+    constexpr PortNum First = 1000;
+    constexpr PortNum Last = 1006;
+    constexpr std::uint32_t NumPorts = Last - First + 1;
+
+    // One counter, shared by all destinations.
+    IpEphemeralPortAllocator<First, Last, 1> alloc;
+    alloc.init();
+    alloc.setKey(TestKey);
+
+    Ip4Addr const remote1 = Ip4Addr(192, 168, 0, 1);
+    Ip4Addr const remote2 = Ip4Addr(192, 168, 0, 2);
+
+    PortNum prev = alloc.allocate(LocalAddr, remote1, 80, &all_free);
+    std::uint32_t wraps = 0;
+    for (std::uint32_t i = 1; i < 70000; i++) {
+        PortNum port = alloc.allocate(LocalAddr, remote1, 80, &all_free);
+        AIPSTACK_ASSERT_FORCE(port >= First && port <= Last);
+        PortNum expected = PortNum(First + (prev - First + 1) % NumPorts);
+        if (port != expected) {
+            // Only at the 16-bit counter wraparound.
+            AIPSTACK_ASSERT_FORCE(i == 65536);
+            wraps++;
+        }
+        prev = port;
+    }
+    AIPSTACK_ASSERT_FORCE(wraps <= 1);
+
+    // Different destinations and ports start at independent offsets, but
+    // advance the shared counter.
+    std::set<PortNum> first_ports;
+    for (PortNum remote_port = 1; remote_port <= 50; remote_port++) {
+        first_ports.insert(alloc.allocate(LocalAddr, remote2, remote_port, &all_free));
+    }
+    AIPSTACK_ASSERT_FORCE(first_ports.size() == NumPorts);
+
+    // A different key gives a different sequence.
+    IpEphemeralPortAllocator<49152, 65535> alloc1;
+    IpEphemeralPortAllocator<49152, 65535> alloc2;
+    alloc1.init();
+    alloc2.init();
+    alloc1.setKey(TestKey);
+    alloc2.setKey(SipHashKey{1, 2});
+    int same = 0;
+    for (std::uint8_t i = 0; i < 20; i++) {
+        Ip4Addr remote = Ip4Addr(192, 168, 1, i);
+        same += alloc1.allocate(LocalAddr, remote, 80, &all_free) ==
+                alloc2.allocate(LocalAddr, remote, 80, &all_free);
+    }
+    AIPSTACK_ASSERT_FORCE(same < 2);
+}
+
+// Ports which are in use are skipped, and 0 is returned when all are in use.
+void test_in_use ()
+{
+    constexpr PortNum First = 2000;
+    constexpr PortNum Last = 2009;
+
+    IpEphemeralPortAllocator<First, Last, 4> alloc;
+    alloc.init();
+    alloc.setKey(TestKey);
+
+    Ip4Addr const remote = Ip4Addr(192, 168, 0, 7);
+
+    // Ports given out stay in use (as if in TIME_WAIT). All ports are given out
+    // exactly once, then the range is exhausted.
+    std::set<PortNum> in_use;
+    auto is_free = [&](PortNum port) { return in_use.count(port) == 0; };
+
+    for (int i = 0; i < 10; i++) {
+        PortNum port = alloc.allocate(LocalAddr, remote, 443, is_free);
+        AIPSTACK_ASSERT_FORCE(port >= First && port <= Last);
+        AIPSTACK_ASSERT_FORCE(in_use.insert(port).second);
+    }
+    AIPSTACK_ASSERT_FORCE(alloc.allocate(LocalAddr, remote, 443, is_free) == 0);
+    AIPSTACK_ASSERT_FORCE(alloc.allocate(LocalAddr, Ip4Addr(1, 2, 3, 4), 1, is_free) == 0);
+
+    // A released port is found wherever the search starts.
+    in_use.erase(2005);
+    AIPSTACK_ASSERT_FORCE(alloc.allocate(LocalAddr, remote, 443, is_free) == 2005);
+    in_use.erase(2001);
+    in_use.erase(2008);
+    PortNum port = alloc.allocate(LocalAddr, Ip4Addr(8, 8, 8, 8), 53, is_free);
+    AIPSTACK_ASSERT_FORCE(port == 2001 || port == 2008);
+
+    // With some ports in use, the next free port after the previous one is
+    // chosen, skipping the used ones.
+    IpEphemeralPortAllocator<First, Last, 1> alloc2;
+    alloc2.init();
+    alloc2.setKey(TestKey);
+    std::set<PortNum> used;
+    auto is_free2 = [&](PortNum p) { return used.count(p) == 0; };
+    PortNum p1 = alloc2.allocate(LocalAddr, remote, 443, is_free2);
+    used.insert(PortNum(First + (p1 - First + 1) % 10));
+    used.insert(PortNum(First + (p1 - First + 2) % 10));
+    PortNum p2 = alloc2.allocate(LocalAddr, remote, 443, is_free2);
+    AIPSTACK_ASSERT_FORCE(p2 == PortNum(First + (p1 - First + 3) % 10));
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_ip_ephemeral_port_test;
+
+    test_distribution();
+    test_sequence();
+    test_in_use();
+
+    return 0;
+}
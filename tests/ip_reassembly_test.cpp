@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+// Tests IpReassembly. Random fragments of several datagrams, including
+// overlapping, duplicate and inconsistent ones, are checked against a reference
+// model using a bitmap of received bytes, comparing the reassembled data byte by
+// byte. Specific cases cover the limit of holes, exhaustion of the chunk pool and
+// of entries with eviction, the timeout, and the ECN codepoint of reassembled
+// datagrams.
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Instance.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_ip_reassembly_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+template<int MaxEntries, std::uint16_t MaxSize, std::uint8_t MaxHoles,
+         std::uint16_t ChunkSize, std::size_t PoolSize>
+struct ReassInstance {
+    using Service = IpReassemblyService<
+        IpReassemblyOptions::MaxReassEntrys::Is<MaxEntries>,
+        IpReassemblyOptions::MaxReassSize::Is<MaxSize>,
+        IpReassemblyOptions::MaxReassHoles::Is<MaxHoles>,
+        IpReassemblyOptions::MaxReassTimeSeconds::Is<30>,
+        IpReassemblyOptions::ReassChunkSize::Is<ChunkSize>,
+        IpReassemblyOptions::ReassPoolSize::Is<PoolSize>
+    >;
+    using Compose = typename Service::template Compose<SimulatedPlatformImpl>;
+    AIPSTACK_MAKE_INSTANCE(Reass, (Compose))
+};
+
+constexpr Ip4Addr SrcAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr DstAddr = Ip4Addr(10, 0, 0, 2);
+constexpr Ip4Protocol Proto = Ip4Protocol::Udp;
+
+// Test environment: the simulated platform and the reassembly object.
+template<typename Reass>
+class Env {
+public:
+    Env () :
+        m_platform(PlatformRef<SimulatedPlatformImpl>{&m_platform_impl}),
+        m_reass(m_platform),
+        m_ecn(Ip4Ecn::NotEct)
+    {}
+
+    Reass & reass () { return m_reass; }
+
+    // The ECN codepoint of the last reassembled datagram.
+    Ip4Ecn ecn () const { return m_ecn; }
+
+    void advance (double seconds)
+    {
+        m_platform_impl.runUntil(m_platform.getTime() +
+            Platform::TimeType(seconds * Platform::TimeFreq));
+    }
+
+    // Pass a fragment with the given data and return the reassembled data if any.
+    bool fragment (std::uint16_t ident, std::uint16_t offset, bool more,
+                   std::vector<char> const &data, std::vector<char> &result,
+                   std::uint8_t ttl = 64, std::size_t chunk_size = 0,
+                   Ip4Ecn ecn = Ip4Ecn::NotEct)
+    {
+        // Pass the data in two buffer nodes to exercise copying across nodes.
+        m_frag_data = data;
+        std::size_t split = data.size() / 3;
+        m_nodes[1] = IpBufNode{m_frag_data.data() + split, data.size() - split, nullptr};
+        m_nodes[0] = IpBufNode{m_frag_data.data(), split, &m_nodes[1]};
+        IpBufRef dgram{&m_nodes[0], 0, data.size()};
+
+        Ip4Ecn orig_ecn = ecn;
+        if (!m_reass.reassembleIp4(ident, SrcAddr, DstAddr, ttl, Proto, more, offset,
+                                   ecn, dgram))
+        {
+            AIPSTACK_ASSERT_FORCE(ecn == orig_ecn);
+            return false;
+        }
+        m_ecn = ecn;
+
+        // The first node must hold the first chunk (or all the data).
+        if (chunk_size > 0) {
+            AIPSTACK_ASSERT_FORCE(
+                dgram.getChunkLength() >= MinValue(chunk_size, dgram.tot_len));
+        }
+
+        result.resize(dgram.tot_len);
+        IpBufRef rest = ipBufTakeBytes(dgram, dgram.tot_len, result.data());
+        AIPSTACK_ASSERT_FORCE(rest.tot_len == 0);
+        return true;
+    }
+
+private:
+    SimulatedPlatformImpl m_platform_impl;
+    Platform m_platform;
+    Reass m_reass;
+    Ip4Ecn m_ecn;
+    std::vector<char> m_frag_data;
+    IpBufNode m_nodes[2];
+};
+
+std::vector<char> make_data (std::size_t len, unsigned seed)
+{
+    std::vector<char> data(len);
+    for (std::size_t i = 0; i < len; i++) {
+        data[i] = char((i * 131 + seed * 17 + (i >> 7)) % 251);
+    }
+    return data;
+}
+
+std::vector<char> slice (std::vector<char> const &data, std::size_t start, std::size_t end)
+{
+    return std::vector<char>(data.begin() + std::ptrdiff_t(start),
+                             data.begin() + std::ptrdiff_t(end));
+}
+
+// Reference model of the reassembly of one datagram.
+class Model {
+public:
+    Model (std::size_t max_size, std::size_t max_holes) :
+        m_max_size(max_size),
+        m_max_holes(max_holes),
+        m_active(false)
+    {}
+
+    bool active () const { return m_active; }
+
+    // Process a fragment. Returns true if the datagram is complete, and sets
+    // active to false if the datagram was completed or dropped.
+    bool fragment (std::size_t offset, bool more, std::vector<char> const &data)
+    {
+        if (data.empty()) {
+            return false;
+        }
+
+        if (!m_active) {
+            m_active = true;
+            m_received.assign(m_max_size, 0);
+            m_data.assign(m_max_size, 0);
+            m_data_length = 0;
+        }
+
+        std::size_t end = offset + data.size();
+
+        bool ok = end <= m_max_size;
+        if (ok && !more) {
+            ok = (m_data_length == 0 || end == m_data_length) && extent() <= end;
+            m_data_length = end;
+        }
+        else if (ok) {
+            ok = m_data_length == 0 || end <= m_data_length;
+        }
+        if (ok) {
+            std::vector<std::uint8_t> received = m_received;
+            for (std::size_t i = offset; i < end; i++) {
+                received[i] = 1;
+            }
+            ok = num_ranges(received) <= m_max_holes;
+            if (ok) {
+                m_received = received;
+                for (std::size_t i = 0; i < data.size(); i++) {
+                    m_data[offset + i] = data[i];
+                }
+            }
+        }
+
+        if (!ok) {
+            m_active = false;
+            return false;
+        }
+
+        if (m_data_length == 0) {
+            return false;
+        }
+        for (std::size_t i = 0; i < m_data_length; i++) {
+            if (!m_received[i]) {
+                return false;
+            }
+        }
+
+        m_active = false;
+        return true;
+    }
+
+    std::vector<char> data () const
+    {
+        return slice(m_data, 0, m_data_length);
+    }
+
+private:
+    std::size_t extent () const
+    {
+        std::size_t ext = 0;
+        for (std::size_t i = 0; i < m_received.size(); i++) {
+            if (m_received[i]) {
+                ext = i + 1;
+            }
+        }
+        return ext;
+    }
+
+    static std::size_t num_ranges (std::vector<std::uint8_t> const &received)
+    {
+        std::size_t num = 0;
+        for (std::size_t i = 0; i < received.size(); i++) {
+            if (received[i] && (i == 0 || !received[i - 1])) {
+                num++;
+            }
+        }
+        return num;
+    }
+
+private:
+    std::size_t m_max_size;
+    std::size_t m_max_holes;
+    bool m_active;
+    std::vector<std::uint8_t> m_received;
+    std::vector<char> m_data;
+    std::size_t m_data_length;
+};
+
+struct Stats {
+    int completed = 0;
+    int dropped = 0;
+};
+
+// Random fragments of several concurrent datagrams, with at most as many
+// datagrams as entries and a pool large enough for all, so nothing is evicted.
+template<std::uint16_t MaxSize, std::uint8_t MaxHoles, std::uint16_t ChunkSize>
+void test_random (unsigned seed, int iterations, Stats &stats)
+{
+    constexpr int NumDgrams = 4;
+    using Reass = typename ReassInstance<NumDgrams, MaxSize, MaxHoles, ChunkSize, 0>::Reass;
+
+    std::mt19937 rng(seed);
+    auto rand_int = [&](std::size_t n) {
+        return std::size_t(std::uniform_int_distribution<std::size_t>(0, n - 1)(rng));
+    };
+
+    Env<Reass> env;
+
+    struct Dgram {
+        std::uint16_t ident;
+        std::vector<char> data;
+        Model model;
+    };
+    std::vector<Dgram> dgrams;
+    std::uint16_t next_ident = 1;
+
+    auto new_dgram = [&](Dgram &dgram) {
+        // Mostly lengths which fit, sometimes too large ones.
+        std::size_t len = 2 + rand_int(MaxSize - 1);
+        if (rand_int(20) == 0) {
+            len = MaxSize + 1 + rand_int(100);
+        }
+        dgram.ident = next_ident++;
+        dgram.data = make_data(len, dgram.ident);
+    };
+
+    for (int i = 0; i < NumDgrams; i++) {
+        dgrams.push_back(Dgram{0, {}, Model(MaxSize, MaxHoles)});
+        new_dgram(dgrams.back());
+    }
+
+    for (int iter = 0; iter < iterations; iter++) {
+        Dgram &dgram = dgrams[rand_int(NumDgrams)];
+        std::size_t len = dgram.data.size();
+
+        // Choose a fragment, often at the ends and sometimes tiny or empty.
+        std::size_t start = rand_int(len);
+        std::size_t max_frag = (rand_int(4) == 0) ? 8 : 600;
+        std::size_t end = MinValue(len, start + 1 + rand_int(max_frag));
+        switch (rand_int(6)) {
+            case 0: start = 0; break;
+            case 1: end = len; break;
+            case 2: end = start; break;
+        }
+        if (start == 0 && end == len) {
+            end = len - 1;
+        }
+
+        bool more = end < len;
+        std::vector<char> frag = slice(dgram.data, start, end);
+
+        // Sometimes claim a wrong end of the datagram, or change the data which
+        // then overwrites data received before.
+        if (rand_int(40) == 0 && start > 0) {
+            more = !more;
+        }
+        if (rand_int(30) == 0 && !frag.empty()) {
+            frag[rand_int(frag.size())] ^= 0x55;
+        }
+        if (!more && start == 0) {
+            continue;
+        }
+
+        std::vector<char> result;
+        bool done = env.fragment(dgram.ident, std::uint16_t(start), more, frag, result,
+                                 64, ChunkSize);
+        bool model_done = dgram.model.fragment(start, more, frag);
+        AIPSTACK_ASSERT_FORCE(done == model_done);
+
+        if (done) {
+            AIPSTACK_ASSERT_FORCE(result == dgram.model.data());
+            stats.completed++;
+            new_dgram(dgram);
+        }
+        else if (!dgram.model.active() && !frag.empty()) {
+            // Dropped; the model and the entry start over with the next fragment,
+            // but use a new datagram anyway.
+            stats.dropped++;
+            new_dgram(dgram);
+        }
+    }
+}
+
+// Fragments in order, in reverse and overlapping, with byte-exact results.
+void test_orders ()
+{
+    using Reass = ReassInstance<2, 4000, 10, 128, 0>::Reass;
+    Env<Reass> env;
+    std::vector<char> result;
+
+    std::vector<char> data = make_data(3000, 1);
+
+    // In order, 1000 bytes each.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 0, true, slice(data, 0, 1000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 1000, true, slice(data, 1000, 2000), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(1, 2000, false, slice(data, 2000, 3000), result));
+    AIPSTACK_ASSERT_FORCE(result == data);
+
+    // Reverse order, with sizes not aligned to chunks.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 2001, false, slice(data, 2001, 3000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 777, true, slice(data, 777, 2001), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 1, true, slice(data, 1, 777), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(2, 0, true, slice(data, 0, 1), result));
+    AIPSTACK_ASSERT_FORCE(result == data);
+
+    // Overlapping fragments and a fragment covering others.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(3, 500, true, slice(data, 500, 1500), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(3, 1400, true, slice(data, 1400, 2600), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(3, 2500, false, slice(data, 2500, 3000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(3, 600, true, slice(data, 600, 700), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(3, 0, true, slice(data, 0, 2000), result));
+    AIPSTACK_ASSERT_FORCE(result == data);
+
+    // A duplicate last fragment is accepted, one with a different end drops
+    // the datagram.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(4, 2000, false, slice(data, 2000, 3000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(4, 2000, false, slice(data, 2000, 3000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(4, 2500, false, slice(data, 2500, 3000), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(4, 0, true, slice(data, 0, 2000), result));
+    AIPSTACK_ASSERT_FORCE(result == data);
+
+    AIPSTACK_ASSERT_FORCE(!env.fragment(5, 2000, false, slice(data, 2000, 3000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(5, 2000, false, slice(data, 2000, 2999), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(5, 0, true, slice(data, 0, 2000), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(5, 2000, false, slice(data, 2000, 3000), result));
+    AIPSTACK_ASSERT_FORCE(result == data);
+
+    // A last fragment ending before received data drops the datagram, as does
+    // data beyond the end.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(6, 2000, true, slice(data, 2000, 3000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(6, 1000, false, slice(data, 1000, 2000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(6, 0, true, slice(data, 0, 1000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(7, 1000, false, slice(data, 1000, 2000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(7, 1500, true, slice(data, 1500, 2500), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(7, 0, true, slice(data, 0, 1000), result));
+
+    // The maximum size and one more.
+    std::vector<char> max_data = make_data(4000, 2);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(8, 0, true, slice(max_data, 0, 2000), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(8, 2000, false, slice(max_data, 2000, 4000), result));
+    AIPSTACK_ASSERT_FORCE(result == max_data);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(9, 0, true, slice(max_data, 0, 2000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(9, 2001, false, slice(max_data, 2000, 4000), result));
+}
+
+// Running out of holes drops the datagram.
+void test_holes ()
+{
+    using Reass = ReassInstance<1, 2000, 3, 128, 0>::Reass;
+    Env<Reass> env;
+    std::vector<char> result;
+
+    std::vector<char> data = make_data(1000, 3);
+
+    // Three separate ranges fit, adjacent fragments merge.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 100, true, slice(data, 100, 200), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 300, true, slice(data, 300, 400), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 500, true, slice(data, 500, 600), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 200, true, slice(data, 200, 250), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 400, true, slice(data, 400, 500), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 700, false, slice(data, 700, 1000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 0, true, slice(data, 0, 100), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 250, true, slice(data, 250, 300), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(1, 600, true, slice(data, 600, 700), result));
+    AIPSTACK_ASSERT_FORCE(result == data);
+
+    // A fourth separate range drops the datagram, so it does not complete.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 100, true, slice(data, 100, 200), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 300, true, slice(data, 300, 400), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 500, true, slice(data, 500, 600), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 700, false, slice(data, 700, 1000), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 0, true, slice(data, 0, 700), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(2, 700, false, slice(data, 700, 1000), result));
+    AIPSTACK_ASSERT_FORCE(result == data);
+}
+
+// Exhaustion of chunks and of entries evicts the entry which expires first.
+void test_eviction ()
+{
+    // 8 chunks of 256 bytes, 3 entries, datagrams of up to 2560 bytes.
+    using Reass = ReassInstance<3, 2560, 10, 256, 8 * 256>::Reass;
+    Env<Reass> env;
+    std::vector<char> result;
+
+    std::vector<char> data_a = make_data(1024, 4);
+    std::vector<char> data_b = make_data(1024, 5);
+    std::vector<char> data_c = make_data(1024, 6);
+
+    // A and B take 3 chunks each.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 0, true, slice(data_a, 0, 768), result));
+    env.advance(1.0);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 0, true, slice(data_b, 0, 768), result));
+    env.advance(1.0);
+
+    // C needs 4 chunks: the last one evicts A, which expires first.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(3, 0, true, slice(data_c, 0, 1000), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(3, 1000, false, slice(data_c, 1000, 1024), result));
+    AIPSTACK_ASSERT_FORCE(result == data_c);
+
+    // B completes, A does not since its first part was dropped.
+    AIPSTACK_ASSERT_FORCE(env.fragment(2, 768, false, slice(data_b, 768, 1024), result));
+    AIPSTACK_ASSERT_FORCE(result == data_b);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 768, false, slice(data_a, 768, 1024), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(1, 0, true, slice(data_a, 0, 768), result));
+    AIPSTACK_ASSERT_FORCE(result == data_a);
+
+    // A datagram needing more chunks than the pool is dropped, even though
+    // other datagrams could be evicted; it only evicts them.
+    std::vector<char> big = make_data(2560, 7);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(4, 0, true, slice(data_a, 0, 256), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(5, 0, true, slice(big, 0, 2300), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(5, 2300, false, slice(big, 2300, 2560), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(4, 256, false, slice(data_a, 256, 1024), result));
+
+    // All chunks are free again: a datagram of the pool size completes.
+    std::vector<char> pool_sized = make_data(2048, 8);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(6, 1024, false, slice(pool_sized, 1024, 2048), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(6, 0, true, slice(pool_sized, 0, 1024), result));
+    AIPSTACK_ASSERT_FORCE(result == pool_sized);
+
+    // With more datagrams than entries the one which expires first is evicted,
+    // here C which has the smallest TTL.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(7, 0, true, slice(data_a, 0, 100), result));
+    env.advance(1.0);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(8, 0, true, slice(data_b, 0, 100), result));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(9, 0, true, slice(data_c, 0, 100), result, 5));
+    AIPSTACK_ASSERT_FORCE(!env.fragment(10, 0, true, slice(data_c, 0, 100), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(7, 100, false, slice(data_a, 100, 1024), result));
+    AIPSTACK_ASSERT_FORCE(result == data_a);
+    AIPSTACK_ASSERT_FORCE(env.fragment(8, 100, false, slice(data_b, 100, 1024), result));
+    AIPSTACK_ASSERT_FORCE(result == data_b);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(9, 100, false, slice(data_c, 100, 1024), result));
+    AIPSTACK_ASSERT_FORCE(env.fragment(10, 100, false, slice(data_c, 100, 1024), result));
+    AIPSTACK_ASSERT_FORCE(result == data_c);
+}
+
+// Incomplete datagrams expire after the TTL, limited by MaxReassTimeSeconds.
+void test_timeout ()
+{
+    using Reass = ReassInstance<2, 2000, 10, 256, 0>::Reass;
+    Env<Reass> env;
+    std::vector<char> result;
+
+    std::vector<char> data = make_data(1000, 9);
+
+    // Completes within the TTL.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(1, 0, true, slice(data, 0, 500), result, 10));
+    env.advance(9.5);
+    AIPSTACK_ASSERT_FORCE(env.fragment(1, 500, false, slice(data, 500, 1000), result, 10));
+    AIPSTACK_ASSERT_FORCE(result == data);
+
+    // Expires after the TTL; the late fragment starts a new entry.
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 0, true, slice(data, 0, 500), result, 10));
+    env.advance(10.5);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(2, 500, false, slice(data, 500, 1000), result, 10));
+    AIPSTACK_ASSERT_FORCE(env.fragment(2, 0, true, slice(data, 0, 500), result, 10));
+    AIPSTACK_ASSERT_FORCE(result == data);
+
+    // A large TTL is limited to MaxReassTimeSeconds (30).
+    AIPSTACK_ASSERT_FORCE(!env.fragment(3, 0, true, slice(data, 0, 500), result, 255));
+    env.advance(29.0);
+    AIPSTACK_ASSERT_FORCE(env.fragment(3, 500, false, slice(data, 500, 1000), result));
+    AIPSTACK_ASSERT_FORCE(result == data);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(4, 0, true, slice(data, 0, 500), result, 255));
+    env.advance(31.0);
+    AIPSTACK_ASSERT_FORCE(!env.fragment(4, 500, false, slice(data, 500, 1000), result));
+}
+
+
+// The ECN codepoint of a reassembled datagram follows RFC 3168 section 5.3.
+void test_ecn ()
+{
+    using Reass = ReassInstance<2, 2000, 10, 256, 0>::Reass;
+    Env<Reass> env;
+    std::vector<char> result;
+
+    std::vector<char> data = make_data(1500, 11);
+    std::uint16_t ident = 1;
+
+    // Reassemble from three fragments with the given codepoints, returning
+    // whether the datagram was delivered.
+    auto reassemble = [&](Ip4Ecn ecn0, Ip4Ecn ecn1, Ip4Ecn ecn2) {
+        ident++;
+        AIPSTACK_ASSERT_FORCE(!env.fragment(
+            ident, 0, true, slice(data, 0, 500), result, 64, 0, ecn0));
+        AIPSTACK_ASSERT_FORCE(!env.fragment(
+            ident, 1000, false, slice(data, 1000, 1500), result, 64, 0, ecn1));
+        bool done = env.fragment(
+            ident, 500, true, slice(data, 500, 1000), result, 64, 0, ecn2);
+        AIPSTACK_ASSERT_FORCE(!done || result == data);
+        return done;
+    };
+
+    // All the same.
+    for (Ip4Ecn ecn : {Ip4Ecn::NotEct, Ip4Ecn::Ect0, Ip4Ecn::Ect1, Ip4Ecn::Ce}) {
+        AIPSTACK_ASSERT_FORCE(reassemble(ecn, ecn, ecn));
+        AIPSTACK_ASSERT_FORCE(env.ecn() == ecn);
+    }
+
+    // CE in any fragment with the others ECT gives CE, no matter which
+    // fragment completes the datagram.
+    AIPSTACK_ASSERT_FORCE(reassemble(Ip4Ecn::Ce, Ip4Ecn::Ect0, Ip4Ecn::Ect0));
+    AIPSTACK_ASSERT_FORCE(env.ecn() == Ip4Ecn::Ce);
+    AIPSTACK_ASSERT_FORCE(reassemble(Ip4Ecn::Ect0, Ip4Ecn::Ce, Ip4Ecn::Ect0));
+    AIPSTACK_ASSERT_FORCE(env.ecn() == Ip4Ecn::Ce);
+    AIPSTACK_ASSERT_FORCE(reassemble(Ip4Ecn::Ect1, Ip4Ecn::Ect1, Ip4Ecn::Ce));
+    AIPSTACK_ASSERT_FORCE(env.ecn() == Ip4Ecn::Ce);
+
+    // A mixture of ECT(0) and ECT(1) is ECT, not CE.
+    AIPSTACK_ASSERT_FORCE(reassemble(Ip4Ecn::Ect0, Ip4Ecn::Ect1, Ip4Ecn::Ect1));
+    AIPSTACK_ASSERT_FORCE(env.ecn() == Ip4Ecn::Ect0 || env.ecn() == Ip4Ecn::Ect1);
+
+    // Not-ECT mixed with ECT or CE is dropped, also if that is the fragment
+    // which would complete the datagram. A mixture is dropped as soon as it
+    // is seen, so that a later fragment only starts a new entry.
+    for (Ip4Ecn ecn : {Ip4Ecn::Ect0, Ip4Ecn::Ect1, Ip4Ecn::Ce}) {
+        AIPSTACK_ASSERT_FORCE(!reassemble(Ip4Ecn::NotEct, ecn, ecn));
+        AIPSTACK_ASSERT_FORCE(!reassemble(ecn, Ip4Ecn::NotEct, ecn));
+        AIPSTACK_ASSERT_FORCE(!reassemble(ecn, ecn, Ip4Ecn::NotEct));
+    }
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_ip_reassembly_test;
+
+    test_orders();
+    test_holes();
+    test_eviction();
+    test_timeout();
+    test_ecn();
+
+    Stats stats;
+    for (unsigned seed = 1; seed <= 20; seed++) {
+        test_random<3000, 10, 256>(seed, 3000, stats);
+        test_random<1480, 3, 64>(seed, 3000, stats);
+        test_random<600, 1, 512>(seed, 1000, stats);
+    }
+    AIPSTACK_ASSERT_FORCE(stats.completed > 100);
+    AIPSTACK_ASSERT_FORCE(stats.dropped > 100);
+
+    return 0;
+}
@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+// Tests IpStack::routeIp4 with interface subnets, gateways and static routes,
+// first with specific cases and then against a reference model of the routing
+// rules under random configuration changes. This is done with a route trie large
+// enough for all routes, with one which overflows (so routing falls back to
+// searching), and with and without the route cache.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpStaticRoute.h>
+#include <aipstack/ip/IpRouteTrie.h>
+#include <aipstack/ip/IpDriverIface.h>
+#include <aipstack/ip/IpIfaceDriverParams.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_ip_route_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+template<std::size_t RouteTableSize, std::size_t RouteCacheSize>
+using TestIpStackService = IpStackService<
+    IpStackOptions::RouteTableSize::Is<RouteTableSize>,
+    IpStackOptions::RouteCacheSize::Is<RouteCacheSize>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<AvlTreeIndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+template<std::size_t RouteTableSize, std::size_t RouteCacheSize>
+class TestStackArg : public TestIpStackService<RouteTableSize, RouteCacheSize>::
+    template Compose<SimulatedPlatformImpl, EmptyTypeList> {};
+
+// IP driver which drops all packets; only routing is tested.
+template<typename StackArg>
+class DummyDriver :
+    private NonCopyable<DummyDriver<StackArg>>
+{
+public:
+    DummyDriver (IpStack<StackArg> *stack) :
+        m_driver_iface(stack, IpIfaceDriverParams{
+            1500,
+            IpHwType::Undefined,
+            nullptr,
+            AIPSTACK_BIND_MEMBER_TN(&DummyDriver::sendIp4Packet, this),
+            AIPSTACK_BIND_MEMBER_TN(&DummyDriver::getState, this),
+            nullptr
+        })
+    {}
+
+    IpIface<StackArg> & iface ()
+    {
+        return m_driver_iface.iface();
+    }
+
+private:
+    IpErr sendIp4Packet (IpBufRef, Ip4Addr, IpSendRetryRequest *)
+    {
+        return IpErr::Success;
+    }
+
+    IpIfaceDriverState getState ()
+    {
+        return IpIfaceDriverState{};
+    }
+
+private:
+    IpDriverIface<StackArg> m_driver_iface;
+};
+
+template<typename StackArg>
+void check_route (IpStack<StackArg> &stack, Ip4Addr dst_addr,
+                  IpIface<StackArg> *exp_iface, Ip4Addr exp_hop)
+{
+    IpRouteInfoIp4<StackArg> route_info;
+    bool found = stack.routeIp4(dst_addr, route_info);
+    if (exp_iface == nullptr) {
+        AIPSTACK_ASSERT_FORCE(!found);
+    } else {
+        AIPSTACK_ASSERT_FORCE(found);
+        AIPSTACK_ASSERT_FORCE(route_info.iface == exp_iface);
+        AIPSTACK_ASSERT_FORCE(route_info.addr == exp_hop);
+    }
+}
+
+IpStaticRouteParams route_params (Ip4Addr dst_addr, std::uint8_t prefix,
+                                  Ip4Addr gateway, std::uint8_t metric)
+{
+    IpStaticRouteParams params;
+    params.dst_addr = dst_addr;
+    params.prefix = prefix;
+    params.gateway = gateway;
+    params.metric = metric;
+    return params;
+}
+
+template<typename StackArg>
+void test_cases ()
+{
+    using Route = IpStaticRoute<StackArg>;
+
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    IpStack<StackArg> stack(platform);
+    DummyDriver<StackArg> driver0(&stack);
+    DummyDriver<StackArg> driver1(&stack);
+    IpIface<StackArg> *if0 = &driver0.iface();
+    IpIface<StackArg> *if1 = &driver1.iface();
+
+    Ip4Addr const host = Ip4Addr(10, 2, 3, 4);
+    Ip4Addr const gw0 = Ip4Addr(10, 0, 0, 254);
+    Ip4Addr const gw1 = Ip4Addr(10, 1, 0, 254);
+
+    // Nothing is configured.
+    check_route<StackArg>(stack, host, nullptr, Ip4Addr());
+
+    if0->setIp4Addr(IpIfaceIp4AddrSetting(24, Ip4Addr(10, 0, 0, 1)));
+    if1->setIp4Addr(IpIfaceIp4AddrSetting(24, Ip4Addr(10, 1, 0, 1)));
+    check_route(stack, Ip4Addr(10, 0, 0, 7), if0, Ip4Addr(10, 0, 0, 7));
+    check_route(stack, Ip4Addr(10, 1, 0, 7), if1, Ip4Addr(10, 1, 0, 7));
+    check_route<StackArg>(stack, host, nullptr, Ip4Addr());
+
+    // The gateway is used when nothing else matches.
+    if0->setIp4Gateway(IpIfaceIp4GatewaySetting(gw0));
+    check_route(stack, host, if0, gw0);
+    check_route(stack, Ip4Addr(10, 1, 0, 7), if1, Ip4Addr(10, 1, 0, 7));
+
+    {
+        // A static route overrides the gateway, and the cached result for the
+        // destination is not used.
+        Route r16(if1, route_params(Ip4Addr(10, 2, 0, 0), 16, gw1, 0));
+        check_route(stack, host, if1, gw1);
+        check_route(stack, Ip4Addr(10, 3, 0, 1), if0, gw0);
+
+        {
+            // The longest prefix wins regardless of the metric.
+            Route r24(if0, route_params(Ip4Addr(10, 2, 3, 99), 24, gw0, 9));
+            check_route(stack, host, if0, gw0);
+            check_route(stack, Ip4Addr(10, 2, 4, 4), if1, gw1);
+
+            // A route without a gateway sends directly to the destination.
+            Route r32(if1, route_params(host, 32, Ip4Addr::ZeroAddr(), 9));
+            check_route(stack, host, if1, host);
+            check_route(stack, Ip4Addr(10, 2, 3, 5), if0, gw0);
+        }
+
+        // After removal the previous route is used again.
+        check_route(stack, host, if1, gw1);
+
+        {
+            // With the same prefix the lower metric wins, independent of order.
+            Route r_high(if0, route_params(Ip4Addr(10, 2, 0, 0), 16, gw0, 5));
+            check_route(stack, host, if1, gw1);
+            Route r_low(if0, route_params(Ip4Addr(10, 2, 0, 0), 16, gw0, 0));
+            // Same metric and prefix: the most recent route wins.
+            check_route(stack, host, if0, gw0);
+        }
+
+        check_route(stack, host, if1, gw1);
+    }
+
+    check_route(stack, host, if0, gw0);
+
+    {
+        // An interface subnet wins over a static route with the same prefix, but
+        // not over a longer one.
+        Route r24(if0, route_params(Ip4Addr(10, 1, 0, 0), 24, gw0, 0));
+        check_route(stack, Ip4Addr(10, 1, 0, 7), if1, Ip4Addr(10, 1, 0, 7));
+        Route r25(if0, route_params(Ip4Addr(10, 1, 0, 0), 25, gw0, 0));
+        check_route(stack, Ip4Addr(10, 1, 0, 7), if0, gw0);
+        check_route(stack, Ip4Addr(10, 1, 0, 200), if1, Ip4Addr(10, 1, 0, 200));
+    }
+
+    check_route(stack, Ip4Addr(10, 1, 0, 7), if1, Ip4Addr(10, 1, 0, 7));
+
+    // Overlapping interface subnets: the longer prefix wins, then the most
+    // recently added interface.
+    if0->setIp4Addr(IpIfaceIp4AddrSetting(16, Ip4Addr(10, 1, 5, 1)));
+    check_route(stack, Ip4Addr(10, 1, 0, 7), if1, Ip4Addr(10, 1, 0, 7));
+    check_route(stack, Ip4Addr(10, 1, 9, 7), if0, Ip4Addr(10, 1, 9, 7));
+    if0->setIp4Addr(IpIfaceIp4AddrSetting(24, Ip4Addr(10, 1, 0, 2)));
+    check_route(stack, Ip4Addr(10, 1, 0, 7), if1, Ip4Addr(10, 1, 0, 7));
+
+    // The gateway of the most recently added interface is used.
+    if1->setIp4Gateway(IpIfaceIp4GatewaySetting(gw1));
+    check_route(stack, host, if1, gw1);
+    if1->setIp4Gateway(IpIfaceIp4GatewaySetting());
+    check_route(stack, host, if0, gw0);
+    if0->setIp4Gateway(IpIfaceIp4GatewaySetting());
+    check_route<StackArg>(stack, host, nullptr, Ip4Addr());
+}
+
+// Reference model of the routing rules documented for IpStack::routeIp4.
+template<typename StackArg>
+class RefModel
+{
+public:
+    struct IfaceState {
+        IpIface<StackArg> *iface;
+        bool have_addr;
+        Ip4Addr netaddr;
+        std::uint8_t prefix;
+        bool have_gateway;
+        Ip4Addr gateway;
+    };
+
+    struct RouteState {
+        IpIface<StackArg> *iface;
+        IpStaticRouteParams params;
+        std::uint64_t seq;
+    };
+
+    // Interfaces in the order added and routes in any order.
+    std::vector<IfaceState> ifaces;
+    std::vector<RouteState> routes;
+
+    bool route (Ip4Addr dst_addr, IpIface<StackArg> *&iface, Ip4Addr &hop) const
+    {
+        int best_prefix = -1;
+        bool best_is_iface = false;
+        std::size_t best_iface_index = 0;
+        RouteState const *best_route = nullptr;
+
+        for (std::size_t i = 0; i < ifaces.size(); i++) {
+            IfaceState const &st = ifaces[i];
+            if (!st.have_addr ||
+                (dst_addr & Ip4Addr::PrefixMask(st.prefix)) != st.netaddr)
+            {
+                continue;
+            }
+            // Later interfaces are more recent.
+            if (int(st.prefix) > best_prefix ||
+                (int(st.prefix) == best_prefix && best_is_iface))
+            {
+                best_prefix = st.prefix;
+                best_is_iface = true;
+                best_iface_index = i;
+            }
+        }
+
+        for (RouteState const &rt : routes) {
+            if ((dst_addr & Ip4Addr::PrefixMask(rt.params.prefix)) !=
+                rt.params.dst_addr)
+            {
+                continue;
+            }
+            int prefix = rt.params.prefix;
+            bool better;
+            if (prefix != best_prefix) {
+                better = prefix > best_prefix;
+            } else if (best_is_iface) {
+                better = false;
+            } else if (rt.params.metric != best_route->params.metric) {
+                better = rt.params.metric < best_route->params.metric;
+            } else {
+                better = rt.seq > best_route->seq;
+            }
+            if (better) {
+                best_prefix = prefix;
+                best_is_iface = false;
+                best_route = &rt;
+            }
+        }
+
+        if (best_prefix >= 0) {
+            if (best_is_iface) {
+                iface = ifaces[best_iface_index].iface;
+                hop = dst_addr;
+            } else {
+                iface = best_route->iface;
+                hop = best_route->params.gateway.isZero() ?
+                    dst_addr : best_route->params.gateway;
+            }
+            return true;
+        }
+
+        for (std::size_t i = ifaces.size(); i-- > 0;) {
+            if (ifaces[i].have_gateway) {
+                iface = ifaces[i].iface;
+                hop = ifaces[i].gateway;
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+template<typename StackArg>
+void test_random (std::uint32_t seed)
+{
+    using Route = IpStaticRoute<StackArg>;
+
+    constexpr std::size_t NumIfaces = 4;
+
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    IpStack<StackArg> stack(platform);
+
+    RefModel<StackArg> model;
+    std::vector<std::unique_ptr<DummyDriver<StackArg>>> drivers;
+    for (std::size_t i = 0; i < NumIfaces; i++) {
+        drivers.emplace_back(new DummyDriver<StackArg>(&stack));
+        model.ifaces.push_back(typename RefModel<StackArg>::IfaceState{
+            &drivers[i]->iface(), false, Ip4Addr(), 0, false, Ip4Addr()});
+    }
+    std::vector<std::unique_ptr<Route>> routes;
+    std::uint64_t route_seq = 0;
+
+    std::mt19937 rng(seed);
+    auto rand_int = [&](std::uint32_t n) {
+        return std::uint32_t(std::uniform_int_distribution<std::uint32_t>(0, n - 1)(rng));
+    };
+
+    // Addresses are taken from a small set so that routes overlap.
+    auto rand_addr = [&]() {
+        static std::uint8_t const second[] = {0, 1, 2};
+        static std::uint8_t const last[] = {0, 1, 5, 127, 128, 200, 255};
+        if (rand_int(8) == 0) {
+            return Ip4Addr(192, 168, 0, last[rand_int(7)]);
+        }
+        return Ip4Addr(10, second[rand_int(3)], std::uint8_t(rand_int(2)),
+                       last[rand_int(7)]);
+    };
+    auto rand_prefix = [&]() {
+        static std::uint8_t const prefixes[] = {0, 8, 15, 16, 23, 24, 25, 31, 32};
+        return prefixes[rand_int(9)];
+    };
+
+    for (int iter = 0; iter < 3000; iter++) {
+        std::uint32_t op = rand_int(10);
+        std::size_t i = rand_int(NumIfaces);
+        auto &st = model.ifaces[i];
+
+        if (op == 0) {
+            if (rand_int(4) == 0) {
+                st.have_addr = false;
+                st.iface->setIp4Addr(IpIfaceIp4AddrSetting());
+            } else {
+                Ip4Addr addr = rand_addr();
+                std::uint8_t prefix = rand_prefix();
+                st.have_addr = true;
+                st.prefix = prefix;
+                st.netaddr = addr & Ip4Addr::PrefixMask(prefix);
+                st.iface->setIp4Addr(IpIfaceIp4AddrSetting(prefix, addr));
+            }
+        }
+        else if (op == 1) {
+            st.have_gateway = rand_int(3) != 0;
+            st.gateway = rand_addr();
+            st.iface->setIp4Gateway(st.have_gateway ?
+                IpIfaceIp4GatewaySetting(st.gateway) : IpIfaceIp4GatewaySetting());
+        }
+        else if (op <= 3 && routes.size() < 12) {
+            IpStaticRouteParams params = route_params(rand_addr(), rand_prefix(),
+                rand_int(3) == 0 ? Ip4Addr::ZeroAddr() : rand_addr(),
+                std::uint8_t(rand_int(3)));
+            routes.emplace_back(new Route(st.iface, params));
+            model.routes.push_back(typename RefModel<StackArg>::RouteState{
+                st.iface, routes.back()->getParams(), route_seq++});
+        }
+        else if (op <= 5 && !routes.empty()) {
+            std::size_t r = rand_int(std::uint32_t(routes.size()));
+            routes.erase(routes.begin() + r);
+            model.routes.erase(model.routes.begin() + r);
+        }
+
+        // Look up some addresses, each twice to also use the route cache.
+        for (int q = 0; q < 8; q++) {
+            Ip4Addr dst_addr = rand_addr();
+            IpIface<StackArg> *exp_iface = nullptr;
+            Ip4Addr exp_hop;
+            model.route(dst_addr, exp_iface, exp_hop);
+            check_route(stack, dst_addr, exp_iface, exp_hop);
+            check_route(stack, dst_addr, exp_iface, exp_hop);
+        }
+    }
+
+    routes.clear();
+}
+
+// The trie on its own, against a linear search over the added routes.
+void test_trie ()
+{
+    constexpr std::size_t MaxRoutes = 16;
+
+    struct Entry {
+        Ip4Addr netaddr;
+        std::uint8_t prefix;
+        int value;
+    };
+
+    std::mt19937 rng(7);
+    for (int round = 0; round < 200; round++) {
+        IpRouteTrie<int, MaxRoutes> trie;
+        trie.reset();
+        std::vector<Entry> entries;
+
+        for (int k = 0; k < 24; k++) {
+            std::uint8_t prefix = std::uint8_t(rng() % 33);
+            if (rng() % 4 == 0) {
+                prefix = std::uint8_t(24 + rng() % 9);
+            }
+            Ip4Addr netaddr = Ip4Addr(std::uint32_t(0x0a000000 | (rng() & 0x0303ff))) &
+                Ip4Addr::PrefixMask(prefix);
+
+            bool exists = false;
+            for (Entry const &e : entries) {
+                exists = exists || (e.netaddr == netaddr && e.prefix == prefix);
+            }
+            bool added = trie.add(netaddr, prefix, k);
+            AIPSTACK_ASSERT_FORCE(added == (exists || entries.size() < MaxRoutes));
+            if (added && !exists) {
+                entries.push_back(Entry{netaddr, prefix, k});
+            }
+        }
+
+        for (int q = 0; q < 200; q++) {
+            Ip4Addr addr = Ip4Addr(std::uint32_t(0x0a000000 | (rng() & 0x0303ff)));
+            if (q % 10 == 0) {
+                addr = Ip4Addr(std::uint32_t(rng()));
+            }
+            Entry const *best = nullptr;
+            for (Entry const &e : entries) {
+                if ((addr & Ip4Addr::PrefixMask(e.prefix)) == e.netaddr &&
+                    (best == nullptr || e.prefix > best->prefix))
+                {
+                    best = &e;
+                }
+            }
+            int const *value = trie.lookup(addr);
+            AIPSTACK_ASSERT_FORCE((value == nullptr) == (best == nullptr));
+            AIPSTACK_ASSERT_FORCE(value == nullptr || *value == best->value);
+        }
+    }
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_ip_route_test;
+
+    test_trie();
+
+    test_cases<TestStackArg<8, 8>>();
+    test_cases<TestStackArg<2, 8>>();
+    test_cases<TestStackArg<0, 0>>();
+    test_cases<TestStackArg<64, 0>>();
+
+    for (std::uint32_t seed = 1; seed <= 5; seed++) {
+        test_random<TestStackArg<64, 8>>(seed);
+        test_random<TestStackArg<64, 0>>(seed);
+        test_random<TestStackArg<6, 8>>(seed);
+        test_random<TestStackArg<0, 0>>(seed);
+    }
+
+    return 0;
+}
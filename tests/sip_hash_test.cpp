@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/SipHash.h>
+
+using namespace AIpStack;
+
+namespace aipstack_sip_hash_test {
+
+// Reference test vectors of SipHash-2-4 (from the SipHash authors) with the
+// key 00 01 .. 0f and the message 00 01 .. (i-1) of length i.
+constexpr std::uint64_t Vectors[64] = {
+    0x726fdb47dd0e0e31u,
+    0x74f839c593dc67fdu,
+    0x0d6c8009d9a94f5au,
+    0x85676696d7fb7e2du,
+    0xcf2794e0277187b7u,
+    0x18765564cd99a68du,
+    0xcbc9466e58fee3ceu,
+    0xab0200f58b01d137u,
+    0x93f5f5799a932462u,
+    0x9e0082df0ba9e4b0u,
+    0x7a5dbbc594ddb9f3u,
+    0xf4b32f46226bada7u,
+    0x751e8fbc860ee5fbu,
+    0x14ea5627c0843d90u,
+    0xf723ca908e7af2eeu,
+    0xa129ca6149be45e5u,
+    0x3f2acc7f57c29bdbu,
+    0x699ae9f52cbe4794u,
+    0x4bc1b3f0968dd39cu,
+    0xbb6dc91da77961bdu,
+    0xbed65cf21aa2ee98u,
+    0xd0f2cbb02e3b67c7u,
+    0x93536795e3a33e88u,
+    0xa80c038ccd5ccec8u,
+    0xb8ad50c6f649af94u,
+    0xbce192de8a85b8eau,
+    0x17d835b85bbb15f3u,
+    0x2f2e6163076bcfadu,
+    0xde4daaaca71dc9a5u,
+    0xa6a2506687956571u,
+    0xad87a3535c49ef28u,
+    0x32d892fad841c342u,
+    0x7127512f72f27cceu,
+    0xa7f32346f95978e3u,
+    0x12e0b01abb051238u,
+    0x15e034d40fa197aeu,
+    0x314dffbe0815a3b4u,
+    0x027990f029623981u,
+    0xcadcd4e59ef40c4du,
+    0x9abfd8766a33735cu,
+    0x0e3ea96b5304a7d0u,
+    0xad0c42d6fc585992u,
+    0x187306c89bc215a9u,
+    0xd4a60abcf3792b95u,
+    0xf935451de4f21df2u,
+    0xa9538f0419755787u,
+    0xdb9acddff56ca510u,
+    0xd06c98cd5c0975ebu,
+    0xe612a3cb9ecba951u,
+    0xc766e62cfcadaf96u,
+    0xee64435a9752fe72u,
+    0xa192d576b245165au,
+    0x0a8787bf8ecb74b2u,
+    0x81b3e73d20b49b6fu,
+    0x7fa8220ba3b2eceau,
+    0x245731c13ca42499u,
+    0xb78dbfaf3a8d83bdu,
+    0xea1ad565322a1a0bu,
+    0x60e61c23a3795013u,
+    0x6606d7e446282b93u,
+    0x6ca4ecb15c5f91e1u,
+    0x9f626da15c9625f3u,
+    0xe51b38608ef25f57u,
+    0x958a324ceb064572u,
+};
+
+}
+
+int main ()
+{
+    using namespace aipstack_sip_hash_test;
+    
+    SipHashKey key;
+    key.k0 = 0x0706050403020100u;
+    key.k1 = 0x0f0e0d0c0b0a0908u;
+    
+    char msg[64];
+    for (std::size_t i = 0; i < sizeof(msg); i++) {
+        msg[i] = char(i);
+    }
+    
+    for (std::size_t len = 0; len < 64; len++) {
+        AIPSTACK_ASSERT_FORCE(SipHash24(key, msg, len) == Vectors[len]);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Long bulk transfer with BBR through a bottleneck of limited rate. The frames
+// received by the server (the data direction) pass through a FrameImpairment
+// stage with the bottleneck rate and a moderate queue. A monitor on the wire
+// records the data segments of the client and the ACKs of the server, seeing
+// the data at the pacing rate of the sender (the wire itself is much faster).
+// This shows that the bandwidth estimate matches the bottleneck (the goodput
+// is close to its rate while the sending rate does not exceed it), and that
+// ProbeRTT is entered periodically since the queue keeps the RTT above the
+// minimum.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/IpTcpProto_constants.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/sim/FrameImpairment.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_bbr_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>,
+        IpTcpProtoOptions::EnableBbr::Is<true>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using TestStack = IpStack<TestStackArg>;
+using TestIface = VirtualWireEthIface<TestStackArg, TestEthIpIfaceService>;
+
+using TcpArg = TestStack::GetProtoArg<TcpApi>;
+using Constants = IpTcpProto_constants<TcpArg>;
+
+constexpr Ip4Addr ServerAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr ClientAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t ServerPort = 80;
+
+constexpr MacAddr ServerMac = MacAddr(2, 0, 0, 0, 0, 1);
+constexpr MacAddr ClientMac = MacAddr(2, 0, 0, 0, 0, 2);
+
+// The MSS with the default MTU of the VirtualWire, and the size of a frame
+// carrying a full segment.
+constexpr std::size_t Mss = 1460;
+constexpr std::size_t FullFrameSize = 1514;
+
+// The bandwidth-delay product is about 17 segments.
+constexpr double BottleneckRate = 10e6;
+constexpr double LinkLatency = 0.01;
+constexpr std::size_t QueueLimit = 100;
+
+// The rate of TCP payload through the bottleneck with full-sized segments.
+constexpr double BottleneckPayloadRate = BottleneckRate / 8.0 * Mss / FullFrameSize;
+
+constexpr double TransferTime = 35.0;
+
+// The end of Startup and Drain.
+constexpr double SteadyStart = 2.0;
+
+constexpr std::size_t SendBufSize = 256 * 1024;
+constexpr std::size_t RecvBufSize = 256 * 1024;
+
+Platform::TimeType sim_time (double seconds)
+{
+    return Platform::TimeType(seconds * Platform::TimeFreq);
+}
+
+double to_seconds (Platform::TimeType time)
+{
+    return double(time) / Platform::TimeFreq;
+}
+
+// Receives and discards data.
+class Receiver :
+    private NonCopyable<Receiver>
+{
+    class Session : public TcpConnection<TcpArg>
+    {
+    public:
+        Session (Receiver *parent) :
+            m_node{m_buffer.get(), RecvBufSize, &m_node}
+        {
+            IpErr err = acceptConnection(parent->m_listener);
+            AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+            setRecvBuf({&m_node, 0, RecvBufSize});
+        }
+        
+    private:
+        void connectionAborted () override final
+        {
+            AIPSTACK_ASSERT_FORCE(false);
+        }
+        
+        void dataReceived (std::size_t amount) override final
+        {
+            extendRecvBuf(amount);
+        }
+        
+        void dataSent (std::size_t) override final {}
+        
+    private:
+        std::unique_ptr<char[]> m_buffer{new char[RecvBufSize]};
+        IpBufNode m_node;
+    };
+    
+public:
+    Receiver (TcpApi<TcpArg> &tcp) :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::connectionEstablished, this))
+    {
+        bool listening = m_listener.startListening(tcp, {
+            /*addr=*/ Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        });
+        AIPSTACK_ASSERT_FORCE(listening);
+        m_listener.setInitialReceiveWindow(RecvBufSize);
+    }
+    
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(m_session == nullptr);
+        m_session = std::make_unique<Session>(this);
+    }
+    
+private:
+    TcpListener<TcpArg> m_listener;
+    std::unique_ptr<Session> m_session;
+};
+
+// Sends from a ring buffer which is refilled as data is acked, so there is
+// always data to send.
+class Sender : public TcpConnection<TcpArg>
+{
+public:
+    Sender (TcpApi<TcpArg> &tcp) :
+        m_node{m_buffer.get(), SendBufSize, &m_node}
+    {
+        TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        IpErr err = startConnection(tcp, args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        setSendBuf({&m_node, 0, 0});
+    }
+    
+private:
+    void connectionAborted () override final
+    {
+        AIPSTACK_ASSERT_FORCE(false);
+    }
+    
+    void connectionEstablished () override final
+    {
+        extendSendBuf(SendBufSize);
+    }
+    
+    void dataReceived (std::size_t) override final {}
+    
+    void dataSent (std::size_t amount) override final
+    {
+        extendSendBuf(amount);
+    }
+    
+private:
+    std::unique_ptr<char[]> m_buffer{new char[SendBufSize]};
+    IpBufNode m_node;
+};
+
+// A data segment of the client or an ACK of the server, with the time when
+// the monitor saw it.
+struct SegRecord {
+    double time;
+    TcpSeqNum seq;
+    std::size_t data_len;
+};
+
+// Records the data segments of the client and the ACKs of the server. The
+// frames arrive here at the same time as at the other end of the wire.
+class Monitor :
+    private NonCopyable<Monitor>
+{
+    using WirePort = VirtualWire<SimulatedPlatformImpl>::Port;
+    
+public:
+    Monitor (Platform platform, VirtualWire<SimulatedPlatformImpl> &wire) :
+        m_platform(platform),
+        m_port(platform, wire, AIPSTACK_BIND_MEMBER_TN(&Monitor::frameReceived, this))
+    {}
+    
+    std::vector<SegRecord> const & dataSegs () const { return m_data_segs; }
+    std::vector<SegRecord> const & acks () const { return m_acks; }
+    
+private:
+    void frameReceived (IpBufRef frame)
+    {
+        constexpr std::size_t MaxFrame = 1600;
+        if (frame.tot_len < EthHeader::Size + Ip4Header::Size + Tcp4Header::Size ||
+            frame.tot_len > MaxFrame)
+        {
+            return;
+        }
+        char data[MaxFrame];
+        ipBufTakeBytes(frame, frame.tot_len, data);
+        
+        auto eth_header = EthHeader::MakeRef(data);
+        if (eth_header.get(EthHeader::EthType()) != EthType::Ipv4) {
+            return;
+        }
+        bool from_client = eth_header.get(EthHeader::SrcMac()) == ClientMac;
+        
+        char *ip_data = data + EthHeader::Size;
+        auto ip4_header = Ip4Header::MakeRef(ip_data);
+        if (ip4_header.get(Ip4Header::Proto()) != Ip4Protocol::Tcp) {
+            return;
+        }
+        std::size_t ihl = 4 * std::size_t(
+            (ip4_header.get(Ip4Header::VersionIhlDscpEcn()) >> 8) & Ip4IhlMask);
+        std::size_t ip_len = ip4_header.get(Ip4Header::TotalLen());
+        
+        auto tcp_header = Tcp4Header::MakeRef(ip_data + ihl);
+        Tcp4Flags flags = tcp_header.get(Tcp4Header::OffsetFlags());
+        std::size_t tcp_hdr_len =
+            4 * std::size_t(std::uint16_t(flags) >> TcpOffsetShift);
+        std::size_t data_len = ip_len - ihl - tcp_hdr_len;
+        double time = to_seconds(m_platform.getTime());
+        
+        if (from_client) {
+            if (data_len > 0) {
+                m_data_segs.push_back({time, tcp_header.get(Tcp4Header::SeqNum()), data_len});
+            }
+        } else {
+            if ((flags & Tcp4Flags::Ack) != Tcp4Flags()) {
+                m_acks.push_back({time, tcp_header.get(Tcp4Header::AckNum()), 0});
+            }
+        }
+    }
+    
+private:
+    Platform m_platform;
+    WirePort m_port;
+    std::vector<SegRecord> m_data_segs;
+    std::vector<SegRecord> m_acks;
+};
+
+// The largest amount of data sent in any interval of the given length after
+// SteadyStart, divided by the length.
+double max_send_rate (std::vector<SegRecord> const &segs, double interval)
+{
+    double max_rate = 0.0;
+    std::size_t first = 0;
+    for (double start = SteadyStart; start + interval <= TransferTime; start += interval) {
+        while (first < segs.size() && segs[first].time < start) {
+            first++;
+        }
+        std::size_t bytes = 0;
+        for (std::size_t i = first; i < segs.size() && segs[i].time < start + interval; i++) {
+            bytes += segs[i].data_len;
+        }
+        max_rate = MaxValue(max_rate, bytes / interval);
+    }
+    return max_rate;
+}
+
+// A period in which the data in flight did not exceed the ProbeRTT cwnd.
+struct ProbeRttPeriod {
+    double start;
+    double end;
+};
+
+// Find the ProbeRTT periods after SteadyStart, as runs of data segments
+// sent with no more than BbrMinCwndSegs segments in flight (including the
+// segment). The latest ACK seen before a segment was the latest processed
+// by the sender before sending it (the wire latency is the same).
+std::vector<ProbeRttPeriod> probe_rtt_periods (
+    std::vector<SegRecord> const &segs, std::vector<SegRecord> const &acks)
+{
+    std::vector<ProbeRttPeriod> periods;
+    std::size_t ack_index = 0;
+    TcpSeqNum ack = acks[0].seq;
+    bool in_period = false;
+    
+    for (SegRecord const &seg : segs) {
+        for (; ack_index < acks.size() && acks[ack_index].time < seg.time; ack_index++) {
+            if (ack.mod_lt(acks[ack_index].seq)) {
+                ack = acks[ack_index].seq;
+            }
+        }
+        
+        std::size_t inflight = (seg.seq + seg.data_len) - ack;
+        bool low = seg.time >= SteadyStart && inflight <= Constants::BbrMinCwndSegs * Mss;
+        if (low && !in_period) {
+            periods.push_back({seg.time, seg.time});
+        }
+        if (low) {
+            periods.back().end = seg.time;
+        }
+        in_period = low;
+    }
+    
+    return periods;
+}
+
+void test_bbr ()
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    VirtualWireParams wire_params;
+    wire_params.bandwidth_bps = 1e9;
+    wire_params.latency_sec = LinkLatency;
+    wire_params.queue_depth = 1024;
+    VirtualWire<SimulatedPlatformImpl> wire(wire_params);
+    
+    Monitor monitor(platform, wire);
+    
+    TestStack server_stack(platform);
+    TestStack client_stack(platform);
+    client_stack.getProtoApi<TcpApi>().setEphemeralPortKey(
+        SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    TestIface server_iface(platform, &server_stack, wire, ServerMac);
+    TestIface client_iface(platform, &client_stack, wire, ClientMac);
+    server_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ServerAddr));
+    client_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ClientAddr));
+    
+    FrameImpairmentParams imp_params;
+    imp_params.rate_bps = BottleneckRate;
+    imp_params.queue_limit = QueueLimit;
+    server_iface.setRxImpairment(imp_params);
+    
+    Receiver receiver(server_stack.getProtoApi<TcpApi>());
+    Sender sender(client_stack.getProtoApi<TcpApi>());
+    
+    platform_impl.runUntil(platform.getTime() + sim_time(TransferTime));
+    
+    std::vector<SegRecord> const &segs = monitor.dataSegs();
+    std::vector<SegRecord> const &acks = monitor.acks();
+    AIPSTACK_ASSERT_FORCE(!segs.empty() && !acks.empty());
+    
+    // BBR keeps the queue short, nothing was dropped.
+    FrameImpairmentStats stats = server_iface.getRxImpairment()->getStats();
+    AIPSTACK_ASSERT_FORCE(stats.frames_queue_dropped == 0);
+    
+    // The goodput after Startup is close to the bottleneck rate, so the
+    // bandwidth estimate is not too low.
+    std::size_t first_ack = 0;
+    while (acks[first_ack].time < SteadyStart) {
+        first_ack++;
+    }
+    double goodput = double(acks.back().seq - acks[first_ack].seq) /
+        (acks.back().time - acks[first_ack].time);
+    AIPSTACK_ASSERT_FORCE(goodput > 0.95 * BottleneckPayloadRate);
+    
+    // Over a second, which spans several gain cycles, the sending rate does
+    // not exceed the bottleneck rate, so the estimate is not too high. Over
+    // short intervals the rate reaches at most the ProbeBW gain of 5/4 (with
+    // a little slack for the pacing burst allowance).
+    AIPSTACK_ASSERT_FORCE(max_send_rate(segs, 1.0) < 1.02 * BottleneckPayloadRate);
+    AIPSTACK_ASSERT_FORCE(max_send_rate(segs, 0.02) < 1.3 * BottleneckPayloadRate);
+    
+    // ProbeRTT is entered every BbrMinRttWindow (plus the ProbeRTT time),
+    // and lasts at least BbrProbeRttTime.
+    double min_rtt_window = double(Constants::BbrMinRttWindow) / Constants::RttTimeFreq;
+    double probe_rtt_time = double(Constants::BbrProbeRttTime) / Constants::RttTimeFreq;
+    std::vector<ProbeRttPeriod> periods = probe_rtt_periods(segs, acks);
+    AIPSTACK_ASSERT_FORCE(periods.size() == 3);
+    for (std::size_t i = 0; i < periods.size(); i++) {
+        double prev_end = (i == 0) ? segs[0].time : periods[i - 1].end;
+        double interval = periods[i].start - prev_end;
+        AIPSTACK_ASSERT_FORCE(interval > min_rtt_window - 0.5 &&
+                              interval < min_rtt_window + 0.5);
+        double duration = periods[i].end - periods[i].start;
+        AIPSTACK_ASSERT_FORCE(duration > probe_rtt_time - 0.05 &&
+                              duration < probe_rtt_time + 0.1);
+    }
+    
+    sender.reset();
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_bbr_test;
+    
+    test_bbr();
+    
+    return 0;
+}
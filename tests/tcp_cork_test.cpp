@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Tests corking and flushing of TCP output. A monitor on the wire records the
+// data segments of the client with the times they were sent (the wire has a
+// fixed latency and no bandwidth limit). The steps check that while corked a
+// sub-MSS tail is held back while full segments are still sent when ACKs
+// arrive, that uncork and flush send immediately without the delay of the
+// output timer (also when flush is called from dataSent, during input
+// processing), that flush does not end corking, and that closeSending does.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/IpTcpProto_constants.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_cork_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using TestStack = IpStack<TestStackArg>;
+using TestIface = VirtualWireEthIface<TestStackArg, TestEthIpIfaceService>;
+
+using TcpArg = TestStack::GetProtoArg<TcpApi>;
+using Constants = IpTcpProto_constants<TcpArg>;
+
+constexpr Ip4Addr ServerAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr ClientAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t ServerPort = 80;
+
+constexpr MacAddr ServerMac = MacAddr(2, 0, 0, 0, 0, 1);
+constexpr MacAddr ClientMac = MacAddr(2, 0, 0, 0, 0, 2);
+
+constexpr double LinkLatency = 0.01;
+
+// The MSS with the default MTU of the VirtualWire.
+constexpr std::size_t Mss = 1460;
+
+constexpr std::size_t SendBufSize = 16 * 1024;
+constexpr std::size_t RecvBufSize = 16 * 1024;
+
+char g_tx_data[SendBufSize];
+
+Platform::TimeType sim_time (double seconds)
+{
+    return Platform::TimeType(seconds * Platform::TimeFreq);
+}
+
+// Accepts a connection and discards the data.
+class Receiver :
+    private NonCopyable<Receiver>
+{
+    class Session : public TcpConnection<TcpArg>
+    {
+    public:
+        Session (Receiver *parent) :
+            m_node{m_buffer, RecvBufSize, &m_node}
+        {
+            IpErr err = acceptConnection(parent->m_listener);
+            AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+            setRecvBuf({&m_node, 0, RecvBufSize});
+        }
+        
+    private:
+        void connectionAborted () override final
+        {
+            AIPSTACK_ASSERT_FORCE(false);
+        }
+        
+        void dataReceived (std::size_t amount) override final
+        {
+            if (amount == 0) {
+                closeSending();
+            }
+            extendRecvBuf(amount);
+        }
+        
+        void dataSent (std::size_t) override final {}
+        
+    private:
+        IpBufNode m_node;
+        char m_buffer[RecvBufSize];
+    };
+    
+public:
+    Receiver (TcpApi<TcpArg> &tcp) :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::connectionEstablished, this))
+    {
+        bool listening = m_listener.startListening(tcp, {
+            /*addr=*/ Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        });
+        AIPSTACK_ASSERT_FORCE(listening);
+        m_listener.setInitialReceiveWindow(RecvBufSize);
+    }
+    
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(m_session == nullptr);
+        m_session = std::make_unique<Session>(this);
+    }
+    
+private:
+    TcpListener<TcpArg> m_listener;
+    std::unique_ptr<Session> m_session;
+};
+
+// The test drives the sending. Optionally, when data is acked, more data is
+// queued and flushed from dataSent.
+class Sender : public TcpConnection<TcpArg>
+{
+public:
+    Sender (Platform platform, TcpApi<TcpArg> &tcp) :
+        m_platform(platform),
+        m_node{g_tx_data, SendBufSize, &m_node},
+        m_established(false),
+        m_flush_on_sent(0),
+        m_flush_time(0)
+    {
+        TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        IpErr err = startConnection(tcp, args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        setSendBuf({&m_node, 0, 0});
+    }
+    
+    bool established () const { return m_established; }
+    
+    // The next dataSent will queue this much data and flush.
+    void flushOnSent (std::size_t amount)
+    {
+        m_flush_on_sent = amount;
+    }
+    
+    // When flush was called from dataSent.
+    Platform::TimeType flushTime () const { return m_flush_time; }
+    
+private:
+    void connectionAborted () override final
+    {
+        AIPSTACK_ASSERT_FORCE(false);
+    }
+    
+    void connectionEstablished () override final
+    {
+        m_established = true;
+    }
+    
+    void dataReceived (std::size_t) override final {}
+    
+    void dataSent (std::size_t amount) override final
+    {
+        if (amount > 0 && m_flush_on_sent > 0) {
+            extendSendBuf(m_flush_on_sent);
+            flush();
+            m_flush_on_sent = 0;
+            m_flush_time = m_platform.getTime();
+        }
+    }
+    
+private:
+    Platform m_platform;
+    IpBufNode m_node;
+    bool m_established;
+    std::size_t m_flush_on_sent;
+    Platform::TimeType m_flush_time;
+};
+
+// A data or FIN segment of the client, with the time it was sent.
+struct DataSeg {
+    Platform::TimeType time;
+    std::size_t offset;
+    std::size_t data_len;
+    bool psh;
+    bool fin;
+};
+
+// Records the data and FIN segments of the client.
+class Monitor :
+    private NonCopyable<Monitor>
+{
+    using WirePort = VirtualWire<SimulatedPlatformImpl>::Port;
+    
+public:
+    Monitor (Platform platform, VirtualWire<SimulatedPlatformImpl> &wire) :
+        m_platform(platform),
+        m_port(platform, wire, AIPSTACK_BIND_MEMBER_TN(&Monitor::frameReceived, this)),
+        m_have_data_start(false)
+    {}
+    
+    std::vector<DataSeg> const & segs () const { return m_segs; }
+    
+private:
+    void frameReceived (IpBufRef frame)
+    {
+        constexpr std::size_t MaxFrame = 1600;
+        if (frame.tot_len < EthHeader::Size + Ip4Header::Size + Tcp4Header::Size ||
+            frame.tot_len > MaxFrame)
+        {
+            return;
+        }
+        char data[MaxFrame];
+        ipBufTakeBytes(frame, frame.tot_len, data);
+        
+        auto eth_header = EthHeader::MakeRef(data);
+        if (eth_header.get(EthHeader::SrcMac()) != ClientMac ||
+            eth_header.get(EthHeader::EthType()) != EthType::Ipv4)
+        {
+            return;
+        }
+        
+        char *ip_data = data + EthHeader::Size;
+        auto ip4_header = Ip4Header::MakeRef(ip_data);
+        if (ip4_header.get(Ip4Header::Proto()) != Ip4Protocol::Tcp) {
+            return;
+        }
+        std::size_t ihl = 4 * std::size_t(
+            (ip4_header.get(Ip4Header::VersionIhlDscpEcn()) >> 8) & Ip4IhlMask);
+        std::size_t ip_len = ip4_header.get(Ip4Header::TotalLen());
+        
+        auto tcp_header = Tcp4Header::MakeRef(ip_data + ihl);
+        Tcp4Flags flags = tcp_header.get(Tcp4Header::OffsetFlags());
+        std::size_t tcp_hdr_len =
+            4 * std::size_t(std::uint16_t(flags) >> TcpOffsetShift);
+        std::size_t data_len = ip_len - ihl - tcp_hdr_len;
+        TcpSeqNum seq = tcp_header.get(Tcp4Header::SeqNum());
+        
+        if ((flags & Tcp4Flags::Syn) != Tcp4Flags()) {
+            m_data_start = seq + TcpSeqInt(1);
+            m_have_data_start = true;
+            return;
+        }
+        
+        bool fin = (flags & Tcp4Flags::Fin) != Tcp4Flags();
+        if (data_len == 0 && !fin) {
+            return;
+        }
+        AIPSTACK_ASSERT_FORCE(m_have_data_start);
+        
+        m_segs.push_back({m_platform.getTime() - sim_time(LinkLatency),
+                          std::size_t(seq - m_data_start), data_len,
+                          (flags & Tcp4Flags::Psh) != Tcp4Flags(), fin});
+    }
+    
+private:
+    Platform m_platform;
+    WirePort m_port;
+    bool m_have_data_start;
+    TcpSeqNum m_data_start;
+    std::vector<DataSeg> m_segs;
+};
+
+void test_cork ()
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    VirtualWireParams wire_params;
+    wire_params.latency_sec = LinkLatency;
+    VirtualWire<SimulatedPlatformImpl> wire(wire_params);
+    
+    Monitor monitor(platform, wire);
+    
+    TestStack server_stack(platform);
+    TestStack client_stack(platform);
+    client_stack.getProtoApi<TcpApi>().setEphemeralPortKey(
+        SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    TestIface server_iface(platform, &server_stack, wire, ServerMac);
+    TestIface client_iface(platform, &client_stack, wire, ClientMac);
+    server_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ServerAddr));
+    client_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ClientAddr));
+    
+    Receiver receiver(server_stack.getProtoApi<TcpApi>());
+    Sender sender(platform, client_stack.getProtoApi<TcpApi>());
+    
+    std::vector<DataSeg> const &segs = monitor.segs();
+    
+    auto run = [&](double seconds) {
+        platform_impl.runUntil(platform.getTime() + sim_time(seconds));
+    };
+    
+    run(1.0);
+    AIPSTACK_ASSERT_FORCE(sender.established());
+    
+    // Flush sends two segments right away. Then, while corked, only full
+    // segments of the data queued next are sent when the ACKs arrive, and the
+    // tail is held back even when pushed.
+    Platform::TimeType time = platform.getTime();
+    sender.extendSendBuf(2 * Mss);
+    sender.flush();
+    sender.cork();
+    sender.extendSendBuf(3 * Mss + 500);
+    sender.sendPush();
+    run(1.0);
+    
+    AIPSTACK_ASSERT_FORCE(segs.size() == 5);
+    for (std::size_t i = 0; i < 5; i++) {
+        AIPSTACK_ASSERT_FORCE(segs[i].offset == i * Mss && segs[i].data_len == Mss);
+        AIPSTACK_ASSERT_FORCE(segs[i].time == time || i >= 2);
+    }
+    AIPSTACK_ASSERT_FORCE(segs[2].time >= time + sim_time(2 * LinkLatency));
+    AIPSTACK_ASSERT_FORCE(sender.isCorked());
+    
+    // Uncork sends the tail right away.
+    time = platform.getTime();
+    sender.uncork();
+    AIPSTACK_ASSERT_FORCE(!sender.isCorked());
+    run(1.0);
+    
+    AIPSTACK_ASSERT_FORCE(segs.size() == 6);
+    AIPSTACK_ASSERT_FORCE(segs[5].offset == 5 * Mss && segs[5].data_len == 500);
+    AIPSTACK_ASSERT_FORCE(segs[5].time == time && segs[5].psh);
+    std::size_t offset = 5 * Mss + 500;
+    
+    // For comparison, sendPush sends after the output timer.
+    time = platform.getTime();
+    sender.extendSendBuf(100);
+    sender.sendPush();
+    run(1.0);
+    
+    AIPSTACK_ASSERT_FORCE(segs.size() == 7);
+    AIPSTACK_ASSERT_FORCE(segs[6].offset == offset && segs[6].data_len == 100);
+    AIPSTACK_ASSERT_FORCE(segs[6].time == time + Constants::OutputTimerTicks);
+    offset += 100;
+    
+    // Flush sends while corked without ending corking. When called from
+    // dataSent, the data is sent at the end of the input processing.
+    sender.cork();
+    sender.flushOnSent(200);
+    time = platform.getTime();
+    sender.extendSendBuf(100);
+    sender.flush();
+    AIPSTACK_ASSERT_FORCE(sender.isCorked());
+    run(1.0);
+    
+    AIPSTACK_ASSERT_FORCE(segs.size() == 9);
+    AIPSTACK_ASSERT_FORCE(segs[7].offset == offset && segs[7].data_len == 100);
+    AIPSTACK_ASSERT_FORCE(segs[7].time == time);
+    AIPSTACK_ASSERT_FORCE(segs[8].offset == offset + 100 && segs[8].data_len == 200);
+    AIPSTACK_ASSERT_FORCE(segs[8].time == sender.flushTime());
+    AIPSTACK_ASSERT_FORCE(sender.isCorked());
+    offset += 300;
+    
+    // While still corked, queued data is held back until closeSending, which
+    // ends corking and sends it with the FIN.
+    sender.extendSendBuf(300);
+    run(1.0);
+    AIPSTACK_ASSERT_FORCE(segs.size() == 9);
+    
+    sender.closeSending();
+    AIPSTACK_ASSERT_FORCE(!sender.isCorked());
+    run(1.0);
+    
+    AIPSTACK_ASSERT_FORCE(segs.size() == 10);
+    AIPSTACK_ASSERT_FORCE(segs[9].offset == offset && segs[9].data_len == 300);
+    AIPSTACK_ASSERT_FORCE(segs[9].fin);
+    AIPSTACK_ASSERT_FORCE(sender.wasEndSent());
+    
+    sender.reset();
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_cork_test;
+    
+    test_cork();
+    
+    return 0;
+}
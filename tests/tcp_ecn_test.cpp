@@ -0,0 +1,707 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Bulk transfers with ECN over a path which marks data packets with CE. The
+// client and the server are on separate VirtualWires bridged by a relay, which
+// sets CE on every N-th ECN-capable frame toward the server. A monitor on the
+// server side checks the negotiation in SYN/SYN-ACK, that ECE on the ACKs of
+// the server follows the CE marks and CWR flags it has received, and that the
+// sender reduces cwnd (indicated by CWR) at most once per window of data. It
+// sees each data segment just before the server, and records how many frames
+// the server has sent by then, so it knows which ACKs were generated after it.
+// Finally the transfer times show that DCTCP responds to the fraction of marked
+// data while classic ECN halves cwnd for any mark.
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_ecn_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+enum class EcnMode {Off, Classic, Dctcp};
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+template<EcnMode Mode>
+using TestProtocolServicesList = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>,
+        IpTcpProtoOptions::EnableEcn::Is<Mode != EcnMode::Off>,
+        IpTcpProtoOptions::EcnDctcp::Is<Mode == EcnMode::Dctcp>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+template<EcnMode Mode>
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList<Mode>> {};
+
+template<EcnMode Mode>
+using TestStack = IpStack<TestStackArg<Mode>>;
+
+template<EcnMode Mode>
+using TestIface = VirtualWireEthIface<TestStackArg<Mode>, TestEthIpIfaceService>;
+
+template<EcnMode Mode>
+using TcpArg = typename TestStack<Mode>::template GetProtoArg<TcpApi>;
+
+using Wire = VirtualWire<SimulatedPlatformImpl>;
+using WirePort = Wire::Port;
+
+constexpr Ip4Addr ServerAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr ClientAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t ServerPort = 80;
+
+constexpr MacAddr ServerMac = MacAddr(2, 0, 0, 0, 0, 1);
+constexpr MacAddr ClientMac = MacAddr(2, 0, 0, 0, 0, 2);
+
+// Latency of each of the two wires, the RTT is twice the sum.
+constexpr double WireLatency = 0.005;
+
+constexpr std::size_t TransferBytes = 4 * 1024 * 1024;
+constexpr std::size_t RecvBufSize = 256 * 1024;
+
+constexpr std::size_t MaxFrame = 1600;
+
+char g_tx_data[TransferBytes];
+
+char pattern_byte (std::size_t pos)
+{
+    return char(pos % 251);
+}
+
+Platform::TimeType sim_time (double seconds)
+{
+    return Platform::TimeType(seconds * Platform::TimeFreq);
+}
+
+double to_seconds (Platform::TimeType time)
+{
+    return double(time) / Platform::TimeFreq;
+}
+
+// Receives data and checks it, remembering when all data has arrived.
+template<EcnMode Mode>
+class Receiver :
+    private NonCopyable<Receiver<Mode>>
+{
+    using Arg = TcpArg<Mode>;
+    
+    class Session : public TcpConnection<Arg>
+    {
+    public:
+        Session (Receiver *parent) :
+            m_parent(parent),
+            m_node{m_buffer, RecvBufSize, &m_node}
+        {
+            IpErr err = this->acceptConnection(parent->m_listener);
+            AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+            this->setRecvBuf({&m_node, 0, RecvBufSize});
+        }
+        
+    private:
+        void connectionAborted () override final
+        {
+            AIPSTACK_ASSERT_FORCE(false);
+        }
+        
+        void dataReceived (std::size_t amount) override final
+        {
+            for (std::size_t i = 0; i < amount; i++) {
+                std::size_t pos = m_parent->m_received + i;
+                AIPSTACK_ASSERT_FORCE(m_buffer[pos % RecvBufSize] == pattern_byte(pos));
+            }
+            m_parent->m_received += amount;
+            if (m_parent->m_received == TransferBytes) {
+                m_parent->m_done_time = m_parent->m_platform.getTime();
+            }
+            this->extendRecvBuf(amount);
+        }
+        
+        void dataSent (std::size_t) override final {}
+        
+    private:
+        Receiver *m_parent;
+        IpBufNode m_node;
+        char m_buffer[RecvBufSize];
+    };
+    
+public:
+    Receiver (Platform platform, TcpApi<Arg> &tcp) :
+        m_platform(platform),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::connectionEstablished, this)),
+        m_received(0),
+        m_done_time(0)
+    {
+        bool listening = m_listener.startListening(tcp, {
+            /*addr=*/ Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        });
+        AIPSTACK_ASSERT_FORCE(listening);
+        m_listener.setInitialReceiveWindow(RecvBufSize);
+    }
+    
+    std::size_t received () const { return m_received; }
+    Platform::TimeType doneTime () const { return m_done_time; }
+    
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(m_session == nullptr);
+        m_session = std::make_unique<Session>(this);
+    }
+    
+private:
+    Platform m_platform;
+    TcpListener<Arg> m_listener;
+    std::unique_ptr<Session> m_session;
+    std::size_t m_received;
+    Platform::TimeType m_done_time;
+};
+
+// Sends TransferBytes of the pattern.
+template<EcnMode Mode>
+class Sender : public TcpConnection<TcpArg<Mode>>
+{
+public:
+    Sender (TcpApi<TcpArg<Mode>> &tcp) :
+        m_node{g_tx_data, TransferBytes, nullptr}
+    {
+        TcpStartConnectionArgs<TcpArg<Mode>> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        IpErr err = this->startConnection(tcp, args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        this->setSendBuf({&m_node, 0, 0});
+    }
+    
+private:
+    void connectionAborted () override final
+    {
+        AIPSTACK_ASSERT_FORCE(false);
+    }
+    
+    void connectionEstablished () override final
+    {
+        this->extendSendBuf(TransferBytes);
+        this->sendPush();
+    }
+    
+    void dataReceived (std::size_t) override final {}
+    
+    void dataSent (std::size_t) override final {}
+    
+private:
+    IpBufNode m_node;
+};
+
+// Pointers into a copied frame if it is an IPv4 TCP frame.
+struct TcpFrame {
+    char *ip_data;
+    std::size_t ihl;
+    std::size_t data_len;
+    Ip4Ecn ecn;
+    Tcp4Flags flags;
+    TcpSeqNum seq;
+    TcpSeqNum ack;
+};
+
+bool parse_tcp_frame (char *data, std::size_t len, TcpFrame &out)
+{
+    if (len < EthHeader::Size + Ip4Header::Size + Tcp4Header::Size ||
+        EthHeader::MakeRef(data).get(EthHeader::EthType()) != EthType::Ipv4)
+    {
+        return false;
+    }
+    
+    out.ip_data = data + EthHeader::Size;
+    auto ip4_header = Ip4Header::MakeRef(out.ip_data);
+    if (ip4_header.get(Ip4Header::Proto()) != Ip4Protocol::Tcp) {
+        return false;
+    }
+    std::uint16_t version_ihl_dscp_ecn = ip4_header.get(Ip4Header::VersionIhlDscpEcn());
+    out.ihl = 4 * std::size_t((version_ihl_dscp_ecn >> 8) & Ip4IhlMask);
+    out.ecn = Ip4Ecn(version_ihl_dscp_ecn & Ip4EcnMask);
+    std::size_t ip_len = ip4_header.get(Ip4Header::TotalLen());
+    
+    auto tcp_header = Tcp4Header::MakeRef(out.ip_data + out.ihl);
+    out.flags = tcp_header.get(Tcp4Header::OffsetFlags());
+    std::size_t tcp_hdr_len = 4 * std::size_t(std::uint16_t(out.flags) >> TcpOffsetShift);
+    out.data_len = ip_len - out.ihl - tcp_hdr_len;
+    out.seq = tcp_header.get(Tcp4Header::SeqNum());
+    out.ack = tcp_header.get(Tcp4Header::AckNum());
+    return true;
+}
+
+bool has_flags (Tcp4Flags flags, Tcp4Flags mask)
+{
+    return (flags & mask) == mask;
+}
+
+// Forwards frames between the two wires, setting CE on every mark_every-th
+// ECN-capable frame toward the server (none if zero).
+class MarkingRelay :
+    private NonCopyable<MarkingRelay>
+{
+public:
+    MarkingRelay (Platform platform, Wire &client_wire, Wire &server_wire,
+                  std::uint64_t mark_every) :
+        m_client_port(platform, client_wire,
+                      AIPSTACK_BIND_MEMBER_TN(&MarkingRelay::clientFrameReceived, this)),
+        m_server_port(platform, server_wire,
+                      AIPSTACK_BIND_MEMBER_TN(&MarkingRelay::serverFrameReceived, this)),
+        m_mark_every(mark_every),
+        m_ect_frames(0),
+        m_marked_frames(0)
+    {}
+    
+    std::uint64_t markedFrames () const { return m_marked_frames; }
+    
+private:
+    void clientFrameReceived (IpBufRef frame)
+    {
+        AIPSTACK_ASSERT_FORCE(frame.tot_len <= MaxFrame);
+        char data[MaxFrame];
+        ipBufTakeBytes(frame, frame.tot_len, data);
+        std::size_t len = frame.tot_len;
+        
+        TcpFrame tcp;
+        if (parse_tcp_frame(data, len, tcp) && tcp.ecn != Ip4Ecn::NotEct &&
+            m_mark_every != 0 && ++m_ect_frames % m_mark_every == 0)
+        {
+            auto ip4_header = Ip4Header::MakeRef(tcp.ip_data);
+            ip4_header.set(Ip4Header::VersionIhlDscpEcn(),
+                ip4_header.get(Ip4Header::VersionIhlDscpEcn()) | Ip4EcnMask);
+            ip4_header.set(Ip4Header::HeaderChksum(), 0);
+            ip4_header.set(Ip4Header::HeaderChksum(), IpChksum(tcp.ip_data, tcp.ihl));
+            m_marked_frames++;
+        }
+        
+        forward(m_server_port, data, len);
+    }
+    
+    void serverFrameReceived (IpBufRef frame)
+    {
+        AIPSTACK_ASSERT_FORCE(frame.tot_len <= MaxFrame);
+        char data[MaxFrame];
+        ipBufTakeBytes(frame, frame.tot_len, data);
+        forward(m_client_port, data, frame.tot_len);
+    }
+    
+    static void forward (WirePort &port, char *data, std::size_t len)
+    {
+        IpBufNode node{data, len, nullptr};
+        IpErr err = port.sendFrame(IpBufRef{&node, 0, len});
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+    }
+    
+private:
+    WirePort m_client_port;
+    WirePort m_server_port;
+    std::uint64_t m_mark_every;
+    std::uint64_t m_ect_frames;
+    std::uint64_t m_marked_frames;
+};
+
+// Observes the frames on the wire of the server. Must be constructed before
+// the interface of the server so that it receives frames before it.
+class Monitor :
+    private NonCopyable<Monitor>
+{
+    // A data segment which reached the server, and how many frames the
+    // server had sent before processing it.
+    struct DataEvent {
+        std::uint64_t server_frames;
+        bool ce;
+        bool cwr;
+    };
+    
+public:
+    Monitor (Platform platform, Wire &wire, bool dctcp) :
+        m_port(platform, wire, AIPSTACK_BIND_MEMBER_TN(&Monitor::frameReceived, this)),
+        m_server_port(nullptr),
+        m_dctcp(dctcp),
+        m_server_frames(0),
+        m_syn_seen(false),
+        m_syn_ack_seen(false),
+        m_syn_ecn_setup(false),
+        m_syn_ack_ecn_setup(false),
+        m_echo(false),
+        m_have_data(false),
+        m_cwr_seen(false),
+        m_cwr_recovered(false),
+        m_cwr_allowed(false),
+        m_data_segs(0),
+        m_ect_segs(0),
+        m_rtx_segs(0),
+        m_ce_segs(0),
+        m_ece_acks(0),
+        m_cwr_segs(0)
+    {}
+    
+    void setServerPort (WirePort *server_port)
+    {
+        m_server_port = server_port;
+    }
+    
+    bool synEcnSetup () const { return m_syn_seen && m_syn_ecn_setup; }
+    bool synAckEcnSetup () const { return m_syn_ack_seen && m_syn_ack_ecn_setup; }
+    std::uint64_t dataSegs () const { return m_data_segs; }
+    std::uint64_t ectSegs () const { return m_ect_segs; }
+    std::uint64_t rtxSegs () const { return m_rtx_segs; }
+    std::uint64_t ceSegs () const { return m_ce_segs; }
+    std::uint64_t eceAcks () const { return m_ece_acks; }
+    std::uint64_t cwrSegs () const { return m_cwr_segs; }
+    
+private:
+    void frameReceived (IpBufRef frame)
+    {
+        if (m_server_port == nullptr || frame.tot_len < EthHeader::Size) {
+            return;
+        }
+        AIPSTACK_ASSERT_FORCE(frame.tot_len <= MaxFrame);
+        char data[MaxFrame];
+        ipBufTakeBytes(frame, frame.tot_len, data);
+        
+        // Frames of the server are seen in the order in which they were sent.
+        auto eth_header = EthHeader::MakeRef(data);
+        bool from_server = eth_header.get(EthHeader::SrcMac()) == ServerMac;
+        std::uint64_t frame_index = from_server ? m_server_frames++ : 0;
+        
+        TcpFrame tcp;
+        if (!parse_tcp_frame(data, frame.tot_len, tcp)) {
+            return;
+        }
+        
+        if (from_server) {
+            serverSegment(tcp, frame_index);
+        } else {
+            clientSegment(tcp);
+        }
+    }
+    
+    void clientSegment (TcpFrame const &tcp)
+    {
+        if (has_flags(tcp.flags, Tcp4Flags::Syn)) {
+            m_syn_seen = true;
+            m_syn_ecn_setup = has_flags(tcp.flags, Tcp4Flags::Ece|Tcp4Flags::Cwr);
+            AIPSTACK_ASSERT_FORCE(tcp.ecn == Ip4Ecn::NotEct);
+            return;
+        }
+        
+        // Pure ACKs are not ECN-capable.
+        if (tcp.data_len == 0) {
+            AIPSTACK_ASSERT_FORCE(tcp.ecn == Ip4Ecn::NotEct);
+            return;
+        }
+        
+        bool ce = tcp.ecn == Ip4Ecn::Ce;
+        bool cwr = has_flags(tcp.flags, Tcp4Flags::Cwr);
+        
+        // The server will process the segment right after this, so ACKs
+        // which it sends from now on reflect it.
+        m_events.push_back({m_server_port->getStats().frames_sent, ce, cwr});
+        
+        TcpSeqNum seg_end = tcp.seq + tcp.data_len;
+        bool rtx = m_have_data && tcp.seq.mod_lt(m_max_data_end);
+        
+        m_data_segs++;
+        if (rtx) {
+            m_rtx_segs++;
+        }
+        if (!m_have_data || m_max_data_end.mod_lt(seg_end)) {
+            m_max_data_end = seg_end;
+            m_have_data = true;
+        }
+        
+        // Only new data is ECN-capable.
+        if (tcp.ecn != Ip4Ecn::NotEct) {
+            AIPSTACK_ASSERT_FORCE(!rtx);
+            m_ect_segs++;
+        }
+        if (ce) {
+            m_ce_segs++;
+        }
+        
+        if (cwr) {
+            AIPSTACK_ASSERT_FORCE(tcp.ecn != Ip4Ecn::NotEct);
+            
+            // A reduction of cwnd is allowed once data after the previous CWR
+            // is acked, and an ACK with ECE arrives after that. ACKs are seen
+            // here long before the sender processes them.
+            AIPSTACK_ASSERT_FORCE(!m_cwr_seen || m_cwr_allowed);
+            m_cwr_seen = true;
+            m_cwr_seq = tcp.seq;
+            m_cwr_recovered = false;
+            m_cwr_allowed = false;
+            m_cwr_segs++;
+        }
+    }
+    
+    void serverSegment (TcpFrame const &tcp, std::uint64_t frame_index)
+    {
+        AIPSTACK_ASSERT_FORCE(tcp.data_len == 0);
+        AIPSTACK_ASSERT_FORCE(tcp.ecn == Ip4Ecn::NotEct);
+        
+        if (has_flags(tcp.flags, Tcp4Flags::Syn)) {
+            m_syn_ack_seen = true;
+            m_syn_ack_ecn_setup = (tcp.flags & (Tcp4Flags::Ece|Tcp4Flags::Cwr)) ==
+                Tcp4Flags::Ece;
+            return;
+        }
+        
+        // Update the expected echo state for the data segments processed by
+        // the server before sending this ACK.
+        while (!m_events.empty() && m_events.front().server_frames <= frame_index) {
+            DataEvent const &event = m_events.front();
+            if (m_dctcp || event.cwr) {
+                m_echo = false;
+            }
+            if (event.ce) {
+                m_echo = true;
+            }
+            m_events.pop_front();
+        }
+        
+        bool ece = has_flags(tcp.flags, Tcp4Flags::Ece);
+        AIPSTACK_ASSERT_FORCE(ece == m_echo);
+        if (ece) {
+            m_ece_acks++;
+        }
+        
+        if (m_cwr_seen) {
+            if (m_cwr_seq.mod_lt(tcp.ack)) {
+                m_cwr_recovered = true;
+            }
+            if (m_cwr_recovered && ece) {
+                m_cwr_allowed = true;
+            }
+        }
+    }
+    
+private:
+    WirePort m_port;
+    WirePort *m_server_port;
+    bool m_dctcp;
+    std::uint64_t m_server_frames;
+    std::deque<DataEvent> m_events;
+    bool m_syn_seen;
+    bool m_syn_ack_seen;
+    bool m_syn_ecn_setup;
+    bool m_syn_ack_ecn_setup;
+    bool m_echo;
+    bool m_have_data;
+    TcpSeqNum m_max_data_end;
+    bool m_cwr_seen;
+    bool m_cwr_recovered;
+    bool m_cwr_allowed;
+    TcpSeqNum m_cwr_seq;
+    std::uint64_t m_data_segs;
+    std::uint64_t m_ect_segs;
+    std::uint64_t m_rtx_segs;
+    std::uint64_t m_ce_segs;
+    std::uint64_t m_ece_acks;
+    std::uint64_t m_cwr_segs;
+};
+
+struct TransferResult {
+    double time;
+    bool syn_ecn_setup;
+    bool syn_ack_ecn_setup;
+    std::uint64_t data_segs;
+    std::uint64_t ect_segs;
+    std::uint64_t ce_segs;
+    std::uint64_t ece_acks;
+    std::uint64_t cwr_segs;
+};
+
+// Run the transfer from a client to a server with the given ECN modes and
+// return the transfer time and the counters of the monitor.
+template<EcnMode ClientMode, EcnMode ServerMode>
+TransferResult test_transfer (std::uint64_t mark_every)
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    VirtualWireParams wire_params;
+    wire_params.latency_sec = WireLatency;
+    Wire client_wire(wire_params);
+    Wire server_wire(wire_params);
+    
+    Monitor monitor(platform, server_wire, ServerMode == EcnMode::Dctcp);
+    MarkingRelay relay(platform, client_wire, server_wire, mark_every);
+    
+    TestStack<ServerMode> server_stack(platform);
+    TestStack<ClientMode> client_stack(platform);
+    client_stack.template getProtoApi<TcpApi>().setEphemeralPortKey(
+        SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    TestIface<ServerMode> server_iface(platform, &server_stack, server_wire, ServerMac);
+    TestIface<ClientMode> client_iface(platform, &client_stack, client_wire, ClientMac);
+    monitor.setServerPort(&server_iface.port());
+    server_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ServerAddr));
+    client_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ClientAddr));
+    
+    Receiver<ServerMode> receiver(platform, server_stack.template getProtoApi<TcpApi>());
+    Sender<ClientMode> sender(client_stack.template getProtoApi<TcpApi>());
+    Platform::TimeType start_time = platform.getTime();
+    
+    platform_impl.runUntil(start_time + sim_time(60.0));
+    
+    AIPSTACK_ASSERT_FORCE(receiver.received() == TransferBytes);
+    
+    // Nothing was lost, so there were no retransmissions.
+    AIPSTACK_ASSERT_FORCE(monitor.rtxSegs() == 0);
+    AIPSTACK_ASSERT_FORCE(monitor.ceSegs() == relay.markedFrames());
+    
+    sender.reset();
+    
+    return TransferResult{
+        /*time=*/ to_seconds(receiver.doneTime() - start_time),
+        /*syn_ecn_setup=*/ monitor.synEcnSetup(),
+        /*syn_ack_ecn_setup=*/ monitor.synAckEcnSetup(),
+        /*data_segs=*/ monitor.dataSegs(),
+        /*ect_segs=*/ monitor.ectSegs(),
+        /*ce_segs=*/ monitor.ceSegs(),
+        /*ece_acks=*/ monitor.eceAcks(),
+        /*cwr_segs=*/ monitor.cwrSegs(),
+    };
+}
+
+// ECN is used only if both ends enable it. The data is then all ECN-capable,
+// since there are no retransmissions.
+template<EcnMode ClientMode, EcnMode ServerMode>
+void test_negotiation ()
+{
+    bool client_ecn = ClientMode != EcnMode::Off;
+    bool ecn = client_ecn && ServerMode != EcnMode::Off;
+    
+    TransferResult res = test_transfer<ClientMode, ServerMode>(0);
+    
+    AIPSTACK_ASSERT_FORCE(res.syn_ecn_setup == client_ecn);
+    AIPSTACK_ASSERT_FORCE(res.syn_ack_ecn_setup == ecn);
+    AIPSTACK_ASSERT_FORCE(res.ect_segs == (ecn ? res.data_segs : 0));
+    AIPSTACK_ASSERT_FORCE(res.ce_segs == 0);
+    AIPSTACK_ASSERT_FORCE(res.cwr_segs == 0);
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_ecn_test;
+    
+    for (std::size_t pos = 0; pos < TransferBytes; pos++) {
+        g_tx_data[pos] = pattern_byte(pos);
+    }
+    
+    test_negotiation<EcnMode::Off, EcnMode::Off>();
+    test_negotiation<EcnMode::Off, EcnMode::Classic>();
+    test_negotiation<EcnMode::Classic, EcnMode::Off>();
+    test_negotiation<EcnMode::Classic, EcnMode::Classic>();
+    test_negotiation<EcnMode::Dctcp, EcnMode::Dctcp>();
+    
+    // Without marks, the transfer is limited by the receive window.
+    double unmarked_time = test_transfer<EcnMode::Classic, EcnMode::Classic>(0).time;
+    
+    // With classic ECN the sender reduces cwnd several times, with CWR each
+    // time. The checks of the monitor were done during the transfer.
+    TransferResult classic = test_transfer<EcnMode::Classic, EcnMode::Classic>(20);
+    AIPSTACK_ASSERT_FORCE(classic.ce_segs > 0);
+    AIPSTACK_ASSERT_FORCE(classic.ece_acks >= classic.ce_segs);
+    AIPSTACK_ASSERT_FORCE(classic.cwr_segs > 10);
+    
+    // DCTCP reduces cwnd only slightly for the small fraction of marked data.
+    TransferResult dctcp = test_transfer<EcnMode::Dctcp, EcnMode::Dctcp>(20);
+    AIPSTACK_ASSERT_FORCE(dctcp.ce_segs > 0);
+    AIPSTACK_ASSERT_FORCE(dctcp.ece_acks == dctcp.ce_segs);
+    AIPSTACK_ASSERT_FORCE(dctcp.cwr_segs > 10);
+    
+    AIPSTACK_ASSERT_FORCE(unmarked_time < 1.0);
+    AIPSTACK_ASSERT_FORCE(dctcp.time < classic.time / 3.0);
+    
+    // When all data is marked, alpha stays at one and DCTCP halves cwnd like
+    // classic ECN, once per window.
+    TransferResult classic_all = test_transfer<EcnMode::Classic, EcnMode::Classic>(1);
+    TransferResult dctcp_all = test_transfer<EcnMode::Dctcp, EcnMode::Dctcp>(1);
+    AIPSTACK_ASSERT_FORCE(classic_all.cwr_segs > classic.cwr_segs);
+    AIPSTACK_ASSERT_FORCE(dctcp_all.time > 0.9 * classic_all.time);
+    AIPSTACK_ASSERT_FORCE(dctcp_all.time < 1.1 * classic_all.time);
+    
+    return 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <random>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/tcp/TcpFastOpen.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_fast_open_test {
+
+constexpr int CacheSize = 4;
+
+using Cache = TcpFastOpenCookieCache<CacheSize>;
+
+Ip4Addr make_addr (int i)
+{
+    return Ip4Addr(192, 168, 1, std::uint8_t(i));
+}
+
+void store (Cache &cache, int i, std::uint8_t cookie_len = 8)
+{
+    char cookie[TcpMaxFastOpenCookieLen];
+    for (std::uint8_t j = 0; j < cookie_len; j++) {
+        cookie[j] = char(i * 16 + j);
+    }
+    cache.store(make_addr(i), std::uint16_t(1000 + i), cookie, cookie_len);
+}
+
+void check_present (Cache &cache, int i, std::uint8_t cookie_len = 8)
+{
+    Cache::Entry const *entry = cache.find(make_addr(i));
+    AIPSTACK_ASSERT_FORCE(entry != nullptr);
+    AIPSTACK_ASSERT_FORCE(entry->addr == make_addr(i));
+    AIPSTACK_ASSERT_FORCE(entry->mss == 1000 + i);
+    AIPSTACK_ASSERT_FORCE(entry->cookie_len == cookie_len);
+    for (std::uint8_t j = 0; j < cookie_len; j++) {
+        AIPSTACK_ASSERT_FORCE(entry->cookie[j] == char(i * 16 + j));
+    }
+}
+
+void test_cookie_gen ()
+{
+    TcpFastOpenCookieGen gen;
+    gen.setKey(SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    
+    char cookie[TcpFastOpenCookieGen::CookieLen];
+    gen.makeCookie(make_addr(1), cookie);
+    AIPSTACK_ASSERT_FORCE(gen.checkCookie(make_addr(1), cookie, sizeof(cookie)));
+    AIPSTACK_ASSERT_FORCE(!gen.checkCookie(make_addr(2), cookie, sizeof(cookie)));
+    AIPSTACK_ASSERT_FORCE(!gen.checkCookie(make_addr(1), cookie, sizeof(cookie) - 2));
+    
+    cookie[3] ^= 1;
+    AIPSTACK_ASSERT_FORCE(!gen.checkCookie(make_addr(1), cookie, sizeof(cookie)));
+    cookie[3] ^= 1;
+    
+    // A different key invalidates the cookie.
+    gen.setKey(SipHashKey{0x0123456789abcdefu, 0xfedcba9876543211u});
+    AIPSTACK_ASSERT_FORCE(!gen.checkCookie(make_addr(1), cookie, sizeof(cookie)));
+}
+
+void test_lru ()
+{
+    Cache cache;
+    
+    for (int i = 1; i <= CacheSize; i++) {
+        store(cache, i);
+    }
+    
+    // Use 1, so that 2 is now least recently used and gets replaced.
+    check_present(cache, 1);
+    store(cache, 5);
+    AIPSTACK_ASSERT_FORCE(cache.find(make_addr(2)) == nullptr);
+    check_present(cache, 1);
+    check_present(cache, 3);
+    check_present(cache, 4);
+    check_present(cache, 5);
+    
+    // Storing for a cached address updates it in place without evicting.
+    store(cache, 3, 16);
+    check_present(cache, 3, 16);
+    check_present(cache, 1);
+    check_present(cache, 4);
+    check_present(cache, 5);
+    
+    // A removed entry is reused before evicting any used one.
+    cache.remove(make_addr(4));
+    AIPSTACK_ASSERT_FORCE(cache.find(make_addr(4)) == nullptr);
+    store(cache, 6);
+    check_present(cache, 1);
+    check_present(cache, 3, 16);
+    check_present(cache, 5);
+    check_present(cache, 6);
+    
+    // A zero-size cache stores nothing.
+    TcpFastOpenCookieCache<0> empty_cache;
+    char cookie[4] = {1, 2, 3, 4};
+    empty_cache.store(make_addr(1), 1000, cookie, sizeof(cookie));
+    AIPSTACK_ASSERT_FORCE(empty_cache.find(make_addr(1)) == nullptr);
+}
+
+// Random finds, stores and removes checked against an LRU list model.
+void test_random ()
+{
+    Cache cache;
+    std::list<int> model; // most recently used at the front
+    std::mt19937 rng(1);
+    
+    auto model_touch = [&](int i) {
+        model.remove(i);
+        model.push_front(i);
+    };
+    
+    for (int iter = 0; iter < 100000; iter++) {
+        int i = 1 + int(rng() % 10);
+        bool in_model = std::find(model.begin(), model.end(), i) != model.end();
+        
+        switch (rng() % 3) {
+            case 0: {
+                if (in_model) {
+                    check_present(cache, i);
+                    model_touch(i);
+                } else {
+                    AIPSTACK_ASSERT_FORCE(cache.find(make_addr(i)) == nullptr);
+                }
+            } break;
+            case 1: {
+                store(cache, i);
+                if (!in_model && model.size() == std::size_t(CacheSize)) {
+                    model.pop_back();
+                }
+                model_touch(i);
+            } break;
+            default: {
+                cache.remove(make_addr(i));
+                model.remove(i);
+            } break;
+        }
+    }
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_fast_open_test;
+    
+    test_cookie_gen();
+    test_lru();
+    test_random();
+    
+    return 0;
+}
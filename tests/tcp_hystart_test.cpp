@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Tests that HyStart++ ends the initial slow start when the RTT increases,
+// before the queue at a bottleneck overflows. The frames received by the
+// server (the data direction) pass through a FrameImpairment stage with a
+// limited rate and a deep queue. Without HyStart++ slow start continues until
+// the queue overflows.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/sim/FrameImpairment.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_hystart_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+template<bool EnableHyStart>
+using TestProtocolServicesList = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>,
+        IpTcpProtoOptions::EnableHyStart::Is<EnableHyStart>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+template<bool EnableHyStart>
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList<EnableHyStart>> {};
+
+template<bool EnableHyStart>
+using TestStack = IpStack<TestStackArg<EnableHyStart>>;
+
+template<bool EnableHyStart>
+using TestIface = VirtualWireEthIface<TestStackArg<EnableHyStart>, TestEthIpIfaceService>;
+
+template<bool EnableHyStart>
+using TcpArg = typename TestStack<EnableHyStart>::template GetProtoArg<TcpApi>;
+
+constexpr Ip4Addr ServerAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr ClientAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t ServerPort = 80;
+
+// The bandwidth-delay product is 100 KB and the bottleneck queue holds about
+// another 1.5 MB, which with the receive window of 2 MB can still overflow.
+constexpr double BottleneckRate = 20e6;
+constexpr double LinkLatency = 0.02;
+constexpr std::size_t QueueLimit = 1000;
+
+constexpr std::size_t TransferBytes = 4 * 1024 * 1024;
+constexpr std::size_t RecvBufSize = 2 * 1024 * 1024;
+
+// The MSS with the default MTU of the VirtualWire.
+constexpr std::size_t Mss = 1460;
+
+char g_tx_data[TransferBytes];
+
+// Receives and discards data.
+template<bool EnableHyStart>
+class Receiver :
+    private NonCopyable<Receiver<EnableHyStart>>
+{
+    using Arg = TcpArg<EnableHyStart>;
+    
+    class Session : public TcpConnection<Arg>
+    {
+    public:
+        Session (Receiver *parent) :
+            m_parent(parent),
+            m_node{m_buffer.get(), RecvBufSize, &m_node}
+        {
+            IpErr err = this->acceptConnection(parent->m_listener);
+            AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+            this->setRecvBuf({&m_node, 0, RecvBufSize});
+        }
+        
+    private:
+        void connectionAborted () override final
+        {
+            AIPSTACK_ASSERT_FORCE(false);
+        }
+        
+        void dataReceived (std::size_t amount) override final
+        {
+            m_parent->m_received += amount;
+            this->extendRecvBuf(amount);
+        }
+        
+        void dataSent (std::size_t) override final {}
+        
+    private:
+        Receiver *m_parent;
+        std::unique_ptr<char[]> m_buffer{new char[RecvBufSize]};
+        IpBufNode m_node;
+    };
+    
+public:
+    Receiver (TcpApi<Arg> &tcp) :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::connectionEstablished, this)),
+        m_received(0)
+    {
+        bool listening = m_listener.startListening(tcp, {
+            /*addr=*/ Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        });
+        AIPSTACK_ASSERT_FORCE(listening);
+        m_listener.setInitialReceiveWindow(RecvBufSize);
+    }
+    
+    std::size_t received () const
+    {
+        return m_received;
+    }
+    
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(m_session == nullptr);
+        m_session = std::make_unique<Session>(this);
+    }
+    
+private:
+    TcpListener<Arg> m_listener;
+    std::unique_ptr<Session> m_session;
+    std::size_t m_received;
+};
+
+// Sends TransferBytes.
+template<bool EnableHyStart>
+class Sender : public TcpConnection<TcpArg<EnableHyStart>>
+{
+public:
+    Sender (TcpApi<TcpArg<EnableHyStart>> &tcp) :
+        m_node{g_tx_data, TransferBytes, nullptr}
+    {
+        TcpStartConnectionArgs<TcpArg<EnableHyStart>> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        IpErr err = this->startConnection(tcp, args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        this->setSendBuf({&m_node, 0, 0});
+    }
+    
+private:
+    void connectionAborted () override final
+    {
+        AIPSTACK_ASSERT_FORCE(false);
+    }
+    
+    void connectionEstablished () override final
+    {
+        this->extendSendBuf(TransferBytes);
+        this->sendPush();
+    }
+    
+    void dataReceived (std::size_t) override final {}
+    
+    void dataSent (std::size_t) override final {}
+    
+private:
+    IpBufNode m_node;
+};
+
+// Run the transfer and return the counters of the bottleneck.
+template<bool EnableHyStart>
+FrameImpairmentStats test_transfer ()
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    VirtualWireParams wire_params;
+    wire_params.latency_sec = LinkLatency;
+    VirtualWire<SimulatedPlatformImpl> wire(wire_params);
+    
+    TestStack<EnableHyStart> server_stack(platform);
+    TestStack<EnableHyStart> client_stack(platform);
+    client_stack.template getProtoApi<TcpApi>().setEphemeralPortKey(
+        SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    TestIface<EnableHyStart> server_iface(
+        platform, &server_stack, wire, MacAddr(2, 0, 0, 0, 0, 1));
+    TestIface<EnableHyStart> client_iface(
+        platform, &client_stack, wire, MacAddr(2, 0, 0, 0, 0, 2));
+    server_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ServerAddr));
+    client_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ClientAddr));
+    
+    FrameImpairmentParams imp_params;
+    imp_params.rate_bps = BottleneckRate;
+    imp_params.queue_limit = QueueLimit;
+    server_iface.setRxImpairment(imp_params);
+    
+    Receiver<EnableHyStart> receiver(server_stack.template getProtoApi<TcpApi>());
+    Sender<EnableHyStart> sender(client_stack.template getProtoApi<TcpApi>());
+    
+    platform_impl.runUntil(Platform::TimeType(60.0 * Platform::TimeFreq));
+    
+    AIPSTACK_ASSERT_FORCE(receiver.received() == TransferBytes);
+    
+    FrameImpairmentStats stats = server_iface.getRxImpairment()->getStats();
+    
+    sender.reset();
+    
+    return stats;
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_hystart_test;
+    
+    // Slow start alone overflows the queue.
+    AIPSTACK_ASSERT_FORCE(test_transfer<false>().frames_queue_dropped > 0);
+    
+    // HyStart++ sees the RTT increase and leaves slow start in time. Data is
+    // sent in full-sized segments also while cwnd grows slowly in Conservative
+    // Slow Start (the frames include the handshake and some ACKs).
+    FrameImpairmentStats stats = test_transfer<true>();
+    AIPSTACK_ASSERT_FORCE(stats.frames_queue_dropped == 0);
+    AIPSTACK_ASSERT_FORCE(stats.frames_in <= TransferBytes / Mss + 16);
+    
+    return 0;
+}
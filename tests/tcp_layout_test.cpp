@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Checks the memory layout of TcpConnection and of the TCP PCBs in several
+// configurations. The offsets of the per-segment fields of TcpConVars and
+// TcpPcb are checked by static asserts in TcpConnection and IpTcpProto, which
+// are evaluated when the types are instantiated here. This test additionally
+// bounds the sizes.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/platform_specific/ReservedArray.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Instance.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/tcp/TcpOosBuffer.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_layout_test {
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+// The default number of out-of-sequence segments.
+constexpr int DefaultOosSegs = 4;
+
+using DefaultProtocols = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<8>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>
+    >
+>;
+
+// Enough out-of-sequence segments to need a 16-bit index.
+using LargeOosProtocols = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<8>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>,
+        IpTcpProtoOptions::NumOosSegs::Is<300>
+    >
+>;
+
+// All optional algorithms, many segment times and a growable PCB array.
+using AllFeaturesProtocols = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<1024>,
+        IpTcpProtoOptions::PcbArrayService::Is<ReservedArrayService<4>>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>,
+        IpTcpProtoOptions::NumOosSegs::Is<64>,
+        IpTcpProtoOptions::NumRackSegTimes::Is<64>,
+        IpTcpProtoOptions::EnableEcn::Is<true>,
+        IpTcpProtoOptions::EcnDctcp::Is<true>,
+        IpTcpProtoOptions::EnableHyStart::Is<true>,
+        IpTcpProtoOptions::EnablePlpmtud::Is<true>,
+        IpTcpProtoOptions::EnableBbr::Is<true>
+    >
+>;
+
+class DefaultStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, DefaultProtocols> {};
+class LargeOosStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, LargeOosProtocols> {};
+class AllFeaturesStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, AllFeaturesProtocols> {};
+
+template<typename StackArg>
+using Connection = TcpConnection<typename IpStack<StackArg>::template GetProtoArg<TcpApi>>;
+
+template<int N>
+struct OosBufferInstance {
+    using Service = TcpOosBufferService<
+        TcpOosBufferServiceOptions::NumOosSegs::Is<N>
+    >;
+    AIPSTACK_MAKE_INSTANCE(Buffer, (Service))
+};
+
+template<int N>
+using OosBuffer = typename OosBufferInstance<N>::Buffer;
+
+// Construct a stack, which checks the PCB layout, and return the size of the
+// connection type, which checks the connection layout.
+template<typename StackArg>
+std::size_t check_config ()
+{
+    SimulatedPlatformImpl platform_impl;
+    PlatformFacade<SimulatedPlatformImpl> platform{
+        PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    auto stack = std::make_unique<IpStack<StackArg>>(platform);
+    
+    return sizeof(Connection<StackArg>);
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_layout_test;
+    
+    std::size_t default_size = check_config<DefaultStackArg>();
+    std::size_t large_oos_size = check_config<LargeOosStackArg>();
+    check_config<AllFeaturesStackArg>();
+    
+    // A larger out-of-sequence buffer only grows the connection by the size
+    // of the buffer (plus at most alignment), nothing else moves.
+    AIPSTACK_ASSERT_FORCE(large_oos_size - sizeof(OosBuffer<300>) <=
+        default_size - sizeof(OosBuffer<DefaultOosSegs>) + alignof(std::max_align_t));
+    
+    // With 64-bit pointers, the whole default connection fits in eight cache
+    // lines (it is 480 bytes on x86-64 Linux).
+    if (sizeof(void *) == 8) {
+        AIPSTACK_ASSERT_FORCE(default_size <= 8 * 64);
+    }
+    
+    return 0;
+}
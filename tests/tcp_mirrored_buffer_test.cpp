@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Tests SendRingBuffer and RecvRingBuffer set up with a MirroredBuffer. Data
+// is written through getWriteRange and read through getReadRange directly as
+// contiguous memory, which is only correct if each range is a single node
+// reaching into the mirror where it wraps around. The buffers are smaller than
+// the transfer and the sender writes random amounts, so ranges cross the wrap point at
+// varying offsets, and frame loss makes the stack retransmit data from the
+// ring buffer.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/misc/platform_specific/MirroredBuffer.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/utils/TcpRingBufferUtils.h>
+#include <aipstack/sim/FrameImpairment.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_mirrored_buffer_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::NumOosSegs::Is<8>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using TestStack = IpStack<TestStackArg>;
+using TestIface = VirtualWireEthIface<TestStackArg, TestEthIpIfaceService>;
+
+using TcpArg = TestStack::GetProtoArg<TcpApi>;
+
+constexpr Ip4Addr ServerAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr ClientAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t ServerPort = 80;
+
+constexpr std::size_t TransferBytes = 1024 * 1024;
+constexpr std::size_t BufferSize = 8192;
+constexpr int WndUpdDiv = 4;
+
+char pattern_byte (std::size_t pos)
+{
+    return char(pos % 251);
+}
+
+Platform::TimeType sim_time (double seconds)
+{
+    return Platform::TimeType(seconds * Platform::TimeFreq);
+}
+
+// Check that a range from a mirrored ring buffer is a single node which
+// extends into the mirror. Returns whether the range wraps around.
+bool check_mirrored_range (IpBufRef range, MirroredBuffer const &buffer)
+{
+    AIPSTACK_ASSERT_FORCE(range.node->ptr == buffer.data());
+    AIPSTACK_ASSERT_FORCE(range.node->len == 2 * buffer.size());
+    AIPSTACK_ASSERT_FORCE(range.offset < buffer.size());
+    AIPSTACK_ASSERT_FORCE(range.tot_len <= buffer.size());
+    
+    return range.offset + range.tot_len > buffer.size();
+}
+
+struct TransferStats {
+    std::size_t received = 0;
+    std::size_t write_wraps = 0;
+    std::size_t read_wraps = 0;
+    bool checked_node_walk = false;
+};
+
+// Receives data into a mirrored RecvRingBuffer, reading it directly from
+// memory.
+class Receiver :
+    private NonCopyable<Receiver>
+{
+    class Session : public TcpConnection<TcpArg>
+    {
+    public:
+        Session (Receiver *parent) :
+            m_parent(parent),
+            m_buffer(BufferSize)
+        {
+            IpErr err = acceptConnection(parent->m_listener);
+            AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+            
+            m_ring.setup(*this, m_buffer.data(), m_buffer.size(), WndUpdDiv,
+                         IpBufRef{}, /*mirrored=*/true);
+        }
+        
+    private:
+        void connectionAborted () override final
+        {
+            AIPSTACK_ASSERT_FORCE(false);
+        }
+        
+        void dataReceived (std::size_t amount) override final
+        {
+            TransferStats &stats = *m_parent->m_stats;
+            
+            if (amount == 0) {
+                return;
+            }
+            
+            IpBufRef range = m_ring.getReadRange(*this);
+            AIPSTACK_ASSERT_FORCE(range.tot_len == amount);
+            if (check_mirrored_range(range, m_buffer)) {
+                stats.read_wraps++;
+                if (!stats.checked_node_walk) {
+                    check_node_walk(range);
+                    stats.checked_node_walk = true;
+                }
+            }
+            
+            char const *data = range.node->ptr + range.offset;
+            for (std::size_t i = 0; i < range.tot_len; i++) {
+                AIPSTACK_ASSERT_FORCE(data[i] == pattern_byte(stats.received + i));
+            }
+            stats.received += range.tot_len;
+            
+            m_ring.consumeData(*this, range.tot_len);
+        }
+        
+        void dataSent (std::size_t) override final {}
+        
+        // Skipping to the end of the node spanning the buffer and mirror
+        // continues at the start of the ring buffer node.
+        void check_node_walk (IpBufRef range)
+        {
+            std::size_t to_end = 2 * m_buffer.size() - range.offset;
+            IpBufRef ext = IpBufRef{range.node, range.offset, to_end + m_buffer.size()};
+            
+            IpBufRef rest = ipBufSkipBytes(ext, to_end);
+            AIPSTACK_ASSERT_FORCE(rest.node != range.node);
+            AIPSTACK_ASSERT_FORCE(rest.node->ptr == m_buffer.data());
+            AIPSTACK_ASSERT_FORCE(rest.node->len == m_buffer.size());
+            AIPSTACK_ASSERT_FORCE(rest.offset == 0);
+            AIPSTACK_ASSERT_FORCE(rest.tot_len == m_buffer.size());
+            
+            // The ring buffer node links to itself, so the rest reads the
+            // same bytes as the mirror.
+            std::unique_ptr<char[]> copy(new char[m_buffer.size()]);
+            rest = ipBufTakeBytes(rest, m_buffer.size(), copy.get());
+            AIPSTACK_ASSERT_FORCE(rest.tot_len == 0);
+            AIPSTACK_ASSERT_FORCE(std::memcmp(copy.get(),
+                m_buffer.data() + m_buffer.size(), m_buffer.size()) == 0);
+        }
+        
+    private:
+        Receiver *m_parent;
+        MirroredBuffer m_buffer;
+        RecvRingBuffer<TcpArg> m_ring;
+    };
+    
+public:
+    Receiver (TcpApi<TcpArg> &tcp, TransferStats *stats) :
+        m_stats(stats),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::connectionEstablished, this))
+    {
+        bool listening = m_listener.startListening(tcp, {
+            /*addr=*/ Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        });
+        AIPSTACK_ASSERT_FORCE(listening);
+        m_listener.setInitialReceiveWindow(BufferSize);
+    }
+    
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(m_session == nullptr);
+        m_session = std::make_unique<Session>(this);
+    }
+    
+private:
+    TransferStats *m_stats;
+    TcpListener<TcpArg> m_listener;
+    std::unique_ptr<Session> m_session;
+};
+
+// Sends TransferBytes of the pattern through a mirrored SendRingBuffer,
+// writing random amounts directly to memory.
+class Sender : public TcpConnection<TcpArg>
+{
+public:
+    Sender (TcpApi<TcpArg> &tcp, TransferStats *stats, unsigned seed) :
+        m_stats(stats),
+        m_rng(seed),
+        m_buffer(BufferSize),
+        m_written(0)
+    {
+        TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        IpErr err = startConnection(tcp, args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        
+        m_ring.setup(*this, m_buffer.data(), m_buffer.size(), /*mirrored=*/true);
+    }
+    
+private:
+    void connectionAborted () override final
+    {
+        AIPSTACK_ASSERT_FORCE(false);
+    }
+    
+    void connectionEstablished () override final
+    {
+        writeData();
+    }
+    
+    void dataReceived (std::size_t) override final {}
+    
+    void dataSent (std::size_t) override final
+    {
+        writeData();
+    }
+    
+    void writeData ()
+    {
+        IpBufRef range = m_ring.getWriteRange(*this);
+        bool wraps = check_mirrored_range(range, m_buffer);
+        
+        std::size_t max_len = MinValue(range.tot_len, TransferBytes - m_written);
+        if (max_len == 0) {
+            return;
+        }
+        std::size_t write_len = std::uniform_int_distribution<std::size_t>(
+            1, max_len)(m_rng);
+        
+        if (wraps && range.offset + write_len > m_buffer.size()) {
+            m_stats->write_wraps++;
+        }
+        
+        char *data = range.node->ptr + range.offset;
+        for (std::size_t i = 0; i < write_len; i++) {
+            data[i] = pattern_byte(m_written + i);
+        }
+        m_written += write_len;
+        
+        m_ring.provideData(*this, write_len);
+        sendPush();
+    }
+    
+private:
+    TransferStats *m_stats;
+    std::mt19937 m_rng;
+    MirroredBuffer m_buffer;
+    SendRingBuffer<TcpArg> m_ring;
+    std::size_t m_written;
+};
+
+void run_transfer (double loss_prob, unsigned seed, TransferStats &stats)
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    VirtualWireParams wire_params;
+    wire_params.bandwidth_bps = 50e6;
+    wire_params.latency_sec = 0.002;
+    VirtualWire<SimulatedPlatformImpl> wire(wire_params);
+    
+    TestStack server_stack(platform);
+    TestStack client_stack(platform);
+    client_stack.getProtoApi<TcpApi>().setEphemeralPortKey(
+        SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    TestIface server_iface(platform, &server_stack, wire, MacAddr(2, 0, 0, 0, 0, 1));
+    TestIface client_iface(platform, &client_stack, wire, MacAddr(2, 0, 0, 0, 0, 2));
+    server_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ServerAddr));
+    client_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ClientAddr));
+    
+    if (loss_prob > 0.0) {
+        FrameImpairmentParams imp_params;
+        imp_params.seed = seed;
+        imp_params.loss_model = FrameLossModel::Bernoulli;
+        imp_params.loss_prob = loss_prob;
+        server_iface.setRxImpairment(imp_params);
+    }
+    
+    Receiver receiver(server_stack.getProtoApi<TcpApi>(), &stats);
+    Sender sender(client_stack.getProtoApi<TcpApi>(), &stats, seed);
+    
+    Platform::TimeType start_time = platform.getTime();
+    while (stats.received < TransferBytes) {
+        AIPSTACK_ASSERT_FORCE(platform_impl.runOne());
+        AIPSTACK_ASSERT_FORCE(platform.getTime() - start_time < sim_time(600.0));
+    }
+}
+
+void test_transfer ()
+{
+    for (double loss_prob : {0.0, 0.02}) {
+        for (unsigned seed = 1; seed <= 3; seed++) {
+            TransferStats stats;
+            run_transfer(loss_prob, seed, stats);
+            
+            // The buffers were cycled many times and both writes and reads
+            // went across the wrap point.
+            AIPSTACK_ASSERT_FORCE(stats.received == TransferBytes);
+            AIPSTACK_ASSERT_FORCE(stats.write_wraps > 10);
+            AIPSTACK_ASSERT_FORCE(stats.read_wraps > 10);
+            AIPSTACK_ASSERT_FORCE(stats.checked_node_walk);
+        }
+    }
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_mirrored_buffer_test;
+    
+    test_transfer();
+    
+    return 0;
+}
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <type_traits>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/infra/Instance.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/tcp/TcpOosBuffer.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_oos_buffer_test {
+
+template<std::size_t N>
+struct OosBufferInstance {
+    using Service = TcpOosBufferService<
+        TcpOosBufferServiceOptions::NumOosSegs::Is<N>
+    >;
+    AIPSTACK_MAKE_INSTANCE(Buffer, (Service))
+};
+
+// Reference model of the out-of-sequence buffer, using a sorted vector of
+// ranges with offsets relative to rcv_nxt.
+class Model {
+public:
+    struct Range {
+        std::uint32_t start;
+        std::uint32_t end;
+    };
+    
+    Model (std::size_t num_segs) :
+        m_num_segs(num_segs),
+        m_fin_valid(false),
+        m_fin_off(0)
+    {}
+    
+    bool update (std::uint32_t off, std::uint32_t len, bool fin, bool &need_ack)
+    {
+        need_ack = off != 0;
+        std::uint32_t end = off + len;
+        
+        if (m_fin_valid) {
+            if ((len > 0 && end > m_fin_off) || (fin && end != m_fin_off)) {
+                return false;
+            }
+        } else if (fin) {
+            if (!m_ranges.empty() && m_ranges.back().end > end) {
+                return false;
+            }
+        }
+        
+        if (len > 0) {
+            std::size_t i = 0;
+            while (i < m_ranges.size() && m_ranges[i].end < off) {
+                i++;
+            }
+            
+            if (i == m_ranges.size() || end < m_ranges[i].start) {
+                // New range. When full, the last range is evicted unless the
+                // new range would itself be last, then it is dropped.
+                bool insert = true;
+                if (m_ranges.size() == m_num_segs) {
+                    if (i == m_ranges.size()) {
+                        insert = false;
+                    } else {
+                        m_ranges.pop_back();
+                    }
+                }
+                if (insert) {
+                    m_ranges.insert(m_ranges.begin() + std::ptrdiff_t(i), Range{off, end});
+                    if (i + 1 < m_ranges.size()) {
+                        need_ack = true;
+                    }
+                }
+            } else {
+                // Merge with the range and any following ones now touched.
+                Range &r = m_ranges[i];
+                if (off < r.start) {
+                    need_ack = true;
+                    r.start = off;
+                }
+                if (end > r.end) {
+                    need_ack = true;
+                    r.end = end;
+                    while (i + 1 < m_ranges.size() && m_ranges[i + 1].start <= end) {
+                        if (m_ranges[i + 1].end > r.end) {
+                            r.end = m_ranges[i + 1].end;
+                        }
+                        m_ranges.erase(m_ranges.begin() + std::ptrdiff_t(i + 1));
+                    }
+                }
+            }
+        }
+        
+        if (fin && !m_fin_valid) {
+            m_fin_valid = true;
+            m_fin_off = end;
+        }
+        
+        return true;
+    }
+    
+    void shift (std::size_t &datalen, bool &fin)
+    {
+        datalen = 0;
+        if (!m_ranges.empty() && m_ranges.front().start == 0) {
+            datalen = m_ranges.front().end;
+            m_ranges.erase(m_ranges.begin());
+        }
+        fin = m_fin_valid && m_fin_off == datalen;
+        
+        // Make the offsets relative to the new rcv_nxt.
+        for (Range &r : m_ranges) {
+            r.start -= std::uint32_t(datalen);
+            r.end -= std::uint32_t(datalen);
+        }
+        if (m_fin_valid) {
+            m_fin_off -= std::uint32_t(datalen);
+        }
+    }
+    
+    bool isNothingBuffered () const
+    {
+        return m_ranges.empty() && !m_fin_valid;
+    }
+    
+    std::uint32_t extent () const
+    {
+        return m_ranges.empty() ? 0 : m_ranges.back().end;
+    }
+    
+    std::size_t numRanges () const
+    {
+        return m_ranges.size();
+    }
+    
+private:
+    std::size_t m_num_segs;
+    std::vector<Range> m_ranges;
+    bool m_fin_valid;
+    std::uint32_t m_fin_off;
+};
+
+struct Stats {
+    std::size_t max_ranges = 0;
+    int num_fin_rejected = 0;
+    int num_fins_delivered = 0;
+};
+
+// Feed random segments (with an occasional FIN, consistent or not) to both the
+// buffer and the model and compare all results. Also check that delivered data
+// was actually received, using a bitmap of received bytes.
+template<std::size_t N>
+void test_random (unsigned seed, std::uint32_t wnd, std::uint32_t max_len, int iterations,
+                  Stats &stats)
+{
+    using Buffer = typename OosBufferInstance<N>::Buffer;
+    static_assert(std::is_trivially_copyable_v<Buffer>);
+    
+    std::mt19937 rng(seed);
+    
+    Buffer buf;
+    buf.init();
+    Model model(N);
+    
+    // Start close to the wrap-around of sequence numbers.
+    TcpSeqNum rcv_nxt = TcpSeqNum(TcpSeqInt(0) - wnd / 2) + TcpSeqInt(rng() % 1000);
+    std::uint32_t fin_off = wnd - rng() % 1000;
+    // Whether each byte in the window was received, indexed by the sequence
+    // number modulo a power of two not less than the window size.
+    std::size_t ring_size = 1;
+    while (ring_size < wnd) {
+        ring_size *= 2;
+    }
+    std::vector<std::uint8_t> received(ring_size);
+    auto received_at = [&](std::size_t i) -> std::uint8_t & {
+        return received[(rcv_nxt + TcpSeqInt(i)).value() & (ring_size - 1)];
+    };
+    
+    for (int iter = 0; iter < iterations; iter++) {
+        std::uint32_t off = rng() % wnd;
+        if (rng() % 8 == 0) {
+            off = rng() % 200;
+        }
+        std::uint32_t len = rng() % (max_len + 1);
+        if (off + len > wnd) {
+            len = wnd - off;
+        }
+        
+        bool fin = false;
+        if (rng() % 100 == 0) {
+            fin = true;
+            // Mostly a FIN at the consistent position, otherwise anywhere.
+            if (rng() % 4 != 0) {
+                len = MinValue(len, fin_off);
+                off = fin_off - len;
+            }
+        }
+        
+        bool need_ack;
+        bool model_need_ack;
+        bool res = buf.updateForSegmentReceived(rcv_nxt, rcv_nxt + off, len, fin, need_ack);
+        bool model_res = model.update(off, len, fin, model_need_ack);
+        AIPSTACK_ASSERT_FORCE(res == model_res);
+        if (!res) {
+            stats.num_fin_rejected++;
+            continue;
+        }
+        AIPSTACK_ASSERT_FORCE(need_ack == model_need_ack);
+        
+        for (std::uint32_t i = off; i < off + len; i++) {
+            received_at(i) = 1;
+        }
+        
+        if (model.numRanges() > stats.max_ranges) {
+            stats.max_ranges = model.numRanges();
+        }
+        
+        // The buffer must be usable after being copied bytewise.
+        if (iter % 64 == 0) {
+            Buffer copy;
+            std::memcpy(static_cast<void *>(&copy), &buf, sizeof(buf));
+            buf = copy;
+        }
+        
+        std::size_t datalen;
+        bool seg_fin;
+        buf.shiftAvailable(rcv_nxt, datalen, seg_fin);
+        std::size_t model_datalen;
+        bool model_fin;
+        model.shift(model_datalen, model_fin);
+        AIPSTACK_ASSERT_FORCE(datalen == model_datalen);
+        AIPSTACK_ASSERT_FORCE(seg_fin == model_fin);
+        
+        for (std::size_t i = 0; i < datalen; i++) {
+            AIPSTACK_ASSERT_FORCE(received_at(i) == 1);
+            received_at(i) = 0;
+        }
+        
+        rcv_nxt = rcv_nxt + TcpSeqInt(datalen);
+        fin_off -= std::uint32_t(MinValue(std::size_t(fin_off), datalen));
+        
+        AIPSTACK_ASSERT_FORCE(buf.isNothingBuffered() == model.isNothingBuffered());
+        AIPSTACK_ASSERT_FORCE(buf.getBufferedExtent(rcv_nxt) == model.extent());
+        
+        // After a FIN is delivered, start over as with a new connection.
+        if (seg_fin) {
+            stats.num_fins_delivered++;
+            buf.init();
+            model = Model(N);
+            rcv_nxt = TcpSeqNum(TcpSeqInt(rng()));
+            fin_off = wnd - rng() % 1000;
+            received.assign(ring_size, 0);
+        }
+    }
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_oos_buffer_test;
+    
+    Stats stats1;
+    for (unsigned seed = 1; seed <= 50; seed++) {
+        test_random<1>(seed, 20000, 1500, 2000, stats1);
+    }
+    AIPSTACK_ASSERT_FORCE(stats1.max_ranges == 1);
+    
+    Stats stats4;
+    for (unsigned seed = 1; seed <= 50; seed++) {
+        test_random<4>(seed, 20000, 1500, 2000, stats4);
+    }
+    AIPSTACK_ASSERT_FORCE(stats4.max_ranges == 4);
+    
+    // More ranges than fit in an 8-bit index, filled up by short segments
+    // in a large window.
+    Stats stats300;
+    for (unsigned seed = 1; seed <= 10; seed++) {
+        test_random<300>(seed, 100000, 100, 20000, stats300);
+    }
+    AIPSTACK_ASSERT_FORCE(stats300.max_ranges == 300);
+    
+    // FIN handling must have been exercised, including rejections. With many
+    // ranges in a large window the FIN is normally not reached.
+    for (Stats const *stats : {&stats1, &stats4, &stats300}) {
+        AIPSTACK_ASSERT_FORCE(stats->num_fin_rejected > 0);
+    }
+    AIPSTACK_ASSERT_FORCE(stats1.num_fins_delivered > 0);
+    AIPSTACK_ASSERT_FORCE(stats4.num_fins_delivered > 0);
+    
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/EnumUtils.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/tcp/TcpOptions.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_options_test {
+
+constexpr std::size_t GuardLen = 8;
+constexpr char GuardByte = char(0xA5);
+
+// Write the options for each combination of MSS/WndScale with a Fast Open
+// option carrying the given cookie length, check that they fit into
+// MaxTcpOptionsWriteLen and parse back to the same values.
+void test_cookie_len (std::uint8_t cookie_len)
+{
+    for (int combo = 0; combo < 4; combo++) {
+        TcpOptions opts = {};
+        opts.options = TcpOptionFlags::FastOpen;
+        if ((combo & 1) != 0) {
+            opts.options |= TcpOptionFlags::Mss;
+            opts.mss = 1460;
+        }
+        if ((combo & 2) != 0) {
+            opts.options |= TcpOptionFlags::WndScale;
+            opts.wnd_scale = 7;
+        }
+        opts.fast_open_cookie_len = cookie_len;
+        for (std::uint8_t i = 0; i < cookie_len; i++) {
+            opts.fast_open_cookie[i] = char(0x10 + i);
+        }
+        
+        std::uint8_t opts_len = CalcTcpOptionsLength(opts);
+        AIPSTACK_ASSERT_FORCE(opts_len <= MaxTcpOptionsWriteLen);
+        AIPSTACK_ASSERT_FORCE(opts_len % 4 == 0);
+        
+        // Write with guard bytes after the maximum length, which must stay intact.
+        char buf[MaxTcpOptionsWriteLen + GuardLen];
+        std::memset(buf, GuardByte, sizeof(buf));
+        WriteTcpOptions(opts, buf);
+        for (std::size_t i = opts_len; i < sizeof(buf); i++) {
+            AIPSTACK_ASSERT_FORCE(buf[i] == GuardByte);
+        }
+        
+        TcpOptions parsed;
+        IpBufNode node = {buf, opts_len, nullptr};
+        ParseTcpOptions(IpBufRef{&node, 0, opts_len}, parsed);
+        
+        AIPSTACK_ASSERT_FORCE((parsed.options & TcpOptionFlags::Mss) ==
+                              (opts.options & TcpOptionFlags::Mss));
+        if ((opts.options & TcpOptionFlags::Mss) != Enum0) {
+            AIPSTACK_ASSERT_FORCE(parsed.mss == opts.mss);
+        }
+        AIPSTACK_ASSERT_FORCE((parsed.options & TcpOptionFlags::WndScale) ==
+                              (opts.options & TcpOptionFlags::WndScale));
+        if ((opts.options & TcpOptionFlags::WndScale) != Enum0) {
+            AIPSTACK_ASSERT_FORCE(parsed.wnd_scale == opts.wnd_scale);
+        }
+        
+        // Only a request or an even length within limits is a valid cookie,
+        // others are ignored by the parser.
+        bool valid = cookie_len == 0 || (cookie_len >= TcpMinFastOpenCookieLen &&
+                                         cookie_len % 2 == 0);
+        AIPSTACK_ASSERT_FORCE(((parsed.options & TcpOptionFlags::FastOpen) != Enum0) == valid);
+        if (valid) {
+            AIPSTACK_ASSERT_FORCE(parsed.fast_open_cookie_len == cookie_len);
+            AIPSTACK_ASSERT_FORCE(std::memcmp(parsed.fast_open_cookie,
+                                              opts.fast_open_cookie, cookie_len) == 0);
+        }
+    }
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_options_test;
+    
+    for (std::uint8_t cookie_len = 0; cookie_len <= TcpMaxFastOpenCookieLen; cookie_len++) {
+        test_cookie_len(cookie_len);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Bulk transfer over a lossy simulated link, checking that the sender never
+// transmits data which it already knows to be acknowledged. A third port on the
+// VirtualWire observes all frames. It sees each ACK just before the sender does
+// and then records how many frames the sender has sent, so for each frame of
+// the sender it knows which ACKs had been processed before it was sent. Frames
+// received by the server (the data direction) are dropped randomly, which with
+// several losses in a window exercises the retransmission on a partial ACK in
+// fast recovery.
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <utility>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/sim/FrameImpairment.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_partial_ack_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using TestStack = IpStack<TestStackArg>;
+using TestIface = VirtualWireEthIface<TestStackArg, TestEthIpIfaceService>;
+
+using TcpArg = TestStack::GetProtoArg<TcpApi>;
+
+constexpr Ip4Addr ServerAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr ClientAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t ServerPort = 80;
+
+constexpr std::size_t TransferBytes = 1024 * 1024;
+constexpr std::size_t RecvBufSize = 64 * 1024;
+
+char g_tx_data[TransferBytes];
+
+char pattern_byte (std::size_t pos)
+{
+    return char(pos % 251);
+}
+
+// Receives data into a ring buffer and checks it.
+class Receiver :
+    private NonCopyable<Receiver>
+{
+    class Session : public TcpConnection<TcpArg>
+    {
+    public:
+        Session (Receiver *parent) :
+            m_parent(parent),
+            m_node{m_buffer, RecvBufSize, &m_node}
+        {
+            IpErr err = acceptConnection(parent->m_listener);
+            AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+            setRecvBuf({&m_node, 0, RecvBufSize});
+        }
+        
+    private:
+        void connectionAborted () override final
+        {
+            m_parent->m_aborted = true;
+        }
+        
+        void dataReceived (std::size_t amount) override final
+        {
+            for (std::size_t i = 0; i < amount; i++) {
+                std::size_t pos = m_parent->m_received + i;
+                AIPSTACK_ASSERT_FORCE(m_buffer[pos % RecvBufSize] == pattern_byte(pos));
+            }
+            m_parent->m_received += amount;
+            extendRecvBuf(amount);
+        }
+        
+        void dataSent (std::size_t) override final {}
+        
+    private:
+        Receiver *m_parent;
+        IpBufNode m_node;
+        char m_buffer[RecvBufSize];
+    };
+    
+public:
+    Receiver (TcpApi<TcpArg> &tcp) :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::connectionEstablished, this)),
+        m_received(0),
+        m_aborted(false)
+    {
+        bool listening = m_listener.startListening(tcp, {
+            /*addr=*/ Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        });
+        AIPSTACK_ASSERT_FORCE(listening);
+        m_listener.setInitialReceiveWindow(RecvBufSize);
+    }
+    
+    std::size_t received () const
+    {
+        return m_received;
+    }
+    
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(m_session == nullptr);
+        m_session = std::make_unique<Session>(this);
+    }
+    
+private:
+    TcpListener<TcpArg> m_listener;
+    std::unique_ptr<Session> m_session;
+    std::size_t m_received;
+    bool m_aborted;
+};
+
+// Sends TransferBytes of the pattern.
+class Sender : public TcpConnection<TcpArg>
+{
+public:
+    Sender (TcpApi<TcpArg> &tcp) :
+        m_node{g_tx_data, TransferBytes, nullptr}
+    {
+        TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        IpErr err = startConnection(tcp, args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        setSendBuf({&m_node, 0, 0});
+    }
+    
+private:
+    void connectionAborted () override final
+    {
+        AIPSTACK_ASSERT_FORCE(false);
+    }
+    
+    void connectionEstablished () override final
+    {
+        extendSendBuf(TransferBytes);
+        sendPush();
+    }
+    
+    void dataReceived (std::size_t) override final {}
+    
+    void dataSent (std::size_t) override final {}
+    
+private:
+    IpBufNode m_node;
+};
+
+// Observes the frames on the wire. Must be constructed before the interfaces
+// so that it receives frames before them.
+class Monitor :
+    private NonCopyable<Monitor>
+{
+    using WirePort = VirtualWire<SimulatedPlatformImpl>::Port;
+    
+public:
+    Monitor (Platform platform, VirtualWire<SimulatedPlatformImpl> &wire) :
+        m_port(platform, wire, AIPSTACK_BIND_MEMBER_TN(&Monitor::frameReceived, this)),
+        m_sender_port(nullptr),
+        m_sender_frames(0),
+        m_have_data(false),
+        m_have_ack(false),
+        m_data_segs(0),
+        m_rtx_segs(0),
+        m_acked_segs(0)
+    {}
+    
+    void setSender (WirePort *sender_port, MacAddr sender_mac)
+    {
+        m_sender_port = sender_port;
+        m_sender_mac = sender_mac;
+    }
+    
+    std::uint64_t dataSegs () const { return m_data_segs; }
+    std::uint64_t rtxSegs () const { return m_rtx_segs; }
+    std::uint64_t ackedSegs () const { return m_acked_segs; }
+    
+private:
+    void frameReceived (IpBufRef frame)
+    {
+        constexpr std::size_t MaxFrame = 1600;
+        if (m_sender_port == nullptr || frame.tot_len < EthHeader::Size ||
+            frame.tot_len > MaxFrame)
+        {
+            return;
+        }
+        char data[MaxFrame];
+        ipBufTakeBytes(frame, frame.tot_len, data);
+        
+        // Frames of the sender are seen in the order in which they were sent.
+        auto eth_header = EthHeader::MakeRef(data);
+        bool from_sender = eth_header.get(EthHeader::SrcMac()) == m_sender_mac;
+        std::uint64_t frame_index = from_sender ? m_sender_frames++ : 0;
+        
+        if (frame.tot_len < EthHeader::Size + Ip4Header::Size + Tcp4Header::Size ||
+            eth_header.get(EthHeader::EthType()) != EthType::Ipv4)
+        {
+            return;
+        }
+        
+        char *ip_data = data + EthHeader::Size;
+        auto ip4_header = Ip4Header::MakeRef(ip_data);
+        if (ip4_header.get(Ip4Header::Proto()) != Ip4Protocol::Tcp) {
+            return;
+        }
+        std::size_t ihl = 4 * std::size_t(
+            (ip4_header.get(Ip4Header::VersionIhlDscpEcn()) >> 8) & Ip4IhlMask);
+        std::size_t ip_len = ip4_header.get(Ip4Header::TotalLen());
+        
+        char *tcp_data = ip_data + ihl;
+        auto tcp_header = Tcp4Header::MakeRef(tcp_data);
+        Tcp4Flags flags = tcp_header.get(Tcp4Header::OffsetFlags());
+        std::size_t tcp_hdr_len =
+            4 * std::size_t(std::uint16_t(flags) >> TcpOffsetShift);
+        std::size_t data_len = ip_len - ihl - tcp_hdr_len;
+        TcpSeqNum seq = tcp_header.get(Tcp4Header::SeqNum());
+        
+        if (!from_sender) {
+            // ACK to the sender, which processes it right after this. Frames
+            // which it has sent up to now were sent before that.
+            if ((flags & Tcp4Flags::Ack) != Tcp4Flags()) {
+                m_acks.push_back({m_sender_port->getStats().frames_sent,
+                                  tcp_header.get(Tcp4Header::AckNum())});
+            }
+            return;
+        }
+        
+        if (data_len == 0) {
+            return;
+        }
+        
+        // Find the highest ACK which the sender had processed before sending
+        // this segment.
+        while (!m_acks.empty() && m_acks.front().first <= frame_index) {
+            TcpSeqNum ack = m_acks.front().second;
+            if (!m_have_ack || m_known_ack.mod_lt(ack)) {
+                m_known_ack = ack;
+                m_have_ack = true;
+            }
+            m_acks.pop_front();
+        }
+        
+        TcpSeqNum seg_end = seq + data_len;
+        
+        m_data_segs++;
+        if (m_have_data && seq.mod_lt(m_max_data_end)) {
+            m_rtx_segs++;
+        }
+        if (!m_have_data || m_max_data_end.mod_lt(seg_end)) {
+            m_max_data_end = seg_end;
+            m_have_data = true;
+        }
+        
+        // The whole segment was acked before it was sent?
+        if (m_have_ack && !m_known_ack.mod_lt(seg_end)) {
+            m_acked_segs++;
+        }
+    }
+    
+private:
+    WirePort m_port;
+    WirePort *m_sender_port;
+    MacAddr m_sender_mac;
+    std::uint64_t m_sender_frames;
+    std::deque<std::pair<std::uint64_t, TcpSeqNum>> m_acks;
+    bool m_have_data;
+    bool m_have_ack;
+    TcpSeqNum m_max_data_end;
+    TcpSeqNum m_known_ack;
+    std::uint64_t m_data_segs;
+    std::uint64_t m_rtx_segs;
+    std::uint64_t m_acked_segs;
+};
+
+std::uint64_t test_transfer (std::uint64_t seed, double loss_prob)
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    VirtualWireParams wire_params;
+    wire_params.bandwidth_bps = 100e6;
+    wire_params.latency_sec = 0.01;
+    VirtualWire<SimulatedPlatformImpl> wire(wire_params);
+    
+    Monitor monitor(platform, wire);
+    
+    TestStack server_stack(platform);
+    TestStack client_stack(platform);
+    client_stack.getProtoApi<TcpApi>().setEphemeralPortKey(
+        SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    MacAddr client_mac = MacAddr(2, 0, 0, 0, 0, 2);
+    TestIface server_iface(platform, &server_stack, wire, MacAddr(2, 0, 0, 0, 0, 1));
+    TestIface client_iface(platform, &client_stack, wire, client_mac);
+    monitor.setSender(&client_iface.port(), client_mac);
+    server_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ServerAddr));
+    client_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ClientAddr));
+    
+    Receiver receiver(server_stack.getProtoApi<TcpApi>());
+    Sender sender(client_stack.getProtoApi<TcpApi>());
+    
+    FrameImpairmentParams imp_params;
+    imp_params.seed = seed;
+    imp_params.loss_model = FrameLossModel::Bernoulli;
+    imp_params.loss_prob = loss_prob;
+    server_iface.setRxImpairment(imp_params);
+    
+    platform_impl.runUntil(Platform::TimeType(120.0 * Platform::TimeFreq));
+    
+    AIPSTACK_ASSERT_FORCE(receiver.received() == TransferBytes);
+    AIPSTACK_ASSERT_FORCE(monitor.dataSegs() > TransferBytes / 1500);
+    
+    // Nothing already acked was sent.
+    AIPSTACK_ASSERT_FORCE(monitor.ackedSegs() == 0);
+    
+    sender.reset();
+    
+    return monitor.rtxSegs();
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_partial_ack_test;
+    
+    for (std::size_t pos = 0; pos < TransferBytes; pos++) {
+        g_tx_data[pos] = pattern_byte(pos);
+    }
+    
+    std::uint64_t rtx_segs = 0;
+    for (std::uint64_t seed = 1; seed <= 10; seed++) {
+        rtx_segs += test_transfer(seed, 0.03);
+    }
+    AIPSTACK_ASSERT_FORCE(rtx_segs > 0);
+    
+    return 0;
+}
@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Tests Packetization Layer Path MTU Discovery (RFC 8899) over a path with a
+// hidden MTU smaller than that of the interfaces. The server drops larger
+// frames silently and no ICMP Packet Too Big is ever sent, so full-sized
+// segments disappear in a black hole. A monitor records the data segments of
+// the clients. The sender must detect the black hole after
+// PlpmtudBlackHoleRtos retransmission timeouts, fall back to PlpmtudBaseMtu
+// and then probe upward close to the hidden MTU. The probed MTU is also used
+// by another connection to the same server, which never probed itself.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/IpTcpProto_constants.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/sim/FrameImpairment.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_plpmtud_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>,
+        IpTcpProtoOptions::EnablePlpmtud::Is<true>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using TestStack = IpStack<TestStackArg>;
+using TestIface = VirtualWireEthIface<TestStackArg, TestEthIpIfaceService>;
+
+using TcpArg = TestStack::GetProtoArg<TcpApi>;
+using Constants = IpTcpProto_constants<TcpArg>;
+
+constexpr Ip4Addr ServerAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr ClientAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t ServerPort = 80;
+
+constexpr MacAddr ServerMac = MacAddr(2, 0, 0, 0, 0, 1);
+constexpr MacAddr ClientMac = MacAddr(2, 0, 0, 0, 0, 2);
+
+// The MTU of the interfaces and the largest IP packet which gets through.
+constexpr std::uint16_t IfaceMtu = 1500;
+constexpr std::uint16_t HiddenMtu = 1400;
+
+constexpr std::size_t TransferBytes = 1024 * 1024;
+constexpr std::size_t RecvBufSize = 64 * 1024;
+
+char g_tx_data[TransferBytes];
+
+Platform::TimeType sim_time (double seconds)
+{
+    return Platform::TimeType(seconds * Platform::TimeFreq);
+}
+
+double to_seconds (Platform::TimeType time)
+{
+    return double(time) / Platform::TimeFreq;
+}
+
+// Accepts connections and discards the data.
+class Receiver :
+    private NonCopyable<Receiver>
+{
+    static constexpr int MaxSessions = 2;
+    
+    class Session : public TcpConnection<TcpArg>
+    {
+    public:
+        Session (Receiver *parent) :
+            m_node{m_buffer, RecvBufSize, &m_node}
+        {
+            IpErr err = acceptConnection(parent->m_listener);
+            AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+            setRecvBuf({&m_node, 0, RecvBufSize});
+        }
+        
+    private:
+        void connectionAborted () override final
+        {
+            AIPSTACK_ASSERT_FORCE(false);
+        }
+        
+        void dataReceived (std::size_t amount) override final
+        {
+            extendRecvBuf(amount);
+        }
+        
+        void dataSent (std::size_t) override final {}
+        
+    private:
+        IpBufNode m_node;
+        char m_buffer[RecvBufSize];
+    };
+    
+public:
+    Receiver (TcpApi<TcpArg> &tcp) :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::connectionEstablished, this)),
+        m_num_sessions(0)
+    {
+        bool listening = m_listener.startListening(tcp, {
+            /*addr=*/ Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ MaxSessions
+        });
+        AIPSTACK_ASSERT_FORCE(listening);
+        m_listener.setInitialReceiveWindow(RecvBufSize);
+    }
+    
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(m_num_sessions < MaxSessions);
+        m_sessions[m_num_sessions++] = std::make_unique<Session>(this);
+    }
+    
+private:
+    TcpListener<TcpArg> m_listener;
+    std::unique_ptr<Session> m_sessions[MaxSessions];
+    int m_num_sessions;
+};
+
+// Sends data as requested.
+class Sender : public TcpConnection<TcpArg>
+{
+public:
+    Sender (TcpApi<TcpArg> &tcp) :
+        m_node{g_tx_data, TransferBytes, nullptr},
+        m_established(false),
+        m_acked(0)
+    {
+        TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        IpErr err = startConnection(tcp, args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        setSendBuf({&m_node, 0, 0});
+    }
+    
+    void sendMore (std::size_t amount)
+    {
+        extendSendBuf(amount);
+        sendPush();
+    }
+    
+    bool established () const { return m_established; }
+    std::size_t acked () const { return m_acked; }
+    
+private:
+    void connectionAborted () override final
+    {
+        AIPSTACK_ASSERT_FORCE(false);
+    }
+    
+    void connectionEstablished () override final
+    {
+        m_established = true;
+    }
+    
+    void dataReceived (std::size_t) override final {}
+    
+    void dataSent (std::size_t amount) override final
+    {
+        m_acked += amount;
+    }
+    
+private:
+    IpBufNode m_node;
+    bool m_established;
+    std::size_t m_acked;
+};
+
+// A data segment sent by a client.
+struct DataSeg {
+    std::uint16_t local_port;
+    TcpSeqNum seq;
+    std::uint16_t ip_len;
+    Platform::TimeType time;
+};
+
+// Records the data segments of the clients. Must be constructed before the
+// interface of the server so that it also sees the frames which it drops.
+class Monitor :
+    private NonCopyable<Monitor>
+{
+    using WirePort = VirtualWire<SimulatedPlatformImpl>::Port;
+    
+public:
+    Monitor (Platform platform, VirtualWire<SimulatedPlatformImpl> &wire) :
+        m_platform(platform),
+        m_port(platform, wire, AIPSTACK_BIND_MEMBER_TN(&Monitor::frameReceived, this))
+    {}
+    
+    // The data segments of a connection, in the order sent.
+    std::vector<DataSeg> segments (std::uint16_t local_port) const
+    {
+        std::vector<DataSeg> result;
+        for (DataSeg const &seg : m_segs) {
+            if (seg.local_port == local_port) {
+                result.push_back(seg);
+            }
+        }
+        return result;
+    }
+    
+private:
+    void frameReceived (IpBufRef frame)
+    {
+        constexpr std::size_t MaxFrame = 1600;
+        if (frame.tot_len < EthHeader::Size + Ip4Header::Size + Tcp4Header::Size ||
+            frame.tot_len > MaxFrame)
+        {
+            return;
+        }
+        char data[MaxFrame];
+        ipBufTakeBytes(frame, frame.tot_len, data);
+        
+        auto eth_header = EthHeader::MakeRef(data);
+        if (eth_header.get(EthHeader::SrcMac()) != ClientMac ||
+            eth_header.get(EthHeader::EthType()) != EthType::Ipv4)
+        {
+            return;
+        }
+        
+        char *ip_data = data + EthHeader::Size;
+        auto ip4_header = Ip4Header::MakeRef(ip_data);
+        if (ip4_header.get(Ip4Header::Proto()) != Ip4Protocol::Tcp) {
+            return;
+        }
+        std::size_t ihl = 4 * std::size_t(
+            (ip4_header.get(Ip4Header::VersionIhlDscpEcn()) >> 8) & Ip4IhlMask);
+        std::uint16_t ip_len = ip4_header.get(Ip4Header::TotalLen());
+        
+        auto tcp_header = Tcp4Header::MakeRef(ip_data + ihl);
+        Tcp4Flags flags = tcp_header.get(Tcp4Header::OffsetFlags());
+        std::size_t tcp_hdr_len =
+            4 * std::size_t(std::uint16_t(flags) >> TcpOffsetShift);
+        if (ip_len - ihl - tcp_hdr_len == 0) {
+            return;
+        }
+        
+        m_segs.push_back({tcp_header.get(Tcp4Header::SrcPort()),
+                          tcp_header.get(Tcp4Header::SeqNum()),
+                          ip_len, m_platform.getTime()});
+    }
+    
+private:
+    Platform m_platform;
+    WirePort m_port;
+    std::vector<DataSeg> m_segs;
+};
+
+bool dropped (DataSeg const &seg)
+{
+    return seg.ip_len > HiddenMtu;
+}
+
+// Index of the first segment which got through.
+std::size_t first_delivered (std::vector<DataSeg> const &segs)
+{
+    std::size_t index = 0;
+    while (index < segs.size() && dropped(segs[index])) {
+        index++;
+    }
+    return index;
+}
+
+// The largest segment which got through.
+std::uint16_t max_delivered (std::vector<DataSeg> const &segs)
+{
+    std::uint16_t max_len = 0;
+    for (DataSeg const &seg : segs) {
+        if (!dropped(seg) && seg.ip_len > max_len) {
+            max_len = seg.ip_len;
+        }
+    }
+    return max_len;
+}
+
+void test_plpmtud ()
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    VirtualWireParams wire_params;
+    wire_params.eth_mtu = EthHeader::Size + IfaceMtu;
+    wire_params.bandwidth_bps = 100e6;
+    wire_params.latency_sec = 0.01;
+    VirtualWire<SimulatedPlatformImpl> wire(wire_params);
+    
+    Monitor monitor(platform, wire);
+    
+    TestStack server_stack(platform);
+    TestStack client_stack(platform);
+    client_stack.getProtoApi<TcpApi>().setEphemeralPortKey(
+        SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    TestIface server_iface(platform, &server_stack, wire, ServerMac);
+    TestIface client_iface(platform, &client_stack, wire, ClientMac);
+    server_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ServerAddr));
+    client_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ClientAddr));
+    
+    // The black hole.
+    FrameImpairmentParams imp_params;
+    imp_params.max_frame_size = EthHeader::Size + HiddenMtu;
+    server_iface.setRxImpairment(imp_params);
+    
+    Receiver receiver(server_stack.getProtoApi<TcpApi>());
+    Sender sender(client_stack.getProtoApi<TcpApi>());
+    Sender other_sender(client_stack.getProtoApi<TcpApi>());
+    
+    platform_impl.runUntil(platform.getTime() + sim_time(1.0));
+    AIPSTACK_ASSERT_FORCE(sender.established() && other_sender.established());
+    
+    // Transfer with the first connection.
+    sender.sendMore(TransferBytes);
+    platform_impl.runUntil(platform.getTime() + sim_time(30.0));
+    AIPSTACK_ASSERT_FORCE(sender.acked() == TransferBytes);
+    
+    std::vector<DataSeg> segs = monitor.segments(sender.getLocalPort());
+    
+    // Full-sized segments are sent until the black hole is detected. The first
+    // segment times out PlpmtudBlackHoleRtos times (the last timeout is also
+    // the detection), and is then retransmitted with PlpmtudBaseMtu.
+    AIPSTACK_ASSERT_FORCE(segs.size() > 0 && segs[0].ip_len == IfaceMtu);
+    std::size_t first_ok = first_delivered(segs);
+    AIPSTACK_ASSERT_FORCE(first_ok < segs.size());
+    AIPSTACK_ASSERT_FORCE(segs[first_ok].ip_len == Constants::PlpmtudBaseMtu);
+    AIPSTACK_ASSERT_FORCE(segs[first_ok].seq == segs[0].seq);
+    
+    std::size_t first_seg_sends = 0;
+    for (std::size_t i = 0; i < first_ok; i++) {
+        if (segs[i].seq == segs[0].seq) {
+            first_seg_sends++;
+        }
+    }
+    AIPSTACK_ASSERT_FORCE(first_seg_sends == Constants::PlpmtudBlackHoleRtos);
+    
+    // That is after the minimum RTO of 250 ms and then twice that.
+    double detect_time = to_seconds(segs[first_ok].time - segs[0].time);
+    AIPSTACK_ASSERT_FORCE(detect_time > 0.75 && detect_time < 1.0);
+    
+    // Probing converges close to the hidden MTU by bisection, losing only
+    // a few probes.
+    std::uint16_t probed_mtu = max_delivered(segs);
+    AIPSTACK_ASSERT_FORCE(probed_mtu <= HiddenMtu);
+    AIPSTACK_ASSERT_FORCE(probed_mtu > HiddenMtu - Constants::PlpmtudMinProbeStep);
+    
+    std::size_t lost_probes = 0;
+    for (std::size_t i = first_ok; i < segs.size(); i++) {
+        if (dropped(segs[i])) {
+            lost_probes++;
+        }
+    }
+    AIPSTACK_ASSERT_FORCE(lost_probes > 0 && lost_probes <= 4);
+    
+    // The other connection got the probed MTU from the path MTU cache, so
+    // it sends segments of that size right away and not of PlpmtudBaseMtu
+    // (except any probes of its own, which are lost).
+    constexpr std::size_t OtherBytes = 64 * 1024;
+    other_sender.sendMore(OtherBytes);
+    platform_impl.runUntil(platform.getTime() + sim_time(5.0));
+    AIPSTACK_ASSERT_FORCE(other_sender.acked() == OtherBytes);
+    
+    std::vector<DataSeg> other_segs = monitor.segments(other_sender.getLocalPort());
+    std::size_t other_first_ok = first_delivered(other_segs);
+    AIPSTACK_ASSERT_FORCE(other_first_ok < other_segs.size());
+    AIPSTACK_ASSERT_FORCE(other_segs[other_first_ok].ip_len == probed_mtu);
+    AIPSTACK_ASSERT_FORCE(max_delivered(other_segs) == probed_mtu);
+    
+    other_sender.reset();
+    sender.reset();
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_plpmtud_test;
+    
+    test_plpmtud();
+    
+    return 0;
+}
@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Tests receive buffer management: RecvRingBuffer::resize (which preserves
+// out-of-sequence data and uses shrinkRecvBuf when shrinking) and receive
+// buffer auto-tuning. Data is sent over a simulated link and checked by the
+// receiver. Memory given up by a resize is overwritten, so using it afterwards
+// or not copying buffered data shows up as corrupted data.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/utils/TcpRingBufferUtils.h>
+#include <aipstack/sim/FrameImpairment.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_recv_buf_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::NumOosSegs::Is<8>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using TestStack = IpStack<TestStackArg>;
+using TestIface = VirtualWireEthIface<TestStackArg, TestEthIpIfaceService>;
+
+using TcpArg = TestStack::GetProtoArg<TcpApi>;
+
+constexpr Ip4Addr ServerAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr ClientAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t ServerPort = 80;
+
+constexpr std::size_t TransferBytes = 2 * 1024 * 1024;
+constexpr int WndUpdDiv = 8;
+
+char g_tx_data[TransferBytes];
+
+char pattern_byte (std::size_t pos)
+{
+    return char(pos % 251);
+}
+
+Platform::TimeType sim_time (double seconds)
+{
+    return Platform::TimeType(seconds * Platform::TimeFreq);
+}
+
+// Settings of the receiving side.
+struct ReceiverSettings {
+    // Initial receive buffer size.
+    std::size_t buf_size = 0;
+    // Maximum buffer size for auto-tuning, zero to disable.
+    std::size_t auto_tune_max = 0;
+    // Interval of random resizes, zero to disable.
+    double resize_interval = 0.0;
+};
+
+struct ReceiverStats {
+    std::size_t received = 0;
+    std::size_t resizes = 0;
+    std::size_t shrinks = 0;
+    std::size_t oos_resizes = 0;
+    std::vector<std::size_t> grow_requests;
+};
+
+// Receives data into a RecvRingBuffer, consuming and checking it right away.
+class Receiver :
+    private NonCopyable<Receiver>
+{
+    class Session : public TcpConnection<TcpArg>
+    {
+    public:
+        Session (Receiver *parent) :
+            m_parent(parent),
+            m_resize_timer(parent->m_platform,
+                AIPSTACK_BIND_MEMBER_TN(&Session::resizeTimer, this))
+        {
+            IpErr err = acceptConnection(parent->m_listener);
+            AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+            
+            std::size_t buf_size = parent->m_settings.buf_size;
+            m_buffer.reset(new char[buf_size]);
+            m_buf_size = buf_size;
+            m_ring.setup(*this, m_buffer.get(), buf_size, WndUpdDiv);
+            
+            if (parent->m_settings.auto_tune_max > 0) {
+                setRecvBufAutoTuning(buf_size, parent->m_settings.auto_tune_max);
+            }
+            if (parent->m_settings.resize_interval > 0.0) {
+                m_resize_timer.setAfter(sim_time(parent->m_settings.resize_interval));
+            }
+        }
+        
+    private:
+        void connectionAborted () override final
+        {
+            AIPSTACK_ASSERT_FORCE(false);
+        }
+        
+        void dataReceived (std::size_t amount) override final
+        {
+            ReceiverStats &stats = m_parent->m_stats;
+            
+            IpBufRef data = m_ring.getReadRange(*this);
+            AIPSTACK_ASSERT_FORCE(data.tot_len == amount);
+            
+            for (std::size_t i = 0; i < amount; i++) {
+                AIPSTACK_ASSERT_FORCE(ipBufTakeByteMut(data) ==
+                                      pattern_byte(stats.received + i));
+            }
+            stats.received += amount;
+            
+            m_ring.consumeData(*this, amount);
+        }
+        
+        void dataSent (std::size_t) override final {}
+        
+        void recvBufGrowRequested (std::size_t buf_size) override final
+        {
+            ReceiverStats &stats = m_parent->m_stats;
+            
+            AIPSTACK_ASSERT_FORCE(buf_size > m_buf_size);
+            AIPSTACK_ASSERT_FORCE(buf_size <= m_parent->m_settings.auto_tune_max);
+            AIPSTACK_ASSERT_FORCE(stats.grow_requests.empty() ||
+                                  buf_size > stats.grow_requests.back());
+            stats.grow_requests.push_back(buf_size);
+            
+            resize(buf_size);
+        }
+        
+        // Move the buffer to new memory of a random size, not below what
+        // must be kept.
+        void resizeTimer ()
+        {
+            ReceiverStats &stats = m_parent->m_stats;
+            std::mt19937 &rng = m_parent->m_rng;
+            
+            std::size_t used_len = m_ring.getReadRange(*this).tot_len;
+            std::size_t min_size =
+                used_len + getRecvBuf().tot_len - getRecvBufShrinkable();
+            std::size_t buf_size = std::uniform_int_distribution<std::size_t>(
+                4096, 3 * m_parent->m_settings.buf_size)(rng);
+            if (buf_size < min_size) {
+                buf_size = min_size;
+            }
+            
+            if (getRecvBufOosExtent() > 0) {
+                stats.oos_resizes++;
+            }
+            if (buf_size < m_buf_size) {
+                stats.shrinks++;
+            }
+            
+            resize(buf_size);
+            
+            m_resize_timer.setAfter(sim_time(m_parent->m_settings.resize_interval));
+        }
+        
+        void resize (std::size_t buf_size)
+        {
+            std::unique_ptr<char[]> buffer(new char[buf_size]);
+            m_ring.resize(*this, buffer.get(), buf_size);
+            
+            // Overwrite the old memory which must not be used any more.
+            std::memset(m_buffer.get(), 0xEE, m_buf_size);
+            
+            m_buffer = std::move(buffer);
+            m_buf_size = buf_size;
+            m_parent->m_stats.resizes++;
+        }
+        
+    private:
+        Receiver *m_parent;
+        Platform::Timer m_resize_timer;
+        std::unique_ptr<char[]> m_buffer;
+        std::size_t m_buf_size;
+        RecvRingBuffer<TcpArg> m_ring;
+    };
+    
+public:
+    Receiver (Platform platform, TcpApi<TcpArg> &tcp, ReceiverSettings const &settings,
+              unsigned seed)
+    :
+        m_platform(platform),
+        m_settings(settings),
+        m_rng(seed),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::connectionEstablished, this))
+    {
+        bool listening = m_listener.startListening(tcp, {
+            /*addr=*/ Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        });
+        AIPSTACK_ASSERT_FORCE(listening);
+        m_listener.setInitialReceiveWindow(settings.buf_size);
+    }
+    
+    ReceiverStats const & stats () const
+    {
+        return m_stats;
+    }
+    
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(m_session == nullptr);
+        m_session = std::make_unique<Session>(this);
+    }
+    
+private:
+    Platform m_platform;
+    ReceiverSettings m_settings;
+    ReceiverStats m_stats;
+    std::mt19937 m_rng;
+    TcpListener<TcpArg> m_listener;
+    std::unique_ptr<Session> m_session;
+};
+
+// Sends TransferBytes of the pattern.
+class Sender : public TcpConnection<TcpArg>
+{
+public:
+    Sender (TcpApi<TcpArg> &tcp) :
+        m_node{g_tx_data, TransferBytes, nullptr}
+    {
+        TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        IpErr err = startConnection(tcp, args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        setSendBuf({&m_node, 0, 0});
+    }
+    
+private:
+    void connectionAborted () override final
+    {
+        AIPSTACK_ASSERT_FORCE(false);
+    }
+    
+    void connectionEstablished () override final
+    {
+        extendSendBuf(TransferBytes);
+        sendPush();
+    }
+    
+    void dataReceived (std::size_t) override final {}
+    
+    void dataSent (std::size_t) override final {}
+    
+private:
+    IpBufNode m_node;
+};
+
+struct LinkSettings {
+    double bandwidth_bps = 0.0;
+    double latency_sec = 0.0;
+    double loss_prob = 0.0;
+};
+
+// Run a transfer, returning the simulated time it took.
+double run_transfer (LinkSettings const &link, ReceiverSettings const &settings,
+                     unsigned seed, ReceiverStats &out_stats)
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    VirtualWireParams wire_params;
+    wire_params.bandwidth_bps = link.bandwidth_bps;
+    wire_params.latency_sec = link.latency_sec;
+    VirtualWire<SimulatedPlatformImpl> wire(wire_params);
+    
+    TestStack server_stack(platform);
+    TestStack client_stack(platform);
+    client_stack.getProtoApi<TcpApi>().setEphemeralPortKey(
+        SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    TestIface server_iface(platform, &server_stack, wire, MacAddr(2, 0, 0, 0, 0, 1));
+    TestIface client_iface(platform, &client_stack, wire, MacAddr(2, 0, 0, 0, 0, 2));
+    server_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ServerAddr));
+    client_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ClientAddr));
+    
+    if (link.loss_prob > 0.0) {
+        FrameImpairmentParams imp_params;
+        imp_params.seed = seed;
+        imp_params.loss_model = FrameLossModel::Bernoulli;
+        imp_params.loss_prob = link.loss_prob;
+        server_iface.setRxImpairment(imp_params);
+    }
+    
+    Receiver receiver(platform, server_stack.getProtoApi<TcpApi>(), settings, seed);
+    Sender sender(client_stack.getProtoApi<TcpApi>());
+    
+    Platform::TimeType start_time = platform.getTime();
+    while (receiver.stats().received < TransferBytes) {
+        AIPSTACK_ASSERT_FORCE(platform_impl.runOne());
+        AIPSTACK_ASSERT_FORCE(platform.getTime() - start_time < sim_time(600.0));
+    }
+    double elapsed = double(platform.getTime() - start_time) / Platform::TimeFreq;
+    
+    out_stats = receiver.stats();
+    
+    return elapsed;
+}
+
+void test_resize ()
+{
+    LinkSettings link;
+    link.bandwidth_bps = 50e6;
+    link.latency_sec = 0.005;
+    link.loss_prob = 0.03;
+    
+    ReceiverSettings settings;
+    settings.buf_size = 32 * 1024;
+    settings.resize_interval = 0.003;
+    
+    std::size_t resizes = 0;
+    std::size_t shrinks = 0;
+    std::size_t oos_resizes = 0;
+    
+    for (unsigned seed = 1; seed <= 5; seed++) {
+        ReceiverStats stats;
+        run_transfer(link, settings, seed, stats);
+        resizes += stats.resizes;
+        shrinks += stats.shrinks;
+        oos_resizes += stats.oos_resizes;
+    }
+    
+    // Both growing and shrinking happened, also with out-of-sequence data.
+    AIPSTACK_ASSERT_FORCE(shrinks > 0);
+    AIPSTACK_ASSERT_FORCE(resizes > shrinks);
+    AIPSTACK_ASSERT_FORCE(oos_resizes > 0);
+}
+
+void test_auto_tune ()
+{
+    // The bandwidth-delay product is 250 KB.
+    LinkSettings link;
+    link.bandwidth_bps = 100e6;
+    link.latency_sec = 0.01;
+    
+    ReceiverSettings settings;
+    settings.buf_size = 8 * 1024;
+    
+    // Without auto-tuning the window limits the rate to 8 KB per round trip.
+    ReceiverStats fixed_stats;
+    double fixed_time = run_transfer(link, settings, 1, fixed_stats);
+    AIPSTACK_ASSERT_FORCE(fixed_stats.grow_requests.empty());
+    
+    settings.auto_tune_max = 1024 * 1024;
+    ReceiverStats tuned_stats;
+    double tuned_time = run_transfer(link, settings, 1, tuned_stats);
+    
+    // The buffer was grown to cover the bandwidth-delay product, and the
+    // transfer was much faster.
+    AIPSTACK_ASSERT_FORCE(!tuned_stats.grow_requests.empty());
+    AIPSTACK_ASSERT_FORCE(tuned_stats.grow_requests.back() >= 250 * 1000);
+    AIPSTACK_ASSERT_FORCE(tuned_time * 5.0 < fixed_time);
+    
+    // Growth stops at the maximum.
+    settings.auto_tune_max = 64 * 1024;
+    ReceiverStats limited_stats;
+    run_transfer(link, settings, 1, limited_stats);
+    AIPSTACK_ASSERT_FORCE(!limited_stats.grow_requests.empty());
+    AIPSTACK_ASSERT_FORCE(limited_stats.grow_requests.back() == 64 * 1024);
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_recv_buf_test;
+    
+    for (std::size_t pos = 0; pos < TransferBytes; pos++) {
+        g_tx_data[pos] = pattern_byte(pos);
+    }
+    
+    test_resize();
+    test_auto_tune();
+    
+    return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/tcp/TcpSegSamples.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_seg_samples_test {
+
+constexpr int NumEntries = 8;
+
+struct Info {
+    std::uint32_t seg_index;
+};
+
+using Samples = TcpSegSamples<std::uint16_t, NumEntries, Info>;
+
+struct Segment {
+    TcpSeqNum seq;
+    TcpSeqNum end;
+    std::uint16_t time;
+};
+
+// Fewer segments than entries are all sampled with their exact times.
+void test_basic ()
+{
+    Samples samples;
+    samples.reset();
+    
+    TcpSeqNum start = TcpSeqNum(0xFFFFF000);
+    auto seq = [&](TcpSeqInt offset) { return start + offset; };
+    
+    for (std::uint32_t i = 0; i < 4; i++) {
+        samples.sent(start, seq(1000 * i), seq(1000 * (i + 1)), std::uint16_t(10 + i),
+                     Info{i});
+    }
+    
+    std::uint16_t time;
+    Info info;
+    AIPSTACK_ASSERT_FORCE(samples.getLastAcked(start, seq(999), time, info) == 0);
+    AIPSTACK_ASSERT_FORCE(samples.getLastAcked(start, seq(2500), time, info) == 2);
+    AIPSTACK_ASSERT_FORCE(time == 11 && info.seg_index == 1);
+    
+    samples.acked(start, seq(2500));
+    TcpSeqNum snd_una = seq(2500);
+    
+    // Retransmitting [2500, 3000) gives the entry the new time.
+    samples.sent(snd_una, seq(2500), seq(3000), 50, Info{2});
+    AIPSTACK_ASSERT_FORCE(samples.getLastAcked(snd_una, seq(4000), time, info) == 2);
+    AIPSTACK_ASSERT_FORCE(time == 13 && info.seg_index == 3);
+    AIPSTACK_ASSERT_FORCE(samples.getLastAcked(snd_una, seq(3000), time, info) == 1);
+    AIPSTACK_ASSERT_FORCE(time == 50 && info.seg_index == 2);
+}
+
+// With many segments outstanding, the samples which are kept always have the
+// exact time of their segment, and entries are reused as they are acked.
+void test_random ()
+{
+    std::mt19937 rng(1);
+    
+    Samples samples;
+    samples.reset();
+    
+    std::vector<Segment> segs;
+    TcpSeqNum snd_una = TcpSeqNum(0xFFFF0000);
+    TcpSeqNum snd_nxt = snd_una;
+    std::uint16_t now = 0;
+    std::size_t num_sampled = 0;
+    
+    for (int iter = 0; iter < 100000; iter++) {
+        now++;
+        
+        if (rng() % 2 == 0 && segs.size() < 100) {
+            // Send a new segment.
+            TcpSeqInt len = 1 + rng() % 1460;
+            Info info{std::uint32_t(iter)};
+            samples.sent(snd_una, snd_nxt, snd_nxt + len, now, info);
+            segs.push_back(Segment{snd_nxt, snd_nxt + len, now});
+            snd_nxt += len;
+        }
+        else if (!segs.empty() && rng() % 8 == 0) {
+            // Retransmit an outstanding segment.
+            Segment &seg = segs[rng() % segs.size()];
+            TcpSeqNum seq = seg.seq.mod_lt(snd_una) ? snd_una : seg.seq;
+            if (seq != seg.end) {
+                samples.sent(snd_una, seq, seg.end, now, Info{0xFFFFFFFF});
+                seg.time = now;
+            }
+        }
+        else if (!segs.empty()) {
+            // Acknowledge a random number of bytes.
+            TcpSeqInt flight = snd_nxt - snd_una;
+            TcpSeqNum ack = snd_una + (1 + rng() % flight);
+            
+            std::size_t num_acked_segs = 0;
+            while (num_acked_segs < segs.size() &&
+                   snd_una.ref_lte(segs[num_acked_segs].end, ack))
+            {
+                num_acked_segs++;
+            }
+            
+            std::uint16_t time;
+            Info info;
+            std::size_t num_acked = samples.getLastAcked(snd_una, ack, time, info);
+            AIPSTACK_ASSERT_FORCE(num_acked <= num_acked_segs);
+            
+            if (num_acked > 0) {
+                // The time is exact for the segment ending where the sample ends.
+                bool found = false;
+                for (std::size_t i = 0; i < num_acked_segs; i++) {
+                    if (segs[i].time == time) {
+                        found = true;
+                    }
+                }
+                AIPSTACK_ASSERT_FORCE(found);
+                num_sampled += num_acked;
+            }
+            
+            samples.acked(snd_una, ack);
+            segs.erase(segs.begin(), segs.begin() + num_acked_segs);
+            
+            // Partially acked segments start at the new snd_una.
+            snd_una = ack;
+        }
+    }
+    
+    // Entries were reused, many more segments than entries were sampled.
+    AIPSTACK_ASSERT_FORCE(num_sampled > 100 * NumEntries);
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_seg_samples_test;
+    
+    test_basic();
+    test_random();
+    
+    return 0;
+}
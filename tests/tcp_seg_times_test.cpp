@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Tests TcpSegTimes, the transmit times used for RACK loss detection, against
+// a model which keeps the exact time of every outstanding segment. The time
+// reported for the first unacknowledged segment must be exact while there are
+// enough entries, and otherwise must never be earlier than the real one.
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/tcp/TcpSegTimes.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_seg_times_test {
+
+constexpr int NumEntries = 4;
+
+using Times = TcpSegTimes<std::uint16_t, NumEntries>;
+
+struct Segment {
+    TcpSeqNum seq;
+    TcpSeqNum end;
+    std::uint16_t time;
+};
+
+std::uint16_t first_time (Times const &times)
+{
+    std::uint16_t time;
+    AIPSTACK_ASSERT_FORCE(times.getFirstTime(time));
+    return time;
+}
+
+// With no more segments than entries, each keeps its own time.
+void test_basic ()
+{
+    Times times;
+    times.reset();
+    
+    std::uint16_t time;
+    AIPSTACK_ASSERT_FORCE(!times.getFirstTime(time));
+    
+    TcpSeqNum start = TcpSeqNum(0xFFFFF000);
+    auto seq = [&](TcpSeqInt offset) { return start + offset; };
+    
+    for (TcpSeqInt i = 0; i < NumEntries; i++) {
+        times.sent(start, seq(1000 * i), seq(1000 * (i + 1)), std::uint16_t(10 + i));
+    }
+    AIPSTACK_ASSERT_FORCE(first_time(times) == 10);
+    
+    // Acking up to the end of a segment removes it.
+    times.acked(start, seq(2000));
+    TcpSeqNum snd_una = seq(2000);
+    AIPSTACK_ASSERT_FORCE(first_time(times) == 12);
+    
+    // A partial ACK keeps the time of the partially acked segment.
+    times.acked(snd_una, seq(2500));
+    snd_una = seq(2500);
+    AIPSTACK_ASSERT_FORCE(first_time(times) == 12);
+    
+    // Retransmitting the rest of it gives it the new time, and does not
+    // affect the next segment.
+    times.sent(snd_una, seq(2500), seq(3000), 50);
+    AIPSTACK_ASSERT_FORCE(first_time(times) == 50);
+    times.acked(snd_una, seq(3000));
+    snd_una = seq(3000);
+    AIPSTACK_ASSERT_FORCE(first_time(times) == 13);
+    
+    // Acking everything leaves no entries.
+    times.acked(snd_una, seq(4000));
+    AIPSTACK_ASSERT_FORCE(!times.getFirstTime(time));
+}
+
+// When all entries are used, new segments are merged into the last entry,
+// which takes the later time.
+void test_merge ()
+{
+    Times times;
+    times.reset();
+    
+    TcpSeqNum start = TcpSeqNum(0x12345678);
+    auto seq = [&](TcpSeqInt offset) { return start + offset; };
+    
+    for (TcpSeqInt i = 0; i < 2 * NumEntries; i++) {
+        times.sent(start, seq(100 * i), seq(100 * (i + 1)), std::uint16_t(10 + i));
+    }
+    
+    // The first NumEntries - 1 segments have exact times.
+    TcpSeqNum snd_una = start;
+    for (TcpSeqInt i = 0; i < NumEntries - 1; i++) {
+        AIPSTACK_ASSERT_FORCE(first_time(times) == 10 + i);
+        times.acked(snd_una, seq(100 * (i + 1)));
+        snd_una = seq(100 * (i + 1));
+    }
+    
+    // The remaining segments are one entry with the time of the last one.
+    std::uint16_t last_time = std::uint16_t(10 + 2 * NumEntries - 1);
+    AIPSTACK_ASSERT_FORCE(first_time(times) == last_time);
+    
+    // Partial ACKs within the merged entry keep it, even past the end of the
+    // segment that was first in it.
+    times.acked(snd_una, seq(100 * NumEntries + 50));
+    snd_una = seq(100 * NumEntries + 50);
+    AIPSTACK_ASSERT_FORCE(first_time(times) == last_time);
+    
+    // Retransmitting any part of the merged entry updates all of it.
+    times.sent(snd_una, seq(100 * (2 * NumEntries - 2)), seq(100 * (2 * NumEntries - 1)), 90);
+    AIPSTACK_ASSERT_FORCE(first_time(times) == 90);
+    
+    // Now that entries are free again, new segments get their own entries.
+    times.acked(snd_una, seq(100 * 2 * NumEntries));
+    snd_una = seq(100 * 2 * NumEntries);
+    std::uint16_t time;
+    AIPSTACK_ASSERT_FORCE(!times.getFirstTime(time));
+    
+    TcpSeqInt base = 100 * 2 * NumEntries;
+    times.sent(snd_una, seq(base), seq(base + 100), 100);
+    times.sent(snd_una, seq(base + 100), seq(base + 200), 101);
+    AIPSTACK_ASSERT_FORCE(first_time(times) == 100);
+    times.acked(snd_una, seq(base + 100));
+    snd_una = seq(base + 100);
+    AIPSTACK_ASSERT_FORCE(first_time(times) == 101);
+}
+
+// Random sending, retransmission and partial ACKs compared with the model.
+// With max_segs <= NumEntries times must be exact, otherwise not earlier than
+// the real time (a merged entry may keep the time of a retransmission or of a
+// later segment after those have been acked).
+void test_random (std::size_t max_segs, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    
+    Times times;
+    times.reset();
+    
+    std::vector<Segment> segs;
+    TcpSeqNum snd_una = TcpSeqNum(0xFFFF0000);
+    TcpSeqNum snd_nxt = snd_una;
+    std::uint16_t now = 0;
+    std::size_t num_later = 0;
+    
+    for (int iter = 0; iter < 100000; iter++) {
+        // Time wraps around during the test.
+        now++;
+        
+        if (rng() % 2 == 0 && segs.size() < max_segs) {
+            // Send a new segment.
+            TcpSeqInt len = 1 + rng() % 1460;
+            times.sent(snd_una, snd_nxt, snd_nxt + len, now);
+            segs.push_back(Segment{snd_nxt, snd_nxt + len, now});
+            snd_nxt += len;
+        }
+        else if (!segs.empty() && rng() % 4 == 0) {
+            // Retransmit the unacked part of an outstanding segment.
+            Segment &seg = segs[rng() % segs.size()];
+            TcpSeqNum seq = seg.seq.mod_lt(snd_una) ? snd_una : seg.seq;
+            times.sent(snd_una, seq, seg.end, now);
+            seg.time = now;
+        }
+        else if (!segs.empty()) {
+            // Acknowledge a random number of bytes, often partially acking
+            // a segment.
+            TcpSeqInt flight = snd_nxt - snd_una;
+            TcpSeqNum ack = snd_una + (1 + rng() % flight);
+            
+            times.acked(snd_una, ack);
+            
+            std::size_t num_acked_segs = 0;
+            while (num_acked_segs < segs.size() &&
+                   snd_una.ref_lte(segs[num_acked_segs].end, ack))
+            {
+                num_acked_segs++;
+            }
+            segs.erase(segs.begin(), segs.begin() + num_acked_segs);
+            snd_una = ack;
+        }
+        
+        std::uint16_t time;
+        bool have_time = times.getFirstTime(time);
+        AIPSTACK_ASSERT_FORCE(have_time == !segs.empty());
+        
+        if (have_time) {
+            // Compare ages so that time wrap-around does not matter.
+            std::uint16_t age = std::uint16_t(now - time);
+            std::uint16_t real_age = std::uint16_t(now - segs[0].time);
+            
+            if (max_segs <= NumEntries) {
+                AIPSTACK_ASSERT_FORCE(age == real_age);
+            } else {
+                AIPSTACK_ASSERT_FORCE(age <= real_age);
+                if (age < real_age) {
+                    num_later++;
+                }
+            }
+        }
+    }
+    
+    // With more segments than entries, merging did happen.
+    AIPSTACK_ASSERT_FORCE((max_segs > NumEntries) == (num_later > 0));
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_seg_times_test;
+    
+    test_basic();
+    test_merge();
+    
+    for (unsigned seed = 1; seed <= 3; seed++) {
+        test_random(NumEntries, seed);
+        test_random(4 * NumEntries, seed);
+    }
+    
+    return 0;
+}
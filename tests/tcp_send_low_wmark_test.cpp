@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Tests the reporting of acknowledged data through dataSent, with and without
+// a send low watermark. A monitor on the wire records the ACKs of the server,
+// which arrive at the client in bursts (the wire has no bandwidth limit). From
+// these the test knows how much data was acked after each burst, so it can
+// check that with a low watermark dataSent is called at most once per burst,
+// exactly when the unreported data reaches the watermark or all data has been
+// acked, and that all data is reported before the FIN. It also checks that
+// the connection may be moved to another object or reset from dataSent.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/MinMax.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_send_low_wmark_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using TestStack = IpStack<TestStackArg>;
+using TestIface = VirtualWireEthIface<TestStackArg, TestEthIpIfaceService>;
+
+using TcpArg = TestStack::GetProtoArg<TcpApi>;
+
+constexpr Ip4Addr ServerAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr ClientAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t ServerPort = 80;
+
+constexpr MacAddr ServerMac = MacAddr(2, 0, 0, 0, 0, 1);
+constexpr MacAddr ClientMac = MacAddr(2, 0, 0, 0, 0, 2);
+
+// Not a multiple of the MSS or the low watermark, so the last part of the
+// data is reported because the send buffer has drained.
+constexpr std::size_t TransferBytes = 200 * 1024 + 123;
+constexpr std::size_t RecvBufSize = 64 * 1024;
+
+constexpr std::size_t LowWmark = 16 * 1024;
+
+// The MSS with the default MTU of the VirtualWire.
+constexpr std::size_t Mss = 1460;
+
+// Bandwidth of the wire for the tests where the ACKs are spread out.
+constexpr double BandwidthBps = 20e6;
+
+char g_tx_data[TransferBytes];
+
+// Accepts a connection and discards the data.
+class Receiver :
+    private NonCopyable<Receiver>
+{
+    class Session : public TcpConnection<TcpArg>
+    {
+    public:
+        Session (Receiver *parent) :
+            m_parent(parent),
+            m_node{m_buffer, RecvBufSize, &m_node}
+        {
+            IpErr err = acceptConnection(parent->m_listener);
+            AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+            setRecvBuf({&m_node, 0, RecvBufSize});
+        }
+        
+    private:
+        void connectionAborted () override final
+        {
+            m_parent->m_aborted = true;
+        }
+        
+        void dataReceived (std::size_t amount) override final
+        {
+            if (amount == 0) {
+                closeSending();
+            }
+            extendRecvBuf(amount);
+        }
+        
+        void dataSent (std::size_t) override final {}
+        
+    private:
+        Receiver *m_parent;
+        IpBufNode m_node;
+        char m_buffer[RecvBufSize];
+    };
+    
+public:
+    Receiver (TcpApi<TcpArg> &tcp) :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::connectionEstablished, this)),
+        m_aborted(false)
+    {
+        bool listening = m_listener.startListening(tcp, {
+            /*addr=*/ Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        });
+        AIPSTACK_ASSERT_FORCE(listening);
+        m_listener.setInitialReceiveWindow(RecvBufSize);
+    }
+    
+    bool aborted () const { return m_aborted; }
+    
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(m_session == nullptr);
+        m_session = std::make_unique<Session>(this);
+    }
+    
+private:
+    TcpListener<TcpArg> m_listener;
+    std::unique_ptr<Session> m_session;
+    bool m_aborted;
+};
+
+// What a Sender does from dataSent once the given amount has been reported.
+enum class SentAction {None, Move, Reset};
+
+// A dataSent call.
+struct SentReport {
+    Platform::TimeType time;
+    std::size_t amount;
+};
+
+class Sender;
+
+// State shared by the Sender objects which a connection is moved between.
+struct SendState {
+    Platform platform;
+    IpBufNode node;
+    std::vector<SentReport> reports;
+    std::size_t reported;
+    bool end_sent;
+    SentAction action;
+    std::size_t action_after;
+    Sender *current;
+    Sender *spare;
+};
+
+// Sends TransferBytes followed by a FIN, recording the dataSent calls.
+class Sender : public TcpConnection<TcpArg>
+{
+public:
+    Sender (SendState *state) :
+        m_state(state)
+    {}
+    
+    void start (TcpApi<TcpArg> &tcp, std::size_t low_wmark)
+    {
+        TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        IpErr err = startConnection(tcp, args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        setSendBuf({&m_state->node, 0, 0});
+        setSendLowWatermark(low_wmark);
+    }
+    
+private:
+    void connectionAborted () override final
+    {
+        AIPSTACK_ASSERT_FORCE(false);
+    }
+    
+    void connectionEstablished () override final
+    {
+        extendSendBuf(TransferBytes);
+        closeSending();
+    }
+    
+    void dataReceived (std::size_t) override final {}
+    
+    void dataSent (std::size_t amount) override final
+    {
+        SendState &state = *m_state;
+        AIPSTACK_ASSERT_FORCE(state.current == this);
+        AIPSTACK_ASSERT_FORCE(!state.end_sent);
+        
+        state.reports.push_back({state.platform.getTime(), amount});
+        if (amount == 0) {
+            // All data must have been reported before the FIN.
+            AIPSTACK_ASSERT_FORCE(state.reported == TransferBytes);
+            state.end_sent = true;
+            return;
+        }
+        
+        state.reported += amount;
+        AIPSTACK_ASSERT_FORCE(state.reported <= TransferBytes);
+        AIPSTACK_ASSERT_FORCE(getSendBuf().tot_len == TransferBytes - state.reported);
+        
+        if (state.action != SentAction::None && state.reported >= state.action_after) {
+            if (state.action == SentAction::Move) {
+                state.spare->moveConnection(this);
+                AIPSTACK_ASSERT_FORCE(isInit());
+                state.current = state.spare;
+            } else {
+                reset();
+                state.current = nullptr;
+            }
+            state.action = SentAction::None;
+        }
+    }
+    
+private:
+    SendState *m_state;
+};
+
+// An ACK from the server, with the time when it arrived at the client.
+struct AckRecord {
+    Platform::TimeType time;
+    TcpSeqNum ack;
+};
+
+// Records the ACKs of the server, which arrive at the client at the same
+// time as here.
+class Monitor :
+    private NonCopyable<Monitor>
+{
+    using WirePort = VirtualWire<SimulatedPlatformImpl>::Port;
+    
+public:
+    Monitor (Platform platform, VirtualWire<SimulatedPlatformImpl> &wire) :
+        m_platform(platform),
+        m_port(platform, wire, AIPSTACK_BIND_MEMBER_TN(&Monitor::frameReceived, this)),
+        m_have_data_start(false)
+    {}
+    
+    // Amount of data acked by an ACK, excluding the FIN.
+    std::size_t ackedData (TcpSeqNum ack) const
+    {
+        AIPSTACK_ASSERT_FORCE(m_have_data_start);
+        return MinValueU(TransferBytes, TcpSeqInt(ack - m_data_start));
+    }
+    
+    std::vector<AckRecord> const & acks () const { return m_acks; }
+    
+private:
+    void frameReceived (IpBufRef frame)
+    {
+        constexpr std::size_t MaxFrame = 1600;
+        if (frame.tot_len < EthHeader::Size + Ip4Header::Size + Tcp4Header::Size ||
+            frame.tot_len > MaxFrame)
+        {
+            return;
+        }
+        char data[MaxFrame];
+        ipBufTakeBytes(frame, frame.tot_len, data);
+        
+        auto eth_header = EthHeader::MakeRef(data);
+        if (eth_header.get(EthHeader::EthType()) != EthType::Ipv4) {
+            return;
+        }
+        bool from_server = eth_header.get(EthHeader::SrcMac()) == ServerMac;
+        
+        char *ip_data = data + EthHeader::Size;
+        auto ip4_header = Ip4Header::MakeRef(ip_data);
+        if (ip4_header.get(Ip4Header::Proto()) != Ip4Protocol::Tcp) {
+            return;
+        }
+        std::size_t ihl = 4 * std::size_t(
+            (ip4_header.get(Ip4Header::VersionIhlDscpEcn()) >> 8) & Ip4IhlMask);
+        
+        auto tcp_header = Tcp4Header::MakeRef(ip_data + ihl);
+        Tcp4Flags flags = tcp_header.get(Tcp4Header::OffsetFlags());
+        
+        if (!from_server) {
+            // The data starts after the SYN of the client.
+            if ((flags & Tcp4Flags::Syn) != Tcp4Flags()) {
+                m_data_start = tcp_header.get(Tcp4Header::SeqNum()) + TcpSeqInt(1);
+                m_have_data_start = true;
+            }
+            return;
+        }
+        
+        if ((flags & Tcp4Flags::Syn) == Tcp4Flags() &&
+            (flags & Tcp4Flags::Ack) != Tcp4Flags())
+        {
+            m_acks.push_back({m_platform.getTime(), tcp_header.get(Tcp4Header::AckNum())});
+        }
+    }
+    
+private:
+    Platform m_platform;
+    WirePort m_port;
+    bool m_have_data_start;
+    TcpSeqNum m_data_start;
+    std::vector<AckRecord> m_acks;
+};
+
+struct TransferResult {
+    std::vector<SentReport> reports;
+    std::size_t num_bursts;
+    std::size_t num_acks;
+};
+
+// Run the transfer and check the dataSent calls against the ACKs. Unless the
+// action is Reset, the transfer must complete. With no bandwidth limit, the
+// ACKs for a window of data arrive together, otherwise they are spread out.
+TransferResult test_transfer (double bandwidth_bps, std::size_t low_wmark,
+                              SentAction action = SentAction::None,
+                              std::size_t action_after = 0)
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    VirtualWireParams wire_params;
+    wire_params.bandwidth_bps = bandwidth_bps;
+    wire_params.latency_sec = 0.005;
+    wire_params.queue_depth = 1024;
+    VirtualWire<SimulatedPlatformImpl> wire(wire_params);
+    
+    Monitor monitor(platform, wire);
+    
+    TestStack server_stack(platform);
+    TestStack client_stack(platform);
+    client_stack.getProtoApi<TcpApi>().setEphemeralPortKey(
+        SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    TestIface server_iface(platform, &server_stack, wire, ServerMac);
+    TestIface client_iface(platform, &client_stack, wire, ClientMac);
+    server_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ServerAddr));
+    client_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ClientAddr));
+    
+    Receiver receiver(server_stack.getProtoApi<TcpApi>());
+    
+    SendState state{platform, {g_tx_data, TransferBytes, nullptr}, {}, 0, false,
+                    action, action_after, nullptr, nullptr};
+    Sender sender(&state);
+    Sender spare_sender(&state);
+    state.current = &sender;
+    state.spare = &spare_sender;
+    sender.start(client_stack.getProtoApi<TcpApi>(), low_wmark);
+    
+    platform_impl.runUntil(platform.getTime() + Platform::TimeType(10.0 * Platform::TimeFreq));
+    
+    if (action == SentAction::Reset) {
+        AIPSTACK_ASSERT_FORCE(state.current == nullptr && sender.isInit());
+        AIPSTACK_ASSERT_FORCE(state.reported >= action_after);
+        AIPSTACK_ASSERT_FORCE(state.reported < TransferBytes);
+        return TransferResult{};
+    }
+    
+    AIPSTACK_ASSERT_FORCE(state.end_sent);
+    AIPSTACK_ASSERT_FORCE(!receiver.aborted());
+    if (action == SentAction::Move) {
+        AIPSTACK_ASSERT_FORCE(state.current == &spare_sender && sender.isInit());
+    }
+    
+    // Go through the bursts of ACKs which acked more data (ACKs arriving at
+    // the same time are processed together).
+    std::vector<AckRecord> const &acks = monitor.acks();
+    std::size_t report_index = 0;
+    std::size_t reported = 0;
+    std::size_t acked = 0;
+    std::size_t num_bursts = 0;
+    std::size_t num_acks = 0;
+    
+    for (std::size_t i = 0; i < acks.size();) {
+        Platform::TimeType time = acks[i].time;
+        std::size_t burst_acks = 0;
+        for (; i < acks.size() && acks[i].time == time; i++) {
+            std::size_t ack_acked = monitor.ackedData(acks[i].ack);
+            if (ack_acked > acked) {
+                acked = ack_acked;
+                burst_acks++;
+            }
+        }
+        if (burst_acks == 0) {
+            continue;
+        }
+        num_bursts++;
+        num_acks += burst_acks;
+        
+        // Reports are only made due to ACKs.
+        AIPSTACK_ASSERT_FORCE(report_index == state.reports.size() ||
+                              state.reports[report_index].time >= time);
+        
+        // Count the reports of data made for this burst.
+        std::size_t burst_reports = 0;
+        std::size_t unreported = acked - reported;
+        for (; report_index < state.reports.size() &&
+               state.reports[report_index].time == time &&
+               state.reports[report_index].amount > 0; report_index++)
+        {
+            reported += state.reports[report_index].amount;
+            burst_reports++;
+        }
+        
+        if (low_wmark == 0) {
+            // Each ACK is reported right away.
+            AIPSTACK_ASSERT_FORCE(burst_reports == burst_acks);
+            AIPSTACK_ASSERT_FORCE(reported == acked);
+        } else {
+            // One report of all unreported data once it reaches the watermark
+            // or all data is acked.
+            bool report_due = unreported >= low_wmark || acked == TransferBytes;
+            AIPSTACK_ASSERT_FORCE(burst_reports == (report_due ? 1 : 0));
+            AIPSTACK_ASSERT_FORCE(reported == (report_due ? acked : acked - unreported));
+        }
+    }
+    
+    // All data reports were checked, then the FIN was reported.
+    AIPSTACK_ASSERT_FORCE(acked == TransferBytes && reported == TransferBytes);
+    AIPSTACK_ASSERT_FORCE(report_index == state.reports.size() - 1);
+    AIPSTACK_ASSERT_FORCE(state.reports[report_index].amount == 0);
+    
+    spare_sender.reset();
+    sender.reset();
+    
+    return TransferResult{state.reports, num_bursts, num_acks};
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_send_low_wmark_test;
+    
+    // Without a watermark, there is a report for each ACK.
+    TransferResult res = test_transfer(0.0, 0);
+    AIPSTACK_ASSERT_FORCE(res.reports.size() == res.num_acks + 1);
+    
+    // With a watermark, the ACKs which arrive together are reported together.
+    res = test_transfer(0.0, 1);
+    AIPSTACK_ASSERT_FORCE(res.num_acks > 2 * res.num_bursts);
+    AIPSTACK_ASSERT_FORCE(res.reports.size() == res.num_bursts + 1);
+    
+    // When the ACKs are spread out, reports are delayed until the watermark.
+    res = test_transfer(BandwidthBps, LowWmark);
+    AIPSTACK_ASSERT_FORCE(res.num_bursts > TransferBytes / (2 * Mss));
+    AIPSTACK_ASSERT_FORCE(res.reports.size() - 1 <= TransferBytes / LowWmark + 1);
+    
+    // The connection can be moved or reset from dataSent, both when it is
+    // called during input processing and when it is called later due to the
+    // watermark.
+    for (std::size_t low_wmark : {std::size_t(0), LowWmark}) {
+        test_transfer(BandwidthBps, low_wmark, SentAction::Move, TransferBytes / 2);
+        test_transfer(BandwidthBps, low_wmark, SentAction::Reset, TransferBytes / 2);
+    }
+    
+    return 0;
+}
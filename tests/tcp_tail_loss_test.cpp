@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Tests recovery of lost segments at the end of a short transfer by the tail
+// loss probe and RACK (RFC 8985). After a warm-up exchange which gives an RTT
+// estimate, the sender sends a burst and the last one or two data segments are
+// dropped. The probe is sent 2*SRTT after the last ACK (plus the worst case
+// delayed ACK time if only one segment is in flight), so the transfer
+// completes before the retransmission timeout would fire. A third port on the
+// wire observes the frames and drops segments by enabling a lossy impairment
+// on the receiver just for those frames.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/misc/SipHash.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/BufUtils.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Tcp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/tcp/IpTcpProto.h>
+#include <aipstack/tcp/TcpApi.h>
+#include <aipstack/tcp/TcpListener.h>
+#include <aipstack/tcp/TcpConnection.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/sim/FrameImpairment.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_tail_loss_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpTcpProtoService<
+        IpTcpProtoOptions::NumTcpPcbs::Is<4>,
+        IpTcpProtoOptions::PcbIndexService::Is<IndexService>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using TestStack = IpStack<TestStackArg>;
+using TestIface = VirtualWireEthIface<TestStackArg, TestEthIpIfaceService>;
+
+using TcpArg = TestStack::GetProtoArg<TcpApi>;
+
+constexpr Ip4Addr ServerAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr ClientAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t ServerPort = 80;
+
+constexpr std::size_t WarmupBytes = 8 * 1024;
+constexpr std::size_t TransferBytes = 64 * 1024;
+constexpr std::size_t RecvBufSize = 64 * 1024;
+
+// MSS for the Ethernet MTU of the link.
+constexpr std::size_t Mss = 1460;
+
+char g_tx_data[TransferBytes];
+
+char pattern_byte (std::size_t pos)
+{
+    return char(pos % 251);
+}
+
+Platform::TimeType sim_time (double seconds)
+{
+    return Platform::TimeType(seconds * Platform::TimeFreq);
+}
+
+double to_seconds (Platform::TimeType time)
+{
+    return double(time) / Platform::TimeFreq;
+}
+
+// Receives data and checks it, remembering when data last arrived.
+class Receiver :
+    private NonCopyable<Receiver>
+{
+    class Session : public TcpConnection<TcpArg>
+    {
+    public:
+        Session (Receiver *parent) :
+            m_parent(parent),
+            m_node{m_buffer, RecvBufSize, &m_node}
+        {
+            IpErr err = acceptConnection(parent->m_listener);
+            AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+            setRecvBuf({&m_node, 0, RecvBufSize});
+        }
+        
+    private:
+        void connectionAborted () override final
+        {
+            AIPSTACK_ASSERT_FORCE(false);
+        }
+        
+        void dataReceived (std::size_t amount) override final
+        {
+            for (std::size_t i = 0; i < amount; i++) {
+                std::size_t pos = m_parent->m_received + i;
+                AIPSTACK_ASSERT_FORCE(m_buffer[pos % RecvBufSize] == pattern_byte(pos));
+            }
+            m_parent->m_received += amount;
+            m_parent->m_last_time = m_parent->m_platform.getTime();
+            extendRecvBuf(amount);
+        }
+        
+        void dataSent (std::size_t) override final {}
+        
+    private:
+        Receiver *m_parent;
+        IpBufNode m_node;
+        char m_buffer[RecvBufSize];
+    };
+    
+public:
+    Receiver (Platform platform, TcpApi<TcpArg> &tcp) :
+        m_platform(platform),
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::connectionEstablished, this)),
+        m_received(0),
+        m_last_time(0)
+    {
+        bool listening = m_listener.startListening(tcp, {
+            /*addr=*/ Ip4Addr::ZeroAddr(),
+            /*port=*/ ServerPort,
+            /*max_pcbs=*/ 1
+        });
+        AIPSTACK_ASSERT_FORCE(listening);
+        m_listener.setInitialReceiveWindow(RecvBufSize);
+    }
+    
+    std::size_t received () const { return m_received; }
+    Platform::TimeType lastTime () const { return m_last_time; }
+    
+private:
+    void connectionEstablished ()
+    {
+        AIPSTACK_ASSERT_FORCE(m_session == nullptr);
+        m_session = std::make_unique<Session>(this);
+    }
+    
+private:
+    Platform m_platform;
+    TcpListener<TcpArg> m_listener;
+    std::unique_ptr<Session> m_session;
+    std::size_t m_received;
+    Platform::TimeType m_last_time;
+};
+
+// Sends the pattern in parts as requested.
+class Sender : public TcpConnection<TcpArg>
+{
+public:
+    Sender (TcpApi<TcpArg> &tcp) :
+        m_node{g_tx_data, TransferBytes, nullptr},
+        m_established(false),
+        m_acked(0)
+    {
+        TcpStartConnectionArgs<TcpArg> args;
+        args.addr = ServerAddr;
+        args.port = ServerPort;
+        IpErr err = startConnection(tcp, args);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        setSendBuf({&m_node, 0, 0});
+    }
+    
+    void sendMore (std::size_t amount)
+    {
+        extendSendBuf(amount);
+        sendPush();
+    }
+    
+    bool established () const { return m_established; }
+    std::size_t acked () const { return m_acked; }
+    
+private:
+    void connectionAborted () override final
+    {
+        AIPSTACK_ASSERT_FORCE(false);
+    }
+    
+    void connectionEstablished () override final
+    {
+        m_established = true;
+    }
+    
+    void dataReceived (std::size_t) override final {}
+    
+    void dataSent (std::size_t amount) override final
+    {
+        m_acked += amount;
+    }
+    
+private:
+    IpBufNode m_node;
+    bool m_established;
+    std::size_t m_acked;
+};
+
+// Observes the frames on the wire. Must be constructed before the interfaces
+// so that it receives frames before them. Drops the first transmission of data
+// segments starting at or after drop_offset (relative to the start of the
+// data) by enabling full loss on the receiver until the next frame.
+class Monitor :
+    private NonCopyable<Monitor>
+{
+    using WirePort = VirtualWire<SimulatedPlatformImpl>::Port;
+    
+public:
+    Monitor (Platform platform, VirtualWire<SimulatedPlatformImpl> &wire) :
+        m_platform(platform),
+        m_port(platform, wire, AIPSTACK_BIND_MEMBER_TN(&Monitor::frameReceived, this)),
+        m_receiver_iface(nullptr),
+        m_have_isn(false),
+        m_drop_offset(0),
+        m_drop_enabled(false),
+        m_dropping(false),
+        m_dropped(false),
+        m_drop_time(0),
+        m_rtx_segs(0),
+        m_max_data_offset(0)
+    {}
+    
+    void setup (TestIface *receiver_iface, MacAddr sender_mac)
+    {
+        m_receiver_iface = receiver_iface;
+        m_sender_mac = sender_mac;
+    }
+    
+    void dropSegmentsFrom (std::size_t drop_offset)
+    {
+        m_drop_offset = drop_offset;
+        m_drop_enabled = true;
+    }
+    
+    bool dropped () const { return m_dropped; }
+    Platform::TimeType dropTime () const { return m_drop_time; }
+    std::size_t rtxSegs () const { return m_rtx_segs; }
+    
+private:
+    void frameReceived (IpBufRef frame)
+    {
+        // A frame following the dropped one is delivered normally.
+        if (m_dropping) {
+            m_receiver_iface->clearRxImpairment();
+            m_dropping = false;
+        }
+        
+        constexpr std::size_t MaxFrame = 1600;
+        if (m_receiver_iface == nullptr ||
+            frame.tot_len < EthHeader::Size + Ip4Header::Size + Tcp4Header::Size ||
+            frame.tot_len > MaxFrame)
+        {
+            return;
+        }
+        char data[MaxFrame];
+        ipBufTakeBytes(frame, frame.tot_len, data);
+        
+        auto eth_header = EthHeader::MakeRef(data);
+        if (eth_header.get(EthHeader::SrcMac()) != m_sender_mac ||
+            eth_header.get(EthHeader::EthType()) != EthType::Ipv4)
+        {
+            return;
+        }
+        
+        char *ip_data = data + EthHeader::Size;
+        auto ip4_header = Ip4Header::MakeRef(ip_data);
+        if (ip4_header.get(Ip4Header::Proto()) != Ip4Protocol::Tcp) {
+            return;
+        }
+        std::size_t ihl = 4 * std::size_t(
+            (ip4_header.get(Ip4Header::VersionIhlDscpEcn()) >> 8) & Ip4IhlMask);
+        std::size_t ip_len = ip4_header.get(Ip4Header::TotalLen());
+        
+        char *tcp_data = ip_data + ihl;
+        auto tcp_header = Tcp4Header::MakeRef(tcp_data);
+        Tcp4Flags flags = tcp_header.get(Tcp4Header::OffsetFlags());
+        std::size_t tcp_hdr_len =
+            4 * std::size_t(std::uint16_t(flags) >> TcpOffsetShift);
+        std::size_t data_len = ip_len - ihl - tcp_hdr_len;
+        TcpSeqNum seq = tcp_header.get(Tcp4Header::SeqNum());
+        
+        if ((flags & Tcp4Flags::Syn) != Tcp4Flags()) {
+            m_data_start = seq + TcpSeqInt(1);
+            m_have_isn = true;
+            return;
+        }
+        
+        if (!m_have_isn || data_len == 0) {
+            return;
+        }
+        
+        std::size_t offset = seq - m_data_start;
+        std::size_t end_offset = offset + data_len;
+        
+        if (offset < m_max_data_offset) {
+            m_rtx_segs++;
+        }
+        
+        if (end_offset > m_max_data_offset) {
+            m_max_data_offset = end_offset;
+            
+            if (m_drop_enabled && offset >= m_drop_offset) {
+                FrameImpairmentParams imp_params;
+                imp_params.loss_model = FrameLossModel::Bernoulli;
+                imp_params.loss_prob = 1.0;
+                m_receiver_iface->setRxImpairment(imp_params);
+                m_dropping = true;
+                if (!m_dropped) {
+                    m_dropped = true;
+                    m_drop_time = m_platform.getTime();
+                }
+            }
+        }
+    }
+    
+private:
+    Platform m_platform;
+    WirePort m_port;
+    TestIface *m_receiver_iface;
+    MacAddr m_sender_mac;
+    bool m_have_isn;
+    TcpSeqNum m_data_start;
+    std::size_t m_drop_offset;
+    bool m_drop_enabled;
+    bool m_dropping;
+    bool m_dropped;
+    Platform::TimeType m_drop_time;
+    std::size_t m_rtx_segs;
+    std::size_t m_max_data_offset;
+};
+
+// Run a transfer where the last drop_segs segments of the burst are dropped,
+// returning the time from the first drop until all data was received.
+double run_tail_loss (double latency, std::size_t burst_bytes, std::size_t drop_segs)
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    
+    VirtualWireParams wire_params;
+    wire_params.bandwidth_bps = 100e6;
+    wire_params.latency_sec = latency;
+    VirtualWire<SimulatedPlatformImpl> wire(wire_params);
+    
+    Monitor monitor(platform, wire);
+    
+    TestStack server_stack(platform);
+    TestStack client_stack(platform);
+    client_stack.getProtoApi<TcpApi>().setEphemeralPortKey(
+        SipHashKey{0x0123456789abcdefu, 0xfedcba9876543210u});
+    MacAddr client_mac = MacAddr(2, 0, 0, 0, 0, 2);
+    TestIface server_iface(platform, &server_stack, wire, MacAddr(2, 0, 0, 0, 0, 1));
+    TestIface client_iface(platform, &client_stack, wire, client_mac);
+    monitor.setup(&server_iface, client_mac);
+    server_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ServerAddr));
+    client_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, ClientAddr));
+    
+    Receiver receiver(platform, server_stack.getProtoApi<TcpApi>());
+    Sender sender(client_stack.getProtoApi<TcpApi>());
+    
+    // Warm up, giving the sender an RTT estimate and some cwnd.
+    platform_impl.runUntil(platform.getTime() + sim_time(1.0));
+    AIPSTACK_ASSERT_FORCE(sender.established());
+    sender.sendMore(WarmupBytes);
+    platform_impl.runUntil(platform.getTime() + sim_time(1.0));
+    AIPSTACK_ASSERT_FORCE(sender.acked() == WarmupBytes);
+    
+    // Send the burst with the last segments being dropped. The segments are
+    // full-sized except the last.
+    std::size_t total = WarmupBytes + burst_bytes;
+    AIPSTACK_ASSERT_FORCE(total <= TransferBytes);
+    std::size_t last_seg_offset = WarmupBytes + (burst_bytes - 1) / Mss * Mss;
+    monitor.dropSegmentsFrom(last_seg_offset - (drop_segs - 1) * Mss);
+    sender.sendMore(burst_bytes);
+    platform_impl.runUntil(platform.getTime() + sim_time(5.0));
+    
+    AIPSTACK_ASSERT_FORCE(monitor.dropped());
+    AIPSTACK_ASSERT_FORCE(receiver.received() == total);
+    AIPSTACK_ASSERT_FORCE(sender.acked() == total);
+    
+    // Only the dropped segments were retransmitted.
+    AIPSTACK_ASSERT_FORCE(monitor.rtxSegs() == drop_segs);
+    
+    return to_seconds(receiver.lastTime() - monitor.dropTime());
+}
+
+// Bursts of several segments, with the last one full-sized or not.
+constexpr std::size_t BurstSizes[] = {6 * Mss, 5 * Mss + 700, 10 * Mss};
+
+// Only the last segment is lost. When the ACK for the other segments arrives
+// just one segment is in flight, so the probe timeout of 2*SRTT is extended
+// by the worst case delayed ACK time (TlpDelAckTime, 200 ms). With a small
+// RTT this is still shorter than the minimum RTO of 250 ms.
+void test_last_segment ()
+{
+    double latency = 0.002;
+    double rtt = 2 * latency;
+    
+    for (std::size_t burst_bytes : BurstSizes) {
+        double recovery = run_tail_loss(latency, burst_bytes, 1);
+        
+        // The probe (a retransmission of the last segment) is sent
+        // 2*SRTT + 200 ms after the last ACK which arrives about half an RTT
+        // after the drop, and then takes half an RTT to arrive.
+        AIPSTACK_ASSERT_FORCE(recovery > 0.2 + 1.5 * rtt);
+        AIPSTACK_ASSERT_FORCE(recovery < 0.2 + 4.0 * rtt);
+        AIPSTACK_ASSERT_FORCE(recovery < 0.25);
+    }
+}
+
+// The last two segments are lost, so two are in flight after the last ACK
+// and the probe is sent after just 2*SRTT. It retransmits the last segment,
+// and the resulting duplicate ACK lets RACK detect the loss of the other.
+void test_last_two_segments ()
+{
+    double latency = 0.01;
+    double rtt = 2 * latency;
+    
+    for (std::size_t burst_bytes : BurstSizes) {
+        double recovery = run_tail_loss(latency, burst_bytes, 2);
+        
+        // Half an RTT for the last ACK, 2*SRTT, an RTT for the probe and its
+        // duplicate ACK and half an RTT for the retransmission.
+        AIPSTACK_ASSERT_FORCE(recovery > 3.5 * rtt);
+        AIPSTACK_ASSERT_FORCE(recovery < 5.0 * rtt);
+    }
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_tail_loss_test;
+    
+    for (std::size_t pos = 0; pos < TransferBytes; pos++) {
+        g_tx_data[pos] = pattern_byte(pos);
+    }
+    
+    test_last_segment();
+    test_last_two_segments();
+    
+    return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <random>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/tcp/TcpPcbKey.h>
+#include <aipstack/tcp/TcpSeqNum.h>
+#include <aipstack/tcp/TcpTimeWaitTable.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_tcp_time_wait_table_test {
+
+using PlatformImpl = SimulatedPlatformImpl;
+using Platform = PlatformFacade<PlatformImpl>;
+using TimeType = Platform::TimeType;
+
+constexpr int NumEntries = 16;
+constexpr TimeType Timeout = 1000;
+constexpr std::uint16_t NumKeys = 40;
+
+using Table = TcpTimeWaitTable<PlatformImpl, AvlTreeIndexService, NumEntries>;
+
+TcpPcbKey make_key (std::uint16_t i)
+{
+    // Vary both the address and the port so the index compares all fields.
+    return TcpPcbKey(Ip4Addr(10, 0, 0, 1), Ip4Addr(10, 0, 1, std::uint8_t(i % 4)),
+                     80, std::uint16_t(40000 + i / 4));
+}
+
+// Reference entry, the model list is ordered by expiration like the table.
+struct ModelEntry {
+    std::uint16_t key_id;
+    TimeType expire_time;
+    std::uint32_t rcv_nxt;
+};
+
+using Model = std::list<ModelEntry>;
+
+Model::iterator model_find (Model &model, std::uint16_t key_id)
+{
+    for (auto it = model.begin(); it != model.end(); ++it) {
+        if (it->key_id == key_id) {
+            return it;
+        }
+    }
+    return model.end();
+}
+
+void check_table (Table &table, Model &model)
+{
+    AIPSTACK_ASSERT_FORCE(model.size() <= std::size_t(NumEntries));
+    
+    for (std::uint16_t i = 0; i < NumKeys; i++) {
+        TcpPcbKey key = make_key(i);
+        Table::Entry *entry = table.find(key);
+        auto it = model_find(model, i);
+        if (it == model.end()) {
+            AIPSTACK_ASSERT_FORCE(entry == nullptr);
+        } else {
+            AIPSTACK_ASSERT_FORCE(entry != nullptr);
+            AIPSTACK_ASSERT_FORCE(entry->remote_addr == key.remote_addr);
+            AIPSTACK_ASSERT_FORCE(entry->remote_port == key.remote_port);
+            AIPSTACK_ASSERT_FORCE(entry->rcv_nxt == TcpSeqNum(it->rcv_nxt));
+            AIPSTACK_ASSERT_FORCE(entry->snd_nxt == TcpSeqNum(it->rcv_nxt + 1));
+            AIPSTACK_ASSERT_FORCE(entry->hdr_wnd == std::uint16_t(i));
+        }
+    }
+}
+
+// Random operations checked against the model: adding (with eviction of the
+// entry closest to expiring when full), restarting and removing entries and
+// expiration driven by the simulated clock.
+void test_random ()
+{
+    PlatformImpl platform_impl;
+    Platform platform{PlatformRef<PlatformImpl>{&platform_impl}};
+    Table table(platform, Timeout);
+    
+    std::mt19937 rng(1);
+    Model model;
+    std::uint32_t seq = 0;
+    int num_evicted = 0;
+    int num_expired = 0;
+    
+    for (int iter = 0; iter < 30000; iter++) {
+        std::uint16_t key_id = std::uint16_t(rng() % NumKeys);
+        auto it = model_find(model, key_id);
+        
+        switch (rng() % 4) {
+            case 0:
+            case 1: {
+                // Add, or restart the timeout if there is an entry.
+                TimeType now = platform.getTime();
+                if (it == model.end()) {
+                    if (model.size() == std::size_t(NumEntries)) {
+                        model.pop_front();
+                        num_evicted++;
+                    }
+                    seq += 1000;
+                    table.add(make_key(key_id), TcpSeqNum(seq), TcpSeqNum(seq + 1),
+                              key_id);
+                    model.push_back(ModelEntry{key_id, now + Timeout, seq});
+                } else {
+                    Table::Entry *entry = table.find(make_key(key_id));
+                    AIPSTACK_ASSERT_FORCE(entry != nullptr);
+                    table.restartTimeout(*entry);
+                    ModelEntry m = *it;
+                    m.expire_time = now + Timeout;
+                    model.erase(it);
+                    model.push_back(m);
+                }
+            } break;
+            
+            case 2: {
+                // Remove an entry if there is one.
+                if (it != model.end()) {
+                    Table::Entry *entry = table.find(make_key(key_id));
+                    AIPSTACK_ASSERT_FORCE(entry != nullptr);
+                    table.remove(*entry);
+                    model.erase(it);
+                }
+            } break;
+            
+            default: {
+                // Advance time, entries whose time has come expire.
+                TimeType end_time = platform.getTime() + rng() % (Timeout / 4);
+                platform_impl.runUntil(end_time);
+                while (!model.empty() && model.front().expire_time <= end_time) {
+                    model.pop_front();
+                    num_expired++;
+                }
+            } break;
+        }
+        
+        check_table(table, model);
+    }
+    
+    // Make sure that the interesting paths were exercised.
+    AIPSTACK_ASSERT_FORCE(num_evicted > 0);
+    AIPSTACK_ASSERT_FORCE(num_expired > 0);
+    
+    // Eventually everything expires.
+    platform_impl.runUntil(platform.getTime() + Timeout);
+    model.clear();
+    check_table(table, model);
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_tcp_time_wait_table_test;
+    
+    test_random();
+    
+    return 0;
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+// Tests that UdpAssociation::sendUdpIp4Packet prepares the route again after the
+// routing configuration changes. Two capturing IP drivers with different MTUs are
+// used and the tests check on which interface, to which next hop and whether
+// fragmented the datagrams are sent after changing the gateway, adding and
+// removing a static route and changing the interface address.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Udp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpStaticRoute.h>
+#include <aipstack/ip/IpDriverIface.h>
+#include <aipstack/ip/IpIfaceDriverParams.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/udp/IpUdpProto.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_udp_association_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpUdpProtoService<
+        IpUdpProtoOptions::UdpIndexService::Is<IndexService>
+    >
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using TestStack = IpStack<TestStackArg>;
+
+using UdpArg = TestStack::GetProtoArg<UdpApi>;
+
+constexpr std::size_t HeaderSpace = UdpApi<UdpArg>::HeaderBeforeUdpData;
+constexpr std::size_t DataLen = 1000;
+
+struct SentPacket {
+    int iface_id;
+    Ip4Addr next_hop;
+    std::vector<char> data;
+};
+
+std::vector<SentPacket> sent_packets;
+
+// IP driver which records the packets sent through it.
+class CaptureDriver :
+    private NonCopyable<CaptureDriver>
+{
+public:
+    CaptureDriver (TestStack *stack, int id, std::size_t ip_mtu) :
+        m_driver_iface(stack, IpIfaceDriverParams{
+            ip_mtu,
+            IpHwType::Undefined,
+            nullptr,
+            AIPSTACK_BIND_MEMBER_TN(&CaptureDriver::sendIp4Packet, this),
+            AIPSTACK_BIND_MEMBER_TN(&CaptureDriver::getState, this),
+            nullptr
+        }),
+        m_id(id)
+    {}
+
+    IpIface<TestStackArg> & iface ()
+    {
+        return m_driver_iface.iface();
+    }
+
+private:
+    IpErr sendIp4Packet (IpBufRef pkt, Ip4Addr ip_addr, IpSendRetryRequest *)
+    {
+        SentPacket sent{m_id, ip_addr, std::vector<char>(pkt.tot_len)};
+        ipBufTakeBytes(pkt, pkt.tot_len, sent.data.data());
+        sent_packets.push_back(std::move(sent));
+        return IpErr::Success;
+    }
+
+    IpIfaceDriverState getState ()
+    {
+        IpIfaceDriverState state = {};
+        state.link_up = true;
+        return state;
+    }
+
+private:
+    IpDriverIface<TestStackArg> m_driver_iface;
+    int m_id;
+};
+
+UdpRecvResult ignore_packet (IpRxInfoIp4<TestStackArg> const &,
+                             UdpRxInfo<UdpArg> const &, IpBufRef)
+{
+    return UdpRecvResult::Reject;
+}
+
+class Sender :
+    private NonCopyable<Sender>
+{
+public:
+    Sender (TestStack &stack, Ip4Addr local_addr, Ip4Addr remote_addr,
+            IpSendFlags send_flags) :
+        m_assoc(&ignore_packet)
+    {
+        UdpAssociationParams<UdpArg> params;
+        params.key = UdpAssociationKey{local_addr, remote_addr, 1000, 2000};
+        params.send_flags = send_flags;
+        IpErr err = m_assoc.associate(stack.getProtoApi<UdpApi>(), params);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+
+        for (std::size_t i = 0; i < DataLen; i++) {
+            m_buf[HeaderSpace + i] = char(i * 7);
+        }
+    }
+
+    // Send a datagram and return the packets it was sent as.
+    IpErr send (std::vector<SentPacket> &packets)
+    {
+        sent_packets.clear();
+        IpBufNode node{m_buf, HeaderSpace + DataLen, nullptr};
+        IpErr err = m_assoc.sendUdpIp4Packet(
+            IpBufRef{&node, HeaderSpace, DataLen}, nullptr);
+        packets = std::move(sent_packets);
+        sent_packets.clear();
+        return err;
+    }
+
+private:
+    UdpAssociation<UdpArg> m_assoc;
+    char m_buf[HeaderSpace + DataLen];
+};
+
+// Check that the datagram was sent as one packet on the given interface.
+void check_whole (std::vector<SentPacket> &packets, int iface_id, Ip4Addr next_hop,
+                  Ip4Addr src_addr)
+{
+    AIPSTACK_ASSERT_FORCE(packets.size() == 1);
+    SentPacket &pkt = packets[0];
+    AIPSTACK_ASSERT_FORCE(pkt.iface_id == iface_id);
+    AIPSTACK_ASSERT_FORCE(pkt.next_hop == next_hop);
+    AIPSTACK_ASSERT_FORCE(pkt.data.size() == Ip4Header::Size + Udp4Header::Size + DataLen);
+    AIPSTACK_ASSERT_FORCE(IpChksum(pkt.data.data(), Ip4Header::Size) == 0);
+    auto ip4_header = Ip4Header::MakeRef(pkt.data.data());
+    AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::SrcAddr()) == src_addr);
+    AIPSTACK_ASSERT_FORCE(
+        (ip4_header.get(Ip4Header::FlagsOffset()) & Ip4Flags::MF) == Enum0);
+}
+
+// Check that the datagram was fragmented to fit the given MTU.
+void check_fragmented (std::vector<SentPacket> &packets, int iface_id, Ip4Addr next_hop,
+                       std::size_t mtu)
+{
+    AIPSTACK_ASSERT_FORCE(packets.size() > 1);
+    std::size_t total_data = 0;
+    for (std::size_t i = 0; i < packets.size(); i++) {
+        SentPacket &pkt = packets[i];
+        AIPSTACK_ASSERT_FORCE(pkt.iface_id == iface_id);
+        AIPSTACK_ASSERT_FORCE(pkt.next_hop == next_hop);
+        AIPSTACK_ASSERT_FORCE(pkt.data.size() <= mtu);
+        AIPSTACK_ASSERT_FORCE(IpChksum(pkt.data.data(), Ip4Header::Size) == 0);
+        auto ip4_header = Ip4Header::MakeRef(pkt.data.data());
+        Ip4Flags flags_offset = ip4_header.get(Ip4Header::FlagsOffset());
+        AIPSTACK_ASSERT_FORCE(
+            std::size_t(AsUnderlying(flags_offset & Ip4Flags::OffsetMask)) * 8 ==
+            total_data);
+        bool more = (flags_offset & Ip4Flags::MF) != Enum0;
+        AIPSTACK_ASSERT_FORCE(more == (i + 1 < packets.size()));
+        total_data += pkt.data.size() - Ip4Header::Size;
+    }
+    AIPSTACK_ASSERT_FORCE(total_data == Udp4Header::Size + DataLen);
+}
+
+void test_route_changes ()
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    TestStack stack(platform);
+
+    constexpr std::size_t SmallMtu = 576;
+    CaptureDriver driver0(&stack, 0, 1500);
+    CaptureDriver driver1(&stack, 1, SmallMtu);
+
+    Ip4Addr const addr0 = Ip4Addr(10, 0, 0, 1);
+    Ip4Addr const addr1 = Ip4Addr(10, 1, 0, 1);
+    driver0.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, addr0));
+    driver0.iface().setIp4Gateway(IpIfaceIp4GatewaySetting(Ip4Addr(10, 0, 0, 254)));
+    driver1.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, addr1));
+
+    // Remote hosts on the subnet of interface 0 and behind its gateway. The
+    // first sender may send from its address through interface 1.
+    Ip4Addr const local_remote = Ip4Addr(10, 0, 0, 2);
+    Ip4Addr const far_remote = Ip4Addr(192, 168, 5, 5);
+    Sender local_sender(stack, addr0, local_remote, IpSendFlags::AllowNonLocalSrc);
+    Sender far_sender(stack, addr0, far_remote, IpSendFlags());
+
+    std::vector<SentPacket> packets;
+
+    AIPSTACK_ASSERT_FORCE(local_sender.send(packets) == IpErr::Success);
+    check_whole(packets, 0, local_remote, addr0);
+    AIPSTACK_ASSERT_FORCE(far_sender.send(packets) == IpErr::Success);
+    check_whole(packets, 0, Ip4Addr(10, 0, 0, 254), addr0);
+
+    // Sending again uses the same route.
+    AIPSTACK_ASSERT_FORCE(local_sender.send(packets) == IpErr::Success);
+    check_whole(packets, 0, local_remote, addr0);
+
+    // A new gateway is used at the next send.
+    driver0.iface().setIp4Gateway(IpIfaceIp4GatewaySetting(Ip4Addr(10, 0, 0, 253)));
+    AIPSTACK_ASSERT_FORCE(far_sender.send(packets) == IpErr::Success);
+    check_whole(packets, 0, Ip4Addr(10, 0, 0, 253), addr0);
+
+    {
+        // A more specific static route through interface 1, where the datagram
+        // does not fit the MTU and is fragmented.
+        IpStaticRouteParams route_params;
+        route_params.dst_addr = local_remote;
+        route_params.prefix = 32;
+        route_params.gateway = Ip4Addr(10, 1, 0, 254);
+        IpStaticRoute<TestStackArg> route(&driver1.iface(), route_params);
+
+        AIPSTACK_ASSERT_FORCE(local_sender.send(packets) == IpErr::Success);
+        check_fragmented(packets, 1, Ip4Addr(10, 1, 0, 254), SmallMtu);
+        AIPSTACK_ASSERT_FORCE(local_sender.send(packets) == IpErr::Success);
+        check_fragmented(packets, 1, Ip4Addr(10, 1, 0, 254), SmallMtu);
+
+        // The other association is not affected by the route.
+        AIPSTACK_ASSERT_FORCE(far_sender.send(packets) == IpErr::Success);
+        check_whole(packets, 0, Ip4Addr(10, 0, 0, 253), addr0);
+    }
+
+    // After the route is removed, interface 0 is used again.
+    AIPSTACK_ASSERT_FORCE(local_sender.send(packets) == IpErr::Success);
+    check_whole(packets, 0, local_remote, addr0);
+
+    // After the address of interface 0 changes, the association address is no
+    // longer local.
+    driver0.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, Ip4Addr(10, 0, 0, 9)));
+    AIPSTACK_ASSERT_FORCE(far_sender.send(packets) == IpErr::NonLocalSrc);
+    AIPSTACK_ASSERT_FORCE(packets.empty());
+
+    // Without the gateway and the address there is no route.
+    driver0.iface().setIp4Gateway(IpIfaceIp4GatewaySetting());
+    AIPSTACK_ASSERT_FORCE(far_sender.send(packets) == IpErr::NoIpRoute);
+    AIPSTACK_ASSERT_FORCE(packets.empty());
+    driver0.iface().setIp4Addr(IpIfaceIp4AddrSetting());
+    AIPSTACK_ASSERT_FORCE(local_sender.send(packets) == IpErr::NoIpRoute);
+    AIPSTACK_ASSERT_FORCE(packets.empty());
+
+    // Sending works again once these are restored.
+    driver0.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, addr0));
+    driver0.iface().setIp4Gateway(IpIfaceIp4GatewaySetting(Ip4Addr(10, 0, 0, 253)));
+    AIPSTACK_ASSERT_FORCE(far_sender.send(packets) == IpErr::Success);
+    check_whole(packets, 0, Ip4Addr(10, 0, 0, 253), addr0);
+    AIPSTACK_ASSERT_FORCE(local_sender.send(packets) == IpErr::Success);
+    check_whole(packets, 0, local_remote, addr0);
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_udp_association_test;
+
+    test_route_changes();
+
+    return 0;
+}
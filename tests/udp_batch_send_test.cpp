@@ -0,0 +1,523 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Tests UdpApi::sendUdpIp4Packets. First with a capturing IP driver, with and
+// without the batch driver function, checking the headers and checksums of the
+// packets and the partial failure semantics. Then between two stacks on a
+// VirtualWire, checking that a batch takes one ARP query and that all
+// datagrams are received.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/misc/NonCopyable.h>
+#include <aipstack/misc/Function.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/infra/Chksum.h>
+#include <aipstack/infra/Err.h>
+#include <aipstack/infra/SendRetry.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/structure/minimum/LinkedHeap.h>
+#include <aipstack/platform/PlatformFacade.h>
+#include <aipstack/proto/EthernetProto.h>
+#include <aipstack/proto/Ip4Proto.h>
+#include <aipstack/proto/Udp4Proto.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpDriverIface.h>
+#include <aipstack/ip/IpIfaceDriverParams.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/udp/IpUdpProto.h>
+#include <aipstack/eth/EthIpIface.h>
+#include <aipstack/eth/MacAddr.h>
+#include <aipstack/sim/VirtualWire.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_udp_batch_send_test {
+
+using Platform = PlatformFacade<SimulatedPlatformImpl>;
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::HeaderBeforeIp::Is<EthHeader::Size>,
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpUdpProtoService<
+        IpUdpProtoOptions::UdpIndexService::Is<IndexService>
+    >
+>;
+
+using TestEthIpIfaceService = EthIpIfaceService<
+    EthIpIfaceOptions::NumArpEntries::Is<4>,
+    EthIpIfaceOptions::ArpProtectCount::Is<2>,
+    EthIpIfaceOptions::TimersStructureService::Is<LinkedHeapService>
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using TestStack = IpStack<TestStackArg>;
+using TestIface = VirtualWireEthIface<TestStackArg, TestEthIpIfaceService>;
+
+using UdpArg = TestStack::GetProtoArg<UdpApi>;
+
+constexpr Ip4Addr LocalAddr = Ip4Addr(10, 0, 0, 1);
+constexpr Ip4Addr RemoteAddr = Ip4Addr(10, 0, 0, 2);
+constexpr std::uint16_t LocalPort = 5000;
+constexpr std::uint16_t RemotePort = 6000;
+constexpr std::size_t IpMtu = 1500;
+
+constexpr std::size_t NumDgrams = 6;
+constexpr std::size_t MaxDataLen = 1500;
+constexpr std::size_t HeaderSpace = UdpApi<UdpArg>::HeaderBeforeUdpData;
+
+char data_byte (std::size_t dgram, std::size_t pos)
+{
+    return char((dgram * 31 + pos) % 253);
+}
+
+// Datagrams to send, each in its own buffer with header space.
+class Batch :
+    private NonCopyable<Batch>
+{
+public:
+    Batch (std::vector<std::size_t> const &lens) :
+        m_lens(lens)
+    {
+        for (std::size_t i = 0; i < lens.size(); i++) {
+            AIPSTACK_ASSERT_FORCE(lens[i] <= MaxDataLen);
+            for (std::size_t j = 0; j < lens[i]; j++) {
+                m_bufs[i][HeaderSpace + j] = data_byte(i, j);
+            }
+            m_nodes[i] = IpBufNode{m_bufs[i], HeaderSpace + MaxDataLen, nullptr};
+        }
+    }
+
+    // Fresh data references, since sendUdpIp4Packets modifies the array.
+    IpBufRef * refs (std::size_t start = 0)
+    {
+        for (std::size_t i = start; i < m_lens.size(); i++) {
+            m_refs[i] = IpBufRef{&m_nodes[i], HeaderSpace, m_lens[i]};
+        }
+        return m_refs + start;
+    }
+
+    std::size_t size () const
+    {
+        return m_lens.size();
+    }
+
+    std::size_t len (std::size_t i) const
+    {
+        return m_lens[i];
+    }
+
+private:
+    std::vector<std::size_t> m_lens;
+    char m_bufs[NumDgrams][HeaderSpace + MaxDataLen];
+    IpBufNode m_nodes[NumDgrams];
+    IpBufRef m_refs[NumDgrams];
+};
+
+// Check a UDP/IPv4 packet against datagram number dgram of the batch.
+void check_packet (std::vector<char> pkt_data, Batch const &batch, std::size_t dgram)
+{
+    char *pkt = pkt_data.data();
+    std::size_t pkt_len = pkt_data.size();
+    AIPSTACK_ASSERT_FORCE(pkt_len == Ip4Header::Size + Udp4Header::Size + batch.len(dgram));
+
+    auto ip4_header = Ip4Header::MakeRef(pkt);
+    AIPSTACK_ASSERT_FORCE(IpChksum(pkt, Ip4Header::Size) == 0);
+    AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::TotalLen()) == pkt_len);
+    AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::Proto()) == Ip4Protocol::Udp);
+    AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::SrcAddr()) == LocalAddr);
+    AIPSTACK_ASSERT_FORCE(ip4_header.get(Ip4Header::DstAddr()) == RemoteAddr);
+
+    char *udp = pkt + Ip4Header::Size;
+    std::size_t udp_len = pkt_len - Ip4Header::Size;
+    auto udp_header = Udp4Header::MakeRef(udp);
+    AIPSTACK_ASSERT_FORCE(udp_header.get(Udp4Header::SrcPort()) == LocalPort);
+    AIPSTACK_ASSERT_FORCE(udp_header.get(Udp4Header::DstPort()) == RemotePort);
+    AIPSTACK_ASSERT_FORCE(udp_header.get(Udp4Header::Length()) == udp_len);
+    AIPSTACK_ASSERT_FORCE(udp_header.get(Udp4Header::Checksum()) != 0);
+
+    // The checksum over the pseudo-header and the datagram must verify.
+    std::vector<char> sum_data(12 + udp_len);
+    std::memcpy(sum_data.data(), pkt + 12, 8);
+    sum_data[8] = 0;
+    sum_data[9] = char(AsUnderlying(Ip4Protocol::Udp));
+    sum_data[10] = char(udp_len >> 8);
+    sum_data[11] = char(udp_len);
+    std::memcpy(sum_data.data() + 12, udp, udp_len);
+    AIPSTACK_ASSERT_FORCE(IpChksum(sum_data.data(), sum_data.size()) == 0);
+
+    for (std::size_t j = 0; j < batch.len(dgram); j++) {
+        AIPSTACK_ASSERT_FORCE(udp[Udp4Header::Size + j] == data_byte(dgram, j));
+    }
+}
+
+// IP driver which records the packets and calls, and can fail a packet.
+class CaptureDriver :
+    private NonCopyable<CaptureDriver>
+{
+public:
+    CaptureDriver (TestStack *stack, bool with_batch) :
+        m_driver_iface(stack, IpIfaceDriverParams{
+            /*ip_mtu=*/ IpMtu,
+            /*hw_type=*/ IpHwType::Undefined,
+            /*hw_iface=*/ nullptr,
+            AIPSTACK_BIND_MEMBER_TN(&CaptureDriver::sendIp4Packet, this),
+            AIPSTACK_BIND_MEMBER_TN(&CaptureDriver::getState, this),
+            with_batch ?
+                AIPSTACK_BIND_MEMBER_TN(&CaptureDriver::sendIp4Packets, this) :
+                nullptr
+        }),
+        m_single_calls(0),
+        m_fail_at(-1)
+    {
+        m_driver_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, LocalAddr));
+    }
+
+    // Fail the packet with this index (counting all packets sent so far).
+    void failAt (int index)
+    {
+        m_fail_at = index;
+    }
+
+    std::vector<std::vector<char>> const & packets () const { return m_packets; }
+    std::vector<std::size_t> const & batchCalls () const { return m_batch_calls; }
+    std::size_t singleCalls () const { return m_single_calls; }
+    IpSendRetryRequest * lastRetryReq () const { return m_last_retry_req; }
+
+private:
+    IpErr capture (IpBufRef pkt, Ip4Addr ip_addr, IpSendRetryRequest *retryReq)
+    {
+        AIPSTACK_ASSERT_FORCE(ip_addr == RemoteAddr);
+        m_last_retry_req = retryReq;
+        if (int(m_packets.size()) == m_fail_at) {
+            m_fail_at = -1;
+            return IpErr::OutputBufferFull;
+        }
+        std::vector<char> data(pkt.tot_len);
+        ipBufTakeBytes(pkt, pkt.tot_len, data.data());
+        m_packets.push_back(std::move(data));
+        return IpErr::Success;
+    }
+
+    IpErr sendIp4Packet (IpBufRef pkt, Ip4Addr ip_addr, IpSendRetryRequest *retryReq)
+    {
+        m_single_calls++;
+        return capture(pkt, ip_addr, retryReq);
+    }
+
+    IpErr sendIp4Packets (IpBufRef const *pkts, std::size_t num_pkts, Ip4Addr ip_addr,
+                          IpSendRetryRequest *retryReq, std::size_t &num_sent)
+    {
+        m_batch_calls.push_back(num_pkts);
+        for (num_sent = 0; num_sent < num_pkts; num_sent++) {
+            IpErr err = capture(pkts[num_sent], ip_addr, retryReq);
+            if (err != IpErr::Success) {
+                return err;
+            }
+        }
+        return IpErr::Success;
+    }
+
+    IpIfaceDriverState getState ()
+    {
+        IpIfaceDriverState state = {};
+        state.link_up = true;
+        return state;
+    }
+
+private:
+    IpDriverIface<TestStackArg> m_driver_iface;
+    std::vector<std::vector<char>> m_packets;
+    std::vector<std::size_t> m_batch_calls;
+    std::size_t m_single_calls;
+    int m_fail_at;
+    IpSendRetryRequest *m_last_retry_req;
+};
+
+class RetryRequest : public IpSendRetryRequest
+{
+public:
+    RetryRequest () : m_retried(false) {}
+
+    bool retried () const { return m_retried; }
+
+private:
+    void retrySending () override final
+    {
+        m_retried = true;
+    }
+
+    bool m_retried;
+};
+
+IpErr send_batch (TestStack &stack, IpBufRef *refs, std::size_t num,
+                  IpSendRetryRequest *retry_req, std::size_t &num_sent)
+{
+    return stack.getProtoApi<UdpApi>().sendUdpIp4Packets(
+        Ip4AddrPair{LocalAddr, RemoteAddr}, UdpTxInfo<UdpArg>{LocalPort, RemotePort},
+        refs, num, retry_req, IpSendFlags(), num_sent);
+}
+
+void test_capture (bool with_batch)
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+    TestStack stack(platform);
+    CaptureDriver driver(&stack, with_batch);
+    RetryRequest retry_req;
+
+    std::size_t const max_data = IpMtu - Ip4Header::Size - Udp4Header::Size;
+    Batch batch({0, 1, 100, 511, max_data, 2});
+
+    // All datagrams are sent in one driver call (or one call each).
+    std::size_t num_sent;
+    IpErr err = send_batch(stack, batch.refs(), batch.size(), &retry_req, num_sent);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+    AIPSTACK_ASSERT_FORCE(num_sent == batch.size());
+    AIPSTACK_ASSERT_FORCE(driver.packets().size() == batch.size());
+    if (with_batch) {
+        AIPSTACK_ASSERT_FORCE(driver.batchCalls().size() == 1);
+        AIPSTACK_ASSERT_FORCE(driver.batchCalls()[0] == batch.size());
+        AIPSTACK_ASSERT_FORCE(driver.singleCalls() == 0);
+    } else {
+        AIPSTACK_ASSERT_FORCE(driver.singleCalls() == batch.size());
+    }
+    for (std::size_t i = 0; i < batch.size(); i++) {
+        check_packet(driver.packets()[i], batch, i);
+    }
+
+    // Each packet gets its own identification.
+    for (std::size_t i = 1; i < batch.size(); i++) {
+        std::vector<char> prev = driver.packets()[i - 1];
+        std::vector<char> cur = driver.packets()[i];
+        AIPSTACK_ASSERT_FORCE(Ip4Header::MakeRef(cur.data()).get(Ip4Header::Ident()) !=
+                              Ip4Header::MakeRef(prev.data()).get(Ip4Header::Ident()));
+    }
+
+    // A driver failure stops the batch there, the earlier datagrams are sent and
+    // the retry request is passed to the driver.
+    driver.failAt(int(driver.packets().size() + 2));
+    err = send_batch(stack, batch.refs(), batch.size(), &retry_req, num_sent);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::OutputBufferFull);
+    AIPSTACK_ASSERT_FORCE(num_sent == 2);
+    AIPSTACK_ASSERT_FORCE(driver.packets().size() == batch.size() + 2);
+    AIPSTACK_ASSERT_FORCE(driver.lastRetryReq() == &retry_req);
+
+    // The rest can be sent by passing the remaining datagrams again.
+    err = send_batch(stack, batch.refs(2), batch.size() - 2, &retry_req, num_sent);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+    AIPSTACK_ASSERT_FORCE(num_sent == batch.size() - 2);
+    AIPSTACK_ASSERT_FORCE(driver.packets().size() == 2 * batch.size());
+    for (std::size_t i = 0; i < batch.size(); i++) {
+        check_packet(driver.packets()[batch.size() + i], batch, i);
+    }
+
+    // A datagram which does not fit into the MTU is not fragmented, the ones
+    // before it are sent.
+    Batch big_batch({10, 20, max_data + 1, 30});
+    std::size_t prev_packets = driver.packets().size();
+    err = send_batch(stack, big_batch.refs(), big_batch.size(), &retry_req, num_sent);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::FragmentationNeeded);
+    AIPSTACK_ASSERT_FORCE(num_sent == 2);
+    AIPSTACK_ASSERT_FORCE(driver.packets().size() == prev_packets + 2);
+    check_packet(driver.packets()[prev_packets + 1], big_batch, 1);
+
+    // Without a route nothing is sent.
+    prev_packets = driver.packets().size();
+    err = stack.getProtoApi<UdpApi>().sendUdpIp4Packets(
+        Ip4AddrPair{LocalAddr, Ip4Addr(192, 168, 1, 1)},
+        UdpTxInfo<UdpArg>{LocalPort, RemotePort},
+        batch.refs(), batch.size(), &retry_req, IpSendFlags(), num_sent);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::NoIpRoute);
+    AIPSTACK_ASSERT_FORCE(num_sent == 0);
+    AIPSTACK_ASSERT_FORCE(driver.packets().size() == prev_packets);
+
+    // An empty batch succeeds.
+    err = send_batch(stack, batch.refs(), 0, &retry_req, num_sent);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+    AIPSTACK_ASSERT_FORCE(num_sent == 0);
+}
+
+// Counts ARP requests and checks UDP frames seen on the wire.
+class Monitor :
+    private NonCopyable<Monitor>
+{
+public:
+    Monitor (Platform platform, VirtualWire<SimulatedPlatformImpl> &wire,
+             Batch const &batch) :
+        m_port(platform, wire, AIPSTACK_BIND_MEMBER_TN(&Monitor::frameReceived, this)),
+        m_batch(batch),
+        m_arp_frames(0),
+        m_udp_frames(0)
+    {}
+
+    std::size_t arpFrames () const { return m_arp_frames; }
+    std::size_t udpFrames () const { return m_udp_frames; }
+
+private:
+    void frameReceived (IpBufRef frame)
+    {
+        std::vector<char> data(frame.tot_len);
+        ipBufTakeBytes(frame, frame.tot_len, data.data());
+        auto eth_header = EthHeader::MakeRef(data.data());
+
+        if (eth_header.get(EthHeader::EthType()) == EthType::Arp) {
+            m_arp_frames++;
+        }
+        else if (eth_header.get(EthHeader::EthType()) == EthType::Ipv4) {
+            check_packet(std::vector<char>(data.begin() + EthHeader::Size, data.end()),
+                         m_batch, m_udp_frames % m_batch.size());
+            m_udp_frames++;
+        }
+    }
+
+private:
+    VirtualWire<SimulatedPlatformImpl>::Port m_port;
+    Batch const &m_batch;
+    std::size_t m_arp_frames;
+    std::size_t m_udp_frames;
+};
+
+// Receives the datagrams and checks their data.
+class Receiver :
+    private NonCopyable<Receiver>
+{
+public:
+    Receiver (TestStack &stack, Batch const &batch) :
+        m_listener(AIPSTACK_BIND_MEMBER_TN(&Receiver::udpIp4Packet, this)),
+        m_batch(batch),
+        m_received(0)
+    {
+        UdpListenParams<UdpArg> listen_params;
+        listen_params.port = RemotePort;
+        IpErr err = m_listener.startListening(stack.getProtoApi<UdpApi>(), listen_params);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+    }
+
+    std::size_t received () const { return m_received; }
+
+private:
+    UdpRecvResult udpIp4Packet (IpRxInfoIp4<TestStackArg> const &ip_info,
+                                UdpRxInfo<UdpArg> const &udp_info, IpBufRef udp_data)
+    {
+        AIPSTACK_ASSERT_FORCE(ip_info.src_addr == LocalAddr);
+        AIPSTACK_ASSERT_FORCE(udp_info.src_port == LocalPort);
+        AIPSTACK_ASSERT_FORCE(udp_info.has_checksum);
+        std::size_t dgram = m_received % m_batch.size();
+        AIPSTACK_ASSERT_FORCE(udp_data.tot_len == m_batch.len(dgram));
+        std::vector<char> data(udp_data.tot_len);
+        ipBufTakeBytes(udp_data, udp_data.tot_len, data.data());
+        for (std::size_t j = 0; j < data.size(); j++) {
+            AIPSTACK_ASSERT_FORCE(data[j] == data_byte(dgram, j));
+        }
+        m_received++;
+        return UdpRecvResult::AcceptStop;
+    }
+
+private:
+    UdpListener<UdpArg> m_listener;
+    Batch const &m_batch;
+    std::size_t m_received;
+};
+
+void test_wire ()
+{
+    SimulatedPlatformImpl platform_impl;
+    Platform platform{PlatformRef<SimulatedPlatformImpl>{&platform_impl}};
+
+    VirtualWireParams wire_params;
+    wire_params.latency_sec = 0.001;
+    VirtualWire<SimulatedPlatformImpl> wire(wire_params);
+
+    Batch batch({8, 1472, 0, 200, 64, 1000});
+    Monitor monitor(platform, wire, batch);
+
+    TestStack local_stack(platform);
+    TestStack remote_stack(platform);
+    TestIface local_iface(platform, &local_stack, wire, MacAddr(2, 0, 0, 0, 0, 1));
+    TestIface remote_iface(platform, &remote_stack, wire, MacAddr(2, 0, 0, 0, 0, 2));
+    local_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, LocalAddr));
+    remote_iface.iface().setIp4Addr(IpIfaceIp4AddrSetting(24, RemoteAddr));
+
+    Receiver receiver(remote_stack, batch);
+
+    // The first batch waits for ARP resolution as a whole.
+    RetryRequest retry_req;
+    std::size_t num_sent;
+    IpErr err = send_batch(local_stack, batch.refs(), batch.size(), &retry_req, num_sent);
+    AIPSTACK_ASSERT_FORCE(err == IpErr::ArpQueryInProgress);
+    AIPSTACK_ASSERT_FORCE(num_sent == 0);
+
+    platform_impl.runUntil(platform.getTime() + Platform::TimeType(0.1 * Platform::TimeFreq));
+    AIPSTACK_ASSERT_FORCE(retry_req.retried());
+    AIPSTACK_ASSERT_FORCE(monitor.arpFrames() == 2); // request and reply
+
+    // Now the batches go out without further ARP traffic.
+    for (int i = 0; i < 3; i++) {
+        err = send_batch(local_stack, batch.refs(), batch.size(), &retry_req, num_sent);
+        AIPSTACK_ASSERT_FORCE(err == IpErr::Success);
+        AIPSTACK_ASSERT_FORCE(num_sent == batch.size());
+    }
+
+    platform_impl.runUntil(platform.getTime() + Platform::TimeType(0.1 * Platform::TimeFreq));
+    AIPSTACK_ASSERT_FORCE(monitor.arpFrames() == 2);
+    AIPSTACK_ASSERT_FORCE(monitor.udpFrames() == 3 * batch.size());
+    AIPSTACK_ASSERT_FORCE(receiver.received() == 3 * batch.size());
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_udp_batch_send_test;
+
+    test_capture(true);
+    test_capture(false);
+    test_wire();
+
+    return 0;
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2018 Ambroz Bizjak
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include <aipstack/misc/Assert.h>
+#include <aipstack/meta/TypeList.h>
+#include <aipstack/infra/Buf.h>
+#include <aipstack/structure/index/AvlTreeIndex.h>
+#include <aipstack/ip/IpAddr.h>
+#include <aipstack/ip/IpStack.h>
+#include <aipstack/ip/IpPathMtuCache.h>
+#include <aipstack/ip/IpReassembly.h>
+#include <aipstack/udp/IpUdpProto.h>
+#include <aipstack/utils/UdpRecvQueue.h>
+#include <aipstack/sim/SimulatedPlatformImpl.h>
+
+using namespace AIpStack;
+
+namespace aipstack_udp_recv_queue_test {
+
+using IndexService = AvlTreeIndexService;
+
+using TestIpStackService = IpStackService<
+    IpStackOptions::PathMtuCacheService::Is<
+        IpPathMtuCacheService<
+            IpPathMtuCacheOptions::NumMtuEntries::Is<4>,
+            IpPathMtuCacheOptions::MtuIndexService::Is<IndexService>
+        >
+    >,
+    IpStackOptions::ReassemblyService::Is<
+        IpReassemblyService<>
+    >
+>;
+
+using TestProtocolServicesList = MakeTypeList<
+    IpUdpProtoService<
+        IpUdpProtoOptions::UdpIndexService::Is<IndexService>
+    >
+>;
+
+class TestStackArg : public TestIpStackService::template Compose<
+    SimulatedPlatformImpl, TestProtocolServicesList> {};
+using UdpArg = IpStack<TestStackArg>::GetProtoArg<UdpApi>;
+
+using Queue = UdpRecvQueue<UdpArg>;
+
+constexpr std::size_t MaxDataLen = 200;
+
+// Enqueue a datagram whose bytes and source port are derived from id.
+void enqueue (Queue &queue, std::uint16_t id, std::size_t data_len)
+{
+    char data[MaxDataLen];
+    for (std::size_t i = 0; i < data_len; i++) {
+        data[i] = char(id + i);
+    }
+    IpBufNode node = {data, data_len, nullptr};
+    
+    IpRxInfoIp4<TestStackArg> ip_info = {};
+    ip_info.src_addr = Ip4Addr(10, 0, 0, 1);
+    UdpRxInfo<UdpArg> udp_info = {};
+    udp_info.src_port = id;
+    udp_info.dst_port = 53;
+    
+    UdpRecvResult res = queue.enqueueIp4Dgram(ip_info, udp_info,
+                                              IpBufRef{&node, 0, data_len});
+    AIPSTACK_ASSERT_FORCE(res == UdpRecvResult::AcceptStop);
+}
+
+void check_datagram (Queue::Datagram const &dgram, std::uint16_t id, std::size_t data_len)
+{
+    AIPSTACK_ASSERT_FORCE(dgram.udp_info.src_port == id);
+    AIPSTACK_ASSERT_FORCE(dgram.udp_info.dst_port == 53);
+    AIPSTACK_ASSERT_FORCE(dgram.ip_info.src_addr == Ip4Addr(10, 0, 0, 1));
+    AIPSTACK_ASSERT_FORCE(dgram.data.len == data_len);
+    for (std::size_t i = 0; i < data_len; i++) {
+        AIPSTACK_ASSERT_FORCE(dgram.data.ptr[i] == char(id + i));
+    }
+}
+
+// Fill the queue, wrap around to the start of the buffer and check drops when full.
+void test_wrap_and_full ()
+{
+    constexpr std::size_t DataLen = 100;
+    constexpr std::size_t NumRecs = 4;
+    alignas(std::max_align_t) static char buffer[NumRecs * Queue::recordSize(DataLen)];
+    
+    int num_notified = 0;
+    Queue queue(buffer, sizeof(buffer), [&]() { num_notified++; });
+    
+    for (std::uint16_t id = 1; id <= NumRecs; id++) {
+        enqueue(queue, id, DataLen);
+    }
+    AIPSTACK_ASSERT_FORCE(queue.getNumQueued() == NumRecs);
+    AIPSTACK_ASSERT_FORCE(num_notified == 1);
+    
+    // No more space.
+    enqueue(queue, 5, DataLen);
+    AIPSTACK_ASSERT_FORCE(queue.getNumQueued() == NumRecs);
+    AIPSTACK_ASSERT_FORCE(queue.getDropCounters().queue_full == 1);
+    
+    // Release two, then two more fit by wrapping around, but not a third.
+    queue.consumeDatagrams(2);
+    enqueue(queue, 6, DataLen);
+    enqueue(queue, 7, DataLen);
+    enqueue(queue, 8, DataLen);
+    AIPSTACK_ASSERT_FORCE(queue.getNumQueued() == NumRecs);
+    AIPSTACK_ASSERT_FORCE(queue.getDropCounters().queue_full == 2);
+    AIPSTACK_ASSERT_FORCE(num_notified == 1);
+    
+    // The datagrams come out in order across the wrap point.
+    Queue::Datagram dgrams[NumRecs];
+    AIPSTACK_ASSERT_FORCE(queue.peekDatagrams(dgrams, NumRecs) == NumRecs);
+    std::uint16_t const expected_ids[NumRecs] = {3, 4, 6, 7};
+    for (std::size_t i = 0; i < NumRecs; i++) {
+        check_datagram(dgrams[i], expected_ids[i], DataLen);
+    }
+    
+    // Release past the wrap point, after which the end of the buffer is free again.
+    queue.consumeDatagrams(3);
+    AIPSTACK_ASSERT_FORCE(queue.peekDatagrams(dgrams, NumRecs) == 1);
+    check_datagram(dgrams[0], 7, DataLen);
+    enqueue(queue, 9, DataLen);
+    enqueue(queue, 10, DataLen);
+    AIPSTACK_ASSERT_FORCE(queue.getNumQueued() == 3);
+    
+    // Emptying the queue makes the whole buffer available and the next
+    // datagram notifies again.
+    queue.consumeDatagrams(3);
+    AIPSTACK_ASSERT_FORCE(queue.getNumQueued() == 0);
+    for (std::uint16_t id = 11; id < 11 + NumRecs; id++) {
+        enqueue(queue, id, DataLen);
+    }
+    AIPSTACK_ASSERT_FORCE(queue.getNumQueued() == NumRecs);
+    AIPSTACK_ASSERT_FORCE(num_notified == 2);
+    
+    // Too large datagrams are counted separately.
+    alignas(std::max_align_t) static char small_buffer[Queue::recordSize(DataLen)];
+    Queue small_queue(small_buffer, sizeof(small_buffer));
+    enqueue(small_queue, 1, DataLen + alignof(std::max_align_t));
+    AIPSTACK_ASSERT_FORCE(small_queue.getNumQueued() == 0);
+    AIPSTACK_ASSERT_FORCE(small_queue.getDropCounters().too_large == 1);
+    AIPSTACK_ASSERT_FORCE(small_queue.getDropCounters().queue_full == 0);
+    
+    small_queue.resetDropCounters();
+    AIPSTACK_ASSERT_FORCE(small_queue.getDropCounters().too_large == 0);
+}
+
+// Random enqueues and batch dequeues checked against a FIFO model.
+void test_random ()
+{
+    struct Model {
+        std::uint16_t id;
+        std::size_t data_len;
+    };
+    
+    alignas(std::max_align_t) static char buffer[2000];
+    Queue queue(buffer, sizeof(buffer));
+    
+    std::mt19937 rng(1);
+    std::deque<Model> model;
+    std::uint32_t num_enqueued = 0;
+    std::uint32_t num_accepted = 0;
+    std::uint16_t next_id = 0;
+    std::vector<Queue::Datagram> dgrams(64);
+    
+    for (int iter = 0; iter < 200000; iter++) {
+        if (rng() % 3 != 0) {
+            std::size_t data_len = rng() % (MaxDataLen + 1);
+            std::size_t num_before = queue.getNumQueued();
+            enqueue(queue, next_id, data_len);
+            num_enqueued++;
+            if (queue.getNumQueued() == num_before + 1) {
+                model.push_back(Model{next_id, data_len});
+                num_accepted++;
+            } else {
+                AIPSTACK_ASSERT_FORCE(queue.getNumQueued() == num_before);
+            }
+            next_id++;
+        } else {
+            std::size_t max_dgrams = rng() % dgrams.size();
+            std::size_t count = queue.peekDatagrams(dgrams.data(), max_dgrams);
+            AIPSTACK_ASSERT_FORCE(count == std::min(max_dgrams, model.size()));
+            for (std::size_t i = 0; i < count; i++) {
+                check_datagram(dgrams[i], model[i].id, model[i].data_len);
+            }
+            std::size_t num_consume = (count > 0) ? rng() % (count + 1) : 0;
+            queue.consumeDatagrams(num_consume);
+            model.erase(model.begin(), model.begin() + std::ptrdiff_t(num_consume));
+        }
+        
+        AIPSTACK_ASSERT_FORCE(queue.getNumQueued() == model.size());
+        
+        // Records never overlap, so the queue holds at most a buffer worth.
+        std::size_t total_size = 0;
+        for (Model const &m : model) {
+            total_size += Queue::recordSize(m.data_len);
+        }
+        AIPSTACK_ASSERT_FORCE(total_size <= sizeof(buffer));
+    }
+    
+    Queue::DropCounters const &drops = queue.getDropCounters();
+    AIPSTACK_ASSERT_FORCE(drops.too_large == 0);
+    AIPSTACK_ASSERT_FORCE(drops.queue_full > 0);
+    AIPSTACK_ASSERT_FORCE(num_enqueued == num_accepted + drops.queue_full);
+    
+    queue.clear();
+    AIPSTACK_ASSERT_FORCE(queue.getNumQueued() == 0);
+}
+
+}
+
+int main ()
+{
+    using namespace aipstack_udp_recv_queue_test;
+    
+    test_wrap_and_full();
+    test_random();
+    
+    return 0;
+}